@@ -0,0 +1,346 @@
+/*
+ * bench.c -- Benchmark for the message store and cache
+ *
+ * Measures, for every combination of message count and thread count:
+ *   - store throughput of store_msg (messages per second)
+ *   - cold retrieve latency: first read of each message, served from disk
+ *   - warm retrieve latency and hit ratios on a skewed read mix through retrieve_msg_cached_l0
+ * and prints one CSV row per combination, so runs before and after a change can be diffed.
+ *
+ * Usage: ./msgbench [-n counts] [-t threads] [-r reads] [-h hot_percent]
+ *   -n  comma separated message counts (default 1000,10000)
+ *   -t  comma separated thread counts (default 1,4)
+ *   -r  measured reads per phase, split over the threads (default 100000)
+ *   -h  percent of warm reads that go to a hot set of CACHE_SIZE messages (default 90)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "message.h"
+#include "cache.h"
+
+#define MAX_RUNS 16
+
+// Per-thread work description and results
+typedef struct {
+    int64_t first_id;       // First message ID stored by this thread
+    int64_t num_stored;     // Messages stored by this thread
+    int64_t num_messages;   // Total messages in the store
+    long num_reads;         // Reads performed by this thread
+    int hot_percent;        // Percent of warm reads hitting the hot set
+    uint64_t rng;           // xorshift state
+    uint64_t *latencies;    // Nanoseconds per read
+    long hits;              // Reads served by the L0 or shared cache
+    unsigned long l0_hits;  // Reads served by the L0 cache
+    pthread_barrier_t *warmed;          // Passed by all threads once warmed up (warm reads)
+    unsigned long *rejected_before;     // Rejected admissions when measuring starts (warm reads)
+} BenchThread;
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ *
+ * @return uint64_t Current time in nanoseconds.
+ */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the next value of a thread's xorshift64 generator.
+ *
+ * @param state The generator state.
+ * @return uint64_t The next pseudo-random value.
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/**
+ * @brief Compares two latencies for qsort.
+ */
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Stores this thread's range of messages on disk.
+ */
+static void *store_worker(void *arg) {
+    BenchThread *t = (BenchThread *)arg;
+    for (int64_t id = t->first_id; id < t->first_id + t->num_stored; id++) {
+        Message *msg = create_msg(id, "bench_sender", "bench_receiver", "bench_content");
+        if (msg == NULL || !store_msg(msg)) {
+            fprintf(stderr, "Error: Failed to store message %" PRId64 "\n", id);
+        }
+        free_msg(msg);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads this thread's messages once each through the cache, which starts empty.
+ */
+static void *cold_read_worker(void *arg) {
+    BenchThread *t = (BenchThread *)arg;
+    bool msg_in_cache = false;
+    for (long i = 0; i < t->num_reads; i++) {
+        int64_t id = t->first_id + i % t->num_stored;
+        uint64_t start = now_ns();
+        Message *msg = retrieve_msg_cached_l0(id, &msg_in_cache, 1);
+        t->latencies[i] = now_ns() - start;
+        if (msg_in_cache) {
+            t->hits++;
+        } else {
+            free_msg(msg);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Performs num_reads skewed reads: hot_percent of them go to the first CACHE_SIZE IDs.
+ *
+ * @param measure Record latencies and hits; otherwise the reads only warm the caches.
+ */
+static void skewed_reads(BenchThread *t, bool measure) {
+    bool msg_in_cache = false;
+    int64_t hot_set = t->num_messages < CACHE_SIZE ? t->num_messages : CACHE_SIZE;
+    for (long i = 0; i < t->num_reads; i++) {
+        uint64_t r = next_random(&t->rng);
+        int64_t id = (int64_t)(r % 100) < t->hot_percent
+                         ? (int64_t)((r >> 8) % (uint64_t)hot_set)
+                         : (int64_t)((r >> 8) % (uint64_t)t->num_messages);
+        uint64_t start = now_ns();
+        Message *msg = retrieve_msg_cached_l0(id, &msg_in_cache, 1);
+        if (measure) {
+            t->latencies[i] = now_ns() - start;
+        }
+        if (msg_in_cache) {
+            if (measure) t->hits++;
+        } else {
+            free_msg(msg);
+        }
+    }
+}
+
+/**
+ * @brief Runs one unmeasured pass of skewed reads, then a measured one on the same thread, so
+ *        its thread-local L0 cache is warm too. All threads finish warming up before any starts
+ *        measuring.
+ */
+static void *warm_read_worker(void *arg) {
+    BenchThread *t = (BenchThread *)arg;
+    skewed_reads(t, false);
+    if (pthread_barrier_wait(t->warmed) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        *t->rejected_before = cache_rejected_admissions();
+    }
+    pthread_barrier_wait(t->warmed);
+    unsigned long l0_before = l0_cache_hits();
+    skewed_reads(t, true);
+    t->l0_hits = l0_cache_hits() - l0_before;
+    return NULL;
+}
+
+/**
+ * @brief Runs a worker function on every thread and returns the elapsed wall time.
+ *
+ * @return uint64_t Elapsed nanoseconds from the first thread start to the last join.
+ */
+static uint64_t run_threads(BenchThread *threads, int num_threads, void *(*worker)(void *)) {
+    pthread_t tids[num_threads];
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&tids[i], NULL, worker, &threads[i]) != 0) {
+            perror("Failed to create thread");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    return now_ns() - start;
+}
+
+/**
+ * @brief Merges the per-thread latencies and returns the requested percentiles in microseconds.
+ *
+ * @param percentiles Array of fractions (e.g. 0.5) to report.
+ * @param out Receives one value per fraction.
+ */
+static void latency_percentiles(BenchThread *threads, int num_threads, const double *percentiles, int count,
+                                double *out) {
+    long total = 0;
+    for (int i = 0; i < num_threads; i++) {
+        total += threads[i].num_reads;
+    }
+    uint64_t *all = malloc(sizeof(uint64_t) * (total > 0 ? total : 1));
+    if (!all) {
+        perror("malloc failed");
+        exit(1);
+    }
+    long n = 0;
+    for (int i = 0; i < num_threads; i++) {
+        memcpy(all + n, threads[i].latencies, sizeof(uint64_t) * threads[i].num_reads);
+        n += threads[i].num_reads;
+    }
+    qsort(all, n, sizeof(uint64_t), compare_u64);
+    for (int p = 0; p < count; p++) {
+        long index = (long)(percentiles[p] * (double)(n - 1));
+        out[p] = n > 0 ? (double)all[index] / 1000.0 : 0.0;
+    }
+    free(all);
+}
+
+/**
+ * @brief Runs all phases for one message count and thread count and prints the CSV row.
+ */
+static void run_bench(int64_t num_messages, int num_threads, long total_reads, int hot_percent) {
+    static const double percentiles[3] = { 0.50, 0.99, 0.999 };
+    BenchThread threads[num_threads];
+    long reads_per_thread = total_reads / num_threads > 0 ? total_reads / num_threads : 1;
+    int64_t per_thread = num_messages / num_threads;
+
+    for (int i = 0; i < num_threads; i++) {
+        memset(&threads[i], 0, sizeof(BenchThread));
+        threads[i].first_id = per_thread * i;
+        threads[i].num_stored = i == num_threads - 1 ? num_messages - per_thread * i : per_thread;
+        threads[i].num_messages = num_messages;
+        threads[i].hot_percent = hot_percent;
+        threads[i].rng = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+        threads[i].latencies = malloc(sizeof(uint64_t) * reads_per_thread);
+        if (!threads[i].latencies) {
+            perror("malloc failed");
+            exit(1);
+        }
+    }
+
+    // Store throughput
+    double store_secs = (double)run_threads(threads, num_threads, store_worker) / 1e9;
+
+    // Cold reads: each thread reads its own messages in order with an empty cache
+    init_cache();
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].num_reads = reads_per_thread < threads[i].num_stored ? reads_per_thread : threads[i].num_stored;
+        if (threads[i].num_reads == 0) {
+            threads[i].num_reads = 1;
+            threads[i].num_stored = 1;
+        }
+    }
+    run_threads(threads, num_threads, cold_read_worker);
+    double cold[3];
+    latency_percentiles(threads, num_threads, percentiles, 3, cold);
+
+    // Warm reads: skewed mix after one unmeasured warm-up pass on the same threads
+    pthread_barrier_t warmed;
+    unsigned long rejected_before = 0;
+    pthread_barrier_init(&warmed, NULL, (unsigned)num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].num_reads = reads_per_thread;
+        threads[i].hits = 0;
+        threads[i].warmed = &warmed;
+        threads[i].rejected_before = &rejected_before;
+    }
+    run_threads(threads, num_threads, warm_read_worker);
+    pthread_barrier_destroy(&warmed);
+    long hits = 0, reads = 0;
+    unsigned long l0_hits = 0;
+    double warm[3];
+    latency_percentiles(threads, num_threads, percentiles, 3, warm);
+    for (int i = 0; i < num_threads; i++) {
+        hits += threads[i].hits;
+        l0_hits += threads[i].l0_hits;
+        reads += threads[i].num_reads;
+        free(threads[i].latencies);
+    }
+    free_cache();
+
+    printf("%" PRId64 ",%d,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.4f,%.4f,%lu\n", num_messages, num_threads,
+           (double)num_messages / store_secs, cold[0], cold[1], cold[2], warm[0], warm[1], warm[2],
+           (double)hits / (double)reads, (double)l0_hits / (double)reads,
+           cache_rejected_admissions() - rejected_before);
+    fflush(stdout);
+}
+
+/**
+ * @brief Parses a comma separated list of positive integers.
+ *
+ * @return int The number of values parsed, or -1 on invalid input.
+ */
+static int parse_list(const char *arg, long long *values, int max_values) {
+    int count = 0;
+    char *copy = strdup(arg);
+    if (!copy) {
+        return -1;
+    }
+    for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+        char *end;
+        long long v = strtoll(tok, &end, 10);
+        if (*end != '\0' || v <= 0 || count == max_values) {
+            free(copy);
+            return -1;
+        }
+        values[count++] = v;
+    }
+    free(copy);
+    return count;
+}
+
+/**
+ * @brief Entry point: parses the options and runs every message count / thread count combination.
+ */
+int main(int argc, char *argv[]) {
+    long long counts[MAX_RUNS] = { 1000, 10000 };
+    long long thread_counts[MAX_RUNS] = { 1, 4 };
+    int num_counts = 2, num_thread_counts = 2;
+    long total_reads = 100000;
+    int hot_percent = 90;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:r:h:")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_counts = parse_list(optarg, counts, MAX_RUNS);
+            break;
+        case 't':
+            num_thread_counts = parse_list(optarg, thread_counts, MAX_RUNS);
+            break;
+        case 'r':
+            total_reads = atol(optarg);
+            break;
+        case 'h':
+            hot_percent = atoi(optarg);
+            break;
+        default:
+            num_counts = -1;
+        }
+    }
+    if (num_counts <= 0 || num_thread_counts <= 0 || total_reads <= 0 || hot_percent < 0 || hot_percent > 100) {
+        fprintf(stderr, "Usage: %s [-n counts] [-t threads] [-r reads] [-h hot_percent]\n", argv[0]);
+        return 1;
+    }
+
+    printf("messages,threads,store_msgs_per_sec,cold_p50_us,cold_p99_us,cold_p999_us,"
+           "warm_p50_us,warm_p99_us,warm_p999_us,hit_ratio,l0_hit_ratio,rejected_admissions\n");
+    for (int c = 0; c < num_counts; c++) {
+        for (int t = 0; t < num_thread_counts; t++) {
+            run_bench(counts[c], (int)thread_counts[t], total_reads, hot_percent);
+        }
+    }
+    return 0;
+}
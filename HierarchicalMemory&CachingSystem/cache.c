@@ -1,3 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "cache.h"
 #include "message.h"
 
@@ -28,26 +36,188 @@ Alternatives Considered:
 For this stage, a simple array with linear search provides a good balance between complexity and performance for the given cache size. In subsequent parts, especially when implementing LRU, the data structure might need to be adjusted.
 */
 
+// Global cache instance
+MessageCache cache = { .lock = PTHREAD_MUTEX_INITIALIZER, .admission_enabled = true };
+
+// Source of slot versions, guarded by cache.lock. Versions are never reused, so an L0 copy can
+// never be validated by an unrelated later fill of the same slot (version 0 means "no copy").
+static uint64_t cache_version_seq = 0;
+
 /**
  * @brief Function to initialize the cache.
  * 
  */
 void init_cache() {
+    pthread_mutex_lock(&cache.lock);
     for (int i = 0; i < CACHE_SIZE; i++) {
         cache.entries[i].id = -1; // Mark as empty
         cache.entries[i].message = NULL;
         cache.entries[i].last_used = 0;
+        __atomic_store_n(&cache.entries[i].version, ++cache_version_seq, __ATOMIC_RELEASE);
     }
     cache.next_available = 0;
+    memset(&cache.sketch, 0, sizeof(cache.sketch));
+    cache.rejected_admissions = 0;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * @brief Finds the slot holding the given message ID without touching its recency. Caller holds cache.lock.
+ * 
+ * @param id The ID of the message.
+ * @return int The index of the CacheEntry holding the message, or -1 if it is not cached.
+ */
+static int find_slot_locked(int64_t id) {
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache.entries[i].id == id && cache.entries[i].message != NULL) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Stores a message in the given slot, freeing the previous occupant and publishing a new
+ *        version so that stale L0 copies of the slot are invalidated. Caller holds cache.lock.
+ * 
+ * @param index The index of the CacheEntry to fill.
+ * @param msg The message to store (owned by the cache afterwards).
+ */
+static void fill_slot_locked(int index, Message *msg) {
+    if (cache.entries[index].message != NULL) {
+        free_msg(cache.entries[index].message);
+    }
+    cache.entries[index].id = msg->id;
+    cache.entries[index].message = msg;
+    cache.entries[index].last_used = time(NULL);
+    __atomic_store_n(&cache.entries[index].version, ++cache_version_seq, __ATOMIC_RELEASE);
 }
 
+//-------------------------------------------Admission control------------------------------------------------//
+
+/**
+ * @brief Returns the counter index of a message ID in one row of the frequency sketch.
+ * 
+ * @param id The ID of the message.
+ * @param row The sketch row.
+ * @return int The counter index within the row.
+ */
+static int sketch_index(int64_t id, int row) {
+    uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    uint64_t h2 = (h * 0xbf58476d1ce4e5b9ULL) | 1; // Odd step for double hashing
+    return (int)((h + (uint64_t)row * h2) >> 24 & (SKETCH_WIDTH - 1));
+}
+
+/**
+ * @brief Records one access to a message ID in the frequency sketch. Caller holds cache.lock.
+ * 
+ * After SKETCH_WINDOW accesses all counters are halved, so the sketch only reflects recent
+ * popularity and formerly hot IDs age out.
+ * 
+ * @param id The ID of the accessed message.
+ */
+static void record_access_locked(int64_t id) {
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        uint8_t *counter = &cache.sketch.counters[row][sketch_index(id, row)];
+        if (*counter < SKETCH_MAX_COUNT) {
+            (*counter)++;
+        }
+    }
+    if (++cache.sketch.additions >= SKETCH_WINDOW) {
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            for (int i = 0; i < SKETCH_WIDTH; i++) {
+                cache.sketch.counters[row][i] >>= 1;
+            }
+        }
+        cache.sketch.additions /= 2;
+    }
+}
+
+/**
+ * @brief Estimates the recent access count of a message ID (minimum over the sketch rows).
+ *        Caller holds cache.lock.
+ * 
+ * @param id The ID of the message.
+ * @return int The estimated number of recent accesses.
+ */
+static int sketch_estimate_locked(int64_t id) {
+    int estimate = SKETCH_MAX_COUNT;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int count = cache.sketch.counters[row][sketch_index(id, row)];
+        if (count < estimate) {
+            estimate = count;
+        }
+    }
+    return estimate;
+}
+
+/**
+ * @brief Decides whether a missed message may replace the victim picked by the eviction policy.
+ *        Caller holds cache.lock.
+ * 
+ * Empty slots and in-place updates are always admitted. Otherwise the candidate must have been
+ * accessed more often than the victim recently, so an ID that is read once cannot evict a hot one.
+ * 
+ * @param id The ID of the missed message.
+ * @param victim_index The index of the CacheEntry the eviction policy would replace.
+ * @return true if the message should be cached, false if it was rejected.
+ */
+static bool admit_locked(int64_t id, int victim_index) {
+    CacheEntry *victim = &cache.entries[victim_index];
+    if (!cache.admission_enabled || victim->message == NULL || victim->id == id) {
+        return true;
+    }
+    if (sketch_estimate_locked(id) > sketch_estimate_locked(victim->id)) {
+        return true;
+    }
+    cache.rejected_admissions++;
+    return false;
+}
+
+/**
+ * @brief Records a lookup of a message ID for admission control.
+ * 
+ * @param id The ID of the message being looked up.
+ */
+static void record_access(int64_t id) {
+    pthread_mutex_lock(&cache.lock);
+    record_access_locked(id);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * @brief Turns admission control for messages added on a cache miss on or off.
+ * 
+ * @param enabled If true, missed messages must be more frequent than the victim to enter the cache.
+ */
+void set_cache_admission(bool enabled) {
+    pthread_mutex_lock(&cache.lock);
+    cache.admission_enabled = enabled;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/**
+ * @brief Returns how many missed messages admission control kept out of the cache since init_cache.
+ * 
+ * @return unsigned long The number of rejected admissions.
+ */
+unsigned long cache_rejected_admissions() {
+    pthread_mutex_lock(&cache.lock);
+    unsigned long rejected = cache.rejected_admissions;
+    pthread_mutex_unlock(&cache.lock);
+    return rejected;
+}
+
+//--------------------------------------------------Part 2------------------------------------------------------//
+
 /**
  * @brief Function to find a message in the cache and return the index of it. Return -1 if not in the cache.
  * 
  * @param id The ID of the message.
  * @return int Return the index of the cacheEntry if found in cache else -1.
  */
-int find_msg_in_cache(int id) {
+int find_msg_in_cache(int64_t id) {
     for (int i = 0; i < CACHE_SIZE; i++) {
         if (cache.entries[i].id == id && cache.entries[i].message != NULL) {
             cache.entries[i].last_used = time(NULL); // Update last used time
@@ -58,7 +228,36 @@ int find_msg_in_cache(int id) {
 }
 
 /**
- * @brief Function to add a message to the cache and return the index of it in the cache
+ * @brief Adds a message to the cache with FIFO replacement. Caller holds cache.lock.
+ * 
+ * @param msg The message pointer to be added to the cache (owned by the cache afterwards).
+ * @param check_admission If true, admission control may reject the message, which is then freed.
+ * @return int The index of the CacheEntry holding the message, or -1 if it was rejected.
+ */
+static int add_msg_fifo_locked(Message *msg, bool check_admission) {
+    // Update in place if the ID is cached, else take the index of CacheEntry for FIFO
+    int index_to_replace = find_slot_locked(msg->id);
+    bool advance = index_to_replace == -1;
+    if (advance) {
+        index_to_replace = cache.next_available;
+    }
+
+    if (check_admission && !admit_locked(msg->id, index_to_replace)) {
+        free_msg(msg);
+        return -1;
+    }
+
+    // Free the existing message if any and store the new one
+    fill_slot_locked(index_to_replace, msg);
+    if (advance) {
+        cache.next_available = (cache.next_available + 1) % CACHE_SIZE;
+    }
+    return index_to_replace;
+}
+
+/**
+ * @brief Function to add a message to the cache and return the index of it in the cache.
+ *        A message whose ID is already cached replaces the old copy in place.
  * 
  * @param msg The message pointer to be added to the cache
  * @return int Return -1 if not successfully added to the cache else the next available index of CacheEntry
@@ -68,20 +267,10 @@ int add_msg_to_cache(Message *msg) {
         return -1;
     }
 
-    // Get the index of CacheEntry to place the current message
-    int index_to_replace = cache.next_available;
-
-    // Free existing message if any
-    if (cache.entries[index_to_replace].message != NULL) {
-        free_msg(cache.entries[index_to_replace].message);
-    }
-
-    cache.entries[index_to_replace].id = msg->id;
-    cache.entries[index_to_replace].message = msg;
-    cache.entries[index_to_replace].last_used = time(NULL);
-
-    cache.next_available = (cache.next_available + 1) % CACHE_SIZE;
-    return index_to_replace;
+    pthread_mutex_lock(&cache.lock);
+    int index = add_msg_fifo_locked(msg, false);
+    pthread_mutex_unlock(&cache.lock);
+    return index;
 }
 
 /**
@@ -115,13 +304,14 @@ int store_msg_cached(Message *msg) {
  * 
  * This function looks for a message in the cache first. If found, it returns the cached message 
  * and sets `msg_in_cache` to true. If not found, it retrieves the message from disk, adds it 
- * to the cache, and returns it while setting `msg_in_cache` to false.
+ * to the cache if admission control lets it in, and returns it while setting `msg_in_cache` to false.
  * 
  * @param id The unique identifier of the message to retrieve.
  * @param msg_in_cache Pointer to a boolean that will be set to true if the message is found in cache, otherwise false.
  * @return Message* A pointer to the retrieved message. Returns NULL if the message is not found.
  */
-Message* retrieve_msg_cached(int id, bool *msg_in_cache) {
+Message* retrieve_msg_cached(int64_t id, bool *msg_in_cache) {
+    record_access(id);
     int cache_index = find_msg_in_cache(id);
     if (cache_index != -1) {
         // Cache hits
@@ -137,7 +327,9 @@ Message* retrieve_msg_cached(int id, bool *msg_in_cache) {
             // Add msg_from_disk to cache
             Message *cache_copy = create_msg(msg_from_disk->id, msg_from_disk->sender, msg_from_disk->receiver, msg_from_disk->content);
             if (cache_copy) {
-                add_msg_to_cache(cache_copy);
+                pthread_mutex_lock(&cache.lock);
+                add_msg_fifo_locked(cache_copy, true);
+                pthread_mutex_unlock(&cache.lock);
             }
         }
 
@@ -182,35 +374,29 @@ int find_lru_replacement_index() {
 }
 
 /**
- * @brief Adds a message to the cache using the specified replacement strategy(Radndom or LRU)
+ * @brief Picks the slot for a new message using the specified replacement strategy and stores it
+ *        there. Caller holds cache.lock.
  * 
- * This function targets to add a new message to the cache. If an empty slot is available, 
- * it stores the message there. If the cache is full, it replaces an existing message using 
- * either the Least Recently Used (LRU) algorithm or a random replacement strategy.
- * 
- * @param msg Pointer to the message to be added to the cache.
+ * @param msg Pointer to the message to be added to the cache (owned by the cache afterwards).
  * @param use_lru If nonzero, the LRU replacement strategy is used; otherwise, random replacement is used.
- * @return int The index where the message was stored in the cache, or -1 if the message is NULL.
+ * @param check_admission If true, admission control may reject the message, which is then freed.
+ * @return int The index where the message was stored in the cache, or -1 if it was rejected.
  */
-int add_msg_to_cache_by_strategy(Message *msg, int use_lru) {
-    if (msg == NULL) {
-        return -1;
-    }
-    int index_to_replace = -1;
+static int add_msg_by_strategy_locked(Message *msg, int use_lru, bool check_admission) {
+    // A cached copy of the same ID is replaced in place so no stale duplicate survives
+    int index_to_replace = find_slot_locked(msg->id);
 
-    // Check for an empty slot first
-    int empty_slot = -1;
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        if (cache.entries[i].id == -1) {
-            empty_slot = i;
-            break;
+    // Check for an empty slot next
+    if (index_to_replace == -1) {
+        for (int i = 0; i < CACHE_SIZE; i++) {
+            if (cache.entries[i].id == -1) {
+                index_to_replace = i;
+                break;
+            }
         }
     }
 
-    if (empty_slot != -1) {
-        // Found an empty slot, use it
-        index_to_replace = empty_slot;
-    } else {
+    if (index_to_replace == -1) {
         // Cache is full, select a replacement index
         if (use_lru) {
             index_to_replace = find_lru_replacement_index();
@@ -219,19 +405,39 @@ int add_msg_to_cache_by_strategy(Message *msg, int use_lru) {
         }
     }
 
-    // Free existing message at the chosen index before replacing it
-    if (cache.entries[index_to_replace].message != NULL) {
-        free_msg(cache.entries[index_to_replace].message);
+    // The victim is chosen by the policy, admission control decides whether it is replaced
+    if (check_admission && !admit_locked(msg->id, index_to_replace)) {
+        free_msg(msg);
+        return -1;
     }
 
-    // Store the new message in the selected index
-    cache.entries[index_to_replace].id = msg->id;
-    cache.entries[index_to_replace].message = msg;
-    cache.entries[index_to_replace].last_used = time(NULL);
-
+    // Free existing message at the chosen index and store the new message in it
+    fill_slot_locked(index_to_replace, msg);
     return index_to_replace;
 }
 
+/**
+ * @brief Adds a message to the cache using the specified replacement strategy(Radndom or LRU)
+ * 
+ * This function targets to add a new message to the cache. If the ID is already cached, the old
+ * copy is replaced. Otherwise, if an empty slot is available, it stores the message there. If
+ * the cache is full, it replaces an existing message using either the Least Recently Used (LRU)
+ * algorithm or a random replacement strategy.
+ * 
+ * @param msg Pointer to the message to be added to the cache.
+ * @param use_lru If nonzero, the LRU replacement strategy is used; otherwise, random replacement is used.
+ * @return int The index where the message was stored in the cache, or -1 if the message is NULL.
+ */
+int add_msg_to_cache_by_strategy(Message *msg, int use_lru) {
+    if (msg == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&cache.lock);
+    int index = add_msg_by_strategy_locked(msg, use_lru, false);
+    pthread_mutex_unlock(&cache.lock);
+    return index;
+}
+
 /**
  * @brief Stores a message to disk and caches it using the specified replacement strategy.
  * 
@@ -269,19 +475,20 @@ int store_msg_cached_by_strategy(Message *msg, int use_lru) {
  * 
  * This function first attempts to locate the message in the cache. If found, it returns the cached message.
  * Otherwise, it retrieves the message from disk, caches a copy using either Least Recently Used (LRU) 
- * or random replacement strategy, and then returns the retrieved message.
+ * or random replacement strategy if admission control lets it in, and then returns the retrieved message.
  * 
  * @param id The unique identifier of the message to retrieve.
  * @param msg_in_cache Pointer to a boolean variable that will be set to true if the message is found in cache, false otherwise.
  * @param use_lru If nonzero, the LRU replacement strategy is used; otherwise, random replacement is used.
  * @return Message* Pointer to the retrieved message, or NULL if the message could not be found.
  */
-Message* retrieve_msg_cached_by_strategy(int id, bool *msg_in_cache, int use_lru) {
+Message* retrieve_msg_cached_by_strategy(int64_t id, bool *msg_in_cache, int use_lru) {
     if (msg_in_cache == NULL) {
         fprintf(stderr, "Error: msg_in_cache pointer is NULL.\n");
         return NULL;
     }
 
+    record_access(id);
     int cache_index = find_msg_in_cache(id);
     if (cache_index != -1) {
         // Cache hit
@@ -296,7 +503,9 @@ Message* retrieve_msg_cached_by_strategy(int id, bool *msg_in_cache, int use_lru
             // Create a copy for caching to avoid external modifications
             Message *cache_copy = create_msg(msg_from_disk->id, msg_from_disk->sender, msg_from_disk->receiver, msg_from_disk->content);
             if (cache_copy) {
-                add_msg_to_cache_by_strategy(cache_copy, use_lru);
+                pthread_mutex_lock(&cache.lock);
+                add_msg_by_strategy_locked(cache_copy, use_lru, true);
+                pthread_mutex_unlock(&cache.lock);
             }
         }
 
@@ -304,17 +513,530 @@ Message* retrieve_msg_cached_by_strategy(int id, bool *msg_in_cache, int use_lru
     }
 }
 
+//--------------------------------------------L0 lookaside cache-----------------------------------------------//
+
+// One L0 entry holds a private copy of a shared cache entry together with the slot and version
+// it was copied from. The copy is valid only while the shared slot still carries that version.
+typedef struct {
+    int64_t id;
+    int slot;
+    uint64_t version; // 0 means the entry is empty
+    Message message;
+} L0Entry;
+
+// Per-thread lookaside caches: no locks and no shared writes on a hit
+static _Thread_local L0Entry l0_cache[L0_CACHE_SIZE];
+static _Thread_local unsigned long l0_hits = 0;
+
+/**
+ * @brief Maps a message ID to its L0 slot (Fibonacci hashing).
+ * 
+ * @param id The ID of the message.
+ * @return L0Entry* The calling thread's L0 entry for the ID.
+ */
+static L0Entry *l0_entry_for(int64_t id) {
+    uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ULL;
+    return &l0_cache[h >> 32 & (L0_CACHE_SIZE - 1)];
+}
+
+/**
+ * @brief Copies a shared cache entry into the calling thread's L0 cache. Caller holds cache.lock.
+ * 
+ * @param l0 The L0 entry to fill.
+ * @param index The index of the shared CacheEntry to copy.
+ * @return Message* The L0 copy of the message.
+ */
+static Message *l0_fill_locked(L0Entry *l0, int index) {
+    l0->id = cache.entries[index].id;
+    l0->slot = index;
+    l0->version = cache.entries[index].version;
+    l0->message = *cache.entries[index].message;
+    return &l0->message;
+}
+
+/**
+ * @brief Retrieves a message through the calling thread's L0 lookaside cache, then the shared cache,
+ *        then disk.
+ * 
+ * The L0 cache is a small direct-mapped array private to each thread. An L0 hit only reads the
+ * version of the shared slot it was copied from, so the hottest IDs are served without locks or
+ * writes to shared cache lines. Any refill or eviction of the shared slot changes its version,
+ * so invalidations in the shared cache are honored. L0 hits do not refresh the shared LRU time
+ * and are not recorded in the admission sketch.
+ * 
+ * Unlike `retrieve_msg_cached_by_strategy()`, this function is safe to call from several threads.
+ * On a hit the returned message is the thread's own copy; it stays valid until the thread's next
+ * L0 lookup of an ID mapping to the same L0 slot and must not be freed. On a miss the message
+ * read from disk is returned and the caller must free it.
+ * 
+ * @param id The unique identifier of the message to retrieve.
+ * @param msg_in_cache Pointer to a boolean set to true if the message was served from the L0 or shared cache.
+ * @param use_lru If nonzero, the LRU replacement strategy is used on a miss; otherwise, random replacement is used.
+ * @return Message* Pointer to the retrieved message, or NULL if the message could not be found.
+ */
+Message* retrieve_msg_cached_l0(int64_t id, bool *msg_in_cache, int use_lru) {
+    if (msg_in_cache == NULL) {
+        fprintf(stderr, "Error: msg_in_cache pointer is NULL.\n");
+        return NULL;
+    }
+
+    // L0 hit: the private copy is still current if the shared slot kept its version
+    L0Entry *l0 = l0_entry_for(id);
+    if (l0->version != 0 && l0->id == id &&
+        __atomic_load_n(&cache.entries[l0->slot].version, __ATOMIC_ACQUIRE) == l0->version) {
+        *msg_in_cache = true;
+        l0_hits++;
+        return &l0->message;
+    }
+
+    // Shared cache hit: refresh recency and copy the entry into L0
+    pthread_mutex_lock(&cache.lock);
+    record_access_locked(id);
+    int cache_index = find_slot_locked(id);
+    if (cache_index != -1) {
+        cache.entries[cache_index].last_used = time(NULL);
+        Message *copy = l0_fill_locked(l0, cache_index);
+        pthread_mutex_unlock(&cache.lock);
+        *msg_in_cache = true;
+        return copy;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    // Cache miss - retrieve from disk without holding the lock
+    *msg_in_cache = false;
+    Message *msg_from_disk = retrieve_msg(id);
+    if (msg_from_disk != NULL) {
+        Message *cache_copy = malloc(sizeof(Message));
+        if (cache_copy) {
+            *cache_copy = *msg_from_disk;
+            pthread_mutex_lock(&cache.lock);
+            int index = add_msg_by_strategy_locked(cache_copy, use_lru, true);
+            if (index != -1) {
+                l0_fill_locked(l0, index);
+            }
+            pthread_mutex_unlock(&cache.lock);
+        }
+    }
+    return msg_from_disk;
+}
+
+/**
+ * @brief Returns how many lookups of the calling thread were served by its L0 cache.
+ * 
+ * @return unsigned long The number of L0 hits of the calling thread.
+ */
+unsigned long l0_cache_hits() {
+    return l0_hits;
+}
+
+//----------------------------------------------Snapshot and restore----------------------------------------------//
+
+/*
+Snapshot file format (host byte order):
+    header:  magic "MSGCACHE" | u32 format version | u32 entry count | u64 payload length | u64 FNV-1a checksum of payload
+    payload: one record per resident entry, in slot order:
+             i64 id | i64 timestamp | i64 last_used | u8 delivered | u8 frequency |
+             u16 sender length | u16 receiver length | u16 content length | sender | receiver | content
+Strings are stored without padding or terminator, so a record is usually far smaller than a Message.
+*/
+#define SNAPSHOT_MAGIC "MSGCACHE"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 32
+#define SNAPSHOT_RECORD_HEADER_SIZE 32
+
+// A consistent copy of one resident entry, taken under the cache lock
+typedef struct {
+    Message message;
+    time_t last_used;
+    int frequency;
+} SnapshotEntry;
+
+// Work handed to the background snapshot writer
+typedef struct {
+    char path[1024];
+    int count;
+    SnapshotEntry entries[CACHE_SIZE];
+} SnapshotJob;
+
+// Background writer state, guarded by snapshot_lock (never taken by the writer itself)
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t snapshot_thread;
+static bool snapshot_running = false;
+static int snapshot_result = 0;
+
+/**
+ * @brief Computes the 64-bit FNV-1a checksum of a buffer.
+ * 
+ * @param data The bytes to checksum.
+ * @param len The number of bytes.
+ * @return uint64_t The checksum.
+ */
+static uint64_t snapshot_checksum(const unsigned char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @brief Serializes a snapshot job into a single buffer holding the header and all records.
+ * 
+ * @param job The entries to serialize.
+ * @param out_len Receives the size of the buffer in bytes.
+ * @return unsigned char* The buffer (caller frees), or NULL if allocation fails.
+ */
+static unsigned char *serialize_snapshot(const SnapshotJob *job, size_t *out_len) {
+    size_t len = SNAPSHOT_HEADER_SIZE + (size_t)job->count * (SNAPSHOT_RECORD_HEADER_SIZE + 3 * MAX_TEXT_LENGTH);
+    unsigned char *buf = malloc(len);
+    if (!buf) {
+        return NULL;
+    }
+
+    unsigned char *p = buf + SNAPSHOT_HEADER_SIZE;
+    for (int i = 0; i < job->count; i++) {
+        const Message *msg = &job->entries[i].message;
+        int64_t timestamp = (int64_t)msg->timestamp;
+        int64_t last_used = (int64_t)job->entries[i].last_used;
+        uint8_t delivered = msg->delivered;
+        uint8_t frequency = (uint8_t)job->entries[i].frequency;
+        const char *texts[3] = { msg->sender, msg->receiver, msg->content };
+        uint16_t lens[3];
+        for (int t = 0; t < 3; t++) {
+            lens[t] = (uint16_t)strnlen(texts[t], MAX_TEXT_LENGTH - 1);
+        }
+
+        memcpy(p, &msg->id, 8);
+        memcpy(p + 8, &timestamp, 8);
+        memcpy(p + 16, &last_used, 8);
+        p[24] = delivered;
+        p[25] = frequency;
+        memcpy(p + 26, lens, sizeof(lens));
+        p += SNAPSHOT_RECORD_HEADER_SIZE;
+        for (int t = 0; t < 3; t++) {
+            memcpy(p, texts[t], lens[t]);
+            p += lens[t];
+        }
+    }
+
+    uint32_t version = SNAPSHOT_VERSION;
+    uint32_t count = (uint32_t)job->count;
+    uint64_t payload_len = (uint64_t)(p - buf - SNAPSHOT_HEADER_SIZE);
+    uint64_t checksum = snapshot_checksum(buf + SNAPSHOT_HEADER_SIZE, payload_len);
+    memcpy(buf, SNAPSHOT_MAGIC, 8);
+    memcpy(buf + 8, &version, 4);
+    memcpy(buf + 12, &count, 4);
+    memcpy(buf + 16, &payload_len, 8);
+    memcpy(buf + 24, &checksum, 8);
+
+    *out_len = (size_t)(p - buf);
+    return buf;
+}
+
+/**
+ * @brief Background thread that writes a snapshot crash-consistently.
+ * 
+ * The file is written to `<path>.tmp`, flushed with fsync and then renamed over `<path>`, and the
+ * directory is synced, so after a crash `<path>` holds either the old or the new snapshot.
+ * 
+ * @param arg The SnapshotJob to write (freed by this thread).
+ * @return void* The outcome (0 or -1), collected by `join_snapshot_locked()`.
+ */
+static void *snapshot_writer(void *arg) {
+    SnapshotJob *job = (SnapshotJob *)arg;
+    int result = -1;
+    size_t len = 0;
+    unsigned char *buf = serialize_snapshot(job, &len);
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", job->path);
+
+    int fd = buf ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600) : -1;
+    if (fd < 0) {
+        perror("Error opening snapshot file");
+    } else {
+        size_t written = 0;
+        while (written < len) {
+            ssize_t n = write(fd, buf + written, len - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            written += (size_t)n;
+        }
+        if (written == len && fsync(fd) == 0 && close(fd) == 0) {
+            fd = -1;
+            if (rename(tmp_path, job->path) == 0) {
+                result = 0;
+            } else {
+                perror("Error renaming snapshot file");
+            }
+        } else {
+            perror("Error writing snapshot file");
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (result != 0) {
+            unlink(tmp_path);
+        }
+    }
+
+    // Persist the rename itself
+    if (result == 0) {
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s", job->path);
+        char *slash = strrchr(dir, '/');
+        if (slash) {
+            *slash = '\0';
+        } else {
+            snprintf(dir, sizeof(dir), ".");
+        }
+        int dir_fd = open(dir[0] ? dir : "/", O_RDONLY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    free(buf);
+    free(job);
+    return (void *)(intptr_t)result;
+}
+
+/**
+ * @brief Waits for the running snapshot writer, if any, and records its outcome in
+ * snapshot_result. The caller holds snapshot_lock.
+ */
+static void join_snapshot_locked() {
+    if (snapshot_running) {
+        void *result;
+        pthread_join(snapshot_thread, &result);
+        snapshot_running = false;
+        snapshot_result = (int)(intptr_t)result;
+    }
+}
+
+/**
+ * @brief Starts writing a snapshot of the resident cache entries to a file.
+ * 
+ * The entries and their recency (`last_used`) and frequency (sketch estimate) are copied under
+ * the cache lock, which only takes a memcpy of at most CACHE_SIZE messages. Serializing and
+ * writing happen on a background thread, so lookups continue meanwhile. A snapshot that is still
+ * being written is waited for first, and reported if it failed. Use `cache_snapshot_wait()` to
+ * learn whether the new one succeeded. Concurrent calls are serialized.
+ * 
+ * @param path The snapshot file to (re)place.
+ * @return int 0 if the snapshot was started, -1 on failure.
+ */
+int cache_snapshot(const char *path) {
+    if (path == NULL || strlen(path) >= sizeof(((SnapshotJob *)0)->path)) {
+        fprintf(stderr, "Error: Invalid snapshot path.\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    bool had_previous = snapshot_running;
+    join_snapshot_locked();
+    if (had_previous && snapshot_result != 0) {
+        fprintf(stderr, "Warning: Previous snapshot failed to write.\n");
+    }
+
+    SnapshotJob *job = malloc(sizeof(SnapshotJob));
+    if (!job) {
+        perror("malloc failed");
+        pthread_mutex_unlock(&snapshot_lock);
+        return -1;
+    }
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    job->count = 0;
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache.entries[i].message != NULL) {
+            SnapshotEntry *entry = &job->entries[job->count++];
+            entry->message = *cache.entries[i].message;
+            entry->last_used = cache.entries[i].last_used;
+            entry->frequency = sketch_estimate_locked(cache.entries[i].id);
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    if (pthread_create(&snapshot_thread, NULL, snapshot_writer, job) != 0) {
+        perror("Failed to create snapshot thread");
+        free(job);
+        pthread_mutex_unlock(&snapshot_lock);
+        return -1;
+    }
+    snapshot_running = true;
+    pthread_mutex_unlock(&snapshot_lock);
+    return 0;
+}
+
+/**
+ * @brief Waits for the snapshot started by `cache_snapshot()` to be written.
+ * 
+ * @return int 0 if the last snapshot was written successfully (or none was started), -1 otherwise.
+ */
+int cache_snapshot_wait() {
+    pthread_mutex_lock(&snapshot_lock);
+    join_snapshot_locked();
+    int result = snapshot_result;
+    pthread_mutex_unlock(&snapshot_lock);
+    return result;
+}
+
+/**
+ * @brief Decodes the records of a snapshot payload, checking every length against the buffer.
+ * 
+ * @param p The first byte of the payload.
+ * @param end One past the last byte of the payload.
+ * @param count The number of records announced by the header.
+ * @param entries Array of at least `count` entries that receives the decoded records.
+ * @return true if all records were decoded, false if the payload is malformed.
+ */
+static bool decode_snapshot_records(const unsigned char *p, const unsigned char *end, uint32_t count,
+                                    SnapshotEntry *entries) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (end - p < SNAPSHOT_RECORD_HEADER_SIZE) {
+            return false;
+        }
+        int64_t timestamp, last_used;
+        uint16_t lens[3];
+        Message *msg = &entries[i].message;
+        memcpy(&msg->id, p, 8);
+        memcpy(&timestamp, p + 8, 8);
+        memcpy(&last_used, p + 16, 8);
+        msg->timestamp = (time_t)timestamp;
+        msg->delivered = p[24] != 0;
+        entries[i].last_used = (time_t)last_used;
+        entries[i].frequency = p[25];
+        memcpy(lens, p + 26, sizeof(lens));
+        p += SNAPSHOT_RECORD_HEADER_SIZE;
+
+        char *texts[3] = { msg->sender, msg->receiver, msg->content };
+        for (int t = 0; t < 3; t++) {
+            if (lens[t] >= MAX_TEXT_LENGTH || end - p < lens[t]) {
+                return false;
+            }
+            memcpy(texts[t], p, lens[t]);
+            texts[t][lens[t]] = '\0';
+            p += lens[t];
+        }
+    }
+    return p == end;
+}
+
+/**
+ * @brief Replaces the cache content with the entries of a snapshot file.
+ * 
+ * The file is mapped with mmap and fully validated (magic, version, lengths and checksum) before
+ * the cache is touched, so a torn or corrupt snapshot leaves the cache unchanged. The restored
+ * entries keep their `last_used` time, and their frequency is written back into the admission sketch.
+ * 
+ * @param path The snapshot file written by `cache_snapshot()`.
+ * @return int The number of restored entries, or -1 on failure.
+ */
+int cache_restore(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening snapshot file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < SNAPSHOT_HEADER_SIZE) {
+        fprintf(stderr, "Error: Snapshot file is truncated.\n");
+        close(fd);
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    const unsigned char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED) {
+        perror("Error mapping snapshot file");
+        return -1;
+    }
+
+    uint32_t version, count;
+    uint64_t payload_len, checksum;
+    memcpy(&version, buf + 8, 4);
+    memcpy(&count, buf + 12, 4);
+    memcpy(&payload_len, buf + 16, 8);
+    memcpy(&checksum, buf + 24, 8);
+    if (memcmp(buf, SNAPSHOT_MAGIC, 8) != 0 || version != SNAPSHOT_VERSION || count > CACHE_SIZE ||
+        payload_len != len - SNAPSHOT_HEADER_SIZE ||
+        snapshot_checksum(buf + SNAPSHOT_HEADER_SIZE, payload_len) != checksum) {
+        fprintf(stderr, "Error: Snapshot file is corrupt.\n");
+        munmap((void *)buf, len);
+        return -1;
+    }
+
+    // Decode every record before touching the cache
+    SnapshotEntry *entries = calloc(CACHE_SIZE, sizeof(SnapshotEntry));
+    if (!entries) {
+        perror("calloc failed");
+        munmap((void *)buf, len);
+        return -1;
+    }
+    if (!decode_snapshot_records(buf + SNAPSHOT_HEADER_SIZE, buf + len, count, entries)) {
+        fprintf(stderr, "Error: Snapshot file is corrupt.\n");
+        free(entries);
+        munmap((void *)buf, len);
+        return -1;
+    }
+    munmap((void *)buf, len);
+
+    pthread_mutex_lock(&cache.lock);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache.entries[i].message != NULL) {
+            free_msg(cache.entries[i].message);
+            cache.entries[i].message = NULL;
+        }
+        cache.entries[i].id = -1;
+        cache.entries[i].last_used = 0;
+        __atomic_store_n(&cache.entries[i].version, ++cache_version_seq, __ATOMIC_RELEASE);
+    }
+    memset(&cache.sketch, 0, sizeof(cache.sketch));
+    int restored = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        Message *msg = malloc(sizeof(Message));
+        if (!msg) {
+            break;
+        }
+        *msg = entries[i].message;
+        fill_slot_locked(restored, msg);
+        cache.entries[restored].last_used = entries[i].last_used;
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            uint8_t *counter = &cache.sketch.counters[row][sketch_index(msg->id, row)];
+            if (*counter < entries[i].frequency) {
+                *counter = (uint8_t)entries[i].frequency;
+            }
+        }
+        restored++;
+    }
+    cache.next_available = restored % CACHE_SIZE;
+    pthread_mutex_unlock(&cache.lock);
+
+    free(entries);
+    return restored;
+}
+
 /**
  * @brief Frees all allocated messages in the cache and resets cache entries.
  * 
  * This function iterates through the cache and deallocates any stored messages, ensuring 
- * that memory is properly freed before program termination or cache reset.
+ * that memory is properly freed before program termination or cache reset. Every slot gets a
+ * new version, so L0 copies of the freed messages are invalidated too.
  */
 void free_cache() {
+    pthread_mutex_lock(&cache.lock);
     for (int i = 0; i < CACHE_SIZE; i++) {
         if (cache.entries[i].message != NULL) {
             free_msg(cache.entries[i].message);
             cache.entries[i].message = NULL;
         }
+        cache.entries[i].id = -1;
+        __atomic_store_n(&cache.entries[i].version, ++cache_version_seq, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&cache.lock);
 }
@@ -1,6 +1,8 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,28 +10,45 @@
 #include "message.h"
 
 #define CACHE_SIZE 16
+#define L0_CACHE_SIZE 32 // Entries in each thread's lock-free lookaside cache (power of two)
+
+#define SKETCH_DEPTH 4                   // Rows (independent hashes) of the frequency sketch
+#define SKETCH_WIDTH 256                 // Counters per row (power of two)
+#define SKETCH_MAX_COUNT 15              // Counters saturate here
+#define SKETCH_WINDOW (10 * CACHE_SIZE)  // Recorded accesses before all counters are halved
 
 // Structure for a cache entry
 typedef struct {
-    int id;
+    int64_t id;
     Message *message;
     time_t last_used; // For LRU
+    uint64_t version; // Changes whenever the slot is refilled or emptied, validates L0 copies
 } CacheEntry;
 
+// Count-min sketch estimating how often each message ID was looked up recently
+typedef struct {
+    uint8_t counters[SKETCH_DEPTH][SKETCH_WIDTH];
+    unsigned long additions; // Accesses recorded since the counters were last halved
+} FrequencySketch;
+
 // Cache structure
 typedef struct {
     CacheEntry entries[CACHE_SIZE];
     int next_available; // Index of next CacheEntry to be replaced
+    pthread_mutex_t lock; // Guards entries for the thread-safe L0 path and all insertions
+    FrequencySketch sketch; // Access frequencies used for admission control
+    bool admission_enabled; // If true, a miss only enters the cache when it is more frequent than the victim
+    unsigned long rejected_admissions; // Misses that admission control kept out of the cache
 } MessageCache;
 
-// Global cache instance
-MessageCache cache;
+// Global cache instance (defined in cache.c)
+extern MessageCache cache;
 
 // Function to initialize the cache
 void init_cache();
 
 // Function to find a message in the cache and return the index of it.
-int find_msg_in_cache(int id);
+int find_msg_in_cache(int64_t id);
 
 // Function to add a message to the cache (FIFO replacement).
 int add_msg_to_cache(Message *msg);
@@ -38,13 +57,34 @@ int add_msg_to_cache(Message *msg);
 int store_msg_cached(Message *msg);
 
 // Modified retrieve_msg function to first check cache
-Message* retrieve_msg_cached(int id, bool *msg_in_cache);
+Message* retrieve_msg_cached(int64_t id, bool *msg_in_cache);
 
 // Store_msg function to also store in cache by a strategy either random replace or lru
 int store_msg_cached_by_strategy(Message *msg, int use_lru);
 
 // Retrieve_msg function with a strategy
-Message* retrieve_msg_cached_by_strategy(int id, bool *msg_in_cache, int use_lru);
+Message* retrieve_msg_cached_by_strategy(int64_t id, bool *msg_in_cache, int use_lru);
+
+// Retrieve_msg function that consults the calling thread's L0 lookaside cache before the shared cache
+Message* retrieve_msg_cached_l0(int64_t id, bool *msg_in_cache, int use_lru);
+
+// Function to get the number of L0 hits served to the calling thread
+unsigned long l0_cache_hits();
+
+// Function to turn admission control of missed messages on or off (on by default)
+void set_cache_admission(bool enabled);
+
+// Function to get the number of missed messages rejected by admission control since init_cache
+unsigned long cache_rejected_admissions();
+
+// Function to start writing the resident entries and their metadata to a snapshot file in the background
+int cache_snapshot(const char *path);
+
+// Function to wait for the background snapshot and return whether it was written
+int cache_snapshot_wait();
+
+// Function to load the cache from a snapshot file written by cache_snapshot
+int cache_restore(const char *path);
 
 // Function to free the cache
 void free_cache();
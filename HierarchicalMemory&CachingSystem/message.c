@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +7,65 @@
 #include <sys/types.h>
 #include "message.h"
 
+/**
+ * @brief Mixes the bits of a message ID so that consecutive IDs spread evenly over the
+ *        fan-out directories (splitmix64 finalizer).
+ * 
+ * @param id The message ID to hash.
+ * @return uint64_t The mixed 64-bit hash.
+ */
+static uint64_t hash_msg_id(int64_t id) {
+    uint64_t x = (uint64_t)id;
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @brief Builds the path of the file that stores the given message.
+ * 
+ * Messages are spread over a two-level directory tree `messages/<h1>/<h2>/` where `h1` and
+ * `h2` are taken from a hash of the ID. With 256 x 256 leaf directories each directory stays
+ * small even with hundreds of millions of messages, so the file system lookup stays fast.
+ * 
+ * @param id Unique identifier of the message.
+ * @param path Buffer that receives the path.
+ * @param path_len Size of the buffer in bytes.
+ */
+void msg_file_path(int64_t id, char *path, size_t path_len) {
+    uint64_t h = hash_msg_id(id);
+    snprintf(path, path_len, MESSAGE_FLODER "/%02x/%02x/messages_%" PRId64 ".txt",
+             (unsigned)(h % MESSAGE_DIR_FANOUT), (unsigned)((h / MESSAGE_DIR_FANOUT) % MESSAGE_DIR_FANOUT), id);
+}
+
+/**
+ * @brief Creates every missing parent directory of a message file path.
+ * 
+ * Concurrent writers may race to create the same directory, so an existing directory is
+ * not treated as an error.
+ * 
+ * @param path The message file path built by `msg_file_path()`.
+ * @return true if all parent directories exist afterwards, false otherwise.
+ */
+static bool make_msg_dirs(const char *path) {
+    char dir[MESSAGE_PATH_LENGTH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+                perror("Error creating directory");
+                return false;
+            }
+            *p = '/';
+        }
+    }
+    return true;
+}
+
 /**
  * @brief Creates a new message with the given parameters and allocates memory dynamically.
  * 
@@ -17,7 +78,7 @@
  * @param content Content of the message.
  * @return Message* Pointer to the newly created message, or NULL if memory allocation fails.
  */
-Message* create_msg(int id, const char* sender, const char* receiver, const char* content) {
+Message* create_msg(int64_t id, const char* sender, const char* receiver, const char* content) {
     // Allocate memory for the message
     Message* msg = (Message*)malloc(sizeof(Message));
     if (!msg) {
@@ -42,7 +103,9 @@ Message* create_msg(int id, const char* sender, const char* receiver, const char
  * @brief Stores a message to disk by writing it to a file.
  * 
  * This function writes the binary representation of the message into a file located in 
- * the `messages/` directory. The filename is generated using the message ID.
+ * the hashed `messages/<h1>/<h2>/` directory of its ID (see `msg_file_path()`). The
+ * directories are only created when the first open fails, so the common case costs a
+ * single open.
  * 
  * @param msg Pointer to the message to store.
  * @return true if the message was stored successfully, false otherwise.
@@ -53,21 +116,15 @@ bool store_msg(const Message *msg) {
         return false;
     }
 
-    // Ensure the 'messages' directory exists
-    struct stat st = {0};
-    if (stat(MESSAGE_FLODER, &st) == -1) { // Check if directory exists
-        if (mkdir(MESSAGE_FLODER, 0700) == -1) { // Create directory if it doesn't exist
-            perror("Error creating directory");
-            return false;
-        }
-    }
-
     // Generate filename based on message ID
-    char filename[64];
-    snprintf(filename, sizeof(filename), MESSAGE_FLODER "/messages_%d.txt", msg->id);
+    char filename[MESSAGE_PATH_LENGTH];
+    msg_file_path(msg->id, filename, sizeof(filename));
 
-    // Open file for binary writing
+    // Open file for binary writing, creating the fan-out directories on first use
     FILE *file = fopen(filename, "wb");
+    if (!file && errno == ENOENT && make_msg_dirs(filename)) {
+        file = fopen(filename, "wb");
+    }
     if (!file) {
         perror("Error opening file for writing");
         return false;
@@ -87,24 +144,17 @@ bool store_msg(const Message *msg) {
 /**
  * @brief Retrieves a message from disk using the given message ID.
  * 
- * This function searches for a file with the corresponding message ID in the `messages/` directory.
+ * This function opens the file of the corresponding message ID in its hashed `messages/` subdirectory.
  * If found, it reads the message into a dynamically allocated structure.
  * The caller is responsible for freeing the allocated memory using `free_msg()`.
  * 
  * @param id Unique identifier of the message to retrieve.
  * @return Message* Pointer to the retrieved message, or NULL if retrieval fails.
  */
-Message* retrieve_msg(const int id) {
-    // Ensure the "messages" directory exists
-    struct stat st = {0};
-    if (stat(MESSAGE_FLODER, &st) == -1) {
-        fprintf(stderr, "Messages directory does not exist\n");
-        return NULL;
-    }
-
+Message* retrieve_msg(const int64_t id) {
     // Generate filename based on message ID
-    char filename[64];
-    snprintf(filename, sizeof(filename), MESSAGE_FLODER "/messages_%d.txt", id);
+    char filename[MESSAGE_PATH_LENGTH];
+    msg_file_path(id, filename, sizeof(filename));
 
     // Open file for binary reading
     FILE *file = fopen(filename, "rb");
@@ -2,14 +2,18 @@
 #define MESSAGE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
 #define MAX_TEXT_LENGTH 256
 #define MESSAGE_FLODER "messages"
+#define MESSAGE_DIR_FANOUT 256   // Subdirectories per level of the two-level message layout
+#define MESSAGE_PATH_LENGTH 96   // Enough for "messages/xx/xx/messages_<int64>.txt"
 
 // Structure to represent a message
 typedef struct {
-    int id;                          // Unique identifier for the message
+    int64_t id;                      // Unique identifier for the message
     time_t timestamp;                // Time the message was sent (e.g., Unix timestamp)
     char sender[MAX_TEXT_LENGTH];    // Sender of the message
     char receiver[MAX_TEXT_LENGTH];  // Receiver of the message
@@ -18,13 +22,16 @@ typedef struct {
 } Message;
 
 // Function to create a message
-Message* create_msg(int id, const char* sender, const char* receiver, const char* content);
+Message* create_msg(int64_t id, const char* sender, const char* receiver, const char* content);
 
 // Function to store a message to disk
 bool store_msg(const Message* msg);
 
 // Function to retrieve a message from disk
-Message* retrieve_msg(const int id);
+Message* retrieve_msg(const int64_t id);
+
+// Function to build the on-disk path of a message
+void msg_file_path(int64_t id, char *path, size_t path_len);
 
 // Function to free the memory allocated for a message
 void free_msg(Message *msg);
@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "message.h"
 #include "cache.h"
@@ -54,6 +57,215 @@ void test_store_and_retrieve_msg() {
     free(retrieved);
 }
 
+void test_64bit_id_and_fanout() {
+    int64_t big_id = (int64_t)INT32_MAX + 12345;
+    Message* msg = create_msg(big_id, "Grace", "Heidi", "Beyond 32 bits");
+    assert(msg != NULL);
+    assert(msg->id == big_id);
+    assert(store_msg(msg) == true);
+
+    // The message file lands in a two-level hashed subdirectory of messages/
+    char path[MESSAGE_PATH_LENGTH];
+    msg_file_path(big_id, path, sizeof(path));
+    assert(strncmp(path, MESSAGE_FLODER "/", strlen(MESSAGE_FLODER) + 1) == 0);
+    assert(path[strlen(MESSAGE_FLODER) + 3] == '/' && path[strlen(MESSAGE_FLODER) + 6] == '/');
+    struct stat st;
+    assert(stat(path, &st) == 0);
+
+    // IDs that only differ above bit 31 must not collide
+    int64_t alias_id = big_id + ((int64_t)1 << 32);
+    char alias_path[MESSAGE_PATH_LENGTH];
+    msg_file_path(alias_id, alias_path, sizeof(alias_path));
+    assert(strcmp(path, alias_path) != 0);
+
+    Message* retrieved = retrieve_msg(big_id);
+    assert(retrieved != NULL);
+    assert(retrieved->id == big_id);
+    assert(strcmp(retrieved->content, "Beyond 32 bits") == 0);
+
+    printf("test_64bit_id_and_fanout passed!\n");
+    free_msg(msg);
+    free_msg(retrieved);
+}
+
+#define L0_TEST_THREADS 4
+#define L0_TEST_LOOKUPS 1000
+
+void *l0_lookup_worker(void *arg) {
+    (void)arg;
+    bool msg_in_cache = false;
+    for (int i = 0; i < L0_TEST_LOOKUPS; i++) {
+        int64_t id = 300 + i % 4;
+        Message *msg = retrieve_msg_cached_l0(id, &msg_in_cache, 1);
+        assert(msg != NULL && msg->id == id);
+        if (!msg_in_cache) {
+            free_msg(msg);
+        }
+    }
+    // Four hot IDs fit in L0, so almost every lookup avoids the shared cache
+    assert(l0_cache_hits() >= L0_TEST_LOOKUPS - 4);
+    return NULL;
+}
+
+void test_l0_cache() {
+    init_cache();
+    for (int64_t id = 300; id < 304; id++) {
+        Message *msg = create_msg(id, "Ivan", "Judy", "L0 original");
+        store_msg_cached_by_strategy(msg, 1);
+        free_msg(msg);
+    }
+
+    // First lookup copies the shared entry into L0, the second is served by L0
+    bool msg_in_cache = false;
+    unsigned long hits_before = l0_cache_hits();
+    Message *msg = retrieve_msg_cached_l0(300, &msg_in_cache, 1);
+    assert(msg != NULL && msg_in_cache);
+    assert(l0_cache_hits() == hits_before);
+    msg = retrieve_msg_cached_l0(300, &msg_in_cache, 1);
+    assert(msg != NULL && msg_in_cache);
+    assert(l0_cache_hits() == hits_before + 1);
+    assert(strcmp(msg->content, "L0 original") == 0);
+
+    // Replacing the shared entry invalidates the L0 copy
+    Message *update = create_msg(300, "Ivan", "Judy", "L0 updated");
+    store_msg_cached_by_strategy(update, 1);
+    free_msg(update);
+    msg = retrieve_msg_cached_l0(300, &msg_in_cache, 1);
+    assert(msg != NULL && msg_in_cache);
+    assert(l0_cache_hits() == hits_before + 1);
+    assert(strcmp(msg->content, "L0 updated") == 0);
+
+    // Lookups from several threads at once
+    pthread_t threads[L0_TEST_THREADS];
+    for (int i = 0; i < L0_TEST_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, l0_lookup_worker, NULL) == 0);
+    }
+    for (int i = 0; i < L0_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Freeing the shared cache invalidates every L0 copy
+    free_cache();
+    init_cache();
+    msg = retrieve_msg_cached_l0(301, &msg_in_cache, 1);
+    assert(msg != NULL && !msg_in_cache);
+    free_msg(msg);
+    free_cache();
+
+    printf("test_l0_cache passed!\n");
+}
+
+void test_admission_control() {
+    init_cache();
+    for (int64_t id = 400; id < 400 + CACHE_SIZE; id++) {
+        Message *msg = create_msg(id, "Karl", "Liam", "Hot message");
+        store_msg_cached_by_strategy(msg, 1);
+        free_msg(msg);
+    }
+    for (int64_t id = 500; id < 600; id++) {
+        Message *msg = create_msg(id, "Karl", "Liam", "Cold message");
+        store_msg(msg);
+        free_msg(msg);
+    }
+
+    // Read the resident set a few times so it is known to be hot
+    bool msg_in_cache = false;
+    for (int round = 0; round < 3; round++) {
+        for (int64_t id = 400; id < 400 + CACHE_SIZE; id++) {
+            retrieve_msg_cached_by_strategy(id, &msg_in_cache, 1);
+            assert(msg_in_cache);
+        }
+    }
+
+    // One-hit wonders are read from disk but never evict the hot set
+    for (int64_t id = 500; id < 600; id++) {
+        Message *msg = retrieve_msg_cached_by_strategy(id, &msg_in_cache, 1);
+        assert(msg != NULL && !msg_in_cache);
+        free_msg(msg);
+    }
+    assert(cache_rejected_admissions() == 100);
+    for (int64_t id = 400; id < 400 + CACHE_SIZE; id++) {
+        assert(find_msg_in_cache(id) != -1);
+    }
+
+    // A cold ID that keeps being read earns its way in once it is hotter than the victim
+    Message *msg = NULL;
+    for (int i = 0; i < 3; i++) {
+        msg = retrieve_msg_cached_by_strategy(500, &msg_in_cache, 1);
+        free_msg(msg);
+    }
+    assert(find_msg_in_cache(500) != -1);
+
+    // Without admission control every miss is cached
+    set_cache_admission(false);
+    unsigned long rejected = cache_rejected_admissions();
+    msg = retrieve_msg_cached_by_strategy(599, &msg_in_cache, 1);
+    free_msg(msg);
+    assert(find_msg_in_cache(599) != -1);
+    assert(cache_rejected_admissions() == rejected);
+    set_cache_admission(true);
+    free_cache();
+
+    printf("test_admission_control passed!\n");
+}
+
+#define SNAPSHOT_TEST_PATH "cache_test.snapshot"
+
+void test_snapshot_and_restore() {
+    init_cache();
+    for (int64_t id = 700; id < 704; id++) {
+        Message *msg = create_msg(id, "Mallory", "Niaj", "Warm after restart");
+        store_msg_cached_by_strategy(msg, 1);
+        free_msg(msg);
+        cache.entries[find_msg_in_cache(id)].message->delivered = id % 2 == 0;
+    }
+    bool msg_in_cache = false;
+    for (int i = 0; i < 5; i++) {
+        retrieve_msg_cached_by_strategy(700, &msg_in_cache, 1);
+    }
+    time_t last_used = cache.entries[find_msg_in_cache(701)].last_used;
+
+    assert(cache_snapshot(SNAPSHOT_TEST_PATH) == 0);
+    assert(cache_snapshot_wait() == 0);
+
+    // Simulate a restart: empty cache, then warm it from the snapshot
+    free_cache();
+    init_cache();
+    assert(cache_restore(SNAPSHOT_TEST_PATH) == 4);
+    for (int64_t id = 700; id < 704; id++) {
+        int index = find_msg_in_cache(id);
+        assert(index != -1);
+        Message *msg = cache.entries[index].message;
+        assert(strcmp(msg->content, "Warm after restart") == 0);
+        assert(msg->delivered == (id % 2 == 0));
+    }
+    assert(cache.entries[1].last_used >= last_used);
+
+    // The restored frequency keeps the hot entry ahead of a one-hit wonder
+    for (int64_t id = 704; id < 704 + CACHE_SIZE; id++) {
+        Message *msg = create_msg(id, "Mallory", "Niaj", "Filler");
+        store_msg_cached_by_strategy(msg, 1);
+        free_msg(msg);
+    }
+    assert(find_msg_in_cache(700) == -1);
+    Message *msg = retrieve_msg_cached_by_strategy(700, &msg_in_cache, 1);
+    free_msg(msg);
+    assert(find_msg_in_cache(700) != -1);
+
+    // A corrupt snapshot is rejected and leaves the cache untouched
+    FILE *file = fopen(SNAPSHOT_TEST_PATH, "r+b");
+    assert(file != NULL);
+    fseek(file, -1, SEEK_END);
+    fputc('#', file);
+    fclose(file);
+    assert(cache_restore(SNAPSHOT_TEST_PATH) == -1);
+    assert(find_msg_in_cache(700) != -1);
+
+    remove(SNAPSHOT_TEST_PATH);
+    free_cache();
+    printf("test_snapshot_and_restore passed!\n");
+}
+
 // use_lru 0->random 1->lru other->FIFO
 void random_access_and_metrics(int use_lru) {
     int num_cache_hit = 0;
@@ -91,6 +303,7 @@ int main() {
     printf("Part 1 tests start!\n");
     test_create_msg();
     test_store_and_retrieve_msg();
+    test_64bit_id_and_fanout();
     printf("Part 1 tests end!\n");
     printf("-----------------------------------------\n");
 
@@ -114,7 +327,7 @@ int main() {
         } else {
             printf("Retrieved from disk.\n");
         }
-        printf("Retrieved mgs: ID=%d, Content=%s\n", retrieved1->id, retrieved1->content);
+        printf("Retrieved mgs: ID=%" PRId64 ", Content=%s\n", retrieved1->id, retrieved1->content);
     }
 
     Message *retrieved2 = retrieve_msg_cached(102, msg_in_cache);
@@ -124,7 +337,7 @@ int main() {
         } else {
             printf("Retrieved from disk.\n");
         }
-        printf("Retrieved msg: ID=%d, Content=%s\n", retrieved2->id, retrieved2->content);
+        printf("Retrieved msg: ID=%" PRId64 ", Content=%s\n", retrieved2->id, retrieved2->content);
     }
 
     Message *retrieved3 = retrieve_msg_cached(103, msg_in_cache); // Should come from disk (if exists)
@@ -134,7 +347,7 @@ int main() {
         } else {
             printf("Retrieved from disk.\n");
         }
-        printf("Retrieved msg: ID=%d, Content=%s\n", retrieved3->id, retrieved3->content);
+        printf("Retrieved msg: ID=%" PRId64 ", Content=%s\n", retrieved3->id, retrieved3->content);
     } else {
         printf("Message with ID 103 not found.\n");
     }
@@ -187,6 +400,21 @@ int main() {
     printf("Part 4 tests end!\n");
     printf("-----------------------------------------\n");
 
+    printf("L0 cache tests start!\n");
+    test_l0_cache();
+    printf("L0 cache tests end!\n");
+    printf("-----------------------------------------\n");
+
+    printf("Admission control tests start!\n");
+    test_admission_control();
+    printf("Admission control tests end!\n");
+    printf("-----------------------------------------\n");
+
+    printf("Snapshot tests start!\n");
+    test_snapshot_and_restore();
+    printf("Snapshot tests end!\n");
+    printf("-----------------------------------------\n");
+
 
     printf("All tests passed!\n");
     return 0;
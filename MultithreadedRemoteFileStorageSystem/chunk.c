@@ -0,0 +1,163 @@
+/*
+ * chunk.c -- Content-defined chunking shared by the RFS server and client
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chunk.h"
+
+#define CHUNK_READ_SIZE (1024 * 1024)  // Bytes read from the file per call
+
+static uint64_t gear[256];             // Random value per byte, mixed into the rolling hash
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Fills the gear table from a fixed splitmix64 sequence, so client and server cut
+ *        the same content at the same places.
+ */
+static void init_gear(void) {
+    uint64_t x = 0x5246534348554e4bULL;
+    for (int i = 0; i < 256; i++) {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/**
+ * @brief Appends an entry to a growing chunk array.
+ *
+ * @return ChunkRef* The new entry, or NULL if out of memory.
+ */
+static ChunkRef *append_chunk(ChunkRef **chunks, size_t *count, size_t *capacity) {
+    if (*count == *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 64;
+        ChunkRef *grown = realloc(*chunks, grown_capacity * sizeof(ChunkRef));
+        if (!grown) {
+            return NULL;
+        }
+        *chunks = grown;
+        *capacity = grown_capacity;
+    }
+    return &(*chunks)[(*count)++];
+}
+
+/**
+ * @brief Splits an open file into content-defined chunks and hashes each of them.
+ *
+ *        The file is read sequentially in CHUNK_READ_SIZE blocks, so memory use does not
+ *        depend on the file size. A boundary is placed after a byte where the gear hash has
+ *        its top CHUNK_AVG_BITS bits clear, but never before CHUNK_MIN_SIZE bytes and always
+ *        at CHUNK_MAX_SIZE bytes. An empty file has no chunks.
+ *
+ * @param fd     Open file, read from offset 0 with pread().
+ * @param chunks Receives a malloc'd array of chunks (NULL when there are none).
+ * @param count  Receives the number of chunks.
+ * @return int 0 on success, -1 on a read or allocation error.
+ */
+int chunk_file(int fd, ChunkRef **chunks, size_t *count) {
+    pthread_once(&gear_once, init_gear);
+    *chunks = NULL;
+    *count = 0;
+
+    unsigned char *buffer = malloc(CHUNK_READ_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    const uint64_t mask = ~0ULL << (64 - CHUNK_AVG_BITS);
+    size_t capacity = 0, chunk_len = 0;
+    uint64_t hash = 0;
+    off_t pos = 0;
+    Sha256 sha;
+    sha256_init(&sha);
+
+    int result = 0;
+    while (result == 0) {
+        ssize_t got = pread(fd, buffer, CHUNK_READ_SIZE, pos);
+        if (got <= 0) {
+            result = got < 0 ? -1 : 0;
+            break;
+        }
+        size_t hashed = 0;  // Bytes of buffer already fed to sha
+        for (size_t i = 0; i < (size_t)got; i++) {
+            hash = (hash << 1) + gear[buffer[i]];
+            chunk_len++;
+            if (chunk_len < CHUNK_MAX_SIZE && (chunk_len < CHUNK_MIN_SIZE || (hash & mask) != 0)) {
+                continue;
+            }
+
+            // Close the chunk after this byte
+            ChunkRef *chunk = append_chunk(chunks, count, &capacity);
+            if (!chunk) {
+                result = -1;
+                break;
+            }
+            sha256_update(&sha, buffer + hashed, i + 1 - hashed);
+            hashed = i + 1;
+            chunk->offset = pos + (off_t)(i + 1) - (off_t)chunk_len;
+            chunk->length = chunk_len;
+            sha256_final(&sha, chunk->digest);
+            sha256_init(&sha);
+            chunk_len = 0;
+            hash = 0;
+        }
+        sha256_update(&sha, buffer + hashed, got - hashed);
+        pos += got;
+    }
+
+    // The rest of the file is the last chunk
+    if (result == 0 && chunk_len > 0) {
+        ChunkRef *chunk = append_chunk(chunks, count, &capacity);
+        if (chunk) {
+            chunk->offset = pos - (off_t)chunk_len;
+            chunk->length = chunk_len;
+            sha256_final(&sha, chunk->digest);
+        } else {
+            result = -1;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+/**
+ * @brief Writes a digest as lowercase hex.
+ *
+ * @param digest The digest.
+ * @param hex    Receives 64 hex digits and a terminating NUL.
+ */
+void chunk_digest_hex(const unsigned char digest[SHA256_DIGEST_SIZE], char hex[CHUNK_HEX_SIZE]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 15];
+    }
+    hex[SHA256_DIGEST_SIZE * 2] = '\0';
+}
+
+/**
+ * @brief Parses a digest from 64 hex digits.
+ *
+ * @param hex    The hex string.
+ * @param digest Receives the digest.
+ * @return int 0 on success, -1 if hex is not exactly 64 hex digits.
+ */
+int chunk_parse_hex(const char *hex, unsigned char digest[SHA256_DIGEST_SIZE]) {
+    for (int i = 0; i < SHA256_DIGEST_SIZE * 2; i++) {
+        char c = hex[i];
+        int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (v < 0) {
+            return -1;
+        }
+        if (i % 2 == 0) {
+            digest[i / 2] = (unsigned char)(v << 4);
+        } else {
+            digest[i / 2] |= (unsigned char)v;
+        }
+    }
+    return hex[SHA256_DIGEST_SIZE * 2] == '\0' ? 0 : -1;
+}
@@ -0,0 +1,39 @@
+/*
+ * chunk.h -- Content-defined chunking shared by the RFS server and client
+ *
+ * Files are cut where a rolling (gear) hash over the last bytes matches a
+ * bit pattern, so chunk boundaries follow the content: an insert near the
+ * start of a file only changes the chunks around it, and the remaining
+ * chunks of a near-identical file hash the same and are stored once.
+ */
+
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "sha256.h"
+
+#define CHUNK_MIN_SIZE (16 * 1024)          // No boundary before this many bytes
+#define CHUNK_AVG_BITS 16                   // Boundary when the top bits of the hash are 0 (64 KB on average)
+#define CHUNK_MAX_SIZE (256 * 1024)         // Forced boundary
+#define CHUNK_HEX_SIZE (SHA256_DIGEST_SIZE * 2 + 1)
+
+// One chunk of a file
+typedef struct {
+    off_t offset;                               // Position in the file
+    size_t length;                              // Bytes in the chunk
+    unsigned char digest[SHA256_DIGEST_SIZE];   // SHA-256 of the bytes, the chunk's name
+} ChunkRef;
+
+// Function to split an open file into content-defined chunks; 0 on success, -1 on error (*chunks must be freed)
+int chunk_file(int fd, ChunkRef **chunks, size_t *count);
+
+// Function to write a digest as lowercase hex
+void chunk_digest_hex(const unsigned char digest[SHA256_DIGEST_SIZE], char hex[CHUNK_HEX_SIZE]);
+
+// Function to parse a digest from hex; 0 on success, -1 on invalid input
+int chunk_parse_hex(const char *hex, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif // CHUNK_H
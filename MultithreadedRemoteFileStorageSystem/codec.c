@@ -0,0 +1,212 @@
+/*
+ * codec.c -- On-the-wire compression shared by the RFS server and client
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "codec.h"
+
+#define CODEC_STORED_FLAG 0x80000000u  // Payload length flag: the block is sent raw
+#define CODEC_SAMPLE_RATIO 0.9         // A sample must shrink below this fraction to compress the body
+
+/**
+ * @brief Checks whether a buffer shrinks enough to be worth compressing.
+ *
+ *        Only the first CODEC_SAMPLE_SIZE bytes are compressed, at the fastest level, so
+ *        already-compressed data (archives, images, media) costs one quick probe and is then
+ *        sent raw over the zero-copy path.
+ *
+ * @param data The bytes to be sent.
+ * @param len  Number of bytes.
+ * @return int 1 if the sample compresses below CODEC_SAMPLE_RATIO, 0 otherwise.
+ */
+int codec_worth_compressing(const void *data, size_t len) {
+    if (len < CODEC_MIN_SIZE) {
+        return 0;
+    }
+    uLong sample = len < CODEC_SAMPLE_SIZE ? (uLong)len : CODEC_SAMPLE_SIZE;
+    uLongf out_len = compressBound(sample);
+    unsigned char *out = malloc(out_len);
+    if (!out) {
+        return 0;
+    }
+    int shrinks = compress2(out, &out_len, data, sample, 1) == Z_OK && out_len < sample * CODEC_SAMPLE_RATIO;
+    free(out);
+    return shrinks;
+}
+
+/**
+ * @brief Checks whether a file range is worth compressing, from a sample at its start.
+ *
+ * @param fd     Open file.
+ * @param offset First byte of the range.
+ * @param len    Length of the range.
+ * @return int 1 if compressing pays off, 0 otherwise.
+ */
+int codec_file_worth_compressing(int fd, off_t offset, off_t len) {
+    if (len < CODEC_MIN_SIZE) {
+        return 0;
+    }
+    size_t sample = len < CODEC_SAMPLE_SIZE ? (size_t)len : CODEC_SAMPLE_SIZE;
+    unsigned char *buffer = malloc(sample);
+    if (!buffer) {
+        return 0;
+    }
+    ssize_t got = pread(fd, buffer, sample, offset);
+    int worth = got > 0 && codec_worth_compressing(buffer, (size_t)got);
+    free(buffer);
+    return worth;
+}
+
+/**
+ * @brief Compresses one block and sends it with its header.
+ *
+ * @param out Scratch buffer of compressBound(CODEC_BLOCK_SIZE) bytes.
+ * @return int 0 on success, -1 on a socket error.
+ */
+static int send_block(int sock, const unsigned char *raw, size_t len, int level, unsigned char *out) {
+    uLongf out_len = compressBound(CODEC_BLOCK_SIZE);
+    int packed = compress2(out, &out_len, raw, len, level) == Z_OK && out_len < len;
+    uint32_t payload_len = packed ? (uint32_t)out_len : (uint32_t)len | CODEC_STORED_FLAG;
+    unsigned char header[8] = {
+        (unsigned char)(len >> 24), (unsigned char)(len >> 16), (unsigned char)(len >> 8), (unsigned char)len,
+        (unsigned char)(payload_len >> 24), (unsigned char)(payload_len >> 16), (unsigned char)(payload_len >> 8),
+        (unsigned char)payload_len,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+        { .iov_base = packed ? out : (unsigned char *)raw, .iov_len = packed ? (size_t)out_len : len },
+    };
+    return send_iov(sock, iov, 2);
+}
+
+/**
+ * @brief Sends a byte range of a file as compressed blocks.
+ *
+ *        The file is read in CODEC_BLOCK_SIZE blocks, so memory use does not depend on its
+ *        size. Blocks that do not shrink are sent raw.
+ *
+ * @param sock   Socket to send on.
+ * @param fd     Open file.
+ * @param offset First byte to send.
+ * @param len    Number of bytes to send.
+ * @param level  zlib level, 1 to CODEC_MAX_LEVEL.
+ * @return int 0 on success, -1 on a read or socket error.
+ */
+int send_compressed_range(int sock, int fd, off_t offset, off_t len, int level) {
+    unsigned char *raw = malloc(CODEC_BLOCK_SIZE);
+    unsigned char *out = malloc(compressBound(CODEC_BLOCK_SIZE));
+    int result = raw && out ? 0 : -1;
+    while (result == 0 && len > 0) {
+        size_t want = len < CODEC_BLOCK_SIZE ? (size_t)len : CODEC_BLOCK_SIZE;
+        size_t done = 0;
+        while (done < want) {
+            ssize_t got = pread(fd, raw + done, want - done, offset + done);
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) continue;
+                result = -1;
+                break;
+            }
+            done += got;
+        }
+        if (result == 0) {
+            result = send_block(sock, raw, want, level, out);
+        }
+        offset += want;
+        len -= want;
+    }
+    free(raw);
+    free(out);
+    return result;
+}
+
+/**
+ * @brief Sends a buffer as compressed blocks.
+ *
+ * @param sock  Socket to send on.
+ * @param data  Bytes to send.
+ * @param len   Number of bytes.
+ * @param level zlib level, 1 to CODEC_MAX_LEVEL.
+ * @return int 0 on success, -1 on a socket error.
+ */
+int send_compressed_buffer(int sock, const void *data, size_t len, int level) {
+    unsigned char *out = malloc(compressBound(CODEC_BLOCK_SIZE));
+    int result = out ? 0 : -1;
+    for (size_t done = 0; result == 0 && done < len; done += CODEC_BLOCK_SIZE) {
+        size_t n = len - done < CODEC_BLOCK_SIZE ? len - done : CODEC_BLOCK_SIZE;
+        result = send_block(sock, (const unsigned char *)data + done, n, level, out);
+    }
+    free(out);
+    return result;
+}
+
+/**
+ * @brief Receives a compressed body and writes the decompressed bytes to a file.
+ *
+ *        Every block header is checked against CODEC_BLOCK_SIZE and the bytes still
+ *        expected before anything is allocated or decompressed, so a corrupt or hostile
+ *        stream cannot make the receiver write past the range. If the file cannot be
+ *        written, the remaining blocks are still read, so the session stays in sync.
+ *
+ * @param reader Reader of the connection; buffered bytes are used first.
+ * @param fd     File to write to, or -1 to discard the body.
+ * @param offset Position in the file of the first decompressed byte.
+ * @param len    Number of decompressed bytes the body carries.
+ * @return int 0 on success, 1 if the file could not be written, -1 if the connection dropped
+ *         or the stream is corrupt.
+ */
+int recv_compressed_range(ConnReader *reader, int fd, off_t offset, off_t len) {
+    unsigned char *raw = malloc(CODEC_BLOCK_SIZE);
+    unsigned char *payload = malloc(compressBound(CODEC_BLOCK_SIZE));
+    int result = raw && payload ? 0 : -1;
+    int write_failed = fd < 0;
+    while (result == 0 && len > 0) {
+        unsigned char header[8];
+        if (conn_read_full(reader, header, sizeof(header)) < 0) {
+            result = -1;
+            break;
+        }
+        uint32_t raw_len = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+        uint32_t payload_len = (uint32_t)header[4] << 24 | (uint32_t)header[5] << 16 | (uint32_t)header[6] << 8
+                               | header[7];
+        int stored = (payload_len & CODEC_STORED_FLAG) != 0;
+        payload_len &= ~CODEC_STORED_FLAG;
+        if (raw_len == 0 || raw_len > CODEC_BLOCK_SIZE || raw_len > len
+            || (stored ? payload_len != raw_len : payload_len > compressBound(CODEC_BLOCK_SIZE))) {
+            result = -1;
+            break;
+        }
+
+        if (conn_read_full(reader, stored ? raw : payload, payload_len) < 0) {
+            result = -1;
+            break;
+        }
+        uLongf out_len = raw_len;
+        if (!stored && (uncompress(raw, &out_len, payload, payload_len) != Z_OK || out_len != raw_len)) {
+            result = -1;
+            break;
+        }
+
+        for (size_t done = 0; !write_failed && done < raw_len;) {
+            ssize_t n = pwrite(fd, raw + done, raw_len - done, offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                write_failed = 1;
+                break;
+            }
+            done += n;
+        }
+        offset += raw_len;
+        len -= raw_len;
+    }
+    free(raw);
+    free(payload);
+    if (result != 0) {
+        return -1;
+    }
+    return write_failed && fd >= 0 ? 1 : 0;
+}
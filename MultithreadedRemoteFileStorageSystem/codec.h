@@ -0,0 +1,41 @@
+/*
+ * codec.h -- On-the-wire compression shared by the RFS server and client
+ *
+ * A compressed body is a sequence of blocks, each with an 8-byte header:
+ * the raw length and the payload length as big-endian 32-bit numbers. The
+ * payload is the block deflated with zlib, or the raw bytes when the top bit
+ * of the payload length is set (a block that did not shrink). The body ends
+ * once the raw lengths add up to the size announced in the command header,
+ * so no terminator is needed and either side may stop early on an error.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "netio.h"
+
+#define CODEC_NAME "deflate"                // Capability and encoding token in headers
+#define CODEC_BLOCK_SIZE (256 * 1024)       // Raw bytes per block
+#define CODEC_SAMPLE_SIZE (64 * 1024)       // Bytes compressed to decide whether compressing pays off
+#define CODEC_MIN_SIZE 1024                 // Smaller bodies are always sent raw
+#define CODEC_MAX_LEVEL 9                   // Levels run from 1 (fastest) to 9 (smallest)
+
+// Function to check whether a sample of a buffer shrinks enough to be worth compressing
+int codec_worth_compressing(const void *data, size_t len);
+
+// Function to check the same for a file range, sampled from its start
+int codec_file_worth_compressing(int fd, off_t offset, off_t len);
+
+// Function to send bytes of a file as compressed blocks; 0 on success, -1 on error
+int send_compressed_range(int sock, int fd, off_t offset, off_t len, int level);
+
+// Function to send a buffer as compressed blocks; 0 on success, -1 on error
+int send_compressed_buffer(int sock, const void *data, size_t len, int level);
+
+// Function to receive len raw bytes of compressed blocks into a file at offset (fd < 0 discards them);
+// 0 on success, 1 if the file could not be written (rest drained), -1 if the connection or stream broke
+int recv_compressed_range(ConnReader *reader, int fd, off_t offset, off_t len);
+
+#endif // CODEC_H
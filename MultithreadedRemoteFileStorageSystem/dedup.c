@@ -0,0 +1,544 @@
+/*
+ * dedup.c -- Content-addressed chunk store of the RFS server
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "dedup.h"
+#include "netio.h"
+
+static char store_root[1024] = ".";     // Server root the store lives in
+static int store_sync = 0;              // fdatasync chunks and manifests before publishing them
+static unsigned long temp_counter = 0;  // Makes temp file names unique
+static pthread_mutex_t temp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Users of chunks (readers and uploads) hold the store shared, a garbage collection exclusively
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int garbage = 1;                 // Manifests were removed or replaced since the last collection
+                                        // (set at start, a store may hold garbage from earlier runs)
+
+// Digests referenced by the manifests, collected by the mark phase
+typedef struct {
+    unsigned char (*digests)[SHA256_DIGEST_SIZE];
+    size_t count;
+    size_t capacity;
+} DigestSet;
+
+/**
+ * @brief Creates every missing directory on the way to a file.
+ *
+ * @param path Path of the file (its directories are created, not the file).
+ */
+static void make_parent_dirs(const char *path) {
+    char copy[2200];
+    snprintf(copy, sizeof(copy), "%s", path);
+    for (char *p = copy + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(copy, 0777);
+            *p = '/';
+        }
+    }
+}
+
+/**
+ * @brief Builds a temp file name next to path that no other thread uses.
+ */
+static void temp_name(const char *path, char *temp, size_t temp_size) {
+    pthread_mutex_lock(&temp_mutex);
+    unsigned long n = ++temp_counter;
+    pthread_mutex_unlock(&temp_mutex);
+    snprintf(temp, temp_size, "%s.tmp.%ld.%lu", path, (long)getpid(), n);
+}
+
+/**
+ * @brief Writes a buffer to a new file and renames it to path, so path only ever holds
+ *        complete contents.
+ *
+ * @return int 0 on success, -1 on error.
+ */
+static int publish_file(const char *path, const void *data, size_t len) {
+    char temp[2300];
+    temp_name(path, temp, sizeof(temp));
+    make_parent_dirs(path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+    const char *p = data;
+    size_t left = len;
+    int result = 0;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    if (result == 0 && store_sync && fdatasync(fd) != 0) {
+        result = -1;
+    }
+    if (close(fd) != 0) {
+        result = -1;
+    }
+    if (result == 0 && rename(temp, path) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(temp);
+    }
+    return result;
+}
+
+/**
+ * @brief Builds the path of a chunk file.
+ */
+static void chunk_path(const unsigned char digest[SHA256_DIGEST_SIZE], char *path, size_t path_size) {
+    char hex[CHUNK_HEX_SIZE];
+    chunk_digest_hex(digest, hex);
+    snprintf(path, path_size, "%s/%s/%.2s/%s", store_root, DEDUP_CHUNK_DIR, hex, hex);
+}
+
+/**
+ * @brief Builds the path of a manifest.
+ */
+static void manifest_path(const char *remote_path, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/%s/%s", store_root, DEDUP_MANIFEST_DIR, remote_path);
+}
+
+/**
+ * @brief Sets where the store lives and how durable it is.
+ *
+ * @param root Server root folder.
+ * @param sync Non-zero to fdatasync chunks and manifests before they are renamed into place.
+ */
+void dedup_init(const char *root, int sync) {
+    snprintf(store_root, sizeof(store_root), "%s", root);
+    store_sync = sync;
+}
+
+/**
+ * @brief Checks whether a chunk is stored.
+ *
+ * @param digest SHA-256 of the chunk.
+ * @return int 1 if the chunk is stored, 0 otherwise.
+ */
+int dedup_has_chunk(const unsigned char digest[SHA256_DIGEST_SIZE]) {
+    char path[1200];
+    chunk_path(digest, path, sizeof(path));
+    return access(path, F_OK) == 0;
+}
+
+/**
+ * @brief Stores a chunk under its digest. The caller has checked that the digest matches
+ *        the data. Storing a chunk that is already present does nothing, and two threads
+ *        storing the same chunk both succeed.
+ *
+ * @param digest SHA-256 of data.
+ * @param data   Chunk contents.
+ * @param len    Chunk length.
+ * @return int 0 on success, -1 on error.
+ */
+int dedup_put_chunk(const unsigned char digest[SHA256_DIGEST_SIZE], const void *data, size_t len) {
+    char path[1200];
+    chunk_path(digest, path, sizeof(path));
+    if (access(path, F_OK) == 0) {
+        return 0;
+    }
+    return publish_file(path, data, len);
+}
+
+/**
+ * @brief Splits a file into content-defined chunks and stores the ones not stored yet.
+ *
+ * @param fd     Open file (read with pread()).
+ * @param chunks Receives the chunk list.
+ * @param count  Receives the number of chunks.
+ * @return int 0 on success, -1 on error.
+ */
+int dedup_import_file(int fd, ChunkRef **chunks, size_t *count) {
+    if (chunk_file(fd, chunks, count) != 0) {
+        return -1;
+    }
+    char *buffer = malloc(CHUNK_MAX_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    int result = 0;
+    for (size_t i = 0; i < *count && result == 0; i++) {
+        ChunkRef *chunk = &(*chunks)[i];
+        if (dedup_has_chunk(chunk->digest)) {
+            continue;
+        }
+        size_t done = 0;
+        while (done < chunk->length) {
+            ssize_t got = pread(fd, buffer + done, chunk->length - done, chunk->offset + done);
+            if (got <= 0) {
+                result = -1;
+                break;
+            }
+            done += got;
+        }
+        if (result == 0) {
+            result = dedup_put_chunk(chunk->digest, buffer, chunk->length);
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+/**
+ * @brief Writes the manifest of a path: a header line with the total size, then one
+ *        "<sha256> <length>" line per chunk. The manifest is replaced atomically.
+ *
+ * @param remote_path Path (relative to the server root) the manifest describes.
+ * @param chunks      The file's chunks, in order.
+ * @param count       Number of chunks.
+ * @return int 0 on success, -1 on error.
+ */
+int dedup_save_manifest(const char *remote_path, const ChunkRef *chunks, size_t count) {
+    long long total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += chunks[i].length;
+    }
+    size_t line_size = CHUNK_HEX_SIZE + 24;
+    char *text = malloc(64 + count * line_size);
+    if (!text) {
+        return -1;
+    }
+    size_t len = sprintf(text, "%s %lld %zu\n", DEDUP_MANIFEST_MAGIC, total, count);
+    for (size_t i = 0; i < count; i++) {
+        char hex[CHUNK_HEX_SIZE];
+        chunk_digest_hex(chunks[i].digest, hex);
+        len += sprintf(text + len, "%s %zu\n", hex, chunks[i].length);
+    }
+
+    char path[2200];
+    manifest_path(remote_path, path, sizeof(path));
+    int replaced = access(path, F_OK) == 0;
+    int result = publish_file(path, text, len);
+    free(text);
+    if (result == 0 && replaced) {
+        __atomic_store_n(&garbage, 1, __ATOMIC_RELAXED); // The old version's chunks may be unused now
+    }
+    return result;
+}
+
+/**
+ * @brief Reads and checks a manifest file.
+ *
+ * @return int 0 on success, -1 if the file is missing or not a valid manifest.
+ */
+static int load_manifest_file(const char *path, ChunkRef **chunks, size_t *count, long long *total) {
+    FILE *fp = fopen(path, "r");
+    *chunks = NULL;
+    if (!fp) {
+        return -1;
+    }
+
+    char line[256];
+    size_t expected;
+    if (!fgets(line, sizeof(line), fp)
+        || sscanf(line, DEDUP_MANIFEST_MAGIC " %lld %zu", total, &expected) != 2
+        || !(*chunks = malloc((expected > 0 ? expected : 1) * sizeof(ChunkRef)))) {
+        fclose(fp);
+        return -1;
+    }
+    off_t offset = 0;
+    *count = 0;
+    while (*count < expected && fgets(line, sizeof(line), fp)) {
+        char hex[CHUNK_HEX_SIZE + 1];
+        ChunkRef *chunk = &(*chunks)[*count];
+        if (sscanf(line, "%65s %zu", hex, &chunk->length) != 2 || chunk_parse_hex(hex, chunk->digest) != 0) {
+            break;
+        }
+        chunk->offset = offset;
+        offset += chunk->length;
+        (*count)++;
+    }
+    fclose(fp);
+    if (*count != expected || offset != *total) {
+        free(*chunks);
+        *chunks = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads the manifest of a path. On success the store is held shared until
+ *        dedup_free_manifest(), so the garbage collector cannot remove the chunks while
+ *        they are being sent, even if the path is replaced or removed meanwhile.
+ *
+ * @param remote_path Path (relative to the server root).
+ * @param chunks      Receives the chunk list (offsets computed from the lengths).
+ * @param count       Receives the number of chunks.
+ * @param total       Receives the file size.
+ * @return int 0 on success, -1 if there is no valid manifest for the path.
+ */
+int dedup_load_manifest(const char *remote_path, ChunkRef **chunks, size_t *count, long long *total) {
+    char path[2200];
+    manifest_path(remote_path, path, sizeof(path));
+    dedup_pin();
+    int result = load_manifest_file(path, chunks, count, total);
+    if (result != 0) {
+        dedup_unpin();
+    }
+    return result;
+}
+
+/**
+ * @brief Frees a chunk list loaded by dedup_load_manifest() and releases the store.
+ *
+ * @param chunks The chunk list, or NULL if none was loaded (then nothing happens).
+ */
+void dedup_free_manifest(ChunkRef *chunks) {
+    if (chunks) {
+        free(chunks);
+        dedup_unpin();
+    }
+}
+
+/**
+ * @brief Removes the manifest of a path, or the empty manifest directory of a directory.
+ *        The chunks stay, other manifests may use them; the next garbage collection
+ *        removes those that no manifest uses any more.
+ *
+ * @param remote_path Path (relative to the server root).
+ * @return int 0 if something was removed, -1 otherwise (errno is ENOENT if there was nothing).
+ */
+int dedup_remove_manifest(const char *remote_path) {
+    char path[2200];
+    manifest_path(remote_path, path, sizeof(path));
+    int result = remove(path);
+    if (result == 0) {
+        __atomic_store_n(&garbage, 1, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+/**
+ * @brief Sends a byte range of a chunked file, each chunk straight from its chunk file
+ *        (see send_file_range()).
+ *
+ * @param sock   Socket to send on.
+ * @param chunks The file's chunks, as loaded by dedup_load_manifest().
+ * @param count  Number of chunks.
+ * @param offset First byte to send.
+ * @param length Number of bytes to send (must lie within the file).
+ * @return int 0 on success, -1 if a chunk is missing or the socket failed.
+ */
+int dedup_send_range(int sock, const ChunkRef *chunks, size_t count, long long offset, long long length) {
+    long long end = offset + length;
+    for (size_t i = 0; i < count && offset < end; i++) {
+        long long chunk_end = chunks[i].offset + (long long)chunks[i].length;
+        if (chunk_end <= offset) {
+            continue;
+        }
+        char path[1200];
+        chunk_path(chunks[i].digest, path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        long long stop = chunk_end < end ? chunk_end : end;
+        int result = send_file_range(sock, fd, offset - chunks[i].offset, stop - offset);
+        close(fd);
+        if (result != 0) {
+            return -1;
+        }
+        offset = stop;
+    }
+    return offset == end ? 0 : -1;
+}
+
+/**
+ * @brief Holds the store shared: no garbage collection runs until dedup_unpin(). Uploads
+ *        hold it from the first dedup_has_chunk() until their manifest is saved, so a
+ *        chunk they found present cannot be removed before the manifest names it.
+ */
+void dedup_pin() {
+    pthread_rwlock_rdlock(&store_lock);
+}
+
+/**
+ * @brief Releases the store held by dedup_pin().
+ */
+void dedup_unpin() {
+    pthread_rwlock_unlock(&store_lock);
+}
+
+/**
+ * @brief Adds the chunks of every manifest below a directory of the manifest tree.
+ *
+ * @param dir_path Directory to scan.
+ * @param marked   Receives the digests.
+ * @return int 0 on success, -1 if a manifest could not be read (nothing may be removed then).
+ */
+static int mark_manifests(const char *dir_path, DigestSet *marked) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    int result = 0;
+    struct dirent *item;
+    while (result == 0 && (item = readdir(dir))) {
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+            continue;
+        }
+        char path[2200];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, item->d_name);
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            result = mark_manifests(path, marked);
+            continue;
+        }
+        if (strstr(item->d_name, ".tmp.")) {
+            unlink(path); // Left by a crash: manifests are only written while the store is held
+            continue;
+        }
+        ChunkRef *chunks;
+        size_t count;
+        long long total;
+        if (load_manifest_file(path, &chunks, &count, &total) != 0) {
+            result = -1;
+            break;
+        }
+        if (marked->count + count > marked->capacity) {
+            size_t capacity = marked->capacity * 2 > marked->count + count ? marked->capacity * 2
+                                                                           : marked->count + count + 1024;
+            void *grown = realloc(marked->digests, capacity * SHA256_DIGEST_SIZE);
+            if (!grown) {
+                free(chunks);
+                result = -1;
+                break;
+            }
+            marked->digests = grown;
+            marked->capacity = capacity;
+        }
+        for (size_t i = 0; i < count; i++) {
+            memcpy(marked->digests[marked->count++], chunks[i].digest, SHA256_DIGEST_SIZE);
+        }
+        free(chunks);
+    }
+    closedir(dir);
+    return result;
+}
+
+/**
+ * @brief Orders digests bytewise, for sorting and searching the marked set.
+ */
+static int compare_digests(const void *a, const void *b) {
+    return memcmp(a, b, SHA256_DIGEST_SIZE);
+}
+
+/**
+ * @brief Removes every chunk that no manifest names (mark and sweep).
+ *
+ *        The store is held exclusively for the whole pass: uploads and readers of chunked
+ *        files wait meanwhile, and none of them holds a chunk that is about to go. The mark
+ *        phase reads all manifests; if any of them cannot be read, nothing is removed.
+ *        The sweep walks the chunk directories and unlinks the unmarked chunks, along with
+ *        temp files left by a crash.
+ *
+ * @param removed Receives the number of chunks removed (may be NULL).
+ * @param freed   Receives the bytes they took (may be NULL).
+ * @return int 0 on success, -1 if the manifests could not be read.
+ */
+int dedup_collect_garbage(long long *removed, long long *freed) {
+    DigestSet marked = { NULL, 0, 0 };
+    long long chunk_count = 0, chunk_bytes = 0;
+    char dir_path[1200];
+
+    pthread_rwlock_wrlock(&store_lock);
+    __atomic_store_n(&garbage, 0, __ATOMIC_RELAXED);
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", store_root, DEDUP_MANIFEST_DIR);
+    int result = mark_manifests(dir_path, &marked);
+    if (result == 0) {
+        qsort(marked.digests, marked.count, SHA256_DIGEST_SIZE, compare_digests);
+        for (int shard = 0; shard < 256; shard++) {
+            snprintf(dir_path, sizeof(dir_path), "%s/%s/%02x", store_root, DEDUP_CHUNK_DIR, shard);
+            DIR *dir = opendir(dir_path);
+            if (!dir) {
+                continue;
+            }
+            struct dirent *item;
+            while ((item = readdir(dir))) {
+                unsigned char digest[SHA256_DIGEST_SIZE];
+                int temp = strstr(item->d_name, ".tmp.") != NULL;
+                if (item->d_name[0] == '.' || (!temp && (chunk_parse_hex(item->d_name, digest) != 0
+                    || bsearch(digest, marked.digests, marked.count, SHA256_DIGEST_SIZE, compare_digests)))) {
+                    continue;
+                }
+                char path[2200];
+                struct stat st;
+                snprintf(path, sizeof(path), "%s/%s", dir_path, item->d_name);
+                if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && unlink(path) == 0 && !temp) {
+                    chunk_count++;
+                    chunk_bytes += st.st_size;
+                }
+            }
+            closedir(dir);
+        }
+    } else {
+        __atomic_store_n(&garbage, 1, __ATOMIC_RELAXED); // Try again next time
+    }
+    pthread_rwlock_unlock(&store_lock);
+
+    free(marked.digests);
+    if (removed) *removed = chunk_count;
+    if (freed) *freed = chunk_bytes;
+    return result;
+}
+
+/**
+ * @brief Collector thread: every interval seconds, collects garbage if manifests were
+ *        removed or replaced since the last pass.
+ *
+ * @param arg The interval in seconds (cast to a pointer).
+ * @return void* Never returns.
+ */
+static void *collector_thread(void *arg) {
+    int interval = (int)(long)arg;
+    while (1) {
+        sleep(interval);
+        if (!__atomic_load_n(&garbage, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        long long removed, freed;
+        if (dedup_collect_garbage(&removed, &freed) != 0) {
+            printf("Chunk store: a manifest could not be read, no chunks removed\n");
+        } else if (removed > 0) {
+            printf("Chunk store: removed %lld unreferenced chunks (%lld bytes)\n", removed, freed);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the thread that removes unreferenced chunks in the background.
+ *
+ * @param interval Seconds between checks for garbage.
+ * @return int 0 on success, -1 if the thread could not be created.
+ */
+int dedup_start_collector(int interval) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, collector_thread, (void *)(long)interval) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * dedup.h -- Content-addressed chunk store of the RFS server
+ *
+ * With deduplication on, a file is kept as a manifest (the list of its chunks)
+ * under ROOT/.manifests/<path>, and every unique chunk once under
+ * ROOT/.chunks/<xx>/<sha256>. Uploads that share content with files already
+ * stored only add their new chunks. Chunks are immutable. Once RM or an
+ * overwrite leaves a chunk without any manifest naming it, a background
+ * mark-and-sweep collection removes it; readers and uploads hold the store
+ * (see dedup_pin()) so a chunk they use is never collected under them.
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "chunk.h"
+
+#define DEDUP_CHUNK_DIR ".chunks"         // Chunk files, named by their SHA-256
+#define DEDUP_MANIFEST_DIR ".manifests"   // One manifest per stored path
+#define DEDUP_MANIFEST_MAGIC "RFSMANIFEST 1"
+#define DEDUP_GC_INTERVAL 60              // Seconds between checks for unreferenced chunks
+
+// Function to set the server root and whether stored data is flushed to disk
+void dedup_init(const char *root, int sync);
+
+// Function to check whether a chunk is stored
+int dedup_has_chunk(const unsigned char digest[SHA256_DIGEST_SIZE]);
+
+// Function to store a chunk (no-op if present); 0 on success, -1 on error
+int dedup_put_chunk(const unsigned char digest[SHA256_DIGEST_SIZE], const void *data, size_t len);
+
+// Function to chunk a file and store all its chunks; 0 on success, -1 on error (*chunks must be freed)
+int dedup_import_file(int fd, ChunkRef **chunks, size_t *count);
+
+// Function to write (or replace) the manifest of a path; 0 on success, -1 on error
+int dedup_save_manifest(const char *remote_path, const ChunkRef *chunks, size_t count);
+
+// Function to read the manifest of a path; 0 on success, -1 if there is none (free with dedup_free_manifest())
+int dedup_load_manifest(const char *remote_path, ChunkRef **chunks, size_t *count, long long *total);
+
+// Function to free a chunk list from dedup_load_manifest() and release the store it held (NULL is ignored)
+void dedup_free_manifest(ChunkRef *chunks);
+
+// Function to hold the store, so no chunk is collected until dedup_unpin() (for uploads)
+void dedup_pin();
+
+// Function to release the store held by dedup_pin()
+void dedup_unpin();
+
+// Function to remove every chunk no manifest names; 0 on success, -1 if a manifest could not be read
+int dedup_collect_garbage(long long *removed, long long *freed);
+
+// Function to start the background thread collecting garbage every interval seconds; 0 on success
+int dedup_start_collector(int interval);
+
+// Function to remove the manifest (or empty manifest directory) of a path; 0 if removed, -1 otherwise
+int dedup_remove_manifest(const char *remote_path);
+
+// Function to send bytes [offset, offset + length) of a chunked file to a socket; 0 on success, -1 on error
+int dedup_send_range(int sock, const ChunkRef *chunks, size_t count, long long offset, long long length);
+
+#endif // DEDUP_H
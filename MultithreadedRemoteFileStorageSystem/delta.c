@@ -0,0 +1,323 @@
+/*
+ * delta.c -- rsync-style delta encoding shared by the RFS server and client
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "delta.h"
+
+#define DELTA_BUFFER_SIZE (2 * (DELTA_LITERAL_MAX + DELTA_MAX_BLOCK))  // Window of the file kept in memory
+
+// Signatures hashed by rolling checksum
+typedef struct {
+    const BlockSignature *sigs;
+    size_t mask;        // Buckets - 1 (a power of two)
+    long *heads;        // First signature of each bucket, or -1
+    long *next;         // Next signature in the same bucket, or -1
+} SignatureIndex;
+
+// Part of the file being encoded, held in memory
+typedef struct {
+    int fd;
+    long long size;             // Size of the file
+    unsigned char *data;        // DELTA_BUFFER_SIZE bytes
+    long long start, end;       // File range held in data
+    Sha256 sha;                 // Hash of the bytes loaded so far
+} FileWindow;
+
+/**
+ * @brief Picks the block size for a base file: about the square root of its size, so the
+ *        signature list and the expected literal overhead grow alike. Rounded to 1 KB and
+ *        kept between DELTA_MIN_BLOCK and DELTA_MAX_BLOCK.
+ *
+ * @param size Size of the base file.
+ * @return uint32_t Block size in bytes.
+ */
+uint32_t delta_block_size(long long size) {
+    long long block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && block * block < size) {
+        block += 1024;
+    }
+    return (uint32_t)block;
+}
+
+/**
+ * @brief Computes the rolling checksum of a window.
+ */
+void rolling_init(RollingSum *sum, const unsigned char *data, size_t len) {
+    sum->a = 0;
+    sum->b = 0;
+    sum->len = len;
+    for (size_t i = 0; i < len; i++) {
+        sum->a += data[i];
+        sum->b += sum->a;
+    }
+}
+
+/**
+ * @brief Slides the window one byte: out leaves at the front, in enters at the back.
+ *        The sums wrap modulo 2^32, which keeps their low 16 bits exact.
+ */
+void rolling_roll(RollingSum *sum, unsigned char out, unsigned char in) {
+    sum->a += in - out;
+    sum->b += sum->a - (uint32_t)sum->len * out;
+}
+
+/**
+ * @brief Returns the checksum: b in the high 16 bits, a in the low ones.
+ */
+uint32_t rolling_value(const RollingSum *sum) {
+    return (sum->b & 0xffff) << 16 | (sum->a & 0xffff);
+}
+
+/**
+ * @brief Reads exactly len bytes at offset.
+ *
+ * @return int 0 on success, -1 on an error or early end of file.
+ */
+static int read_at(int fd, unsigned char *buffer, size_t len, long long offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(fd, buffer + done, len - done, offset + done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        done += got;
+    }
+    return 0;
+}
+
+/**
+ * @brief Signs every full block of a file. A shorter tail is not signed; it is at most one
+ *        block of literal data when it comes back unchanged.
+ *
+ * @param fd         Open file (read with pread()).
+ * @param size       Size of the file.
+ * @param block_size Block size (see delta_block_size()).
+ * @param sigs       Receives size / block_size signatures.
+ * @param count      Receives their number.
+ * @return int 0 on success, -1 on a read error or out of memory.
+ */
+int delta_signatures(int fd, long long size, uint32_t block_size, BlockSignature **sigs, size_t *count) {
+    *count = (size_t)(size / block_size);
+    *sigs = malloc((*count > 0 ? *count : 1) * sizeof(BlockSignature));
+    unsigned char *buffer = malloc(block_size);
+    int result = *sigs && buffer ? 0 : -1;
+    for (size_t i = 0; i < *count && result == 0; i++) {
+        result = read_at(fd, buffer, block_size, (long long)i * block_size);
+        if (result == 0) {
+            RollingSum sum;
+            rolling_init(&sum, buffer, block_size);
+            (*sigs)[i].rolling = rolling_value(&sum);
+            Sha256 sha;
+            sha256_init(&sha);
+            sha256_update(&sha, buffer, block_size);
+            sha256_final(&sha, (*sigs)[i].digest);
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+/**
+ * @brief Builds the hash table of a signature list.
+ *
+ * @return int 0 on success, -1 if out of memory.
+ */
+static int index_build(SignatureIndex *index, const BlockSignature *sigs, size_t count) {
+    size_t buckets = 16;
+    while (buckets < count * 2) buckets *= 2;
+    index->sigs = sigs;
+    index->mask = buckets - 1;
+    index->heads = malloc(buckets * sizeof(long));
+    index->next = malloc((count > 0 ? count : 1) * sizeof(long));
+    if (!index->heads || !index->next) {
+        free(index->heads);
+        free(index->next);
+        return -1;
+    }
+    for (size_t i = 0; i < buckets; i++) {
+        index->heads[i] = -1;
+    }
+    // Inserted backwards so chains list earlier blocks first
+    for (size_t i = count; i-- > 0;) {
+        size_t bucket = sigs[i].rolling & index->mask;
+        index->next[i] = index->heads[bucket];
+        index->heads[bucket] = (long)i;
+    }
+    return 0;
+}
+
+/**
+ * @brief Looks up a window. The SHA-256 is only computed when the rolling checksum hits.
+ *        If several blocks match, the one after the previous match is preferred, so runs
+ *        of unchanged blocks become a single copy op.
+ *
+ * @param rolling   Rolling checksum of the window.
+ * @param data      The window.
+ * @param len       Its length (the block size).
+ * @param preferred Block that would extend the previous copy, or -1.
+ * @return long Index of a matching block, or -1.
+ */
+static long index_find(const SignatureIndex *index, uint32_t rolling, const unsigned char *data, size_t len,
+                       long preferred) {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    int hashed = 0;
+    long found = -1;
+    for (long i = index->heads[rolling & index->mask]; i >= 0; i = index->next[i]) {
+        if (index->sigs[i].rolling != rolling) {
+            continue;
+        }
+        if (!hashed) {
+            Sha256 sha;
+            sha256_init(&sha);
+            sha256_update(&sha, data, len);
+            sha256_final(&sha, digest);
+            hashed = 1;
+        }
+        if (memcmp(index->sigs[i].digest, digest, SHA256_DIGEST_SIZE) == 0) {
+            if (i == preferred) return i;
+            if (found < 0) found = i;
+        }
+    }
+    return found;
+}
+
+/**
+ * @brief Makes sure the buffer holds [keep, want) of the file, dropping what lies before keep
+ *        and loading as much as fits after it. New bytes are hashed as they are loaded, so the
+ *        file is read and hashed once.
+ *
+ * @param window The buffer.
+ * @param keep   First byte still needed (at most DELTA_BUFFER_SIZE before want).
+ * @param want   End of the range needed.
+ * @return int 0 on success, -1 on a read error.
+ */
+static int window_load(FileWindow *window, long long keep, long long want) {
+    if (want <= window->end) {
+        return 0;
+    }
+    memmove(window->data, window->data + (keep - window->start), window->end - keep);
+    window->start = keep;
+    long long room = window->start + DELTA_BUFFER_SIZE;
+    long long load_end = room < window->size ? room : window->size;
+    unsigned char *dst = window->data + (window->end - window->start);
+    if (read_at(window->fd, dst, load_end - window->end, window->end) != 0) {
+        return -1;
+    }
+    sha256_update(&window->sha, dst, load_end - window->end);
+    window->end = load_end;
+    return 0;
+}
+
+/**
+ * @brief Encodes a file as copies of base blocks and literal bytes (see delta.h).
+ *
+ *        A window of block_size bytes slides over the file. Wherever it matches a base
+ *        block the pending literal bytes are flushed and a copy is emitted (consecutive
+ *        blocks are merged into one copy), and the window jumps past the block; otherwise
+ *        it moves one byte and its checksum is rolled. The file is read once, through a
+ *        bounded buffer, so memory use does not depend on its size, and hashed on the way.
+ *
+ * @param fd         Open file (read with pread()).
+ * @param size       Size of the file.
+ * @param block_size Block size of the signatures.
+ * @param sigs       Signatures of the base file's blocks.
+ * @param count      Number of signatures.
+ * @param sink       Receives the ops.
+ * @param digest     Receives the SHA-256 of the whole file.
+ * @return int 0 on success, -1 on a read error, out of memory, or if the sink failed.
+ */
+int delta_generate(int fd, long long size, uint32_t block_size, const BlockSignature *sigs, size_t count,
+                   const DeltaSink *sink, unsigned char digest[SHA256_DIGEST_SIZE]) {
+    SignatureIndex index;
+    FileWindow file = { .fd = fd, .size = size, .data = malloc(DELTA_BUFFER_SIZE) };
+    if (!file.data || index_build(&index, sigs, count) != 0) {
+        free(file.data);
+        return -1;
+    }
+    sha256_init(&file.sha);
+    unsigned char *buffer = file.data;
+
+    long long pos = 0, literal_start = 0;           // Window start, first byte not sent yet
+    long copy_first = -1;                           // Pending copy op
+    size_t copy_count = 0;
+    RollingSum sum;
+    int summed = 0;
+    int result = 0;
+
+    while (result == 0 && count > 0 && pos + block_size <= size) {
+        // Unsent literal bytes stay in the buffer with the window and the byte rolled in next
+        long long want = pos + block_size < size ? pos + block_size + 1 : size;
+        if (window_load(&file, literal_start, want) != 0) {
+            result = -1;
+            break;
+        }
+
+        unsigned char *window = buffer + (pos - file.start);
+        if (!summed) {
+            rolling_init(&sum, window, block_size);
+            summed = 1;
+        }
+        long preferred = copy_first >= 0 ? copy_first + (long)copy_count : -1;
+        long match = index_find(&index, rolling_value(&sum), window, block_size, preferred);
+        if (match >= 0) {
+            if (pos > literal_start) {
+                if (copy_first >= 0) {
+                    result = sink->copy(sink->ctx, copy_first, copy_count);
+                    copy_first = -1;
+                }
+                if (result == 0) {
+                    result = sink->literal(sink->ctx, buffer + (literal_start - file.start), pos - literal_start);
+                }
+            }
+            if (copy_first >= 0 && match == preferred) {
+                copy_count++;
+            } else {
+                if (copy_first >= 0 && result == 0) {
+                    result = sink->copy(sink->ctx, copy_first, copy_count);
+                }
+                copy_first = match;
+                copy_count = 1;
+            }
+            pos += block_size;
+            literal_start = pos;
+            summed = 0;
+        } else {
+            if (pos + block_size < size) {
+                rolling_roll(&sum, window[0], window[block_size]);
+            }
+            pos++;
+            if (pos - literal_start >= DELTA_LITERAL_MAX) {
+                if (copy_first >= 0) {
+                    result = sink->copy(sink->ctx, copy_first, copy_count);
+                    copy_first = -1;
+                }
+                if (result == 0) {
+                    result = sink->literal(sink->ctx, buffer + (literal_start - file.start), pos - literal_start);
+                }
+                literal_start = pos;
+            }
+        }
+    }
+
+    // Flush the pending copy and whatever is left behind the last match
+    if (result == 0 && copy_first >= 0) {
+        result = sink->copy(sink->ctx, copy_first, copy_count);
+    }
+    while (result == 0 && literal_start < size) {
+        long long len = size - literal_start < DELTA_LITERAL_MAX ? size - literal_start : DELTA_LITERAL_MAX;
+        if (window_load(&file, literal_start, literal_start + len) != 0) {
+            result = -1;
+            break;
+        }
+        result = sink->literal(sink->ctx, buffer + (literal_start - file.start), (size_t)len);
+        literal_start += len;
+    }
+    sha256_final(&file.sha, digest);
+    free(file.data);
+    free(index.heads);
+    free(index.next);
+    return result;
+}
@@ -0,0 +1,68 @@
+/*
+ * delta.h -- rsync-style delta encoding shared by the RFS server and client
+ *
+ * The server splits the remote copy of a file (the base) into fixed blocks
+ * and sends a signature per block: a rolling checksum, cheap to slide one
+ * byte at a time, and the SHA-256 of the block. The client slides a window
+ * over its new version of the file and looks every position up by the
+ * rolling checksum; a hit whose SHA-256 matches too is a block the server
+ * already has. The file is then sent as references to base blocks and the
+ * literal bytes in between:
+ *
+ *   C <first-block> <count>\n     copy count consecutive base blocks
+ *   L <length>\n<bytes>           literal bytes (at most DELTA_LITERAL_MAX)
+ *   END <sha256>\n                the SHA-256 of the whole new file
+ *
+ * The server rebuilds the file and only commits it if the hash matches.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+#define DELTA_MIN_BLOCK 2048                // Smallest block (small files)
+#define DELTA_MAX_BLOCK (128 * 1024)        // Largest block (multi-GB files)
+#define DELTA_LITERAL_MAX (256 * 1024)      // Longest literal op
+
+// Signature of one block of the base file
+typedef struct {
+    uint32_t rolling;                           // Rolling checksum (see rolling_value())
+    unsigned char digest[SHA256_DIGEST_SIZE];   // SHA-256 of the block
+} BlockSignature;
+
+// Rolling checksum of a window (rsync's weak checksum, two 16-bit sums)
+typedef struct {
+    uint32_t a;     // Sum of the bytes
+    uint32_t b;     // Sum of the running values of a
+    size_t len;     // Window length
+} RollingSum;
+
+// Where delta_generate() sends the ops it produces
+typedef struct {
+    // Function to send "copy count base blocks from first on"; 0 on success
+    int (*copy)(void *ctx, size_t first, size_t count);
+    // Function to send literal bytes; 0 on success
+    int (*literal)(void *ctx, const unsigned char *data, size_t len);
+    void *ctx;
+} DeltaSink;
+
+// Function to pick the block size for a base file (about the square root of its size)
+uint32_t delta_block_size(long long size);
+
+// Functions to compute a rolling checksum, slide it by one byte and read its value
+void rolling_init(RollingSum *sum, const unsigned char *data, size_t len);
+void rolling_roll(RollingSum *sum, unsigned char out, unsigned char in);
+uint32_t rolling_value(const RollingSum *sum);
+
+// Function to sign the full blocks of an open file; 0 on success, -1 on a read error (*sigs must be freed)
+int delta_signatures(int fd, long long size, uint32_t block_size, BlockSignature **sigs, size_t *count);
+
+// Function to encode an open file against base signatures; fills digest with the file's SHA-256.
+// 0 on success, -1 on a read error or if the sink failed
+int delta_generate(int fd, long long size, uint32_t block_size, const BlockSignature *sigs, size_t count,
+                   const DeltaSink *sink, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif // DELTA_H
@@ -0,0 +1,286 @@
+/*
+ * filecache.c -- In-memory cache of hot files of the RFS server
+ */
+
+#define _GNU_SOURCE  // struct stat st_mtim
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "filecache.h"
+
+// macOS names the mtime field differently
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+static CachedFile *buckets[FILE_CACHE_BUCKETS];    // Path index
+static uint64_t ghosts[FILE_CACHE_GHOSTS];          // Hashes of paths that missed once (0: empty)
+static CachedFile *lru_head = NULL;                 // Most recently used entry
+static CachedFile *lru_tail = NULL;                 // Next entry to evict
+static size_t cached_bytes = 0;                     // Sum of the sizes of all entries
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards all of the above
+
+/**
+ * @brief Hashes a path with 64-bit FNV-1a.
+ *
+ * @param path The path to hash.
+ * @return uint64_t The hash, never 0.
+ */
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash | 1;
+}
+
+/**
+ * @brief Maps a path to its bucket of the path index.
+ */
+static CachedFile **bucket_of(const char *path) {
+    return &buckets[hash_path(path) % FILE_CACHE_BUCKETS];
+}
+
+/**
+ * @brief Decides whether a missed file is cached: only if it missed before. A first miss
+ *        remembers the path in its ghost slot instead, overwriting whatever was there, so
+ *        the table stays small and one-off reads age out.
+ *
+ * @return int Non-zero to admit the file.
+ */
+static int admit_locked(const char *path) {
+    uint64_t hash = hash_path(path);
+    uint64_t *ghost = &ghosts[(hash >> 16) % FILE_CACHE_GHOSTS];
+    if (*ghost == hash) {
+        *ghost = 0;
+        return 1;
+    }
+    *ghost = hash;
+    return 0;
+}
+
+/**
+ * @brief Frees an entry's memory once nobody references it any more.
+ */
+static void put_ref_locked(CachedFile *file) {
+    if (--file->refs == 0) {
+        free(file->data);
+        free(file->path);
+        free(file);
+    }
+}
+
+/**
+ * @brief Takes an entry out of the index and the recency list and drops the cache's reference.
+ */
+static void remove_locked(CachedFile *file) {
+    CachedFile **link = bucket_of(file->path);
+    while (*link != file) {
+        link = &(*link)->hash_next;
+    }
+    *link = file->hash_next;
+
+    if (file->lru_prev) file->lru_prev->lru_next = file->lru_next;
+    else lru_head = file->lru_next;
+    if (file->lru_next) file->lru_next->lru_prev = file->lru_prev;
+    else lru_tail = file->lru_prev;
+
+    cached_bytes -= file->size;
+    put_ref_locked(file);
+}
+
+/**
+ * @brief Finds the entry of a path, or NULL.
+ */
+static CachedFile *find_locked(const char *path) {
+    CachedFile *file = *bucket_of(path);
+    while (file && strcmp(file->path, path) != 0) {
+        file = file->hash_next;
+    }
+    return file;
+}
+
+/**
+ * @brief Checks whether an entry still holds the contents of the file described by st.
+ */
+static int matches(const CachedFile *file, const struct stat *st) {
+    return file->ino == st->st_ino && file->size == st->st_size && file->mtime.tv_sec == st->st_mtim.tv_sec
+           && file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Moves an entry to the head of the recency list.
+ */
+static void touch_locked(CachedFile *file) {
+    if (file == lru_head) {
+        return;
+    }
+    file->lru_prev->lru_next = file->lru_next;
+    if (file->lru_next) file->lru_next->lru_prev = file->lru_prev;
+    else lru_tail = file->lru_prev;
+    file->lru_prev = NULL;
+    file->lru_next = lru_head;
+    lru_head->lru_prev = file;
+    lru_head = file;
+}
+
+/**
+ * @brief Looks up the cached contents of a file.
+ *
+ *        The entry is only used if it was read from the same version of the file: same
+ *        inode (an upload renames a new inode into place), size and mtime. An outdated
+ *        entry is dropped. Every call counts as a hit or a miss.
+ *
+ * @param path Path (relative to the server root) of the file.
+ * @param st   Current stat of the file.
+ * @return CachedFile* A referenced entry, or NULL on a miss.
+ */
+CachedFile *file_cache_lookup(const char *path, const struct stat *st) {
+    pthread_mutex_lock(&cache_mutex);
+    CachedFile *file = find_locked(path);
+    if (file && !matches(file, st)) {
+        remove_locked(file);
+        file = NULL;
+    }
+    if (file) {
+        touch_locked(file);
+        file->refs++;
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return file;
+}
+
+/**
+ * @brief Reads a file into memory and adds it to the cache, evicting the least recently
+ *        used entries until the cache fits its byte budget again.
+ *
+ *        Only a file that missed before is admitted (see admit_locked()); on its first miss
+ *        the caller streams it from disk. The file is read outside of the cache lock, so
+ *        loads of different files run in parallel. If another thread cached the same version
+ *        meanwhile, that entry is used.
+ *
+ * @param path Path (relative to the server root) of the file.
+ * @param fd   Open descriptor of the file.
+ * @param st   Stat of fd.
+ * @return CachedFile* A referenced entry, or NULL if the file is not admitted yet, too large
+ *         to cache or could not be read.
+ */
+CachedFile *file_cache_load(const char *path, int fd, const struct stat *st) {
+    if (st->st_size > FILE_CACHE_MAX_FILE) {
+        return NULL;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    int admitted = admit_locked(path);
+    pthread_mutex_unlock(&cache_mutex);
+    if (!admitted) {
+        return NULL;
+    }
+
+    CachedFile *file = calloc(1, sizeof(CachedFile));
+    if (!file) {
+        return NULL;
+    }
+    file->data = malloc(st->st_size > 0 ? st->st_size : 1);
+    file->path = strdup(path);
+    if (!file->data || !file->path) {
+        free(file->data);
+        free(file->path);
+        free(file);
+        return NULL;
+    }
+    off_t done = 0;
+    while (done < st->st_size) {
+        ssize_t got = pread(fd, file->data + done, st->st_size - done, done);
+        if (got <= 0) {
+            free(file->data);
+            free(file->path);
+            free(file);
+            return NULL;
+        }
+        done += got;
+    }
+    file->size = st->st_size;
+    file->ino = st->st_ino;
+    file->mtime = st->st_mtim;
+    file->refs = 2; // The cache and the caller
+
+    pthread_mutex_lock(&cache_mutex);
+    CachedFile *existing = find_locked(path);
+    if (existing && matches(existing, st)) {
+        existing->refs++;
+        pthread_mutex_unlock(&cache_mutex);
+        free(file->data);
+        free(file->path);
+        free(file);
+        return existing;
+    }
+    if (existing) {
+        remove_locked(existing);
+    }
+
+    CachedFile **bucket = bucket_of(path);
+    file->hash_next = *bucket;
+    *bucket = file;
+    file->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = file;
+    lru_head = file;
+    if (!lru_tail) lru_tail = file;
+    cached_bytes += file->size;
+
+    while (cached_bytes > FILE_CACHE_BUDGET && lru_tail != file) {
+        remove_locked(lru_tail);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return file;
+}
+
+/**
+ * @brief Drops a reference to an entry. An entry evicted meanwhile is freed with its last reference.
+ *
+ * @param file Entry returned by file_cache_lookup() or file_cache_load() (NULL is ignored).
+ */
+void file_cache_release(CachedFile *file) {
+    if (!file) {
+        return;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    put_ref_locked(file);
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * @brief Drops the cached contents of a path. GETs still sending them keep their reference.
+ *
+ * @param path Path (relative to the server root) that was written or removed.
+ */
+void file_cache_invalidate(const char *path) {
+    pthread_mutex_lock(&cache_mutex);
+    CachedFile *file = find_locked(path);
+    if (file) {
+        remove_locked(file);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * @brief Reads the cache counters.
+ *
+ * @param hits   Receives the number of lookups served from memory.
+ * @param misses Receives the number of lookups that went to disk.
+ * @param bytes  Receives the bytes of file data currently cached.
+ */
+void file_cache_stats(unsigned long *hits, unsigned long *misses, size_t *bytes) {
+    pthread_mutex_lock(&cache_mutex);
+    *hits = cache_hits;
+    *misses = cache_misses;
+    *bytes = cached_bytes;
+    pthread_mutex_unlock(&cache_mutex);
+}
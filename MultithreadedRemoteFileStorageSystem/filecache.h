@@ -0,0 +1,56 @@
+/*
+ * filecache.h -- In-memory cache of hot files of the RFS server
+ *
+ * Small and medium files are kept in memory, keyed by path, up to a total
+ * byte budget; the least recently used ones are evicted first. A file is
+ * only admitted when it misses a second time (a small table remembers the
+ * paths that missed once), so a scan of cold files streams them from disk
+ * instead of evicting the hot ones. An entry is
+ * only used while the file's inode, size and mtime still match, so files
+ * changed behind the server's back are never served stale. WRITE and RM
+ * also drop the path's entry right away.
+ */
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_BUDGET (64L * 1024 * 1024)  // Bytes of file data kept in memory
+#define FILE_CACHE_MAX_FILE (4L * 1024 * 1024) // Larger files are always streamed from disk
+#define FILE_CACHE_BUCKETS 4096                // Hash chains of the path index
+#define FILE_CACHE_GHOSTS 16384                // Paths remembered after one miss, for admission
+
+// Contents of one cached file (read-only while referenced)
+typedef struct CachedFile {
+    char *data;                     // File contents
+    off_t size;                     // Length of data
+    ino_t ino;                      // Inode, size and mtime the contents were read from
+    struct timespec mtime;
+    int refs;                       // Users, plus one while the entry is in the cache
+    struct CachedFile *hash_next;   // Next entry in the bucket
+    struct CachedFile *lru_prev;    // Neighbours in the recency list (head = most recent)
+    struct CachedFile *lru_next;
+    char *path;                     // Path (relative to the server root)
+} CachedFile;
+
+// Function to look up a file whose current stat is st; NULL on a miss (the reference must be released)
+CachedFile *file_cache_lookup(const char *path, const struct stat *st);
+
+// Function to read an open file into the cache if it missed before; NULL if not admitted (yet), too large or
+// unreadable (the reference must be released)
+CachedFile *file_cache_load(const char *path, int fd, const struct stat *st);
+
+// Function to drop a reference taken by file_cache_lookup() or file_cache_load()
+void file_cache_release(CachedFile *file);
+
+// Function to drop the cached contents of a path after it was written or removed
+void file_cache_invalidate(const char *path);
+
+// Function to read the hit and miss counters and the bytes currently cached
+void file_cache_stats(unsigned long *hits, unsigned long *misses, size_t *bytes);
+
+#endif // FILECACHE_H
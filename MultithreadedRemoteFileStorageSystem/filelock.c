@@ -0,0 +1,143 @@
+/*
+ * filelock.c -- Per-path reader-writer locks of the RFS server
+ */
+
+#define _GNU_SOURCE  // pthread_rwlockattr_setkind_np()
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filelock.h"
+#include "stats.h"
+
+// Lock entry of one path, chained in its bucket
+struct FileLock {
+    uint64_t hash;              // Hash of path
+    int refs;                   // Threads holding or waiting for the lock
+    int shard;                  // Shard the entry lives in
+    pthread_rwlock_t rwlock;    // Shared for GET, exclusive for WRITE and RM
+    struct FileLock *next;      // Next entry in the bucket
+    char path[];                // Path (relative to the server root)
+};
+
+// One independently locked part of the table
+typedef struct {
+    pthread_mutex_t mutex;      // Guards the buckets and the refs of their entries
+    FileLock *buckets[FILE_LOCK_BUCKETS];
+} LockShard;
+
+static LockShard shards[FILE_LOCK_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Initializes the shard mutexes (run once).
+ */
+static void init_shards(void) {
+    for (int i = 0; i < FILE_LOCK_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].mutex, NULL);
+    }
+}
+
+/**
+ * @brief Hashes a path with 64-bit FNV-1a.
+ *
+ * @param path The path to hash.
+ * @return uint64_t The hash.
+ */
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Locks a path for reading (shared) or writing (exclusive).
+ *
+ *        The entry for the path is looked up (or created) and referenced under its shard's
+ *        mutex only; waiting for the lock itself happens outside of it, so a blocked writer
+ *        does not hold up other paths of the same shard. Where supported, waiting writers
+ *        are preferred, so a stream of GETs cannot starve an upload. A lock that is not free
+ *        right away is timed, and the wait counted (see stats.h).
+ *
+ * @param path      Path (relative to the server root) to lock.
+ * @param exclusive Non-zero for an exclusive (writer) lock, zero for a shared one.
+ * @return FileLock* The held lock, to be passed to file_lock_release(); NULL if out of memory.
+ */
+FileLock *file_lock_acquire(const char *path, int exclusive) {
+    pthread_once(&shards_once, init_shards);
+
+    uint64_t hash = hash_path(path);
+    int shard_num = (int)(hash % FILE_LOCK_SHARDS);
+    LockShard *shard = &shards[shard_num];
+    FileLock **bucket = &shard->buckets[(hash / FILE_LOCK_SHARDS) % FILE_LOCK_BUCKETS];
+
+    pthread_mutex_lock(&shard->mutex);
+    FileLock *lock = *bucket;
+    while (lock && (lock->hash != hash || strcmp(lock->path, path) != 0)) {
+        lock = lock->next;
+    }
+    if (!lock) {
+        size_t len = strlen(path);
+        lock = malloc(sizeof(FileLock) + len + 1);
+        if (!lock) {
+            pthread_mutex_unlock(&shard->mutex);
+            return NULL;
+        }
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#ifdef __linux__
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&lock->rwlock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        lock->hash = hash;
+        lock->refs = 0;
+        lock->shard = shard_num;
+        memcpy(lock->path, path, len + 1);
+        lock->next = *bucket;
+        *bucket = lock;
+    }
+    lock->refs++;
+    pthread_mutex_unlock(&shard->mutex);
+
+    int held = exclusive ? pthread_rwlock_trywrlock(&lock->rwlock) : pthread_rwlock_tryrdlock(&lock->rwlock);
+    if (held != 0) {
+        long long start = stats_now_ns();
+        if (exclusive) {
+            pthread_rwlock_wrlock(&lock->rwlock);
+        } else {
+            pthread_rwlock_rdlock(&lock->rwlock);
+        }
+        stats_add_lock_wait(stats_now_ns() - start);
+    }
+    return lock;
+}
+
+/**
+ * @brief Unlocks a path. The entry is unlinked and freed when no other thread holds or
+ *        waits for it, so the table only ever holds the paths currently in use.
+ *
+ * @param lock Lock returned by file_lock_acquire() (NULL is ignored).
+ */
+void file_lock_release(FileLock *lock) {
+    if (!lock) {
+        return;
+    }
+    pthread_rwlock_unlock(&lock->rwlock);
+
+    LockShard *shard = &shards[lock->shard];
+    pthread_mutex_lock(&shard->mutex);
+    if (--lock->refs == 0) {
+        FileLock **link = &shard->buckets[(lock->hash / FILE_LOCK_SHARDS) % FILE_LOCK_BUCKETS];
+        while (*link != lock) {
+            link = &(*link)->next;
+        }
+        *link = lock->next;
+        pthread_rwlock_destroy(&lock->rwlock);
+        free(lock);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
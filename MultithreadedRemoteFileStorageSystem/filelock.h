@@ -0,0 +1,25 @@
+/*
+ * filelock.h -- Per-path reader-writer locks of the RFS server
+ *
+ * Paths hash into a fixed number of shards, each with its own mutex and
+ * bucket array, so lookups are O(1) and threads working on unrelated paths
+ * do not contend on one table lock. A lock entry only exists while some
+ * thread holds or waits for it, and is freed when the last one releases it.
+ */
+
+#ifndef FILELOCK_H
+#define FILELOCK_H
+
+#define FILE_LOCK_SHARDS 64     // Independently locked parts of the table
+#define FILE_LOCK_BUCKETS 256   // Hash chains per shard
+
+// Lock of one path (opaque; only valid between acquire and release)
+typedef struct FileLock FileLock;
+
+// Function to lock a path, shared (readers) or exclusive (writers); blocks until granted
+FileLock *file_lock_acquire(const char *path, int exclusive);
+
+// Function to unlock a path and free its entry once nobody else holds or waits for it
+void file_lock_release(FileLock *lock);
+
+#endif // FILELOCK_H
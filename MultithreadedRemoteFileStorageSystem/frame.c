@@ -0,0 +1,118 @@
+/*
+ * frame.c -- Binary framed protocol shared by the RFS server and client
+ */
+
+#include "frame.h"
+
+/**
+ * @brief Writes a header in wire format.
+ *
+ * @param header The header.
+ * @param out    Receives FRAME_HEADER_SIZE bytes.
+ */
+void frame_pack_header(const FrameHeader *header, unsigned char out[FRAME_HEADER_SIZE]) {
+    out[0] = (unsigned char)(header->length >> 24);
+    out[1] = (unsigned char)(header->length >> 16);
+    out[2] = (unsigned char)(header->length >> 8);
+    out[3] = (unsigned char)header->length;
+    out[4] = header->version;
+    out[5] = header->opcode;
+    frame_put_u16(out + 6, header->status);
+    out[8] = (unsigned char)(header->request_id >> 24);
+    out[9] = (unsigned char)(header->request_id >> 16);
+    out[10] = (unsigned char)(header->request_id >> 8);
+    out[11] = (unsigned char)header->request_id;
+}
+
+/**
+ * @brief Reads the next frame header from a connection.
+ *
+ * @param reader Reader of the connection; buffered bytes are used first.
+ * @param header Receives the decoded header (the payload is left unread).
+ * @return int 0 on success, -1 if the connection ended or failed.
+ */
+int frame_read_header(ConnReader *reader, FrameHeader *header) {
+    unsigned char raw[FRAME_HEADER_SIZE];
+    if (conn_read_full(reader, raw, sizeof(raw)) < 0) {
+        return -1;
+    }
+    header->length = (uint32_t)raw[0] << 24 | (uint32_t)raw[1] << 16 | (uint32_t)raw[2] << 8 | raw[3];
+    header->version = raw[4];
+    header->opcode = raw[5];
+    header->status = frame_get_u16(raw + 6);
+    header->request_id = (uint32_t)raw[8] << 24 | (uint32_t)raw[9] << 16 | (uint32_t)raw[10] << 8 | raw[11];
+    return 0;
+}
+
+/**
+ * @brief Sends a frame: the header and header->length payload bytes.
+ *
+ * @param sock    Socket to send on.
+ * @param header  Header of the frame (its length is the payload length).
+ * @param payload Payload bytes (may be NULL for an empty payload).
+ * @return int 0 on success, -1 on error.
+ */
+int frame_send(int sock, const FrameHeader *header, const void *payload) {
+    unsigned char raw[FRAME_HEADER_SIZE];
+    frame_pack_header(header, raw);
+    struct iovec iov[2] = {
+        { .iov_base = raw, .iov_len = sizeof(raw) },
+        { .iov_base = (void *)payload, .iov_len = header->length },
+    };
+    return send_iov(sock, iov, header->length > 0 ? 2 : 1);
+}
+
+/**
+ * @brief Stores a 16-bit number in big-endian order.
+ */
+void frame_put_u16(unsigned char *p, uint16_t value) {
+    p[0] = (unsigned char)(value >> 8);
+    p[1] = (unsigned char)value;
+}
+
+/**
+ * @brief Stores a 64-bit number in big-endian order.
+ */
+void frame_put_u64(unsigned char *p, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(value >> (56 - 8 * i));
+    }
+}
+
+/**
+ * @brief Loads a big-endian 16-bit number.
+ */
+uint16_t frame_get_u16(const unsigned char *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/**
+ * @brief Loads a big-endian 64-bit number.
+ */
+uint64_t frame_get_u64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+/**
+ * @brief Returns a readable name of a status code, for messages.
+ *
+ * @param status A FRAME_STATUS_* code.
+ * @return const char* Its name.
+ */
+const char *frame_status_name(uint16_t status) {
+    switch (status) {
+    case FRAME_STATUS_OK: return "OK";
+    case FRAME_STATUS_NOT_FOUND: return "File not found";
+    case FRAME_STATUS_INVALID: return "Invalid request";
+    case FRAME_STATUS_IO_ERROR: return "I/O error";
+    case FRAME_STATUS_TOO_LARGE: return "Too large";
+    case FRAME_STATUS_UNSUPPORTED: return "Unsupported";
+    case FRAME_STATUS_READ_ONLY: return "Read-only replica";
+    case FRAME_STATUS_NO_QUORUM: return "Replication quorum not reached";
+    default: return "Unknown status";
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * frame.h -- Binary framed protocol shared by the RFS server and client
+ *
+ * A session switches from text commands to frames with "BINARY 1", answered
+ * with "BINARY 1". Every request and response is then a frame: a 12-byte
+ * header followed by a payload. All numbers are big-endian.
+ *
+ *   length      u32  Payload bytes behind the header
+ *   version     u8   FRAME_VERSION
+ *   opcode      u8   FRAME_OP_*
+ *   status      u16  FRAME_STATUS_* in responses, 0 in requests
+ *   request_id  u32  Chosen by the client and echoed in the response
+ *
+ * Requests are pipelined: a client may send many before reading a response,
+ * and the server runs them concurrently, so responses arrive in completion
+ * order and are matched to their requests by ID.
+ *
+ * Payloads (path bytes are not NUL-terminated):
+ *   GET    request  u64 offset, u64 length (FRAME_LENGTH_ALL = to the end), path
+ *          response the bytes of the range
+ *   WRITE  request  u16 path length, path, file contents
+ *   RM     request  path
+ *   STAT   request  path
+ *          response u64 size
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "netio.h"
+
+#define FRAME_VERSION 1
+#define FRAME_HEADER_SIZE 12
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)  // Larger files go over the text protocol
+#define FRAME_LENGTH_ALL UINT64_MAX           // GET length meaning "to the end of the file"
+
+// Opcodes
+#define FRAME_OP_GET 1
+#define FRAME_OP_WRITE 2
+#define FRAME_OP_RM 3
+#define FRAME_OP_STAT 4
+
+// Response status codes
+#define FRAME_STATUS_OK 0
+#define FRAME_STATUS_NOT_FOUND 1       // No such file
+#define FRAME_STATUS_INVALID 2         // Malformed payload or range
+#define FRAME_STATUS_IO_ERROR 3        // The server could not read or write the file
+#define FRAME_STATUS_TOO_LARGE 4       // Request or response above FRAME_MAX_PAYLOAD
+#define FRAME_STATUS_UNSUPPORTED 5     // Unknown version or opcode
+#define FRAME_STATUS_READ_ONLY 6       // WRITE or RM sent to a replica
+#define FRAME_STATUS_NO_QUORUM 7       // Committed, but not applied by enough replicas in time
+
+// Header of one frame
+typedef struct {
+    uint32_t length;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t status;
+    uint32_t request_id;
+} FrameHeader;
+
+// Function to write a header in wire format
+void frame_pack_header(const FrameHeader *header, unsigned char out[FRAME_HEADER_SIZE]);
+
+// Function to read and decode a header; 0 on success, -1 if the connection ended
+int frame_read_header(ConnReader *reader, FrameHeader *header);
+
+// Function to send a header and its payload in one gather call; 0 on success, -1 on error
+int frame_send(int sock, const FrameHeader *header, const void *payload);
+
+// Functions to store and load big-endian integers in payloads
+void frame_put_u16(unsigned char *p, uint16_t value);
+void frame_put_u64(unsigned char *p, uint64_t value);
+uint16_t frame_get_u16(const unsigned char *p);
+uint64_t frame_get_u64(const unsigned char *p);
+
+// Function to get the name of a status code
+const char *frame_status_name(uint16_t status);
+
+#endif // FRAME_H
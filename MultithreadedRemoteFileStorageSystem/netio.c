@@ -0,0 +1,550 @@
+/*
+ * netio.c -- Buffered connection reader shared by the RFS server and client
+ */
+
+#define _GNU_SOURCE  // splice()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include "netio.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // Platforms without it rely on SIGPIPE being ignored
+#endif
+
+void (*netio_count_bytes)(size_t received, size_t sent) = NULL;
+
+// Wait budget of the command this thread is serving (see netio_start_budget())
+static __thread long long budget_ms;   // Milliseconds the command may still wait on its peer
+static __thread int budget_on;         // 1 while a budget is enforced
+static __thread size_t budget_rate;    // Bytes that earn one more second of waiting
+static __thread long long budget_max;  // Most milliseconds the budget may hold
+
+/**
+ * @brief Returns the monotonic clock in milliseconds.
+ */
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Starts the wait budget of a command on the calling thread. The command may spend
+ *        grace seconds in total waiting for its peer to send or take bytes; every min_rate
+ *        bytes moved earn one more second, up to max_idle seconds banked. A peer trickling
+ *        bytes slower than min_rate therefore runs out of time however long its body is,
+ *        while a fast transfer may still stall for up to max_idle seconds. Time the command
+ *        spends on its own work (disk, locks) is not charged.
+ * 
+ *        The budget is only enforced on non-blocking sockets, where the socket paths wait
+ *        with poll(); blocking sockets keep their own SO_RCVTIMEO/SO_SNDTIMEO.
+ * 
+ * @param grace    Seconds of waiting before any bytes moved; 0 turns the budget off.
+ * @param min_rate Slowest accepted transfer rate in bytes per second.
+ * @param max_idle Most seconds of waiting a transfer can bank.
+ */
+void netio_start_budget(int grace, size_t min_rate, int max_idle) {
+    budget_on = grace > 0;
+    budget_ms = grace * 1000LL;
+    budget_rate = min_rate > 0 ? min_rate : 1;
+    budget_max = max_idle * 1000LL;
+}
+
+/**
+ * @brief Waits until a non-blocking socket is ready, charging the wait to the thread's
+ *        budget. Called after a socket call failed; only EAGAIN is waited on.
+ * 
+ * @param fd     Socket to wait on.
+ * @param events POLLIN or POLLOUT.
+ * @return int 0 once the socket is ready, -1 on another error, when the budget ran out
+ *             (errno ETIMEDOUT), or when no budget is set (a blocking socket's timeout
+ *             expired; errno unchanged).
+ */
+static int wait_ready(int fd, short events) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (!budget_on) return -1;
+    while (budget_ms > 0) {
+        struct pollfd pfd = { .fd = fd, .events = events };
+        long long start = now_ms();
+        int ready = poll(&pfd, 1, budget_ms > 60000 ? 60000 : (int)budget_ms);
+        budget_ms -= now_ms() - start;
+        if (ready > 0) return 0;
+        if (ready < 0 && errno != EINTR) return -1;
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/**
+ * @brief Reports bytes moved on a socket to the program's statistics, if it keeps any,
+ *        and credits the thread's wait budget with the time they earned.
+ */
+static inline void count_bytes(ssize_t received, ssize_t sent) {
+    if (budget_on && (received > 0 || sent > 0)) {
+        long long moved = (received > 0 ? received : 0) + (sent > 0 ? sent : 0);
+        budget_ms += moved * 1000 / (long long)budget_rate;
+        if (budget_ms > budget_max) budget_ms = budget_max;
+    }
+    if (netio_count_bytes && (received > 0 || sent > 0)) {
+        netio_count_bytes(received > 0 ? (size_t)received : 0, sent > 0 ? (size_t)sent : 0);
+    }
+}
+
+/**
+ * @brief Sets up a reader for a socket. The buffer is only allocated when data is read,
+ *        so idle connections cost no buffer memory.
+ * 
+ * @param reader Reader to initialize.
+ * @param fd     Socket to read from.
+ */
+void conn_reader_init(ConnReader *reader, int fd) {
+    reader->fd = fd;
+    reader->buf = NULL;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+/**
+ * @brief Reads more bytes from the socket into the free tail of the buffer,
+ *        first moving unread bytes to the front.
+ * 
+ * @param reader Reader to fill.
+ * @return ssize_t Number of bytes added, 0 on EOF, -1 on error or a full buffer.
+ */
+static ssize_t conn_fill(ConnReader *reader) {
+    if (reader->buf == NULL) {
+        reader->buf = malloc(CONN_READER_SIZE);
+        if (reader->buf == NULL) return -1;
+    }
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == CONN_READER_SIZE) return -1;
+
+    ssize_t got;
+    do {
+        got = recv(reader->fd, reader->buf + reader->end, CONN_READER_SIZE - reader->end, 0);
+    } while (got < 0 && (errno == EINTR || wait_ready(reader->fd, POLLIN) == 0));
+    if (got > 0) reader->end += got;
+    count_bytes(got, 0);
+    return got;
+}
+
+/**
+ * @brief Reads one newline-terminated line. The newline is stripped and the line is
+ *        NUL-terminated; a line longer than line_size - 1 is truncated.
+ * 
+ * @param reader    Reader of the connection.
+ * @param line      Buffer receiving the line.
+ * @param line_size Size of the line buffer.
+ * @return int Length of the (possibly truncated) line, or -1 on EOF, error, or a line
+ *             longer than CONN_READER_SIZE.
+ */
+int conn_read_line(ConnReader *reader, char *line, size_t line_size) {
+    size_t scanned = 0;
+    while (1) {
+        if (reader->buf != NULL) {
+            char *start = reader->buf + reader->start;
+            char *nl = memchr(start + scanned, '\n', reader->end - reader->start - scanned);
+            if (nl != NULL) {
+                size_t len = nl - start;
+                size_t copy = len < line_size - 1 ? len : line_size - 1;
+                memcpy(line, start, copy);
+                line[copy] = '\0';
+                reader->start += len + 1;
+                return (int)copy;
+            }
+            scanned = reader->end - reader->start;
+        }
+        if (conn_fill(reader) <= 0) {
+            line[0] = '\0';
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Reads up to len bytes. Buffered bytes are returned first; once the buffer is
+ *        empty, the data is received straight into dst without an extra copy.
+ * 
+ * @param reader Reader of the connection.
+ * @param dst    Destination buffer.
+ * @param len    Maximum number of bytes to read.
+ * @return ssize_t Number of bytes read, 0 on EOF, -1 on error.
+ */
+ssize_t conn_read(ConnReader *reader, void *dst, size_t len) {
+    size_t buffered = conn_buffered(reader);
+    if (buffered > 0) {
+        size_t n = buffered < len ? buffered : len;
+        memcpy(dst, reader->buf + reader->start, n);
+        reader->start += n;
+        return (ssize_t)n;
+    }
+    ssize_t got;
+    do {
+        got = recv(reader->fd, dst, len, 0);
+    } while (got < 0 && (errno == EINTR || wait_ready(reader->fd, POLLIN) == 0));
+    count_bytes(got, 0);
+    return got;
+}
+
+/**
+ * @brief Reads exactly len bytes, for fixed-size binary fields and payloads.
+ * 
+ * @param reader Reader of the connection.
+ * @param dst    Destination buffer.
+ * @param len    Number of bytes to read.
+ * @return int 0 on success, -1 on EOF or error before len bytes arrived.
+ */
+int conn_read_full(ConnReader *reader, void *dst, size_t len) {
+    char *p = dst;
+    while (len > 0) {
+        ssize_t got = conn_read(reader, p, len);
+        if (got <= 0) return -1;
+        p += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the number of bytes already received but not consumed yet.
+ * 
+ * @param reader Reader of the connection.
+ * @return size_t Number of buffered bytes.
+ */
+size_t conn_buffered(const ConnReader *reader) {
+    return reader->buf ? reader->end - reader->start : 0;
+}
+
+/**
+ * @brief Frees the buffer of a reader that holds no unread bytes, so an idle
+ *        connection keeps no buffer memory.
+ * 
+ * @param reader Reader of the connection.
+ */
+void conn_reader_shrink(ConnReader *reader) {
+    if (reader->buf != NULL && reader->start == reader->end) {
+        free(reader->buf);
+        reader->buf = NULL;
+        reader->start = 0;
+        reader->end = 0;
+    }
+}
+
+/**
+ * @brief Sends a whole buffer, retrying after short sends and interrupts.
+ * 
+ * @param fd  Socket to send on.
+ * @param buf Data to send.
+ * @param len Number of bytes to send.
+ * @return int 0 on success, -1 on error.
+ */
+int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR || wait_ready(fd, POLLOUT) == 0) continue;
+            return -1;
+        }
+        count_bytes(0, sent);
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends several buffers with one gather call per round (like writev(), but with
+ *        MSG_NOSIGNAL), retrying after short sends and interrupts.
+ * 
+ * @param fd     Socket to send on.
+ * @param iov    Buffers to send; advanced in place as bytes go out.
+ * @param iovcnt Number of buffers.
+ * @return int 0 on success, -1 on error.
+ */
+int send_iov(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR || wait_ready(fd, POLLOUT) == 0) continue;
+            return -1;
+        }
+        count_bytes(0, sent);
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a file range with pread() and send_all(), the portable fallback.
+ * 
+ * @return off_t Number of bytes sent.
+ */
+static off_t send_file_copy(int sock, int file_fd, off_t offset, off_t len) {
+    char buffer[65536];
+    off_t sent = 0;
+    while (sent < len) {
+        size_t want = len - sent < (off_t)sizeof(buffer) ? (size_t)(len - sent) : sizeof(buffer);
+        ssize_t got = pread(file_fd, buffer, want, offset + sent);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0 || send_all(sock, buffer, got) < 0) break;
+        sent += got;
+    }
+    return sent;
+}
+
+#ifdef __linux__
+/**
+ * @brief Sends a file range through a pipe with splice(), for files sendfile() rejects.
+ *        The data still never enters user space.
+ * 
+ * @return off_t Number of bytes sent, or -1 if splice is not supported for these descriptors.
+ */
+static off_t send_file_splice(int sock, int file_fd, off_t offset, off_t len) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) return -1;
+
+    off_t sent = 0;
+    loff_t pos = offset;
+    while (sent < len) {
+        ssize_t in = splice(file_fd, &pos, pipefd[1], NULL, len - sent, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            sent = -1;
+            break;
+        }
+        if (in <= 0) break;
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, sock, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && (errno == EINTR || wait_ready(sock, POLLOUT) == 0)) continue;
+            if (out <= 0) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return sent;
+            }
+            count_bytes(0, out);
+            in -= out;
+            sent += out;
+        }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return sent;
+}
+#endif
+
+/**
+ * @brief Sends len bytes of a file starting at offset to a socket.
+ * 
+ *        On Linux the bytes go from the page cache to the socket with sendfile(), falling
+ *        back to splice() through a pipe and finally to a pread()/send() copy loop when the
+ *        file system does not support them. The file offset of file_fd is not changed.
+ * 
+ * @param sock    Socket to send on.
+ * @param file_fd File to send from.
+ * @param offset  First byte to send.
+ * @param len     Number of bytes to send.
+ * @return int 0 if all bytes were sent, -1 otherwise (the peer then misses part of the body).
+ */
+int send_file_range(int sock, int file_fd, off_t offset, off_t len) {
+    off_t sent = 0;
+#ifdef __linux__
+    off_t pos = offset;
+    while (sent < len) {
+        ssize_t n = sendfile(sock, file_fd, &pos, len - sent);
+        if (n < 0 && (errno == EINTR || wait_ready(sock, POLLOUT) == 0)) continue;
+        if (n < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            off_t spliced = send_file_splice(sock, file_fd, offset, len);
+            sent = spliced >= 0 ? spliced : send_file_copy(sock, file_fd, offset, len);
+            break;
+        }
+        if (n <= 0) break;
+        count_bytes(0, n);
+        sent += n;
+    }
+#else
+    sent = send_file_copy(sock, file_fd, offset, len);
+#endif
+    return sent == len ? 0 : -1;
+}
+
+/**
+ * @brief Reads and drops len body bytes, keeping the stream in sync after an error.
+ * 
+ * @param reader Reader of the connection.
+ * @param len    Number of bytes to drop.
+ * @return int 0 on success, -1 if the connection was lost first.
+ */
+int conn_discard(ConnReader *reader, off_t len) {
+    char buffer[65536];
+    while (len > 0) {
+        ssize_t got = conn_read(reader, buffer, len < (off_t)sizeof(buffer) ? (size_t)len : sizeof(buffer));
+        if (got <= 0) return -1;
+        len -= got;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a whole buffer at a file offset, retrying short writes.
+ * 
+ * @return int 0 on success, -1 on error.
+ */
+static int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+/**
+ * @brief Moves up to len bytes from the socket through a pipe into the file with splice(),
+ *        so the payload never enters user space.
+ * 
+ * @param received Set to the number of bytes taken from the socket.
+ * @return int 0 ok, 1 file write failed (bytes taken so far were dropped), -1 connection
+ *             lost, -2 splice is not supported for this socket (nothing was read).
+ */
+static int recv_file_splice(int sock, int file_fd, off_t offset, off_t len, off_t *received) {
+    int pipefd[2];
+    *received = 0;
+    if (pipe(pipefd) < 0) return -2;
+    fcntl(pipefd[1], F_SETPIPE_SZ, 1 << 20); // Bigger batches per splice; best effort
+
+    int result = 0;
+    loff_t pos = offset;
+    while (*received < len) {
+        ssize_t in = splice(sock, NULL, pipefd[1], NULL, len - *received, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && (errno == EINTR || wait_ready(sock, POLLIN) == 0)) continue;
+        if (in < 0 && *received == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            result = -2;
+            break;
+        }
+        if (in <= 0) {
+            result = -1;
+            break;
+        }
+        *received += in;
+        count_bytes(in, 0);
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, file_fd, &pos, in, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                // Drop what is left in the pipe; the caller drains the rest of the body
+                char scratch[65536];
+                while (in > 0) {
+                    ssize_t n = read(pipefd[0], scratch, in < (ssize_t)sizeof(scratch) ? (size_t)in : sizeof(scratch));
+                    if (n <= 0) break;
+                    in -= n;
+                }
+                result = 1;
+                break;
+            }
+            in -= out;
+        }
+        if (result != 0) break;
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return result;
+}
+#endif
+
+/**
+ * @brief Receives len body bytes into a file, starting at offset.
+ * 
+ *        Bytes already in the reader's buffer are written first. The rest is spliced from
+ *        the socket through a pipe into the file on Linux, or copied with recv()/pwrite()
+ *        elsewhere or when splice is unsupported. If writing the file fails, the remaining
+ *        body is still read and dropped so the connection stays usable.
+ * 
+ * @param reader  Reader of the connection.
+ * @param file_fd File to write to.
+ * @param offset  File offset of the first body byte.
+ * @param len     Number of body bytes.
+ * @return int 0 on success, 1 if the file could not be written, -1 if the connection was lost.
+ */
+int recv_file_range(ConnReader *reader, int file_fd, off_t offset, off_t len) {
+    // Buffered bytes first
+    size_t buffered = conn_buffered(reader);
+    if (buffered > 0) {
+        size_t n = (off_t)buffered < len ? buffered : (size_t)len;
+        int failed = pwrite_all(file_fd, reader->buf + reader->start, n, offset);
+        reader->start += n;
+        offset += n;
+        len -= n;
+        if (failed) return conn_discard(reader, len) == 0 ? 1 : -1;
+    }
+
+#ifdef __linux__
+    off_t received = 0;
+    int result = recv_file_splice(reader->fd, file_fd, offset, len, &received);
+    if (result == 1) return conn_discard(reader, len - received) == 0 ? 1 : -1;
+    if (result != -2) return result;
+#endif
+
+    char buffer[65536];
+    while (len > 0) {
+        ssize_t got = conn_read(reader, buffer, len < (off_t)sizeof(buffer) ? (size_t)len : sizeof(buffer));
+        if (got <= 0) return -1;
+        if (pwrite_all(file_fd, buffer, got, offset) < 0) {
+            return conn_discard(reader, len - got) == 0 ? 1 : -1;
+        }
+        offset += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/**
+ * @brief Turns TCP_CORK on or off. While corked, the kernel only sends full segments,
+ *        so a short header is merged with the first segment of the body; uncorking
+ *        flushes whatever is left. A no-op where TCP_CORK does not exist.
+ * 
+ * @param sock Socket to configure.
+ * @param on   1 to cork, 0 to uncork and flush.
+ */
+void set_cork(int sock, int on) {
+#ifdef TCP_CORK
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#else
+    (void)sock;
+    (void)on;
+#endif
+}
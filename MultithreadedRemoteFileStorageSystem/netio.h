@@ -0,0 +1,71 @@
+/*
+ * netio.h -- Buffered connection reader shared by the RFS server and client
+ *
+ * Protocol headers are read with large recv() calls into a buffer and split
+ * into lines from there, instead of one recv() per byte. Bytes that arrive
+ * behind a header (the start of a file body, or the next pipelined command)
+ * stay in the buffer and are handed out first by conn_read().
+ */
+
+#ifndef NETIO_H
+#define NETIO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CONN_READER_SIZE 16384  // Bytes buffered per connection (also the longest header line)
+
+// Read side of a connection
+typedef struct {
+    int fd;         // Socket to read from
+    char *buf;      // Buffer, allocated on first use and released by conn_reader_shrink()
+    size_t start;   // First unread byte in buf
+    size_t end;     // One past the last buffered byte
+} ConnReader;
+
+// Function the socket paths report the bytes they moved to (received, sent); NULL unless a
+// program keeps statistics (the server points it at stats_count_bytes())
+extern void (*netio_count_bytes)(size_t received, size_t sent);
+
+// Function to start the wait budget of the calling thread's command: grace seconds of waiting on
+// the peer, one more per min_rate bytes moved, at most max_idle banked; enforced on non-blocking sockets
+void netio_start_budget(int grace, size_t min_rate, int max_idle);
+
+// Function to set up a reader for a socket (no memory is allocated yet)
+void conn_reader_init(ConnReader *reader, int fd);
+
+// Function to read one newline-terminated line (newline stripped); -1 on EOF, error or overlong line
+int conn_read_line(ConnReader *reader, char *line, size_t line_size);
+
+// Function to read up to len bytes, buffered bytes first; 0 on EOF, -1 on error
+ssize_t conn_read(ConnReader *reader, void *dst, size_t len);
+
+// Function to read exactly len bytes; 0 on success, -1 if the connection ended first
+int conn_read_full(ConnReader *reader, void *dst, size_t len);
+
+// Function to get the number of bytes read from the socket but not consumed yet
+size_t conn_buffered(const ConnReader *reader);
+
+// Function to release the buffer of a reader that holds no unread bytes
+void conn_reader_shrink(ConnReader *reader);
+
+// Function to send a whole buffer, retrying short sends; 0 on success, -1 on error
+int send_all(int fd, const void *buf, size_t len);
+
+// Function to send several buffers in one gather call per round; 0 on success, -1 on error
+int send_iov(int fd, struct iovec *iov, int iovcnt);
+
+// Function to send a byte range of a file to a socket without copying it through user space
+int send_file_range(int sock, int file_fd, off_t offset, off_t len);
+
+// Function to receive len body bytes into a file at offset; 0 ok, 1 file write failed (body drained), -1 connection lost
+int recv_file_range(ConnReader *reader, int file_fd, off_t offset, off_t len);
+
+// Function to read and drop len body bytes; 0 on success, -1 if the connection was lost
+int conn_discard(ConnReader *reader, off_t len);
+
+// Function to turn TCP_CORK on or off, so a header and the following data leave in full segments
+void set_cork(int sock, int on);
+
+#endif // NETIO_H
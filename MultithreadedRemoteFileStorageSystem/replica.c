@@ -0,0 +1,445 @@
+/*
+ * replica.c -- Primary/replica replication of the RFS server
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "netio.h"
+#include "replica.h"
+
+// One replica and the state of its stream
+typedef struct {
+    char address[64];           // "<ip>:<port>", for messages
+    struct sockaddr_in addr;
+    char instance[32];          // Replica process last brought up to date, or ""
+    long long acked;            // Last change that process applied
+    int connected;              // Stream open and up to date but for the log
+    int reported;               // Unreachable message printed (only touched by the replica's thread)
+} Replica;
+
+static Replica replicas[REPLICA_MAX];
+static int replicas_added = 0;
+static int quorum_size = 0;                 // Replicas a change must reach before it is acknowledged
+static ReplicaSource tree_source;
+
+static char *log_paths[REPLICA_LOG_SIZE];   // Path of change n, in slot n % REPLICA_LOG_SIZE
+static long long log_head = 0;              // Last change logged
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards the log and the replicas' state
+static pthread_cond_t log_grown = PTHREAD_COND_INITIALIZER;    // Signalled when a change is logged
+static pthread_cond_t log_acked = PTHREAD_COND_INITIALIZER;    // Signalled when a replica applied changes
+static __thread long long pending = 0;      // Last change the calling thread logged, not awaited yet
+
+static void *replica_thread(void *arg);
+
+/**
+ * @brief Adds a replica to stream to. Must be called before replica_start().
+ *
+ * @param address "<ip>:<port>", or just a port for a replica on this machine.
+ * @return int 0 on success, -1 if the address is invalid or REPLICA_MAX replicas were added.
+ */
+int replica_add(const char *address) {
+    if (replicas_added == REPLICA_MAX) {
+        return -1;
+    }
+    Replica *replica = &replicas[replicas_added];
+    char ip[INET_ADDRSTRLEN] = "127.0.0.1";
+    const char *colon = strrchr(address, ':');
+    const char *port_text = colon ? colon + 1 : address;
+    if (colon) {
+        size_t len = (size_t)(colon - address);
+        if (len == 0 || len >= sizeof(ip)) {
+            return -1;
+        }
+        memcpy(ip, address, len);
+        ip[len] = '\0';
+    }
+    char *end;
+    long port = strtol(port_text, &end, 10);
+    if (*port_text == '\0' || *end != '\0' || port < 1 || port > 65535) {
+        return -1;
+    }
+    memset(replica, 0, sizeof(Replica));
+    replica->addr.sin_family = AF_INET;
+    replica->addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, ip, &replica->addr.sin_addr) != 1) {
+        return -1;
+    }
+    snprintf(replica->address, sizeof(replica->address), "%s:%ld", ip, port);
+    replicas_added++;
+    return 0;
+}
+
+/**
+ * @brief Returns the number of replicas added.
+ */
+int replica_count(void) {
+    return replicas_added;
+}
+
+/**
+ * @brief Starts one streaming thread per replica.
+ *
+ * @param source Where the threads read the primary's tree from.
+ * @param quorum Replicas that must apply a change before replica_await() lets it be
+ *               acknowledged; 0 acknowledges changes right away (asynchronous replication).
+ * @return int 0 on success, -1 if a thread could not be started.
+ */
+int replica_start(const ReplicaSource *source, int quorum) {
+    tree_source = *source;
+    quorum_size = quorum;
+    for (int i = 0; i < replicas_added; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, replica_thread, &replicas[i]) != 0) {
+            perror("Failed to create replication thread");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    if (replicas_added > 0) {
+        printf("Replicating to %d replicas (%s)\n", replicas_added, quorum > 0 ? "quorum acks" : "asynchronous");
+    }
+    return 0;
+}
+
+/**
+ * @brief Logs a changed path for the replicas, once the change is committed. The calling
+ *        thread remembers the change, so its response can wait for the quorum (see
+ *        replica_await()). Logging never waits: a replica that falls more than
+ *        REPLICA_LOG_SIZE changes behind is brought up to date with SYNC instead.
+ *
+ * @param path Path (relative to the root) of the file or directory that changed.
+ */
+void replica_log(const char *path) {
+    if (replicas_added == 0) {
+        return;
+    }
+    char *copy = strdup(path); // NULL if out of memory: the replicas then fall back to SYNC
+    pthread_mutex_lock(&log_mutex);
+    long long seq = ++log_head;
+    free(log_paths[seq % REPLICA_LOG_SIZE]);
+    log_paths[seq % REPLICA_LOG_SIZE] = copy;
+    pthread_cond_broadcast(&log_grown);
+    pthread_mutex_unlock(&log_mutex);
+    pending = seq;
+}
+
+/**
+ * @brief Counts the replicas that applied a change. Called with log_mutex held.
+ */
+static int applied_by(long long seq) {
+    int count = 0;
+    for (int i = 0; i < replicas_added; i++) {
+        if (replicas[i].acked >= seq) count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Counts the replicas that applied a change or are streaming and may still apply
+ *        it soon. A replica being brought up to date with SYNC, or not reachable, is left
+ *        out. Called with log_mutex held.
+ */
+static int may_apply(long long seq) {
+    int count = 0;
+    for (int i = 0; i < replicas_added; i++) {
+        if (replicas[i].acked >= seq || replicas[i].connected) count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Ends a request of the calling thread. If it is to be acknowledged and changed
+ *        anything, waits up to REPLICA_QUORUM_TIMEOUT until the quorum of replicas applied
+ *        its last change (and so every change before it). Without a quorum it returns at once.
+ *        It also fails at once, or as soon as a replica drops, when fewer than a quorum of
+ *        replicas have applied the change or are streaming: a down replica would only park
+ *        the calling worker for the whole timeout.
+ *
+ * @param wait Non-zero if the request succeeded and is about to be acknowledged.
+ * @return int 0 if the request may be acknowledged, -1 if the quorum was not reached in time
+ *         (the change stays committed on the primary and reaches the replicas later).
+ */
+int replica_await(int wait) {
+    long long seq = pending;
+    pending = 0;
+    if (!wait || seq == 0 || quorum_size == 0) {
+        return 0;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += REPLICA_QUORUM_TIMEOUT;
+    int result = 0;
+    pthread_mutex_lock(&log_mutex);
+    while (applied_by(seq) < quorum_size) {
+        if (may_apply(seq) < quorum_size) {
+            result = -1;
+            break;
+        }
+        if (pthread_cond_timedwait(&log_acked, &log_mutex, &deadline) == ETIMEDOUT) {
+            result = applied_by(seq) >= quorum_size ? 0 : -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&log_mutex);
+    return result;
+}
+
+/**
+ * @brief Reports the state of the replicas, for the server's counters.
+ *
+ * @param connected Receives the number of replicas with an open stream.
+ * @param lag       Receives the number of changes the slowest replica has not applied yet.
+ */
+void replica_status(int *connected, long long *lag) {
+    *connected = 0;
+    *lag = 0;
+    pthread_mutex_lock(&log_mutex);
+    for (int i = 0; i < replicas_added; i++) {
+        if (replicas[i].connected) (*connected)++;
+        if (log_head - replicas[i].acked > *lag) *lag = log_head - replicas[i].acked;
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+/**
+ * @brief Connects to a replica. An unreachable replica is reported once, not on every retry.
+ *
+ * @return int Socket on success, -1 on failure.
+ */
+static int connect_replica(Replica *replica) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&replica->addr, sizeof(replica->addr)) < 0) {
+        if (!replica->reported) {
+            printf("Replica %s unreachable: %s\n", replica->address, strerror(errno));
+            replica->reported = 1;
+        }
+        close(sock);
+        return -1;
+    }
+    replica->reported = 0;
+
+    // Batches end in a short SEQ line the replica waits for, so do not let Nagle hold it back
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    struct timeval timeout = { .tv_sec = REPLICA_IO_TIMEOUT, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+/**
+ * @brief Ends a batch: sends "SEQ <seq>" and waits for the replica to echo it.
+ *
+ * @return int 0 once the replica applied everything up to seq, -1 on an error or a lost connection.
+ */
+static int finish_batch(Replica *replica, ConnReader *conn, long long seq) {
+    char line[256];
+    snprintf(line, sizeof(line), "SEQ %lld\n", seq);
+    if (send_all(conn->fd, line, strlen(line)) != 0 || conn_read_line(conn, line, sizeof(line)) < 0) {
+        return -1;
+    }
+    long long echoed;
+    if (sscanf(line, "SEQ %lld", &echoed) != 1 || echoed != seq) {
+        printf("Replica %s: %s\n", replica->address, line);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends one changed path in its current state: the file with its contents, a
+ *        directory, or a removal if the path no longer exists.
+ *
+ * @return int 0 on success, -1 if the connection failed.
+ */
+static int send_change(int sock, const char *path) {
+    const TreeSource *files = &tree_source.files;
+    char header[1100];
+    int fd;
+    long long size;
+    if (files->open(files->ctx, path, &fd, &size) == 0) {
+        snprintf(header, sizeof(header), "F %lld %s\n", size, path);
+        set_cork(sock, 1);
+        int result = send_all(sock, header, strlen(header));
+        if (result == 0) {
+            result = fd >= 0 ? send_file_range(sock, fd, 0, size) : files->send_body(files->ctx, sock, path, size);
+        }
+        set_cork(sock, 0);
+        if (fd >= 0) close(fd);
+        return result;
+    }
+    snprintf(header, sizeof(header), tree_source.is_dir(path) ? "D %s\n" : "R %s\n", path);
+    return send_all(sock, header, strlen(header));
+}
+
+/**
+ * @brief Brings a replica up to date with the whole tree (SYNC).
+ *
+ *        The log position is taken before the tree is listed, so every change up to it is
+ *        in the tree; the changes after it are streamed next, and those already in the tree
+ *        are sent again, which is harmless. On success the replica counts as having applied
+ *        everything up to that position.
+ *
+ * @param replica  The replica.
+ * @param conn     Its stream.
+ * @param instance ID of the replica process, remembered once it is up to date.
+ * @return int 0 on success, -1 if the tree could not be listed or the connection failed.
+ */
+static int send_sync(Replica *replica, ConnReader *conn, const char *instance) {
+    pthread_mutex_lock(&log_mutex);
+    long long seq = log_head;
+    pthread_mutex_unlock(&log_mutex);
+
+    TreeEntry *entries;
+    size_t count;
+    if (tree_source.list(&entries, &count) != 0) {
+        printf("Replica %s: unable to list the tree\n", replica->address);
+        return -1;
+    }
+    printf("Replica %s: sending the whole tree (%zu entries)\n", replica->address, count);
+    long long files = 0, bytes = 0;
+    int result = send_all(conn->fd, "SYNC\n", 5);
+    if (result == 0) {
+        result = tree_send(conn->fd, entries, count, &tree_source.files, &files, &bytes);
+    }
+    tree_free(entries, count);
+    if (result == 0) {
+        result = finish_batch(replica, conn, seq);
+    }
+    if (result == 0) {
+        pthread_mutex_lock(&log_mutex);
+        snprintf(replica->instance, sizeof(replica->instance), "%s", instance);
+        replica->acked = seq;
+        pthread_cond_broadcast(&log_acked);
+        pthread_mutex_unlock(&log_mutex);
+        printf("Replica %s synced (%lld files, %lld bytes)\n", replica->address, files, bytes);
+    }
+    return result;
+}
+
+/**
+ * @brief Runs the stream to a connected replica until the connection fails.
+ *
+ *        After the handshake the replica is brought up to date with SYNC, unless it is the
+ *        process this thread streamed to before and the log still holds every change it
+ *        lacks. Then the log is sent in batches of up to REPLICA_BATCH changes, each ended
+ *        by SEQ, so a batch costs one round trip however many files it holds. An idle
+ *        stream sends SEQ every REPLICA_HEARTBEAT seconds, which keeps the replica from
+ *        closing it and finds a dead replica.
+ *
+ * @param replica The replica.
+ * @param conn    Reader of its socket.
+ */
+static void stream_changes(Replica *replica, ConnReader *conn) {
+    char line[256], instance[32];
+    if (send_all(conn->fd, "REPLICATE\n", 10) != 0 || conn_read_line(conn, line, sizeof(line)) < 0) {
+        return;
+    }
+    if (sscanf(line, "REPLICA %31s", instance) != 1) {
+        printf("Replica %s refused the stream: %s\n", replica->address, line);
+        return;
+    }
+    pthread_mutex_lock(&log_mutex);
+    int resume = strcmp(instance, replica->instance) == 0 && replica->acked >= log_head - REPLICA_LOG_SIZE;
+    pthread_mutex_unlock(&log_mutex);
+    if (!resume && send_sync(replica, conn, instance) != 0) {
+        return;
+    }
+    pthread_mutex_lock(&log_mutex);
+    replica->connected = 1;
+    long long acked = replica->acked;
+    pthread_mutex_unlock(&log_mutex);
+    printf("Replica %s streaming from change %lld\n", replica->address, acked + 1);
+
+    char *batch[REPLICA_BATCH];
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REPLICA_HEARTBEAT;
+
+        // Copy the next batch out of the log, so it is sent without holding the lock
+        pthread_mutex_lock(&log_mutex);
+        long long first = replica->acked + 1;
+        while (log_head < first && pthread_cond_timedwait(&log_grown, &log_mutex, &deadline) != ETIMEDOUT);
+        long long last = log_head - first < REPLICA_BATCH ? log_head : first + REPLICA_BATCH - 1;
+        int behind = first <= log_head - REPLICA_LOG_SIZE;
+        size_t count = 0;
+        for (long long seq = first; !behind && seq <= last; seq++) {
+            const char *path = log_paths[seq % REPLICA_LOG_SIZE];
+            batch[count] = path ? strdup(path) : NULL;
+            if (!batch[count++]) behind = 1;
+        }
+        pthread_mutex_unlock(&log_mutex);
+
+        int result = 0;
+        if (behind) {
+            printf("Replica %s fell behind the log\n", replica->address);
+            result = send_sync(replica, conn, instance);
+        } else {
+            // A path changed twice in a row is sent once, in its later state
+            for (size_t i = 0; i < count && result == 0; i++) {
+                if (i + 1 == count || strcmp(batch[i], batch[i + 1]) != 0) {
+                    result = send_change(conn->fd, batch[i]);
+                }
+            }
+            if (result == 0) {
+                result = finish_batch(replica, conn, last);
+            }
+            if (result == 0) {
+                pthread_mutex_lock(&log_mutex);
+                replica->acked = last;
+                pthread_cond_broadcast(&log_acked);
+                pthread_mutex_unlock(&log_mutex);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            free(batch[i]);
+        }
+        if (result != 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Thread streaming to one replica: connects, streams until the connection fails,
+ *        and reconnects after REPLICA_RETRY_MS, forever.
+ *
+ * @param arg The Replica.
+ * @return void* Never returns.
+ */
+static void *replica_thread(void *arg) {
+    Replica *replica = arg;
+    while (1) {
+        int sock = connect_replica(replica);
+        if (sock >= 0) {
+            ConnReader conn;
+            conn_reader_init(&conn, sock);
+            stream_changes(replica, &conn);
+            pthread_mutex_lock(&log_mutex);
+            int was_connected = replica->connected;
+            replica->connected = 0;
+            pthread_cond_broadcast(&log_acked); // Requests waiting on it may no longer reach a quorum
+            pthread_mutex_unlock(&log_mutex);
+            if (was_connected) {
+                printf("Replica %s disconnected\n", replica->address);
+            }
+            free(conn.buf);
+            close(sock);
+        }
+        usleep(REPLICA_RETRY_MS * 1000);
+    }
+    return NULL;
+}
@@ -0,0 +1,64 @@
+/*
+ * replica.h -- Primary/replica replication of the RFS server
+ *
+ * A primary started with --replicate-to streams every committed change to
+ * each replica over a connection of its own, in commit order:
+ *
+ *   REPLICATE\n                   opens the stream; the replica answers
+ *                                 "REPLICA <instance>", an ID picked at its start
+ *   F <size> <path>\n<bytes>      a file and its contents (as in tree.h)
+ *   D <path>\n                    a directory
+ *   R <path>\n                    a path that no longer exists, with anything below it
+ *   SYNC\n<entries>END\n          the whole tree (as in tree.h); the replica removes
+ *                                 whatever the tree lacks
+ *   SEQ <n>\n                     the end of a batch; the replica answers "SEQ <n>"
+ *                                 once everything before it is applied
+ *
+ * The log only holds the paths that changed. A path is looked at when it is
+ * sent, so the replica gets its state of that moment, whatever order
+ * concurrent changes were logged in. A replica process the primary has not
+ * brought up to date yet, or one that fell behind the whole log, gets SYNC.
+ */
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stddef.h>
+#include "tree.h"
+
+#define REPLICA_MAX 8                   // Replicas one primary streams to
+#define REPLICA_LOG_SIZE 65536          // Changes kept for replicas that fall behind
+#define REPLICA_BATCH 256               // Most changes sent before waiting for SEQ
+#define REPLICA_QUORUM_TIMEOUT 10       // Seconds a change waits for its quorum
+#define REPLICA_IO_TIMEOUT 30           // Seconds the stream waits on a stalled replica
+#define REPLICA_HEARTBEAT 20            // Seconds between SEQ lines on an idle stream
+#define REPLICA_RETRY_MS 1000           // Pause before reconnecting to a replica
+
+// Where the replication threads get the primary's tree from
+typedef struct {
+    TreeSource files;                                   // Opens a file by path (see tree.h)
+    int (*is_dir)(const char *path);                    // Function to tell a directory by path
+    int (*list)(TreeEntry **entries, size_t *count);    // Function to list the whole tree (for SYNC)
+} ReplicaSource;
+
+// Function to add a replica ("<ip>:<port>", or a port on 127.0.0.1); 0 on success, -1 if invalid
+int replica_add(const char *address);
+
+// Function to get the number of replicas added
+int replica_count(void);
+
+// Function to start streaming to the replicas; changes wait for quorum of them (0: none)
+int replica_start(const ReplicaSource *source, int quorum);
+
+// Function to log a path whose file or directory changed (no-op without replicas)
+void replica_log(const char *path);
+
+// Function to end a request: waits until the changes the calling thread logged for it reached
+// the quorum if wait is non-zero, or forgets them; 0 on success, -1 if the quorum timed out
+// or fewer than a quorum of replicas are streaming
+int replica_await(int wait);
+
+// Function to report the replicas in sync and how many changes the slowest one lacks
+void replica_status(int *connected, long long *lag);
+
+#endif // REPLICA_H
@@ -2,9 +2,24 @@
  * client.c -- TCP Socket Client
  *
  * This program is a TCP client that supports three file operations with a server:
- *  - WRITE <local-file> <remote-file>: Uploads a file from client to server
- *  - GET <remote-file> <local-file>: Downloads a file from server to client
- *  - RM <remote-file>: Deletes a file on the server
+ *  - WRITE <local-file> <remote-file> [--resume] [--compress <level>] | [--streams <n>] | [--dedup] | [--delta]:
+ *    Uploads a file from client to server (with --delta, only what changed since the server's copy)
+ *  - GET <remote-file> <local-file> [--resume | <offset> <length>] [--compress <level>] | [--streams <n>]:
+ *    Downloads a file (or a byte range of it) from server to client
+ *  - RM [-r] <remote-file>: Deletes a file on the server (with -r, a whole directory tree)
+ *  - PUTDIR <local-dir> <remote-dir>: Uploads a directory tree as one stream
+ *  - GETDIR <remote-dir> <local-dir>: Downloads a directory tree as one stream
+ *  - STATS: Prints the server's counters
+ *  - SESSION: Reads the commands above from stdin, one per line, and runs them
+ *             over a single persistent connection
+ *  - BATCH <manifest|-> [--parallel <n>]: Runs the commands of a manifest file (or stdin)
+ *             concurrently over a pool of n persistent connections
+ *  - PIPELINE [depth]: Reads GET, WRITE, RM and STAT commands from stdin and keeps up to
+ *             depth of them in flight on one connection, using binary frames (see frame.h)
+ *
+ * The server is RFS_SERVER ("<ip>:<port>", or a port) if set. GET and GETDIR go to one
+ * of the replicas listed in RFS_REPLICAS (comma-separated), if set, and to the server
+ * if none of them can be reached.
  * 
  * adapted from: 
  *   https://www.educative.io/answers/how-to-implement-tcp-sockets-in-c
@@ -14,18 +29,127 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include "netio.h"
+#include "chunk.h"
+#include "codec.h"
+#include "frame.h"
+#include "tree.h"
+#include "delta.h"
 
 #define PORT 2000
 #define SERVER_IP "127.0.0.1"
-#define BUFFER_SIZE 8192
+#define MAX_STREAMS 16  // Most connections one file may be split across
+#define MAX_PIPELINE_DEPTH 64       // Most frames the server runs at once for one session
+#define DEFAULT_PIPELINE_DEPTH 16
+#define MAX_BATCH_PARALLEL 64       // Most connections of one BATCH run
+#define DEFAULT_BATCH_PARALLEL 4
+
+// One byte range of a multi-stream transfer, moved over its own connection
+typedef struct {
+    const char *remote_path;    // Path of the file on the server
+    int fd;                     // Local file, shared by all parts
+    long long total;            // Size of the whole file
+    long long offset;           // First byte of this part
+    long long length;           // Bytes in this part
+    const char *token;          // Upload ID shared by all parts (WRITE only)
+    int result;                 // 0 once the part arrived completely
+} TransferPart;
+
+// Options of one WRITE or GET, as given behind its paths
+typedef struct {
+    long long offset;           // First byte of the range to download (GET)
+    long long length;           // Bytes in the range, or -1 for the rest of the file
+    int resume;                 // Continue an interrupted transfer
+    int streams;                // Parallel connections, 1 for a single stream
+    int dedup;                  // Send only the chunks the server lacks (WRITE)
+    int delta;                  // Send only what differs from the server's copy (WRITE)
+    int compress;               // zlib level to compress the body with, or 0 for none
+} TransferOptions;
+
+// Op stream of a delta upload (see do_write_delta())
+typedef struct {
+    int sock;
+    char pending[4096];         // Command and copy ops not sent yet
+    size_t pending_len;
+    uint32_t block_size;
+    long long literal;          // Bytes sent as literal data
+    long long matched;          // Bytes the server copies from its version
+} DeltaUpload;
+
+// A request of a pipelined session waiting for its response
+typedef struct {
+    int in_use;
+    uint32_t request_id;
+    uint8_t opcode;
+    char remote_path[1024];
+    char local_path[1024];      // Where the file of a GET is saved
+} PendingRequest;
+
+// State shared by the sending and the receiving side of a pipelined session
+typedef struct {
+    ConnReader conn;            // Read by the receiver only
+    PendingRequest pending[MAX_PIPELINE_DEPTH];
+    int depth;                  // Requests allowed in flight
+    int outstanding;            // Requests sent and not answered yet
+    int failures;               // Requests that failed or were never answered
+    int broken;                 // The connection was lost
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;     // Signalled whenever a request is answered
+} Pipeline;
+
+// State shared by the workers of a BATCH run
+typedef struct {
+    FILE *input;                // Manifest, read one line at a time under mutex
+    int lines;                  // Lines read so far (for line numbers)
+    int commands;               // Commands run
+    int failures;               // Commands that failed
+    long long bytes;            // File bytes moved by successful commands
+    pthread_mutex_t mutex;
+} Batch;
 
 // Function declarations
-int send_write_command(const char *local_path, const char *remote_path);
-int send_get_command(const char *remote_path, const char *local_path);
-int send_rm_command(const char *remote_path);
+int send_write_command(const char *local_path, const char *remote_path, const TransferOptions *options);
+int send_get_command(const char *remote_path, const char *local_path, const TransferOptions *options);
+int send_rm_command(const char *remote_path, int recursive);
+int send_tree_command(const char *command, const char *from, const char *to);
+int run_session(FILE *input);
+int run_pipeline(FILE *input, int depth);
+int run_batch(FILE *input, int parallel);
+int do_write(ConnReader *conn, const char *local_path, const char *remote_path, int resume, int compress);
+int do_write_dedup(ConnReader *conn, const char *local_path, const char *remote_path);
+int do_write_delta(ConnReader *conn, const char *local_path, const char *remote_path);
+int do_get(ConnReader *conn, const char *remote_path, const char *local_path, long long offset, long long length,
+           int resume, int compress);
+int do_rm(ConnReader *conn, const char *remote_path, int recursive);
+int do_stats(ConnReader *conn);
+int do_putdir(ConnReader *conn, const char *local_dir, const char *remote_dir);
+int do_getdir(ConnReader *conn, const char *remote_dir, const char *local_dir);
+int parallel_write(const char *local_path, const char *remote_path, int streams);
+int parallel_get(const char *remote_path, const char *local_path, int streams);
+static int connect_to_server();
+static int connect_for_read();
+static void make_parent_dirs(const char *local_path);
+static int negotiate_compression(ConnReader *conn);
+static int parse_transfer_options(int argc, char *argv[], TransferOptions *options);
+static int open_local_tree_file(void *ctx, const char *path, int *fd, long long *size);
+static unsigned char *build_frame_request(const char *command, const char *arg1, const char *arg2, uint8_t *opcode,
+                                          size_t *length);
+static void *pipeline_receiver(void *arg);
+static void *batch_worker(void *arg);
+static int is_blank_line(const char *line);
+static int run_command(ConnReader *conn, const char *line, long long *bytes);
+static int send_delta_copy(void *ctx, size_t first, size_t count);
+static int send_delta_literal(void *ctx, const unsigned char *data, size_t len);
+static int read_refusal(ConnReader *conn);
+static void make_upload_token(char *token, size_t size);
 
 
 /**
@@ -40,35 +164,114 @@ int main(int argc, char *argv[]) {
     // Invalid usage with insufficient arguments
     if (argc < 2) {
         printf("Usage:\n");
-        printf("  %s WRITE <local> <remote>\n", argv[0]);
-        printf("  %s GET <remote> <local>\n", argv[0]);
-        printf("  %s RM <remote>\n", argv[0]);
+        printf("  %s WRITE <local> <remote> [--resume] [--compress <level>] | [--streams <n>] | [--dedup] | [--delta]\n",
+               argv[0]);
+        printf("  %s GET <remote> <local> [--resume | <offset> <length>] [--compress <level>] | [--streams <n>]\n",
+               argv[0]);
+        printf("  %s RM [-r] <remote>\n", argv[0]);
+        printf("  %s PUTDIR <local-dir> <remote-dir>\n", argv[0]);
+        printf("  %s GETDIR <remote-dir> <local-dir>\n", argv[0]);
+        printf("  %s STATS\n", argv[0]);
+        printf("  %s SESSION < commands.txt\n", argv[0]);
+        printf("  %s BATCH <manifest|-> [--parallel <n>]\n", argv[0]);
+        printf("  %s PIPELINE [depth] < commands.txt\n", argv[0]);
+        printf("Environment: RFS_SERVER=<ip:port>, RFS_REPLICAS=<ip:port>,... (for GET and GETDIR)\n");
         return 1;
     }
 
     // Handle WRITE command
     if (strcmp(argv[1], "WRITE") == 0) {
-        if (argc != 4) {
-            printf("Usage: %s WRITE <local-file-path> <remote-file-path>\n", argv[0]);
+        TransferOptions options;
+        if (argc < 4 || parse_transfer_options(argc - 4, argv + 4, &options) < 0 || options.length >= 0) {
+            printf("Usage: %s WRITE <local-file-path> <remote-file-path> "
+                   "[--resume] [--compress <level>] | [--streams <n>] | [--dedup] | [--delta]\n", argv[0]);
             return 1;
         }
-        return send_write_command(argv[2], argv[3]);
+        signal(SIGPIPE, SIG_IGN); // A server refusing the upload may close before the body is sent
+        return send_write_command(argv[2], argv[3], &options);
 
     // Handle GET command
     } else if (strcmp(argv[1], "GET") == 0) {
-        if (argc != 4) {
-            printf("Usage: %s GET <remote-file-path> <local-file-path>\n", argv[0]);
+        TransferOptions options;
+        if (argc < 4 || parse_transfer_options(argc - 4, argv + 4, &options) < 0 || options.dedup
+            || options.delta) {
+            printf("Usage: %s GET <remote-file-path> <local-file-path> "
+                   "[--resume | <offset> <length>] [--compress <level>] | [--streams <n>]\n", argv[0]);
             return 1;
         }
-        return send_get_command(argv[2], argv[3]);
+        return send_get_command(argv[2], argv[3], &options);
 
     // Handle RM command
     } else if (strcmp(argv[1], "RM") == 0) {
-        if (argc != 3) {
-            printf("Usage: %s RM <remote-file-path>\n", argv[0]);
+        int recursive = argc == 4 && strcmp(argv[2], "-r") == 0;
+        if (argc != 3 + recursive) {
+            printf("Usage: %s RM [-r] <remote-file-path>\n", argv[0]);
+            return 1;
+        }
+        return send_rm_command(argv[2 + recursive], recursive);
+
+    // Handle PUTDIR and GETDIR commands: a whole tree over one connection
+    } else if (strcmp(argv[1], "PUTDIR") == 0 || strcmp(argv[1], "GETDIR") == 0) {
+        if (argc != 4) {
+            printf("Usage: %s %s\n", argv[0], strcmp(argv[1], "PUTDIR") == 0 ? "PUTDIR <local-dir> <remote-dir>"
+                                                                              : "GETDIR <remote-dir> <local-dir>");
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+        return send_tree_command(argv[1], argv[2], argv[3]);
+
+    // Handle STATS command
+    } else if (strcmp(argv[1], "STATS") == 0) {
+        if (argc != 2) {
+            printf("Usage: %s STATS\n", argv[0]);
             return 1;
         }
-        return send_rm_command(argv[2]);
+        int sock = connect_to_server();
+        if (sock < 0) {
+            return 1;
+        }
+        ConnReader conn;
+        conn_reader_init(&conn, sock);
+        int result = do_stats(&conn);
+        free(conn.buf);
+        close(sock);
+        return result != 0;
+
+    // Handle SESSION mode: many commands over one connection
+    } else if (strcmp(argv[1], "SESSION") == 0) {
+        signal(SIGPIPE, SIG_IGN); // A connection closed by the server is retried, not fatal
+        return run_session(stdin);
+
+    // Handle BATCH mode: a manifest of commands over a pool of connections
+    } else if (strcmp(argv[1], "BATCH") == 0) {
+        int parallel = DEFAULT_BATCH_PARALLEL;
+        if (argc == 5 && strcmp(argv[3], "--parallel") == 0) {
+            parallel = atoi(argv[4]);
+        }
+        if ((argc != 3 && argc != 5) || (argc == 5 && strcmp(argv[3], "--parallel") != 0) || parallel < 1
+            || parallel > MAX_BATCH_PARALLEL) {
+            printf("Usage: %s BATCH <manifest|-> [--parallel <1-%d>]\n", argv[0], MAX_BATCH_PARALLEL);
+            return 1;
+        }
+        FILE *input = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+        if (!input) {
+            perror("Failed to open manifest");
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+        int result = run_batch(input, parallel);
+        if (input != stdin) fclose(input);
+        return result;
+
+    // Handle PIPELINE mode: many small requests in flight on one connection
+    } else if (strcmp(argv[1], "PIPELINE") == 0) {
+        int depth = argc > 2 ? atoi(argv[2]) : DEFAULT_PIPELINE_DEPTH;
+        if (argc > 3 || depth < 1 || depth > MAX_PIPELINE_DEPTH) {
+            printf("Usage: %s PIPELINE [depth 1-%d] < commands.txt\n", argv[0], MAX_PIPELINE_DEPTH);
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+        return run_pipeline(stdin, depth);
 
     // Unknown command
     } else {
@@ -82,183 +285,1651 @@ int main(int argc, char *argv[]) {
  * 
  * @param local_path Path to the local file on client
  * @param remote_path Destination path on the server
+ * @param options Transfer options: resume and compress (see do_write()), streams (see
+ *                parallel_write()), dedup (see do_write_dedup()) or delta (see do_write_delta())
  * @return int Exit status
  */
-int send_write_command(const char *local_path, const char *remote_path) {
-    // Open the local file for reading in binary mode
-    FILE *fp = fopen(local_path, "rb");
-    if (!fp) {
-        perror("Failed to open local file");
-        return 1;
+int send_write_command(const char *local_path, const char *remote_path, const TransferOptions *options) {
+    if (options->streams > 1) {
+        return parallel_write(local_path, remote_path, options->streams);
     }
 
-    // Determine file size
-    fseek(fp, 0, SEEK_END);
-    int file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
     // Create socket and connect to server
     int sock = connect_to_server();
     if (sock < 0) {
         return 1;
     }
+    ConnReader conn;
+    conn_reader_init(&conn, sock);
+    int result = options->dedup   ? do_write_dedup(&conn, local_path, remote_path)
+                 : options->delta ? do_write_delta(&conn, local_path, remote_path)
+                                  : do_write(&conn, local_path, remote_path, options->resume, options->compress);
+    free(conn.buf);
+    close(sock);
+    return result != 0;
+}
 
-    // Send WRITE header to server
-    char header[1024];
-    snprintf(header, sizeof(header), "WRITE %s %d\n", remote_path, file_size);
-    send(sock, header, strlen(header), 0);
-
-    // Send file content
-    char buffer[BUFFER_SIZE];
-    int bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        send(sock, buffer, bytes, 0);
+/**
+ * @brief Sends a GET command to retrieve a file from the server and save it locally.
+ * 
+ * @param remote_path Path to the file on the server
+ * @param local_path Path to store the file locally
+ * @param options Transfer options: range, resume and compress (see do_get()) or streams (see
+ *                parallel_get())
+ * @return int Exit status
+ */
+int send_get_command(const char *remote_path, const char *local_path, const TransferOptions *options) {
+    if (options->streams > 1) {
+        return parallel_get(remote_path, local_path, options->streams);
     }
 
-    // Wait for server response
-    memset(buffer, 0, sizeof(buffer));
-    recv(sock, buffer, sizeof(buffer) - 1, 0);
-    printf("Server response: %s", buffer);
-
-    // Close the connection and return the exist status
-    fclose(fp);
+    // Create socket and connect to server
+    int sock = connect_for_read();
+    if (sock < 0) {
+        return 1;
+    }
+    ConnReader conn;
+    conn_reader_init(&conn, sock);
+    int result = do_get(&conn, remote_path, local_path, options->offset, options->length, options->resume,
+                        options->compress);
+    free(conn.buf);
     close(sock);
-    return 0;
+    return result != 0;
 }
 
 /**
- * @brief Sends a GET command to retrieve a file from the server and save it locally. 
- *         If the file does not exist locally, create a path and file in local.
- *         If the file already exists locally, replace the existing file with downloaded file.
+ * @brief Sends a RM (remove) command to the server to delete a file.
  * 
- * @param remote_path Path to the file on the server
- * @param local_path Path to store the file locally
+ * @param remote_path Path of the file to remove on the server
+ * @param recursive Non-zero to remove a directory with everything in it
  * @return int Exit status
  */
-int send_get_command(const char *remote_path, const char *local_path) {
+int send_rm_command(const char *remote_path, int recursive) {
     // Create socket and connect to server
     int sock = connect_to_server();
     if (sock < 0) {
         return 1;
     }
+    ConnReader conn;
+    conn_reader_init(&conn, sock);
+    int result = do_rm(&conn, remote_path, recursive);
+    free(conn.buf);
+    close(sock);
+    return result != 0;
+}
 
-    // Send GET request
-    char request[1024];
-    snprintf(request, sizeof(request), "GET %s\n", remote_path);
-    send(sock, request, strlen(request), 0);
-
-    // Receive SIZE header from server
-    char header[128] = {0};
-    char ch;
-    int i = 0;
-    while (recv(sock, &ch, 1, 0) > 0 && ch != '\n' && i < sizeof(header) - 1) {
-        header[i++] = ch;
+/**
+ * @brief Sends a PUTDIR or GETDIR command to move a directory tree.
+ * 
+ * @param command "PUTDIR" (from is local, to is remote) or "GETDIR" (the other way round)
+ * @param from Directory to copy
+ * @param to Directory to copy it to
+ * @return int Exit status
+ */
+int send_tree_command(const char *command, const char *from, const char *to) {
+    int sock = strcmp(command, "GETDIR") == 0 ? connect_for_read() : connect_to_server();
+    if (sock < 0) {
+        return 1;
     }
-    header[i] = '\0';
+    ConnReader conn;
+    conn_reader_init(&conn, sock);
+    int result = strcmp(command, "PUTDIR") == 0 ? do_putdir(&conn, from, to) : do_getdir(&conn, from, to);
+    free(conn.buf);
+    close(sock);
+    return result != 0;
+}
 
-    // Check for error or size info
-    if (strncmp(header, "SIZE", 4) != 0) {
-        printf("Server response: %s\n", header);
-        close(sock);
+/**
+ * @brief Runs many commands over one persistent connection.
+ * 
+ *        Each input line holds one command, run in order (see run_command()). Blank lines
+ *        and lines starting with '#' are skipped. QUIT is sent when the input ends.
+ * 
+ * @param input Stream to read the commands from
+ * @return int Exit status (1 if any command failed)
+ */
+int run_session(FILE *input) {
+    int sock = connect_to_server();
+    if (sock < 0) {
         return 1;
     }
+    ConnReader conn;
+    conn_reader_init(&conn, sock);
+
+    int failures = 0;
+    char line[2200];
+    while (fgets(line, sizeof(line), input)) {
+        if (is_blank_line(line)) {
+            continue;
+        }
+        int result = run_command(&conn, line, NULL);
+        if (conn.fd < 0) {
+            return 1;
+        }
+        if (result != 0) {
+            failures++;
+        }
+    }
 
-    int file_size;
-    sscanf(header, "SIZE %d", &file_size);
+    send_all(conn.fd, "QUIT\n", 5);
+    char response[128];
+    conn_read_line(&conn, response, sizeof(response));
+    close(conn.fd);
+    free(conn.buf);
+    return failures > 0;
+}
 
-    // Create directories if needed
-    char path_copy[1024];
-    strncpy(path_copy, local_path, sizeof(path_copy));
-    char *p = strrchr(path_copy, '/');
-    if (p) {
-        *p = '\0';
-        char mkdir_cmd[1050];
-        snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", path_copy);
-        system(mkdir_cmd);
+/**
+ * @brief Runs the commands of a manifest concurrently over a small pool of connections.
+ * 
+ *        Each manifest line holds one command in the SESSION form (options included), and
+ *        parallel worker threads each keep a persistent connection and take the next line
+ *        as soon as they are done with the previous one. The lines are read as they are
+ *        needed, so a manifest of any length runs in constant memory. Commands run in no
+ *        particular order: a GET of a file written in the same batch belongs in a SESSION.
+ *        One status line is printed per command, and a summary with the number of commands,
+ *        file bytes moved and throughput at the end.
+ * 
+ * @param input Stream to read the commands from (a manifest file or stdin)
+ * @param parallel Number of worker threads and connections (at most MAX_BATCH_PARALLEL)
+ * @return int Exit status (1 if any command failed)
+ */
+int run_batch(FILE *input, int parallel) {
+    Batch batch = { .input = input };
+    pthread_mutex_init(&batch.mutex, NULL);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t threads[MAX_BATCH_PARALLEL];
+    int started = 0;
+    for (int i = 0; i < parallel; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &batch) != 0) {
+            perror("Failed to create batch worker");
+            break;
+        }
+        started++;
     }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_destroy(&batch.mutex);
 
-    // Open local file for writing
-    FILE *fp = fopen(local_path, "wb");
-    if (!fp) {
-        perror("Failed to open local file");
-        close(sock);
-        return 1;
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d commands in %.3f s over %d connections, %d failed, %lld bytes (%.2f MB/s, %.0f commands/s)\n",
+           batch.commands, seconds, started, batch.failures, batch.bytes,
+           seconds > 0 ? batch.bytes / seconds / (1024 * 1024) : 0.0, seconds > 0 ? batch.commands / seconds : 0.0);
+    return started == 0 || batch.failures > 0;
+}
+
+/**
+ * @brief Worker of a BATCH run: takes manifest lines one at a time and runs them over a
+ *        connection of its own, which is opened on first use and reopened if it was lost.
+ * 
+ * @param arg The Batch
+ * @return void* Always NULL.
+ */
+static void *batch_worker(void *arg) {
+    Batch *batch = arg;
+    ConnReader conn;
+    conn_reader_init(&conn, -1);
+    char line[2200];
+    while (1) {
+        pthread_mutex_lock(&batch->mutex);
+        int number = 0;
+        while (fgets(line, sizeof(line), batch->input)) {
+            batch->lines++;
+            if (!is_blank_line(line)) {
+                number = batch->lines;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&batch->mutex);
+        if (number == 0) {
+            break;
+        }
+        line[strcspn(line, "\n")] = '\0';
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (conn.fd < 0) {
+            conn_reader_init(&conn, connect_to_server());
+        }
+        long long bytes = 0;
+        int result = conn.fd < 0 ? 1 : run_command(&conn, line, &bytes);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("[line %d] %s: %s (%lld bytes, %.1f ms)\n", number, line, result == 0 ? "OK" : "FAILED", bytes, ms);
+
+        pthread_mutex_lock(&batch->mutex);
+        batch->commands++;
+        if (result == 0) {
+            batch->bytes += bytes;
+        } else {
+            batch->failures++;
+        }
+        pthread_mutex_unlock(&batch->mutex);
     }
 
-    // Receive and write file data
-    int total_received = 0;
-    char buffer[BUFFER_SIZE];
-    while (total_received < file_size) {
-        int bytes = recv(sock, buffer, sizeof(buffer), 0);
-        if (bytes <= 0) break;
-        fwrite(buffer, 1, bytes, fp);
-        total_received += bytes;
+    if (conn.fd >= 0) {
+        send_all(conn.fd, "QUIT\n", 5);
+        char response[128];
+        conn_read_line(&conn, response, sizeof(response));
+        close(conn.fd);
     }
+    free(conn.buf);
+    return NULL;
+}
 
-    fclose(fp);
-    close(sock);
-    printf("Downloaded file to %s (%d bytes)\n", local_path, total_received);
-    return 0;
+/**
+ * @brief Checks whether a command line is blank or a comment ('#').
+ */
+static int is_blank_line(const char *line) {
+    char word[2] = {0};
+    return sscanf(line, "%1s", word) != 1 || word[0] == '#';
 }
 
 /**
- * @brief Sends a RM (remove) command to the server to delete a file.
+ * @brief Runs one SESSION or BATCH command line over an open connection.
  * 
- * @param remote_path Path of the file to remove on the server
- * @return int Exit status
+ *        The line holds a command in the same form as the command line, options included:
+ *        "WRITE <local> <remote> [...]", "GET <remote> <local> [...]", "RM [-r] <remote>",
+ *        "PUTDIR <local> <remote>" or "GETDIR <remote> <local>". If the server closed the connection (for example after its idle timeout), the
+ *        client reconnects once and retries the command. Multi-stream transfers open
+ *        connections of their own.
+ * 
+ * @param conn Reader of the connected socket; replaced when reconnecting, and left with fd -1
+ *             if the server cannot be reached any more
+ * @param line The command line
+ * @param bytes If not NULL, receives the size of the local file a successful WRITE or GET moved
+ * @return int 0 on success, 1 on failure
  */
-int send_rm_command(const char *remote_path) {
-    // Create socket and connect to server
+static int run_command(ConnReader *conn, const char *line, long long *bytes) {
+    char command[16] = {0}, arg1[1024] = {0}, arg2[1024] = {0}, opt[4][32] = {{0}};
+    int args = sscanf(line, "%15s %1023s %1023s %31s %31s %31s %31s", command, arg1, arg2, opt[0], opt[1], opt[2],
+                      opt[3]);
+    char *opts[4] = { opt[0], opt[1], opt[2], opt[3] };
+    int num_opts = args > 3 ? args - 3 : 0;
+    TransferOptions options;
+    int options_ok = parse_transfer_options(num_opts, opts, &options) == 0;
+
+    int result = -1;
+    for (int attempt = 0; attempt < 2 && result == -1; attempt++) {
+        if (attempt > 0) {
+            close(conn->fd);
+            free(conn->buf);
+            conn_reader_init(conn, connect_to_server());
+            if (conn->fd < 0) {
+                return 1;
+            }
+        }
+        if (strcmp(command, "WRITE") == 0 && args >= 3 && options_ok && options.length < 0) {
+            result = options.streams > 1 ? parallel_write(arg1, arg2, options.streams)
+                     : options.dedup     ? do_write_dedup(conn, arg1, arg2)
+                     : options.delta     ? do_write_delta(conn, arg1, arg2)
+                                         : do_write(conn, arg1, arg2, options.resume, options.compress);
+        } else if (strcmp(command, "GET") == 0 && args >= 3 && options_ok && !options.dedup && !options.delta) {
+            result = options.streams > 1 ? parallel_get(arg1, arg2, options.streams)
+                                         : do_get(conn, arg1, arg2, options.offset, options.length,
+                                                  options.resume, options.compress);
+        } else if (strcmp(command, "RM") == 0 && (args == 2 || (args == 3 && strcmp(arg1, "-r") == 0))) {
+            result = args == 3 ? do_rm(conn, arg2, 1) : do_rm(conn, arg1, 0);
+        } else if (strcmp(command, "PUTDIR") == 0 && args == 3) {
+            result = do_putdir(conn, arg1, arg2);
+        } else if (strcmp(command, "GETDIR") == 0 && args == 3) {
+            result = do_getdir(conn, arg1, arg2);
+        } else if (strcmp(command, "STATS") == 0 && args == 1) {
+            result = do_stats(conn);
+        } else {
+            printf("Invalid session command: %s\n", line);
+            result = 1;
+        }
+    }
+
+    struct stat st;
+    const char *local_path = strcmp(command, "WRITE") == 0 ? arg1 : strcmp(command, "GET") == 0 ? arg2 : NULL;
+    if (bytes) {
+        *bytes = result == 0 && local_path && stat(local_path, &st) == 0 ? (long long)st.st_size : 0;
+    }
+    return result == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Runs many small requests over one connection without waiting for each response.
+ * 
+ *        The session is switched to binary frames (see frame.h) and every input line is
+ *        sent as a request frame as soon as fewer than depth requests are in flight:
+ *        "GET <remote> <local>", "WRITE <local> <remote>", "RM <remote>" or "STAT <remote>".
+ *        A receiver thread matches the responses, which arrive in completion order, to their
+ *        requests by ID, saves downloaded files and prints one result line per request.
+ *        Frames carry whole files, so files above FRAME_MAX_PAYLOAD are refused here and
+ *        must be moved with WRITE or GET.
+ * 
+ * @param input Stream to read the commands from
+ * @param depth Most requests in flight at once (at most MAX_PIPELINE_DEPTH)
+ * @return int Exit status (1 if any request failed)
+ */
+int run_pipeline(FILE *input, int depth) {
     int sock = connect_to_server();
     if (sock < 0) {
         return 1;
     }
+    Pipeline *pipeline = calloc(1, sizeof(Pipeline));
+    if (!pipeline) {
+        close(sock);
+        return 1;
+    }
+    conn_reader_init(&pipeline->conn, sock);
+    pipeline->depth = depth;
+    pthread_mutex_init(&pipeline->mutex, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
 
-    // Send RM request
-    char request[1024];
-    snprintf(request, sizeof(request), "RM %s\n", remote_path);
-    send(sock, request, strlen(request), 0);
+    char response[256];
+    if (send_all(sock, "BINARY 1\n", 9) < 0 || conn_read_line(&pipeline->conn, response, sizeof(response)) < 0
+        || strcmp(response, "BINARY 1") != 0) {
+        printf("Server does not support binary frames\n");
+        close(sock);
+        free(pipeline->conn.buf);
+        free(pipeline);
+        return 1;
+    }
 
-    // Receive and print response
-    char response[1024] = {0};
-    recv(sock, response, sizeof(response) - 1, 0);
-    printf("Server response: %s", response);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t receiver;
+    if (pthread_create(&receiver, NULL, pipeline_receiver, pipeline) != 0) {
+        perror("Failed to create receiver thread");
+        close(sock);
+        free(pipeline->conn.buf);
+        free(pipeline);
+        return 1;
+    }
+
+    uint32_t next_id = 1;
+    int sent = 0;
+    char line[2200];
+    while (fgets(line, sizeof(line), input)) {
+        char command[16] = {0}, arg1[1024] = {0}, arg2[1024] = {0};
+        int args = sscanf(line, "%15s %1023s %1023s", command, arg1, arg2);
+        if (args <= 0 || command[0] == '#') {
+            continue;
+        }
+        uint8_t opcode;
+        size_t length;
+        unsigned char *payload = build_frame_request(command, args > 1 ? arg1 : NULL, args > 2 ? arg2 : NULL,
+                                                     &opcode, &length);
+        if (!payload) {
+            pthread_mutex_lock(&pipeline->mutex);
+            pipeline->failures++;
+            pthread_mutex_unlock(&pipeline->mutex);
+            continue;
+        }
+
+        // Wait for a free slot, then record the request before its response can arrive
+        pthread_mutex_lock(&pipeline->mutex);
+        while (!pipeline->broken && pipeline->outstanding == pipeline->depth) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+        }
+        if (pipeline->broken) {
+            pthread_mutex_unlock(&pipeline->mutex);
+            free(payload);
+            break;
+        }
+        PendingRequest *request = pipeline->pending;
+        while (request->in_use) request++;
+        request->in_use = 1;
+        request->request_id = next_id;
+        request->opcode = opcode;
+        snprintf(request->remote_path, sizeof(request->remote_path), "%s", opcode == FRAME_OP_WRITE ? arg2 : arg1);
+        snprintf(request->local_path, sizeof(request->local_path), "%s", opcode == FRAME_OP_GET ? arg2 : arg1);
+        pipeline->outstanding++;
+        pthread_mutex_unlock(&pipeline->mutex);
 
+        FrameHeader header = {
+            .length = (uint32_t)length, .version = FRAME_VERSION, .opcode = opcode, .status = 0,
+            .request_id = next_id++,
+        };
+        int result = frame_send(sock, &header, payload);
+        free(payload);
+        if (result < 0) {
+            break; // The receiver notices the lost connection and fails what is in flight
+        }
+        sent++;
+    }
+
+    // Wait for the last responses; closing the socket then ends the receiver
+    pthread_mutex_lock(&pipeline->mutex);
+    while (!pipeline->broken && pipeline->outstanding > 0) {
+        pthread_cond_wait(&pipeline->changed, &pipeline->mutex);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    shutdown(sock, SHUT_RDWR);
+    pthread_join(receiver, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int failures = pipeline->failures;
+    printf("%d requests in %.3f s (%.0f requests/s), %d failed\n", sent, seconds,
+           seconds > 0 ? sent / seconds : 0.0, failures);
     close(sock);
-    return 0;
+    free(pipeline->conn.buf);
+    pthread_mutex_destroy(&pipeline->mutex);
+    pthread_cond_destroy(&pipeline->changed);
+    free(pipeline);
+    return failures > 0;
 }
 
 /**
- * @brief Establishes a TCP connection to the server.
+ * @brief Builds the payload of a request frame from a pipeline command (see frame.h).
  * 
- * This function creates a socket, sets up the server address structure, and attempts
- * to connect to the server using the provided IP and port. If the connection is 
- * successful, it returns the socket file descriptor. Otherwise, it prints an error 
- * message and returns -1.
+ * @param command GET, WRITE, RM or STAT
+ * @param arg1 First argument, or NULL if missing
+ * @param arg2 Second argument, or NULL if missing
+ * @param opcode Receives the FRAME_OP_* of the request
+ * @param length Receives the payload length
+ * @return unsigned char* The payload (free it), or NULL if the command is invalid, the local
+ *         file cannot be read or is too large for a frame (a message is printed).
+ */
+static unsigned char *build_frame_request(const char *command, const char *arg1, const char *arg2, uint8_t *opcode,
+                                          size_t *length) {
+    unsigned char *payload = NULL;
+    if (strcmp(command, "GET") == 0 && arg2) {
+        *opcode = FRAME_OP_GET;
+        *length = 16 + strlen(arg1);
+        if ((payload = malloc(*length))) {
+            frame_put_u64(payload, 0);
+            frame_put_u64(payload + 8, FRAME_LENGTH_ALL);
+            memcpy(payload + 16, arg1, strlen(arg1));
+        }
+    } else if (strcmp(command, "WRITE") == 0 && arg2) {
+        *opcode = FRAME_OP_WRITE;
+        int fd = open(arg1, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            printf("Failed to open local file: %s\n", arg1);
+            if (fd >= 0) close(fd);
+            return NULL;
+        }
+        size_t path_len = strlen(arg2);
+        if (st.st_size > FRAME_MAX_PAYLOAD - 2 - (off_t)path_len) {
+            printf("%s is too large for a frame, send it with WRITE\n", arg1);
+            close(fd);
+            return NULL;
+        }
+        *length = 2 + path_len + (size_t)st.st_size;
+        if ((payload = malloc(*length))) {
+            frame_put_u16(payload, (uint16_t)path_len);
+            memcpy(payload + 2, arg2, path_len);
+            size_t done = 0;
+            while (done < (size_t)st.st_size) {
+                ssize_t got = read(fd, payload + 2 + path_len + done, st.st_size - done);
+                if (got <= 0) break;
+                done += got;
+            }
+            if (done < (size_t)st.st_size) {
+                printf("Failed to read local file: %s\n", arg1);
+                free(payload);
+                payload = NULL;
+            }
+        }
+        close(fd);
+        return payload;
+    } else if ((strcmp(command, "RM") == 0 || strcmp(command, "STAT") == 0) && arg1 && !arg2) {
+        *opcode = strcmp(command, "RM") == 0 ? FRAME_OP_RM : FRAME_OP_STAT;
+        *length = strlen(arg1);
+        if ((payload = malloc(*length))) {
+            memcpy(payload, arg1, *length);
+        }
+    } else {
+        printf("Invalid pipeline command: %s %s %s\n", command, arg1 ? arg1 : "", arg2 ? arg2 : "");
+    }
+    return payload;
+}
+
+/**
+ * @brief Receiving side of a pipelined session: reads response frames until the connection
+ *        ends, handles each one and frees its request's slot.
  * 
- * @return int Socket file descriptor on success, -1 on failure.
+ * @param arg The Pipeline
+ * @return void* Always NULL.
  */
-static int connect_to_server() {
-    // Create TCP socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
+static void *pipeline_receiver(void *arg) {
+    Pipeline *pipeline = arg;
+    FrameHeader header;
+    while (frame_read_header(&pipeline->conn, &header) == 0) {
+        unsigned char *payload = malloc(header.length > 0 ? header.length : 1);
+        if (!payload || conn_read_full(&pipeline->conn, payload, header.length) < 0) {
+            free(payload);
+            break;
+        }
+
+        // A slot is only changed by its owner while in use, so it can be read unlocked
+        PendingRequest *request = NULL;
+        pthread_mutex_lock(&pipeline->mutex);
+        for (int i = 0; i < pipeline->depth; i++) {
+            if (pipeline->pending[i].in_use && pipeline->pending[i].request_id == header.request_id) {
+                request = &pipeline->pending[i];
+            }
+        }
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (!request) {
+            printf("Response to unknown request %u\n", header.request_id);
+            free(payload);
+            continue;
+        }
+
+        int ok = header.status == FRAME_STATUS_OK;
+        if (!ok) {
+            printf("[#%u] %s: %s\n", header.request_id, request->remote_path, frame_status_name(header.status));
+        } else if (request->opcode == FRAME_OP_GET) {
+            make_parent_dirs(request->local_path);
+            int fd = open(request->local_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            size_t done = 0;
+            while (fd >= 0 && done < header.length) {
+                ssize_t n = write(fd, payload + done, header.length - done);
+                if (n <= 0) break;
+                done += n;
+            }
+            ok = fd >= 0 && done == header.length;
+            if (fd >= 0) close(fd);
+            printf("[#%u] GET %s -> %s: %s (%u bytes)\n", header.request_id, request->remote_path,
+                   request->local_path, ok ? "OK" : "Failed to write local file", header.length);
+        } else if (request->opcode == FRAME_OP_STAT) {
+            ok = header.length == 8;
+            printf("[#%u] STAT %s: SIZE %llu\n", header.request_id, request->remote_path,
+                   ok ? (unsigned long long)frame_get_u64(payload) : 0ULL);
+        } else {
+            printf("[#%u] %s %s: OK\n", header.request_id, request->opcode == FRAME_OP_WRITE ? "WRITE" : "RM",
+                   request->remote_path);
+        }
+        free(payload);
+
+        pthread_mutex_lock(&pipeline->mutex);
+        request->in_use = 0;
+        pipeline->outstanding--;
+        if (!ok) pipeline->failures++;
+        pthread_cond_signal(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->mutex);
+    }
+
+    pthread_mutex_lock(&pipeline->mutex);
+    if (pipeline->outstanding > 0) {
+        printf("Connection lost with %d requests in flight\n", pipeline->outstanding);
+        pipeline->failures += pipeline->outstanding;
+        pipeline->outstanding = 0;
+    }
+    pipeline->broken = 1;
+    pthread_cond_signal(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->mutex);
+    return NULL;
+}
+
+/**
+ * @brief Uploads a local file over an open connection.
+ * 
+ *        With resume set, the client first asks the server how many bytes of an interrupted
+ *        upload of remote_path it holds (OFFSET) and only sends the rest of the file from there.
+ *        With compress set, the body is sent as compressed blocks (see codec.h) if a sample of
+ *        the file shrinks and the server supports it (see negotiate_compression()).
+ * 
+ * @param conn Reader of the connected socket
+ * @param local_path Path to the local file on client
+ * @param remote_path Destination path on the server
+ * @param resume Non-zero to continue an interrupted upload
+ * @param compress zlib level to compress the body with, or 0 to send it raw
+ * @return int 0 on success, 1 on failure, -1 if the connection was lost
+ */
+int do_write(ConnReader *conn, const char *local_path, const char *remote_path, int resume, int compress) {
+    // Open the local file for reading
+    int fd = open(local_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Failed to open local file");
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // Determine file size (64-bit, so files over 2 GB are sent whole)
+    long long file_size = st.st_size;
+
+    // Ask how much of an interrupted upload the server already holds
+    long long offset = 0;
+    if (resume) {
+        char reply[128];
+        snprintf(reply, sizeof(reply), "OFFSET %s\n", remote_path);
+        if (send_all(conn->fd, reply, strlen(reply)) < 0 || conn_read_line(conn, reply, sizeof(reply)) < 0) {
+            close(fd);
+            return -1;
+        }
+        if (sscanf(reply, "OFFSET %lld", &offset) != 1) {
+            printf("Server response: %s\n", reply);
+            close(fd);
+            return 1;
+        }
+        if (offset > file_size) {
+            offset = 0; // The remote file is not a prefix of this one, start over
+        }
+        printf("Resuming upload at byte %lld of %lld\n", offset, file_size);
+    }
+
+    // Compress only data that shrinks, and only for a server that can inflate it
+    int level = 0;
+    if (compress && codec_file_worth_compressing(fd, offset, file_size - offset)) {
+        int supported = negotiate_compression(conn);
+        if (supported < 0) {
+            close(fd);
+            return -1;
+        }
+        level = supported ? compress : 0;
+    }
+
+    // Send WRITE header to server
+    char header[1100];
+    const char *encoding = level > 0 ? " " CODEC_NAME : "";
+    if (offset > 0) {
+        snprintf(header, sizeof(header), "WRITE %s %lld %lld%s\n", remote_path, file_size - offset, offset, encoding);
+    } else {
+        snprintf(header, sizeof(header), "WRITE %s %lld%s\n", remote_path, file_size, encoding);
+    }
+    if (send_all(conn->fd, header, strlen(header)) < 0) {
+        close(fd);
         return -1;
     }
 
-    // Set up server address struct
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    // Stream file content from the page cache to the socket, never holding the whole file
+    int sent = level > 0 ? send_compressed_range(conn->fd, fd, offset, file_size - offset, level)
+                         : send_file_range(conn->fd, fd, offset, file_size - offset);
+    close(fd);
+    if (sent < 0) {
+        return read_refusal(conn);
+    }
 
-    // Connect to server
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connect failed");
-        close(sock);
+    // Wait for server response
+    char response[1024];
+    if (conn_read_line(conn, response, sizeof(response)) < 0) {
         return -1;
     }
+    printf("Server response: %s\n", response);
+    return strcmp(response, "OK") == 0 ? 0 : 1;
+}
 
-    return sock;
+/**
+ * @brief Uploads a local file as content-defined chunks, sending only the ones the server lacks.
+ * 
+ *        The file is split with the chunking the server uses (see chunk.c) and announced as
+ *        "CHUNKS <path> <total> <count>" followed by one "<sha256> <length>" line per chunk.
+ *        The server answers "NEED <k>" and the indices of the chunks it does not store, and
+ *        only those chunks are sent. A server without deduplication gets a plain WRITE instead.
+ * 
+ * @param conn Reader of the connected socket
+ * @param local_path Path to the local file on client
+ * @param remote_path Destination path on the server
+ * @return int 0 on success, 1 on failure, -1 if the connection was lost
+ */
+int do_write_dedup(ConnReader *conn, const char *local_path, const char *remote_path) {
+    int fd = open(local_path, O_RDONLY);
+    ChunkRef *chunks = NULL;
+    size_t count = 0;
+    if (fd < 0 || chunk_file(fd, &chunks, &count) != 0) {
+        perror("Failed to read local file");
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // Announce the chunk list in one send
+    long long total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += chunks[i].length;
+    }
+    char *list = malloc(1100 + count * (CHUNK_HEX_SIZE + 24));
+    if (!list) {
+        free(chunks);
+        close(fd);
+        return 1;
+    }
+    size_t len = snprintf(list, 1100, "CHUNKS %s %lld %zu\n", remote_path, total, count);
+    for (size_t i = 0; i < count; i++) {
+        char hex[CHUNK_HEX_SIZE];
+        chunk_digest_hex(chunks[i].digest, hex);
+        len += sprintf(list + len, "%s %zu\n", hex, chunks[i].length);
+    }
+    int result = send_all(conn->fd, list, len) < 0 ? -1 : 0;
+    free(list);
+
+    // Send the chunks the server asks for
+    char reply[1024];
+    size_t needed = 0;
+    long long bytes = 0;
+    if (result == 0 && conn_read_line(conn, reply, sizeof(reply)) < 0) {
+        result = -1;
+    }
+    if (result == 0 && strcmp(reply, "ERROR: Deduplication disabled") == 0) {
+        free(chunks);
+        close(fd);
+        printf("Server does not deduplicate, sending the whole file\n");
+        return do_write(conn, local_path, remote_path, 0, 0);
+    }
+    if (result == 0 && sscanf(reply, "NEED %zu", &needed) != 1) {
+        printf("Server response: %s\n", reply);
+        result = 1;
+    }
+    for (size_t i = 0; i < needed && result == 0; i++) {
+        char line[64];
+        size_t idx;
+        if (conn_read_line(conn, line, sizeof(line)) < 0 || sscanf(line, "%zu", &idx) != 1 || idx >= count) {
+            result = -1; // Out of step with the server
+            break;
+        }
+        if (send_file_range(conn->fd, fd, chunks[idx].offset, chunks[idx].length) < 0) {
+            result = -1;
+            break;
+        }
+        bytes += chunks[idx].length;
+    }
+    free(chunks);
+    close(fd);
+    if (result != 0) {
+        return result;
+    }
+
+    // Wait for server response
+    char response[1024];
+    if (conn_read_line(conn, response, sizeof(response)) < 0) {
+        return -1;
+    }
+    printf("Sent %zu of %zu chunks (%lld of %lld bytes)\n", needed, count, bytes, total);
+    printf("Server response: %s\n", response);
+    return strcmp(response, "OK") == 0 ? 0 : 1;
 }
 
+/**
+ * @brief Uploads a local file as a delta against the server's copy of it, rsync style.
+ * 
+ *        "SIGS <path>" fetches the signatures of the remote file's blocks; the local file is
+ *        scanned with a rolling checksum for blocks the server already has (see delta.c) and
+ *        sent as "DELTA <path> <total> <base_size> <block_size>" followed by block references
+ *        and the literal bytes in between. A file that is new to the server, or that changed
+ *        there while the delta was made, is sent whole with a plain WRITE instead.
+ * 
+ * @param conn Reader of the connected socket
+ * @param local_path Path to the local file on client
+ * @param remote_path Destination path on the server
+ * @return int 0 on success, 1 on failure, -1 if the connection was lost
+ */
+int do_write_delta(ConnReader *conn, const char *local_path, const char *remote_path) {
+    int fd = open(local_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Failed to read local file");
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // Fetch the signatures of the server's version
+    char line[1200];
+    long long base_size;
+    uint32_t block_size;
+    size_t count;
+    snprintf(line, sizeof(line), "SIGS %s\n", remote_path);
+    if (send_all(conn->fd, line, strlen(line)) < 0 || conn_read_line(conn, line, sizeof(line)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (strncmp(line, "ERROR", 5) == 0) {
+        close(fd);
+        printf("Server has no copy to patch (%s), sending the whole file\n", line);
+        return do_write(conn, local_path, remote_path, 0, 0);
+    }
+    if (sscanf(line, "SIGS %lld %u %zu", &base_size, &block_size, &count) != 3 || base_size < 0
+        || block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK || count != (size_t)(base_size / block_size)) {
+        close(fd);
+        return -1; // Out of step with the server
+    }
+    BlockSignature *sigs = malloc((count > 0 ? count : 1) * sizeof(BlockSignature));
+    if (!sigs) {
+        close(fd);
+        return -1; // The signature lines cannot be skipped
+    }
+    int result = 0;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        char hex[CHUNK_HEX_SIZE + 1];
+        if (conn_read_line(conn, line, sizeof(line)) < 0 || sscanf(line, "%x %65s", &sigs[i].rolling, hex) != 2
+            || chunk_parse_hex(hex, sigs[i].digest) != 0) {
+            result = -1;
+        }
+    }
+
+    // Stream the ops; the command goes out with the first of them
+    DeltaUpload upload = { .sock = conn->fd, .block_size = block_size };
+    upload.pending_len = snprintf(upload.pending, sizeof(upload.pending), "DELTA %s %lld %lld %u\n", remote_path,
+                                  (long long)st.st_size, base_size, block_size);
+    DeltaSink sink = { send_delta_copy, send_delta_literal, &upload };
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    if (result == 0 && delta_generate(fd, st.st_size, block_size, sigs, count, &sink, digest) != 0) {
+        free(sigs);
+        close(fd);
+        if (read_refusal(conn) > 0) {
+            return 1;
+        }
+        perror("Delta upload failed");
+        return -1; // The ops sent so far cannot be taken back
+    }
+    free(sigs);
+    close(fd);
+    if (result == 0) {
+        char hex[CHUNK_HEX_SIZE];
+        chunk_digest_hex(digest, hex);
+        upload.pending_len += snprintf(upload.pending + upload.pending_len, sizeof(upload.pending) - upload.pending_len,
+                                       "END %s\n", hex);
+        result = send_all(conn->fd, upload.pending, upload.pending_len) < 0 ? -1 : 0;
+    }
+    if (result != 0) {
+        return result;
+    }
+
+    // Wait for server response
+    char response[1024];
+    if (conn_read_line(conn, response, sizeof(response)) < 0) {
+        return -1;
+    }
+    if (strcmp(response, "ERROR: Base file changed") == 0) {
+        printf("Server's copy changed meanwhile, sending the whole file\n");
+        return do_write(conn, local_path, remote_path, 0, 0);
+    }
+    printf("Sent %lld literal bytes, %lld of %lld bytes matched the server's copy\n", upload.literal, upload.matched,
+           (long long)st.st_size);
+    printf("Server response: %s\n", response);
+    return strcmp(response, "OK") == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Queues a copy op of a delta upload; the queue is sent when it fills up or with
+ *        the next literal bytes.
+ * 
+ * @param ctx The DeltaUpload
+ * @param first First base block to copy
+ * @param count Number of consecutive blocks
+ * @return int 0 on success, -1 if the connection failed
+ */
+static int send_delta_copy(void *ctx, size_t first, size_t count) {
+    DeltaUpload *upload = ctx;
+    if (upload->pending_len > sizeof(upload->pending) - 200) {
+        if (send_all(upload->sock, upload->pending, upload->pending_len) < 0) return -1;
+        upload->pending_len = 0;
+    }
+    upload->pending_len += sprintf(upload->pending + upload->pending_len, "C %zu %zu\n", first, count);
+    upload->matched += (long long)count * upload->block_size;
+    return 0;
+}
+
+/**
+ * @brief Sends a literal op of a delta upload, after the queued ops, in one system call.
+ * 
+ * @param ctx The DeltaUpload
+ * @param data Literal bytes
+ * @param len Their number (at most DELTA_LITERAL_MAX)
+ * @return int 0 on success, -1 if the connection failed
+ */
+static int send_delta_literal(void *ctx, const unsigned char *data, size_t len) {
+    DeltaUpload *upload = ctx;
+    upload->pending_len += sprintf(upload->pending + upload->pending_len, "L %zu\n", len);
+    struct iovec iov[2] = {
+        { .iov_base = upload->pending, .iov_len = upload->pending_len },
+        { .iov_base = (void *)data, .iov_len = len },
+    };
+    upload->pending_len = 0;
+    upload->literal += len;
+    return send_iov(upload->sock, iov, 2);
+}
+
+/**
+ * @brief Downloads a file over an open connection and saves it locally.
+ *         If the file does not exist locally, create a path and file in local.
+ *         If the file already exists locally, replace the existing file with downloaded file.
+ *         With a range, only bytes [offset, offset + length) of the remote file are fetched
+ *         and saved as the local file. With resume set, the local file is kept and only the
+ *         remote bytes behind its current length are fetched and appended.
+ * 
+ * @param conn Reader of the connected socket
+ * @param remote_path Path to the file on the server
+ * @param local_path Path to store the file locally
+ * @param offset First byte of the range to download (ignored when resuming)
+ * @param length Number of bytes to download, or -1 for the rest of the file
+ * @param resume Non-zero to continue an interrupted download
+ * @param compress zlib level the server may compress the body with, or 0 to receive it raw
+ * @return int 0 on success, 1 on failure, -1 if the connection was lost
+ */
+int do_get(ConnReader *conn, const char *remote_path, const char *local_path, long long offset, long long length,
+           int resume, int compress) {
+    // Continue behind the bytes downloaded so far
+    struct stat st;
+    if (resume) {
+        offset = stat(local_path, &st) == 0 ? st.st_size : 0;
+        length = -1;
+    }
+
+    // Offer compression to a server that supports it
+    char encoding[32] = "";
+    if (compress) {
+        int supported = negotiate_compression(conn);
+        if (supported < 0) {
+            return -1;
+        }
+        if (supported) {
+            snprintf(encoding, sizeof(encoding), " %s:%d", CODEC_NAME, compress);
+        }
+    }
+
+    // Send GET request (the plain form when the whole file is wanted)
+    char request[1100];
+    if (length >= 0) {
+        snprintf(request, sizeof(request), "GET %s %lld %lld%s\n", remote_path, offset, length, encoding);
+    } else if (offset > 0) {
+        snprintf(request, sizeof(request), "GET %s %lld%s\n", remote_path, offset, encoding);
+    } else {
+        snprintf(request, sizeof(request), "GET %s%s\n", remote_path, encoding);
+    }
+    if (send_all(conn->fd, request, strlen(request)) < 0) {
+        return -1;
+    }
+
+    // Receive SIZE header from server
+    char header[128];
+    if (conn_read_line(conn, header, sizeof(header)) < 0) {
+        return -1;
+    }
+
+    // Check for error or size info
+    if (strncmp(header, "SIZE", 4) != 0) {
+        printf("Server response: %s\n", header);
+        return 1;
+    }
+
+    long long file_size;
+    char body_encoding[16] = "";
+    if (sscanf(header, "SIZE %lld %15s", &file_size, body_encoding) < 1 || file_size < 0) {
+        printf("Server response: %s\n", header);
+        return -1;
+    }
+    int compressed = strcmp(body_encoding, CODEC_NAME) == 0;
+
+    // Create directories if needed
+    make_parent_dirs(local_path);
+
+    // Open local file for writing (the body is still drained on failure to keep the session in sync)
+    int fd = open(local_path, resume ? O_WRONLY | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror("Failed to open local file");
+        return (compressed ? recv_compressed_range(conn, -1, 0, file_size) : conn_discard(conn, file_size)) == 0 ? 1
+                                                                                                                  : -1;
+    }
+
+    // Receive file data straight into the file, in bounded chunks
+    long long local_offset = resume ? offset : 0;
+    int result = compressed ? recv_compressed_range(conn, fd, local_offset, file_size)
+                            : recv_file_range(conn, fd, local_offset, file_size);
+    close(fd);
+    if (result != 0) {
+        return result;
+    }
+    printf("Downloaded file to %s (%lld bytes at %lld%s)\n", local_path, file_size, local_offset,
+           compressed ? ", deflate" : "");
+    return 0;
+}
+
+/**
+ * @brief Removes a remote file or directory over an open connection.
+ * 
+ * @param conn Reader of the connected socket
+ * @param remote_path Path of the file to remove on the server
+ * @param recursive Non-zero to remove a directory with everything in it ("RM -r")
+ * @return int 0 on success, 1 on failure, -1 if the connection was lost
+ */
+int do_rm(ConnReader *conn, const char *remote_path, int recursive) {
+    // Send RM request
+    char request[1100];
+    snprintf(request, sizeof(request), recursive ? "RM -r %s\n" : "RM %s\n", remote_path);
+    if (send_all(conn->fd, request, strlen(request)) < 0) {
+        return -1;
+    }
+
+    // Receive and print response
+    char response[1024];
+    if (conn_read_line(conn, response, sizeof(response)) < 0) {
+        return -1;
+    }
+    printf("Server response: %s\n", response);
+    return strcmp(response, "OK") == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Fetches the server's counters over an open connection and prints them, one
+ *        "<name> <value>" line each.
+ * 
+ * @param conn Reader of the connected socket
+ * @return int 0 on success, 1 on failure, -1 if the connection was lost
+ */
+int do_stats(ConnReader *conn) {
+    char line[1024];
+    size_t lines;
+    if (send_all(conn->fd, "STATS\n", 6) < 0 || conn_read_line(conn, line, sizeof(line)) < 0) {
+        return -1;
+    }
+    if (sscanf(line, "STATS %zu", &lines) != 1) {
+        printf("Server response: %s\n", line);
+        return 1;
+    }
+    for (size_t i = 0; i < lines; i++) {
+        if (conn_read_line(conn, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        printf("%s\n", line);
+    }
+    return 0;
+}
+
+/**
+ * @brief Uploads a local directory tree over an open connection.
+ * 
+ *        The tree is listed, announced with "PUTDIR <remote-dir>" and streamed as one
+ *        sequence of entries (see tree.h), with no round trip per file. Reader threads open
+ *        and read the files ahead of the socket (see tree_send()). The server answers once,
+ *        after the whole tree.
+ * 
+ * @param conn Reader of the connected socket
+ * @param local_dir Directory to upload
+ * @param remote_dir Destination directory on the server
+ * @return int 0 on success, 1 on failure, -1 if the connection was lost
+ */
+int do_putdir(ConnReader *conn, const char *local_dir, const char *remote_dir) {
+    TreeEntry *entries;
+    size_t count;
+    if (tree_list(local_dir, NULL, &entries, &count) != 0) {
+        printf("Not a local directory: %s\n", local_dir);
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char request[1100];
+    snprintf(request, sizeof(request), "PUTDIR %s\n", remote_dir);
+    long long files = 0, bytes = 0;
+    TreeSource source = { .open = open_local_tree_file, .send_body = NULL, .ctx = (void *)local_dir };
+    int result = send_all(conn->fd, request, strlen(request)) == 0
+                 && tree_send(conn->fd, entries, count, &source, &files, &bytes) == 0 ? 0 : -1;
+    tree_free(entries, count);
+    if (result < 0) {
+        return -1;
+    }
+
+    char response[1024];
+    if (conn_read_line(conn, response, sizeof(response)) < 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Server response: %s\n", response);
+    printf("Uploaded tree %s to %s (%lld files, %lld bytes in %.3f s)\n", local_dir, remote_dir, files, bytes,
+           seconds);
+    return strncmp(response, "OK", 2) == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Downloads a remote directory tree over an open connection.
+ * 
+ *        Sends "GETDIR <remote-dir>"; the server answers "TREE" and streams the entries (see
+ *        tree.h). Directories are created as they arrive and every file is received straight
+ *        into its local file. Entries with an unsafe path, and files that cannot be written,
+ *        are skipped and make the command fail once the stream has ended.
+ * 
+ * @param conn Reader of the connected socket
+ * @param remote_dir Directory on the server
+ * @param local_dir Local directory to store the tree in
+ * @return int 0 on success, 1 on failure, -1 if the connection was lost
+ */
+int do_getdir(ConnReader *conn, const char *remote_dir, const char *local_dir) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char line[2048];
+    snprintf(line, sizeof(line), "GETDIR %s\n", remote_dir);
+    if (send_all(conn->fd, line, strlen(line)) < 0 || conn_read_line(conn, line, sizeof(line)) < 0) {
+        return -1;
+    }
+    if (strcmp(line, "TREE") != 0) {
+        printf("Server response: %s\n", line);
+        return 1;
+    }
+    tree_make_dirs(local_dir);
+
+    long long files = 0, bytes = 0;
+    int failed = 0;
+    while (1) {
+        if (conn_read_line(conn, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        int is_dir;
+        long long size;
+        char path[1024], local_path[2100];
+        int kind = tree_parse_entry(line, &is_dir, &size, path, sizeof(path));
+        if (kind == 1) {
+            break;
+        }
+        if (kind < 0) {
+            printf("Invalid tree entry: %s\n", line);
+            return -1; // The stream cannot be followed any further
+        }
+        int valid = tree_path_ok(path);
+        snprintf(local_path, sizeof(local_path), "%s/%s", local_dir, path);
+        if (is_dir) {
+            if (valid) tree_make_dirs(local_path);
+            else failed++;
+            continue;
+        }
+
+        int fd = valid ? open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+        int result;
+        if (fd < 0) {
+            printf("Skipped %s: unable to write file\n", path);
+            result = conn_discard(conn, size) == 0 ? 1 : -1;
+        } else {
+            result = recv_file_range(conn, fd, 0, size);
+            close(fd);
+        }
+        if (result < 0) {
+            return -1;
+        }
+        if (result == 0) {
+            files++;
+            bytes += size;
+        } else {
+            failed++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Downloaded tree %s to %s (%lld files, %lld bytes in %.3f s, %d failed)\n", remote_dir, local_dir, files,
+           bytes, seconds, failed);
+    return failed > 0;
+}
+
+/**
+ * @brief Opens a file of a local tree being uploaded by PUTDIR (see TreeSource).
+ */
+static int open_local_tree_file(void *ctx, const char *path, int *fd, long long *size) {
+    char full_path[2100];
+    snprintf(full_path, sizeof(full_path), "%s/%s", (const char *)ctx, path);
+    struct stat st;
+    *fd = open(full_path, O_RDONLY);
+    if (*fd < 0 || fstat(*fd, &st) != 0) {
+        if (*fd >= 0) close(*fd);
+        return -1;
+    }
+    *size = st.st_size;
+    return 0;
+}
+
+/**
+ * @brief Uploads one part of a multi-stream WRITE over a connection of its own.
+ * 
+ * @param arg The TransferPart to send; its result is set to 0 on success.
+ * @return void* Always NULL.
+ */
+static void *write_part_thread(void *arg) {
+    TransferPart *part = (TransferPart *)arg;
+    part->result = 1;
+    int sock = connect_to_server();
+    if (sock < 0) {
+        return NULL;
+    }
+    ConnReader conn;
+    conn_reader_init(&conn, sock);
+
+    char header[1200];
+    snprintf(header, sizeof(header), "WRITEPART %s %lld %lld %lld %s\n", part->remote_path, part->total,
+             part->offset, part->length, part->token);
+    char response[1024];
+    if (send_all(sock, header, strlen(header)) == 0
+        && send_file_range(sock, part->fd, part->offset, part->length) == 0
+        && conn_read_line(&conn, response, sizeof(response)) >= 0) {
+        if (strcmp(response, "OK") == 0) {
+            part->result = 0;
+        } else {
+            printf("Server response (bytes %lld+%lld): %s\n", part->offset, part->length, response);
+        }
+    }
+    free(conn.buf);
+    close(sock);
+    return NULL;
+}
+
+/**
+ * @brief Downloads one part of a multi-stream GET over a connection of its own,
+ *        writing it into the shared local file at the part's offset.
+ * 
+ * @param arg The TransferPart to receive; its result is set to 0 on success.
+ * @return void* Always NULL.
+ */
+static void *get_part_thread(void *arg) {
+    TransferPart *part = (TransferPart *)arg;
+    part->result = 1;
+    int sock = connect_for_read();
+    if (sock < 0) {
+        return NULL;
+    }
+    ConnReader conn;
+    conn_reader_init(&conn, sock);
+
+    char request[1200];
+    snprintf(request, sizeof(request), "GET %s %lld %lld\n", part->remote_path, part->offset, part->length);
+    char header[128];
+    long long size;
+    if (send_all(sock, request, strlen(request)) == 0 && conn_read_line(&conn, header, sizeof(header)) >= 0) {
+        if (sscanf(header, "SIZE %lld", &size) != 1 || size != part->length) {
+            printf("Server response (bytes %lld+%lld): %s\n", part->offset, part->length, header);
+        } else if (recv_file_range(&conn, part->fd, part->offset, part->length) == 0) {
+            part->result = 0;
+        }
+    }
+    free(conn.buf);
+    close(sock);
+    return NULL;
+}
+
+/**
+ * @brief Splits a file into one contiguous range per stream and moves all ranges in parallel.
+ * 
+ * @param part Template filled in with everything but the range
+ * @param streams Number of parallel connections
+ * @param worker write_part_thread() or get_part_thread()
+ * @return int 0 if every range was moved, 1 otherwise.
+ */
+static int run_parts(const TransferPart *part, int streams, void *(*worker)(void *)) {
+    TransferPart parts[MAX_STREAMS];
+    pthread_t tids[MAX_STREAMS];
+    long long chunk = (part->total + streams - 1) / streams;
+    int count = 0;
+    for (long long offset = 0; offset < part->total; offset += chunk) {
+        parts[count] = *part;
+        parts[count].offset = offset;
+        parts[count].length = part->total - offset < chunk ? part->total - offset : chunk;
+        if (pthread_create(&tids[count], NULL, worker, &parts[count]) != 0) {
+            perror("Failed to create thread");
+            parts[count].result = 1;
+            break;
+        }
+        count++;
+    }
+    int failed = count * chunk < part->total;
+    for (int i = 0; i < count; i++) {
+        pthread_join(tids[i], NULL);
+        failed |= parts[i].result != 0;
+    }
+    return failed;
+}
+
+/**
+ * @brief Makes the token of a multi-stream upload from 12 bytes of /dev/urandom, so
+ *        another client cannot guess it and write into the upload. Falls back to the
+ *        time, process ID and clock if /dev/urandom cannot be read.
+ * 
+ * @param token Buffer receiving the token as hex digits.
+ * @param size  Size of the buffer (at least 25 bytes).
+ */
+static void make_upload_token(char *token, size_t size) {
+    unsigned char random[12];
+    int fd = open("/dev/urandom", O_RDONLY);
+    ssize_t got = fd >= 0 ? read(fd, random, sizeof(random)) : -1;
+    if (fd >= 0) close(fd);
+    if (got != (ssize_t)sizeof(random)) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        snprintf(token, size, "%lx%x%lx", (unsigned long)now.tv_sec, (unsigned)getpid(), (unsigned long)now.tv_nsec);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(random) && 2 * i + 2 < size; i++) {
+        snprintf(token + 2 * i, 3, "%02x", random[i]);
+    }
+}
+
+/**
+ * @brief Uploads a file over several connections at once.
+ * 
+ *        The file is split into one byte range per stream, each sent as a WRITEPART with
+ *        a shared random token. The server writes the ranges into a preallocated temp file
+ *        and renames it over remote_path once all of them have arrived, so the remote file
+ *        is only replaced when the upload is complete. Empty files go over a single stream.
+ * 
+ * @param local_path Path to the local file on client
+ * @param remote_path Destination path on the server
+ * @param streams Number of parallel connections
+ * @return int 0 on success, 1 on failure
+ */
+int parallel_write(const char *local_path, const char *remote_path, int streams) {
+    int fd = open(local_path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Failed to open local file");
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return send_write_command(local_path, remote_path, &(TransferOptions){ .length = -1, .streams = 1 });
+    }
+
+    char token[32];
+    make_upload_token(token, sizeof(token));
+    TransferPart part = { .remote_path = remote_path, .fd = fd, .total = st.st_size, .token = token };
+    int failed = run_parts(&part, streams, write_part_thread);
+    close(fd);
+
+    if (failed) {
+        printf("Upload of %s failed\n", local_path);
+        return 1;
+    }
+    printf("Server response: OK (%lld bytes over %d streams)\n", (long long)st.st_size, streams);
+    return 0;
+}
+
+/**
+ * @brief Downloads a file over several connections at once.
+ * 
+ *        The remote size is asked for first (STAT). The local file is preallocated to that
+ *        size, and each stream fetches one byte range with a range GET and writes it at its
+ *        own offset. Empty remote files are fetched over a single stream.
+ * 
+ * @param remote_path Path to the file on the server
+ * @param local_path Path to store the file locally
+ * @param streams Number of parallel connections
+ * @return int 0 on success, 1 on failure
+ */
+int parallel_get(const char *remote_path, const char *local_path, int streams) {
+    // Ask for the size of the remote file
+    int sock = connect_for_read();
+    if (sock < 0) {
+        return 1;
+    }
+    ConnReader conn;
+    conn_reader_init(&conn, sock);
+    char reply[1200];
+    long long total = -1;
+    snprintf(reply, sizeof(reply), "STAT %s\n", remote_path);
+    if (send_all(sock, reply, strlen(reply)) == 0 && conn_read_line(&conn, reply, sizeof(reply)) >= 0
+        && sscanf(reply, "SIZE %lld", &total) != 1) {
+        printf("Server response: %s\n", reply);
+    }
+    free(conn.buf);
+    close(sock);
+    if (total < 0) {
+        return 1;
+    }
+    if (total == 0) {
+        return send_get_command(remote_path, local_path, &(TransferOptions){ .length = -1, .streams = 1 });
+    }
+
+    // Preallocate the local file, so every stream can write its range in place
+    make_parent_dirs(local_path);
+    int fd = open(local_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, total) != 0) {
+        perror("Failed to open local file");
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+#ifdef __linux__
+    posix_fallocate(fd, 0, total);
+#endif
+
+    TransferPart part = { .remote_path = remote_path, .fd = fd, .total = total };
+    int failed = run_parts(&part, streams, get_part_thread);
+    close(fd);
+
+    if (failed) {
+        printf("Download of %s failed\n", remote_path);
+        return 1;
+    }
+    printf("Downloaded file to %s (%lld bytes over %d streams)\n", local_path, total, streams);
+    return 0;
+}
+
+/**
+ * @brief Parses a server address: "<ip>:<port>", or just a port on SERVER_IP.
+ * 
+ * @param text Address to parse
+ * @param addr Receives the address
+ * @return int 0 on success, -1 if the address is invalid.
+ */
+static int parse_server_address(const char *text, struct sockaddr_in *addr) {
+    char ip[INET_ADDRSTRLEN] = SERVER_IP;
+    const char *colon = strrchr(text, ':');
+    const char *port_text = colon ? colon + 1 : text;
+    if (colon) {
+        size_t len = (size_t)(colon - text);
+        if (len == 0 || len >= sizeof(ip)) {
+            return -1;
+        }
+        memcpy(ip, text, len);
+        ip[len] = '\0';
+    }
+    char *end;
+    long port = strtol(port_text, &end, 10);
+    if (*port_text == '\0' || *end != '\0' || port < 1 || port > 65535) {
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)port);
+    return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+/**
+ * @brief Opens a TCP connection to one server.
+ * 
+ * @param addr  Address of the server
+ * @param quiet Non-zero to leave a failed connect unreported (another server is tried next)
+ * @return int Socket file descriptor on success, -1 on failure.
+ */
+static int connect_to_address(const struct sockaddr_in *addr, int quiet) {
+    // Create TCP socket
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Commands are small writes in lockstep with responses, so do not let Nagle delay them
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // Connect to server
+    if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+        if (!quiet) perror("Connect failed");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * @brief Reads the reply of a server that stopped taking a request body, e.g. a read-only
+ *        replica refusing an upload, so its reason is shown rather than a broken pipe.
+ * 
+ * @param conn Connection the body could not be sent on
+ * @return int 1 if a reply was read (the request failed), -1 if the connection is gone.
+ */
+static int read_refusal(ConnReader *conn) {
+    char response[1024];
+    if (conn_read_line(conn, response, sizeof(response)) < 0) {
+        return -1;
+    }
+    printf("Server response: %s\n", response);
+    return 1;
+}
+
+/**
+ * @brief Establishes a TCP connection to the server.
+ * 
+ * This function connects to the primary server: RFS_SERVER ("<ip>:<port>", or a
+ * port) if it is set, SERVER_IP and PORT otherwise. If the connection is
+ * successful, it returns the socket file descriptor. Otherwise, it prints an error 
+ * message and returns -1.
+ * 
+ * @return int Socket file descriptor on success, -1 on failure.
+ */
+static int connect_to_server() {
+    struct sockaddr_in server_addr;
+    const char *server = getenv("RFS_SERVER");
+    if (server && *server) {
+        if (parse_server_address(server, &server_addr) != 0) {
+            fprintf(stderr, "Invalid RFS_SERVER: %s\n", server);
+            return -1;
+        }
+    } else {
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(PORT);
+        server_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    }
+    return connect_to_address(&server_addr, 0);
+}
+
+/**
+ * @brief Establishes a TCP connection for a read (GET, GETDIR).
+ * 
+ *        With RFS_REPLICAS set to a comma-separated list of replica addresses, one replica
+ *        is picked at random, so reads spread across them; if it cannot be reached the
+ *        others are tried, then the primary. The pick is kept for the rest of the process,
+ *        so all connections of a multi-stream GET read the same copy of the file.
+ * 
+ * @return int Socket file descriptor on success, -1 on failure.
+ */
+static int connect_for_read() {
+    static pthread_mutex_t pick_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static int picked;                  // 1 once a replica was picked, -1 if none could be
+    static struct sockaddr_in replica_addr;
+
+    pthread_mutex_lock(&pick_mutex);
+    if (picked == 0) {
+        picked = -1;
+        const char *list = getenv("RFS_REPLICAS");
+        struct sockaddr_in replicas[16];
+        int count = 0;
+        char copy[1024];
+        snprintf(copy, sizeof(copy), "%s", list ? list : "");
+        char *save;
+        for (char *item = strtok_r(copy, ",", &save); item && count < 16; item = strtok_r(NULL, ",", &save)) {
+            if (parse_server_address(item, &replicas[count]) == 0) {
+                count++;
+            } else {
+                fprintf(stderr, "Invalid replica address in RFS_REPLICAS: %s\n", item);
+            }
+        }
+        unsigned int seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+        int first = count > 0 ? rand_r(&seed) % count : 0;
+        for (int i = 0; i < count; i++) {
+            int sock = connect_to_address(&replicas[(first + i) % count], 1);
+            if (sock >= 0) {
+                replica_addr = replicas[(first + i) % count];
+                picked = 1;
+                pthread_mutex_unlock(&pick_mutex);
+                return sock;
+            }
+        }
+    }
+    int use_replica = picked == 1;
+    pthread_mutex_unlock(&pick_mutex);
+
+    if (use_replica) {
+        int sock = connect_to_address(&replica_addr, 1);
+        if (sock >= 0) {
+            return sock;
+        }
+    }
+    return connect_to_server();
+}
+
+/**
+ * @brief Creates the local directories leading up to a file, if needed.
+ * 
+ * @param local_path Path of the local file
+ */
+static void make_parent_dirs(const char *local_path) {
+    char path_copy[1024];
+    strncpy(path_copy, local_path, sizeof(path_copy) - 1);
+    path_copy[sizeof(path_copy) - 1] = '\0';
+    char *p = strrchr(path_copy, '/');
+    if (p) {
+        *p = '\0';
+        char mkdir_cmd[1050];
+        snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", path_copy);
+        system(mkdir_cmd);
+    }
+}
+
+/**
+ * @brief Asks the server whether it accepts and sends compressed bodies.
+ * 
+ *        Sends "HELLO deflate"; a server that supports it repeats the word. Older servers
+ *        answer "ERROR: Unknown command", which counts as no.
+ * 
+ * @param conn Reader of the connected socket
+ * @return int 1 if the server supports compression, 0 if not, -1 if the connection was lost.
+ */
+static int negotiate_compression(ConnReader *conn) {
+    char reply[256];
+    if (send_all(conn->fd, "HELLO " CODEC_NAME "\n", strlen("HELLO " CODEC_NAME "\n")) < 0
+        || conn_read_line(conn, reply, sizeof(reply)) < 0) {
+        return -1;
+    }
+    return strncmp(reply, "HELLO", 5) == 0 && strstr(reply, " " CODEC_NAME) != NULL;
+}
+
+/**
+ * @brief Parses the options behind "WRITE <local> <remote>" or "GET <remote> <local>".
+ * 
+ *        Accepts nothing (the whole file), "--resume", "--compress <level>", (GET only)
+ *        "<offset> <length>" for a byte range, or on their own "--streams <n>" and (WRITE
+ *        only) "--dedup" or "--delta". A range cannot be resumed.
+ * 
+ * @param argc Number of options
+ * @param argv The options
+ * @param options Receives the options; offset 0, length -1 (the rest of the file), one
+ *                stream and nothing else by default
+ * @return int 0 on success, -1 on invalid options.
+ */
+static int parse_transfer_options(int argc, char *argv[], TransferOptions *options) {
+    *options = (TransferOptions){ .length = -1, .streams = 1 };
+    int numbers = 0;
+    for (int i = 0; i < argc; i++) {
+        char *end;
+        if (strcmp(argv[i], "--resume") == 0) {
+            options->resume = 1;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            options->dedup = 1;
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            options->delta = 1;
+        } else if (strcmp(argv[i], "--streams") == 0 && i + 1 < argc) {
+            options->streams = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || options->streams < 1 || options->streams > MAX_STREAMS) return -1;
+        } else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+            options->compress = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || options->compress < 1 || options->compress > CODEC_MAX_LEVEL) return -1;
+        } else if (numbers < 2) {
+            long long value = strtoll(argv[i], &end, 10);
+            if (*end != '\0' || value < 0) return -1;
+            *(numbers++ == 0 ? &options->offset : &options->length) = value;
+        } else {
+            return -1;
+        }
+    }
+    if (numbers == 1 || (numbers == 2 && options->resume)) {
+        return -1;
+    }
+    // Multi-stream, deduplicated and delta uploads have their own wire formats, without the other options
+    int others = options->resume || options->compress || numbers > 0;
+    int modes = (options->streams > 1) + options->dedup + options->delta;
+    if (modes > 1 || (modes == 1 && others)) {
+        return -1;
+    }
+    return 0;
+}
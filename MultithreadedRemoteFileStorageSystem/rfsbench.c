@@ -0,0 +1,555 @@
+/*
+ * rfsbench.c -- Load generator and benchmark for the RFS server
+ *
+ * Drives a mix of WRITE, GET and RM requests over N persistent connections
+ * to a server on localhost and reports throughput and latency percentiles
+ * per operation, so server changes can be compared run against run.
+ *
+ * The requests work on a fixed set of files (bench/<n>.bin), all written once
+ * before the measurement starts. WRITE replaces a random file with a new size
+ * drawn from the size distribution, GET reads a random file, RM removes one;
+ * a GET or RM of a removed file is answered with an error and counted as a
+ * miss, not as a failure. Bodies come from a buffer in memory and downloads
+ * are discarded, so the client's disk is never in the way.
+ *
+ * Closed loop (default): every connection sends its next request as soon as
+ * the previous one is answered, so the offered load follows the server.
+ * Open loop (--rate): requests are scheduled at a fixed total arrival rate,
+ * spread evenly over the connections. Latency is measured from the scheduled
+ * time, so requests that queue behind a slow one count their wait as well.
+ *
+ * Usage: ./rfsbench [--connections <n>] [--duration <seconds> | --requests <n>] [--rate <per-second>]
+ *                   [--mix <write>:<get>:<rm>] [--size fixed:<n> | uniform:<min>:<max> | exp:<mean>]
+ *                   [--files <n>] [--port <port>]
+ *        Sizes take a K, M or G suffix.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include "netio.h"
+
+#define SERVER_IP "127.0.0.1"
+#define DEFAULT_PORT 2000
+#define MAX_CONNECTIONS 1024
+#define MAX_BODY (1LL << 30)        // Largest body a size distribution may produce
+#define EXP_CAP 8                   // Exponential sizes are cut off at this many times the mean
+
+// Request types of the mix
+typedef enum {
+    OP_WRITE,
+    OP_GET,
+    OP_RM,
+    OP_COUNT,
+} BenchOp;
+
+static const char *op_names[OP_COUNT] = { "WRITE", "GET", "RM" };
+
+// Distribution of the sizes of written files
+typedef struct {
+    enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP } kind;
+    long long a;                // Size (fixed), minimum (uniform) or mean (exp)
+    long long b;                // Maximum (uniform)
+} SizeDist;
+
+// Settings of a run
+typedef struct {
+    int connections;
+    double duration;            // Seconds to run (unless requests is set)
+    long long requests;         // Requests to send in total, or 0 to run for duration
+    double rate;                // Total requests per second (open loop), or 0 for a closed loop
+    int mix[OP_COUNT];          // Relative weights of the request types
+    SizeDist size;
+    int files;                  // Number of files the requests pick from
+    int port;
+} BenchConfig;
+
+// Latencies of one request type, in nanoseconds
+typedef struct {
+    long long *samples;
+    size_t count;
+    size_t capacity;
+} LatencyLog;
+
+// One connection of the run and what it measured
+typedef struct {
+    int id;
+    pthread_t tid;
+    uint64_t rng;                   // xorshift64 state
+    LatencyLog latency[OP_COUNT];   // Completed requests (answered, hit or miss)
+    long long misses[OP_COUNT];     // Requests answered with an error
+    long long bytes[OP_COUNT];      // Body bytes moved
+    long long failures;             // Requests lost with their connection
+} BenchWorker;
+
+BenchConfig config = {
+    .connections = 8, .duration = 10, .mix = { 20, 75, 5 },
+    .size = { SIZE_FIXED, 64 * 1024, 0 }, .files = 1000, .port = DEFAULT_PORT,
+};
+char *payload = NULL;               // Body bytes of every WRITE
+long long start_ns = 0;             // When the measurement started
+long long requests_issued = 0;      // Requests claimed so far (with --requests)
+pthread_barrier_t warmup_barrier;   // Holds the workers until every file exists
+
+// Function declarations
+static int parse_options(int argc, char *argv[]);
+static int parse_size(const char *text, long long *size);
+static long long max_size(const SizeDist *size);
+static void *bench_worker(void *arg);
+static int run_request(BenchWorker *worker, ConnReader *conn, BenchOp op, int file, long long *bytes);
+static int connect_to_server(void);
+static uint64_t next_random(BenchWorker *worker);
+static long long draw_size(BenchWorker *worker);
+static BenchOp draw_op(BenchWorker *worker);
+static long long now_ns(void);
+static void record_latency(LatencyLog *log, long long ns);
+static int compare_latencies(const void *a, const void *b);
+static double percentile_ms(const LatencyLog *log, double p);
+static void print_report(BenchWorker *workers, double elapsed);
+
+
+/**
+ * @brief Entry point of the benchmark. Parses the settings, starts one thread per
+ *        connection, waits for the run to end and prints the report.
+ *
+ * @param argc Number of command-line arguments
+ * @param argv Command-line arguments (see the usage at the top of the file)
+ * @return int 0 if every request got an answer, 1 otherwise
+ */
+int main(int argc, char *argv[]) {
+    if (parse_options(argc, argv) != 0) {
+        printf("Usage: %s [--connections <n>] [--duration <seconds> | --requests <n>] [--rate <per-second>]\n"
+               "       [--mix <write>:<get>:<rm>] [--size fixed:<n> | uniform:<min>:<max> | exp:<mean>]\n"
+               "       [--files <n>] [--port <port>]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // A connection closed by the server counts as a failure, not a crash
+
+    long long body = max_size(&config.size);
+    payload = malloc(body > 0 ? body : 1);
+    BenchWorker *workers = calloc(config.connections, sizeof(BenchWorker));
+    if (!payload || !workers) {
+        perror("Out of memory");
+        return 1;
+    }
+    for (long long i = 0; i < body; i++) {
+        payload[i] = (char)(i * 2654435761u >> 24); // Not all zeros, so nothing on the way shortcuts it
+    }
+
+    printf("Writing %d files, then running %d connections %s (mix %d:%d:%d WRITE:GET:RM)\n", config.files,
+           config.connections, config.rate > 0 ? "open loop" : "closed loop", config.mix[OP_WRITE],
+           config.mix[OP_GET], config.mix[OP_RM]);
+    pthread_barrier_init(&warmup_barrier, NULL, config.connections);
+    for (int i = 0; i < config.connections; i++) {
+        workers[i].id = i;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if (pthread_create(&workers[i].tid, NULL, bench_worker, &workers[i]) != 0) {
+            perror("Failed to create worker thread");
+            return 1;
+        }
+    }
+    for (int i = 0; i < config.connections; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+
+    print_report(workers, elapsed);
+    long long failures = 0;
+    for (int i = 0; i < config.connections; i++) {
+        failures += workers[i].failures;
+        for (int op = 0; op < OP_COUNT; op++) {
+            free(workers[i].latency[op].samples);
+        }
+    }
+    free(workers);
+    free(payload);
+    return failures > 0;
+}
+
+/**
+ * @brief Parses the command line into config.
+ *
+ * @return int 0 on success, -1 on invalid options.
+ */
+static int parse_options(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            return -1;
+        }
+        char *end = NULL;
+        if (strcmp(argv[i], "--connections") == 0) {
+            config.connections = (int)strtol(value, &end, 10);
+            if (config.connections < 1 || config.connections > MAX_CONNECTIONS) return -1;
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            config.duration = strtod(value, &end);
+            if (config.duration <= 0) return -1;
+        } else if (strcmp(argv[i], "--requests") == 0) {
+            config.requests = strtoll(value, &end, 10);
+            if (config.requests < 1) return -1;
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            config.rate = strtod(value, &end);
+            if (config.rate <= 0) return -1;
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            int n = 0;
+            if (sscanf(value, "%d:%d:%d%n", &config.mix[OP_WRITE], &config.mix[OP_GET], &config.mix[OP_RM], &n) != 3
+                || value[n] != '\0' || config.mix[OP_WRITE] < 0 || config.mix[OP_GET] < 0 || config.mix[OP_RM] < 0
+                || config.mix[OP_WRITE] + config.mix[OP_GET] + config.mix[OP_RM] == 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--size") == 0) {
+            char kind[16], first[32], second[32];
+            int fields = sscanf(value, "%15[^:]:%31[^:]:%31s", kind, first, second);
+            if (fields == 2 && strcmp(kind, "fixed") == 0 && parse_size(first, &config.size.a) == 0) {
+                config.size.kind = SIZE_FIXED;
+            } else if (fields == 3 && strcmp(kind, "uniform") == 0 && parse_size(first, &config.size.a) == 0
+                       && parse_size(second, &config.size.b) == 0 && config.size.a <= config.size.b) {
+                config.size.kind = SIZE_UNIFORM;
+            } else if (fields == 2 && strcmp(kind, "exp") == 0 && parse_size(first, &config.size.a) == 0
+                       && config.size.a > 0) {
+                config.size.kind = SIZE_EXP;
+            } else {
+                return -1;
+            }
+            if (max_size(&config.size) > MAX_BODY) return -1;
+        } else if (strcmp(argv[i], "--files") == 0) {
+            config.files = (int)strtol(value, &end, 10);
+            if (config.files < 1) return -1;
+        } else if (strcmp(argv[i], "--port") == 0) {
+            config.port = (int)strtol(value, &end, 10);
+            if (config.port < 1 || config.port > 65535) return -1;
+        } else {
+            return -1;
+        }
+        if (end && *end != '\0') {
+            return -1;
+        }
+        i++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a byte count with an optional K, M or G suffix (powers of 1024).
+ *
+ * @return int 0 on success, -1 if the text is not a size.
+ */
+static int parse_size(const char *text, long long *size) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+    long long unit = 1;
+    if (*end == 'K' || *end == 'k') unit = 1024;
+    else if (*end == 'M' || *end == 'm') unit = 1024 * 1024;
+    else if (*end == 'G' || *end == 'g') unit = 1024 * 1024 * 1024;
+    if (end == text || value < 0 || (unit > 1 && *++end != '\0') || (unit == 1 && *end != '\0')) {
+        return -1;
+    }
+    *size = value * unit;
+    return 0;
+}
+
+/**
+ * @brief Returns the largest size a distribution produces, the size of the body buffer.
+ */
+static long long max_size(const SizeDist *size) {
+    switch (size->kind) {
+    case SIZE_UNIFORM: return size->b;
+    case SIZE_EXP: return size->a * EXP_CAP;
+    default: return size->a;
+    }
+}
+
+/**
+ * @brief Thread of one connection. Writes its share of the files, waits for the others,
+ *        then sends requests until the run ends: in a closed loop back to back, in an open
+ *        loop each at its scheduled time. A connection the server drops is reopened and
+ *        the lost request counted as a failure.
+ *
+ * @param arg The BenchWorker of the connection.
+ * @return void* Always NULL.
+ */
+static void *bench_worker(void *arg) {
+    BenchWorker *worker = arg;
+    ConnReader conn;
+    conn_reader_init(&conn, connect_to_server());
+    if (conn.fd < 0) {
+        worker->failures++;
+    }
+
+    // Create the files first, so the measurement starts from a known state
+    for (int file = worker->id; file < config.files && conn.fd >= 0; file += config.connections) {
+        long long bytes;
+        if (run_request(worker, &conn, OP_WRITE, file, &bytes) < 0) {
+            worker->failures++;
+            close(conn.fd);
+            free(conn.buf);
+            conn_reader_init(&conn, connect_to_server());
+        }
+    }
+    if (pthread_barrier_wait(&warmup_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+        __atomic_store_n(&start_ns, now_ns(), __ATOMIC_RELEASE);
+    }
+    pthread_barrier_wait(&warmup_barrier);
+    long long start = __atomic_load_n(&start_ns, __ATOMIC_ACQUIRE);
+    long long end = start + (long long)(config.duration * 1e9);
+
+    // In an open loop each connection sends every interval, staggered against the others
+    double interval = config.rate > 0 ? 1e9 * config.connections / config.rate : 0;
+    long long offset = (long long)(interval * worker->id / config.connections);
+
+    for (long long sent = 0; conn.fd >= 0; sent++) {
+        if (config.requests > 0 && __atomic_fetch_add(&requests_issued, 1, __ATOMIC_RELAXED) >= config.requests) {
+            break;
+        }
+        long long scheduled = now_ns();
+        if (interval > 0) {
+            scheduled = start + offset + (long long)(sent * interval);
+            if (config.requests == 0 && scheduled >= end) {
+                break;
+            }
+            struct timespec at = { .tv_sec = scheduled / 1000000000LL, .tv_nsec = scheduled % 1000000000LL };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR) {
+            }
+        } else if (config.requests == 0 && scheduled >= end) {
+            break;
+        }
+
+        BenchOp op = draw_op(worker);
+        long long bytes = 0;
+        int result = run_request(worker, &conn, op, (int)(next_random(worker) % config.files), &bytes);
+        if (result < 0) {
+            worker->failures++;
+            close(conn.fd);
+            free(conn.buf);
+            conn_reader_init(&conn, connect_to_server());
+            continue;
+        }
+        record_latency(&worker->latency[op], now_ns() - scheduled);
+        worker->misses[op] += result;
+        worker->bytes[op] += bytes;
+    }
+    if (conn.fd >= 0) {
+        close(conn.fd);
+    }
+    free(conn.buf);
+    return NULL;
+}
+
+/**
+ * @brief Sends one request and reads its answer, the body of a GET included.
+ *
+ * @param worker The connection's worker (for the WRITE size).
+ * @param conn   Reader of the connection.
+ * @param op     Request type.
+ * @param file   Number of the file to work on.
+ * @param bytes  Receives the body bytes moved.
+ * @return int 0 if the request succeeded, 1 if the server answered with an error,
+ *         -1 if the connection was lost.
+ */
+static int run_request(BenchWorker *worker, ConnReader *conn, BenchOp op, int file, long long *bytes) {
+    char request[128], response[1024];
+    long long size = op == OP_WRITE ? draw_size(worker) : 0;
+    int len = op == OP_WRITE ? snprintf(request, sizeof(request), "WRITE bench/%d.bin %lld\n", file, size)
+              : op == OP_GET ? snprintf(request, sizeof(request), "GET bench/%d.bin\n", file)
+                             : snprintf(request, sizeof(request), "RM bench/%d.bin\n", file);
+    struct iovec iov[2] = {
+        { .iov_base = request, .iov_len = len },
+        { .iov_base = payload, .iov_len = size },
+    };
+    *bytes = 0;
+    if (send_iov(conn->fd, iov, 2) < 0 || conn_read_line(conn, response, sizeof(response)) < 0) {
+        return -1;
+    }
+    if (op == OP_GET && sscanf(response, "SIZE %lld", &size) == 1) {
+        if (conn_discard(conn, size) < 0) {
+            return -1;
+        }
+        *bytes = size;
+        return 0;
+    }
+    if (strcmp(response, "OK") == 0) {
+        *bytes = size;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Opens a connection to the server on localhost.
+ *
+ * @return int Socket file descriptor on success, -1 on failure.
+ */
+static int connect_to_server(void) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    struct sockaddr_in server_addr = { .sin_family = AF_INET, .sin_port = htons(config.port) };
+    server_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connect failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * @brief Returns the next number of the worker's xorshift64 generator.
+ */
+static uint64_t next_random(BenchWorker *worker) {
+    uint64_t x = worker->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return worker->rng = x;
+}
+
+/**
+ * @brief Draws the size of a WRITE from the configured distribution.
+ */
+static long long draw_size(BenchWorker *worker) {
+    if (config.size.kind == SIZE_UNIFORM) {
+        return config.size.a + (long long)(next_random(worker) % (uint64_t)(config.size.b - config.size.a + 1));
+    }
+    if (config.size.kind == SIZE_EXP) {
+        double u = (next_random(worker) >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+        long long size = (long long)(-log(1.0 - u) * config.size.a);
+        return size < max_size(&config.size) ? size : max_size(&config.size);
+    }
+    return config.size.a;
+}
+
+/**
+ * @brief Draws a request type by the weights of the mix.
+ */
+static BenchOp draw_op(BenchWorker *worker) {
+    int total = config.mix[OP_WRITE] + config.mix[OP_GET] + config.mix[OP_RM];
+    int pick = (int)(next_random(worker) % total);
+    BenchOp op = OP_WRITE;
+    while (pick >= config.mix[op]) {
+        pick -= config.mix[op];
+        op++;
+    }
+    return op;
+}
+
+/**
+ * @brief Reads the monotonic clock in nanoseconds.
+ */
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Appends a latency to a log, growing it as needed (a sample that does not fit in
+ *        memory is dropped).
+ */
+static void record_latency(LatencyLog *log, long long ns) {
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity ? log->capacity * 2 : 4096;
+        long long *grown = realloc(log->samples, capacity * sizeof(long long));
+        if (!grown) return;
+        log->samples = grown;
+        log->capacity = capacity;
+    }
+    log->samples[log->count++] = ns;
+}
+
+/**
+ * @brief Orders latencies for qsort().
+ */
+static int compare_latencies(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns a percentile of a sorted log (nearest rank), in milliseconds.
+ *
+ * @param log Sorted, non-empty latencies.
+ * @param p   The percentile as a fraction (0.99 for p99, 1 for the maximum).
+ */
+static double percentile_ms(const LatencyLog *log, double p) {
+    size_t rank = (size_t)ceil(p * log->count);
+    return log->samples[rank > 0 ? rank - 1 : 0] / 1e6;
+}
+
+/**
+ * @brief Merges the latencies of all connections and prints, per request type and in
+ *        total, the count, misses, throughput and latency percentiles (in milliseconds).
+ *
+ * @param workers All connections of the run.
+ * @param elapsed Length of the measurement in seconds.
+ */
+static void print_report(BenchWorker *workers, double elapsed) {
+    printf("\n%-6s %9s %7s %10s %9s %8s %8s %8s %8s %8s %8s\n", "op", "requests", "misses", "req/s", "MB/s",
+           "mean", "p50", "p90", "p99", "p99.9", "max");
+    long long failures = 0;
+    LatencyLog all = { 0 };
+    long long all_misses = 0, all_bytes = 0;
+    for (int op = 0; op <= OP_COUNT; op++) {
+        // The last round reports all request types together
+        LatencyLog merged = { 0 };
+        long long misses = 0, bytes = 0;
+        if (op < OP_COUNT) {
+            for (int i = 0; i < config.connections; i++) {
+                for (size_t j = 0; j < workers[i].latency[op].count; j++) {
+                    record_latency(&merged, workers[i].latency[op].samples[j]);
+                    record_latency(&all, workers[i].latency[op].samples[j]);
+                }
+                misses += workers[i].misses[op];
+                bytes += workers[i].bytes[op];
+            }
+            all_misses += misses;
+            all_bytes += bytes;
+        } else {
+            merged = all;
+            misses = all_misses;
+            bytes = all_bytes;
+        }
+        if (merged.count == 0) {
+            continue;
+        }
+        qsort(merged.samples, merged.count, sizeof(long long), compare_latencies);
+        double sum = 0;
+        for (size_t j = 0; j < merged.count; j++) {
+            sum += merged.samples[j];
+        }
+        printf("%-6s %9zu %7lld %10.1f %9.2f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n",
+               op < OP_COUNT ? op_names[op] : "all", merged.count, misses, merged.count / elapsed,
+               bytes / elapsed / (1024 * 1024), sum / merged.count / 1e6, percentile_ms(&merged, 0.5),
+               percentile_ms(&merged, 0.9), percentile_ms(&merged, 0.99), percentile_ms(&merged, 0.999),
+               percentile_ms(&merged, 1));
+        if (op < OP_COUNT) {
+            free(merged.samples);
+        }
+    }
+    free(all.samples);
+    for (int i = 0; i < config.connections; i++) {
+        failures += workers[i].failures;
+    }
+    printf("\n%.2f s, %d connections", elapsed, config.connections);
+    if (config.rate > 0) {
+        printf(", target %.1f req/s", config.rate);
+    }
+    printf(", %lld failed requests\n", failures);
+    printf("Latencies in ms%s; misses are GETs and RMs of removed files\n",
+           config.rate > 0 ? ", from each request's scheduled time" : "");
+}
@@ -2,16 +2,61 @@
  * server.c -- Multithreaded TCP File Server
  * 
  * This server accepts TCP connections and supports commands:
- * WRITE <path> <size> - Uploads a file to the server
- * GET <path>          - Downloads a file from the server
- * RM <path>           - Removes a file or directory from the server
+ * WRITE <path> <size> [offset] [deflate]
+ *                                - Uploads a file (or, from offset on, the rest of one)
+ * GET <path> [offset [length]] [deflate:<level>]
+ *                                - Downloads a file, or a byte range of it
+ * WRITEPART <path> <total> <offset> <length> <token>
+ *                                - Uploads one byte range of a file sent over several connections
+ * OFFSET <path>                  - Reports the length of an interrupted upload, for resuming
+ * STAT <path>                    - Reports the size of a file
+ * CHUNKS <path> <total> <count>  - Uploads a file as a chunk list, sending only chunks the server lacks
+ * SIGS <path>                    - Sends block signatures of a file, the base of a delta upload
+ * DELTA <path> <total> <base_size> <block_size>
+ *                                - Uploads a file as copies of base blocks and literal bytes (see delta.h)
+ * RM [-r] <path>                 - Removes a file or directory (with -r, a whole tree) from the server
+ * PUTDIR <path>                  - Uploads a directory tree, streamed as entries (see tree.h)
+ * GETDIR <path>                  - Downloads a directory tree, streamed as entries
+ * HELLO <capability>...          - Reports which of the listed capabilities the server has
+ * STATS                          - Reports the server-wide counters (see stats.h)
+ * REPLICATE                      - Switches the session to a primary's stream of changes (see replica.h)
+ * BINARY <version>               - Switches the session to the binary framed protocol (see frame.h)
+ * QUIT                           - Ends the session
  *
- * Each client is handled in a separate thread.
+ * A connection is a session: the client may send any number of commands and
+ * the server keeps the connection open until QUIT, EOF or an idle timeout.
+ *
+ * Connections are multiplexed with an edge-triggered epoll loop and served by a
+ * fixed pool of worker threads sized to the number of cores.
+ *
+ * Uploads are written to a temp file and renamed into place when complete, so a
+ * GET always sends a whole version of a file and never waits for an upload.
+ * A binary session pipelines requests: each frame is handed to a worker of its
+ * own, so responses come back in completion order, tagged with request IDs.
+ *
+ * Bodies may be compressed on the wire (see codec.h): a client that got "deflate"
+ * back from HELLO adds the token to a WRITE, or "deflate:<level>" to a GET, and
+ * the server then answers "SIZE <size> deflate" if the file compresses well.
+ *
+ * With --dedup, files are stored as manifests of content-defined chunks, each
+ * unique chunk once (see dedup.h).
+ *
+ * With --metrics <port>, the counters are also served in the Prometheus text
+ * format over HTTP on 127.0.0.1:<port>.
+ *
+ * With --replicate-to, the server is a primary and streams every committed
+ * change to the given replicas (see replica.h); with --quorum <n>, a change is
+ * only acknowledged once n of them applied it. A server started with --replica
+ * refuses changes from clients and takes them from a primary's stream instead.
+ * Usage: ./server [--port <port>] [--sync none|data|full] [--dedup] [--metrics <port>]
+ *                 [--replica | --replicate-to <ip:port>... [--quorum <n>]]
  * 
  * adapted from: 
  *   https://www.educative.io/answers/how-to-implement-tcp-sockets-in-c
  */
 
+#define _GNU_SOURCE  // fallocate()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,57 +65,278 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/statvfs.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "netio.h"
+#include "filelock.h"
+#include "filecache.h"
+#include "dedup.h"
+#include "codec.h"
+#include "frame.h"
+#include "tree.h"
+#include "delta.h"
+#include "stats.h"
+#include "replica.h"
 
-// Define server port, folder, and buffer limits
+// Define server port (default of --port), folder, and buffer limits
 #define PORT 2000
 #define ROOT_FOLDER "server_root"
 #define BUFFER_SIZE 8192
-#define MAX_FILES 100
 
-// Structure representing a lock for a specific file path
-struct FileLock {
-    char path[1024];          // Path to the file
-    pthread_mutex_t mutex;    // Mutex to lock access to the file
-};
+// Define connection handling limits
+#define LISTEN_BACKLOG 4096     // Pending connections the kernel may queue (capped by somaxconn)
+#define MAX_EVENTS 256          // Events fetched per epoll_wait call
+#define WORKERS_PER_CORE 2      // Handlers block on disk and socket I/O, so keep a few spare workers
+#define TASK_QUEUE_SIZE 1024    // Ready connections waiting for a worker
+#define IDLE_TIMEOUT 60         // Seconds a session may sit idle between commands
+#define IO_GRACE 10             // Seconds a command may wait on its client before bytes moved
+#define IO_TIMEOUT 30           // Most seconds of waiting a command can bank by moving bytes
+#define MIN_TRANSFER_RATE 65536 // Bytes per second that earn a command one more second of waiting
+#define IDLE_CHECK_MS 1000      // Interval of the idle-session sweep
+#define FRAME_MAX_INFLIGHT 64   // Frames of one binary session running at once
 
-struct FileLock file_locks[MAX_FILES];  // Array of file locks
-int lock_count = 0;                     // How many file locks are used
-pthread_mutex_t lock_table_mutex = PTHREAD_MUTEX_INITIALIZER;  // Global lock for lock table
+// Define multi-stream upload limits
+#define MAX_UPLOADS 64          // Multi-stream uploads in progress at once
+#define UPLOAD_TIMEOUT 600      // Seconds before an abandoned multi-stream upload may be reclaimed
+#define PARTIAL_SUFFIX ".partial"  // Temp file of a WRITE in progress, kept for resuming when cut off
+#define PREALLOC_MARGIN (1LL << 30)  // Free bytes an upload's preallocation must leave on the disk
 
-// Struct for passing arguments to each client thread
+// How far an upload is flushed to disk before it is acknowledged
+typedef enum {
+    SYNC_NONE,  // Leave flushing to the kernel (a crash may lose recent uploads)
+    SYNC_DATA,  // fdatasync the file before it is renamed into place
+    SYNC_FULL,  // Also fsync the directory, so the new name survives a crash
+} SyncMode;
+
+SyncMode sync_mode = SYNC_NONE;
+int dedup_enabled = 0;          // Store files in the content-addressed chunk store (--dedup)
+int worker_count = 0;           // Threads of the worker pool
+int server_port = PORT;         // Port clients connect to (--port)
+int replica_mode = 0;           // Refuse changes from clients, take them from a primary (--replica)
+char replica_instance[32];      // ID of this replica process, sent in answer to REPLICATE
+
+// One byte range of a multi-stream upload, claimed by a part being received or already written
+typedef struct {
+    long long offset;           // First byte of the range
+    long long end;              // Byte after the range
+    int done;                   // Written completely (adjacent written ranges are merged)
+} PartRange;
+
+// Structure representing one file uploaded in parts over several connections (WRITEPART)
 typedef struct {
+    int in_use;                 // Slot holds an upload
+    char token[32];             // Client-chosen ID shared by all parts of the upload
+    char path[1024];            // Destination path (relative to ROOT_FOLDER)
+    char temp_path[2100];       // Preallocated file the parts are written into
+    int fd;                     // Open descriptor of temp_path, shared by all parts
+    int opening;                // Temp file still being created by the first part
+    long long total;            // Final file size
+    long long received;         // Bytes of completed parts (their ranges never overlap)
+    PartRange *ranges;          // Claimed ranges, sorted by offset and disjoint
+    int range_count;
+    int range_capacity;
+    int active;                 // Parts currently being received
+    time_t last_active;         // When a part last started or finished
+} Upload;
+
+Upload uploads[MAX_UPLOADS];    // Multi-stream uploads in progress
+pthread_mutex_t uploads_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards the upload table
+pthread_cond_t upload_opened = PTHREAD_COND_INITIALIZER;    // An upload's temp file was created (or not)
+
+// Struct describing one accepted client connection (session)
+typedef struct Connection {
     int client_sock;
-    int thread_num;
-} ThreadArgs;
+    int conn_num;
+    ConnReader reader;          // Buffered read side (buffer only held while serving)
+    time_t last_active;         // When the last command finished
+    int busy;                   // Set while a worker serves the connection
+    int binary;                 // Session switched to the framed protocol (see frame.h)
+    int replication;            // Session switched to a primary's stream of changes (see replica.h)
+    int replication_failed;     // Changes of the stream that could not be applied since the last SEQ
+    int inflight;               // Frames handed to workers and not answered yet
+    int closing;                // Session ended; the last answered frame closes the connection
+    pthread_mutex_t send_mutex; // Keeps responses of frames answered at once from interleaving
+    struct Connection *prev;    // Neighbours in the list of open connections
+    struct Connection *next;
+} Connection;
+
+Connection *open_conns = NULL;  // All open connections, for the idle sweep
+long long open_conn_count = 0;  // Length of open_conns
+long long accepted_count = 0;   // Connections accepted since the start
+pthread_mutex_t conns_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards open_conns and its counts, busy, inflight,
+                                                          // closing and last_active
+int epoll_fd = -1;              // Epoll instance of the event loop
+
+// One request frame of a binary session, run by a worker apart from the session's reader
+typedef struct {
+    Connection *conn;
+    FrameHeader header;
+    unsigned char *payload;     // header.length bytes
+} FrameTask;
+
+// Unit of work of the pool: serve a readable connection, or run one frame
+typedef struct {
+    Connection *conn;           // Connection to read commands from (NULL for a frame)
+    FrameTask *frame;           // Frame to run (NULL for a connection)
+} Task;
+
+// Bounded queue of tasks waiting for a worker
+typedef struct {
+    Task items[TASK_QUEUE_SIZE];
+    int head;
+    int count;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} TaskQueue;
+
+TaskQueue task_queue = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
 
-int thread_counter = 0;                      // Counter for assigning thread IDs
-pthread_mutex_t thread_counter_mutex = PTHREAD_MUTEX_INITIALIZER; // Lock for thread counter
+int conn_counter = 0;  // Counter for assigning connection IDs (only touched by the epoll thread)
 
 // Function declarations
-void handle_client(int client_sock);
-void *client_thread(void *arg);
-void receive_file(int client_sock, char *remote_path, int file_size);
-void send_file(int client_sock, const char *remote_path);
+int handle_client(Connection *conn);
+void *worker_thread(void *arg);
+void task_queue_push(TaskQueue *queue, Task task);
+int task_queue_try_push(TaskQueue *queue, Task task);
+Task task_queue_pop(TaskQueue *queue);
+void end_session(Connection *conn);
+int handle_frame(Connection *conn);
+void run_frame(FrameTask *frame);
+int send_frame(Connection *conn, const FrameHeader *request, uint16_t status, const void *payload, uint32_t length);
+int send_frame_file(Connection *conn, const FrameHeader *request, const char *remote_path, uint64_t offset,
+                    uint64_t length);
+int store_file(const char *remote_path, const void *data, size_t len);
+void make_parent_dirs(char *full_path);
+void preallocate_blocks(int fd, int mode, long long offset, long long len);
+int receive_tree(Connection *conn, const char *remote_dir);
+int send_tree(int client_sock, const char *remote_dir);
+void remove_tree(int client_sock, const char *remote_path);
+int list_tree(const char *remote_dir, TreeEntry **entries, size_t *count);
+void accept_connections(int server_fd);
+void rearm_connection(Connection *conn);
+void close_connection(Connection *conn);
+void close_idle_connections();
+void send_response(int client_sock, const char *response);
+int receive_file(Connection *conn, char *remote_path, long long file_size, long long offset, int compressed);
+int receive_part(Connection *conn, const char *remote_path, long long total, long long offset, long long length,
+                 const char *token);
+Upload *join_upload(const char *remote_path, long long total, const char *token);
+int claim_part_range(Upload *upload, long long offset, long long length);
+int finish_upload_part(Upload *upload, long long offset, long long length, int written);
+int send_file(int client_sock, const char *remote_path, long long offset, long long length, int level);
+int parse_encoding(char *command_buf, int required);
+void send_capabilities(int client_sock, const char *command_buf);
+int send_chunked_file(int client_sock, const char *remote_path, long long offset, long long length);
+void send_committed_length(int client_sock, const char *remote_path);
+void send_file_size(int client_sock, const char *remote_path);
 void remove_file_or_dir(int client_sock, const char *remote_path);
-pthread_mutex_t* get_file_mutex(const char *path);
+int open_for_read(const char *remote_path, struct stat *st, int *fd, CachedFile **cached);
+int lookup_file_size(const char *remote_path, long long *size);
+int remove_path(const char *remote_path);
+int commit_upload(const char *remote_path, int fd, const char *temp_path);
+int commit_chunked(const char *remote_path, const char *temp_path);
+int publish_manifest(const char *remote_path, const ChunkRef *chunks, size_t count);
+int receive_chunks(Connection *conn, const char *remote_path, long long total, size_t count);
+void collect_gauges(ServerGauges *gauges);
+int send_stats(int client_sock);
+int start_metrics_endpoint(int port);
+void *metrics_thread(void *arg);
+int send_signatures(int client_sock, const char *remote_path);
+int receive_delta(Connection *conn, const char *remote_path, long long total, long long base_size,
+                  uint32_t block_size);
+int start_replication(int quorum);
+int handle_replication(Connection *conn);
+int receive_sync(Connection *conn);
 
 /**
- * @brief Entry point of the server program. Initializes the server, listens for incoming client
- *        connections, and spawns threads to handle each client. Each client is assigned to a new
- *        thread to allow concurrent handling of multiple clients.
+ * @brief Entry point of the server program. Initializes the server, starts a fixed pool of
+ *        worker threads and runs an edge-triggered epoll loop over the listening socket and
+ *        all client sockets.
  * 
- *        The server sets up a TCP socket, binds it to the specified port, and listens for incoming
- *        connections. Upon accepting a connection, it allocates memory for the thread arguments,
- *        creates a new thread to handle the client, and increments the thread counter. The server
- *        continuously loops to accept new connections, spawning new threads for each.
+ *        The server sets up a TCP socket, binds it to the specified port, and listens with a
+ *        deep backlog so connection bursts are not dropped. The listening socket is non-blocking
+ *        and drained on every readiness event. Each accepted client socket is registered with
+ *        EPOLLONESHOT; when it becomes readable the connection is handed to a worker through the
+ *        task queue, so idle clients cost no thread and no thread is created per request.
+ *        Once per IDLE_CHECK_MS the loop closes sessions that stayed idle for IDLE_TIMEOUT.
  * 
+ * @param argc Number of command-line arguments
+ * @param argv Command-line arguments ("--port <port>" replaces PORT, "--sync none|data|full"
+ *             selects the SyncMode, "--dedup" turns on the chunk store, "--metrics <port>"
+ *             starts the metrics endpoint, "--replica" makes the server a replica, and
+ *             "--replicate-to <ip:port>" (repeatable) and "--quorum <n>" a primary)
  * @return int Exit status of the program (0 for successful termination, non-zero for failure).
  */
-int main() {
-    int server_fd, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
+int main(int argc, char *argv[]) {
+    int server_fd;
+    struct sockaddr_in server_addr;
+    int metrics_port = 0;
+    int quorum = 0;
+    int usage = 0;
+
+    // Parse options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dedup") == 0) {
+            dedup_enabled = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--replica") == 0) {
+            replica_mode = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metrics_port = atoi(argv[++i]);
+            if (metrics_port > 0 && metrics_port < 65536) continue;
+        }
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            server_port = atoi(argv[++i]);
+            if (server_port > 0 && server_port < 65536) continue;
+        }
+        if (strcmp(argv[i], "--replicate-to") == 0 && i + 1 < argc) {
+            if (replica_add(argv[++i]) == 0) continue;
+        }
+        if (strcmp(argv[i], "--quorum") == 0 && i + 1 < argc) {
+            quorum = atoi(argv[++i]);
+            if (quorum > 0) continue;
+        }
+        const char *mode = strcmp(argv[i], "--sync") == 0 && i + 1 < argc ? argv[++i] : "";
+        if (strcmp(mode, "none") == 0) {
+            sync_mode = SYNC_NONE;
+        } else if (strcmp(mode, "data") == 0) {
+            sync_mode = SYNC_DATA;
+        } else if (strcmp(mode, "full") == 0) {
+            sync_mode = SYNC_FULL;
+        } else {
+            usage = 1;
+            break;
+        }
+    }
+    if (usage || metrics_port == server_port || quorum > replica_count() || (replica_mode && replica_count() > 0)) {
+        printf("Usage: %s [--port <port>] [--sync none|data|full] [--dedup] [--metrics <port>]\n"
+               "       [--replica | --replicate-to <ip:port>... [--quorum <n>]]\n", argv[0]);
+        return 1;
+    }
+    if (replica_mode) {
+        // A new ID per process: a primary brings a restarted replica up to date with SYNC
+        snprintf(replica_instance, sizeof(replica_instance), "%lx%lx%llx", (long)time(NULL), (long)getpid(),
+                 stats_now_ns() & 0xffffff);
+    }
+
+    // Writing to a socket the client already closed must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Count the bytes of every socket call (see stats.h)
+    netio_count_bytes = stats_count_bytes;
 
     // Create TCP socket
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -78,10 +344,12 @@ int main() {
         perror("Socket failed");
         return 1;
     }
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
     // Set up server address struct
     server_addr.sin_family = AF_INET;             // IPv4
-    server_addr.sin_port = htons(PORT);           // Set port
+    server_addr.sin_port = htons(server_port);    // Set port
     server_addr.sin_addr.s_addr = INADDR_ANY;     // Accept connections on any local address
 
 
@@ -92,303 +360,2773 @@ int main() {
     }
 
     // Start listening for incoming client connections
-    listen(server_fd, 5);
-    printf("Server listening on port %d...\n", PORT);
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) {
+        perror("Listen failed");
+        return 1;
+    }
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL, 0) | O_NONBLOCK);
+    printf("Server listening on port %d%s...\n", server_port, replica_mode ? " as a replica" : "");
 
     // Ensure the root folder exists
     mkdir(ROOT_FOLDER, 0777);
+    dedup_init(ROOT_FOLDER, sync_mode != SYNC_NONE);
+    if (dedup_enabled && dedup_start_collector(DEDUP_GC_INTERVAL) != 0) {
+        perror("Failed to create chunk collector thread");
+        return 1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return 1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        return 1;
+    }
+
+    // Start the worker pool
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = (cores > 0 ? (int)cores : 1) * WORKERS_PER_CORE;
+    for (int i = 0; i < worker_count; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_thread, (void *)(long)i) != 0) {
+            perror("Failed to create worker thread");
+            return 1;
+        }
+        pthread_detach(tid);
+    }
+    printf("Started %d worker threads\n", worker_count);
+
+    if (metrics_port > 0 && start_metrics_endpoint(metrics_port) != 0) {
+        return 1;
+    }
+    if (start_replication(quorum) != 0) {
+        return 1;
+    }
+
+    // Event loop: accept new clients and dispatch readable ones to the workers
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, IDLE_CHECK_MS);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(server_fd);
+            } else {
+                // EPOLLONESHOT disarmed the socket, so only this worker touches it
+                pthread_mutex_lock(&conns_mutex);
+                conn->busy = 1;
+                pthread_mutex_unlock(&conns_mutex);
+                task_queue_push(&task_queue, (Task){ .conn = conn });
+            }
+        }
+        if (time(NULL) - last_sweep >= IDLE_CHECK_MS / 1000) {
+            close_idle_connections();
+            last_sweep = time(NULL);
+        }
+    }
+    return 0;
+}
 
-    // Main loop to accept clients
+/**
+ * @brief Accepts every pending connection on the non-blocking listening socket.
+ * 
+ *        With edge-triggered notification the listening socket must be drained until
+ *        accept() reports EAGAIN. Each client socket is registered for a single readable
+ *        event (EPOLLONESHOT), so a connection is never handed to two workers at once.
+ * 
+ *        Client sockets are non-blocking too: the handlers wait on them through netio.c,
+ *        which charges every wait to the command's budget (see netio_start_budget()), so a
+ *        client stalling or trickling bytes mid-command cannot pin a worker.
+ * 
+ * @param server_fd Listening socket.
+ */
+void accept_connections(int server_fd) {
     while (1) {
-        client_sock = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_sock = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
         if (client_sock < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
             perror("Accept failed");
-            continue;
+            return;
         }
 
-        // Allocate memory for thread arguments
-        ThreadArgs *args = malloc(sizeof(ThreadArgs));
-        if (args == NULL) {
-            perror("Failed to allocate memory for thread args");
-            close(client_sock); // Close the accepted socket
-            continue; // Skip this client
+        Connection *conn = malloc(sizeof(Connection));
+        if (conn == NULL) {
+            perror("Failed to allocate memory for connection");
+            close(client_sock);
+            continue;
         }
+        conn->client_sock = client_sock;
+        conn->conn_num = conn_counter++;
+        conn->last_active = time(NULL);
+        conn->busy = 0;
+        conn->binary = 0;
+        conn->replication = 0;
+        conn->replication_failed = 0;
+        conn->inflight = 0;
+        conn->closing = 0;
+        pthread_mutex_init(&conn->send_mutex, NULL);
+        conn_reader_init(&conn->reader, client_sock);
 
-        // Assign the client socket and a unique thread number
-        args->client_sock = client_sock;
-        pthread_mutex_lock(&thread_counter_mutex);
-        args->thread_num = thread_counter++;
-        pthread_mutex_unlock(&thread_counter_mutex);
+        // Responses are small writes in lockstep with requests, so do not let Nagle delay them
+        int nodelay = 1;
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-        // Launch thread to handle the client
-        // Each client connection is handled in a separate thread using pthread_create()
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, client_thread, args) != 0) {
-            perror("Failed to create thread");
-            free(args); // Free allocated memory if thread creation fails
-            close(client_sock);
-        } else {
-             pthread_detach(tid); // Auto-release thread resources
+        fcntl(client_sock, F_SETFL, fcntl(client_sock, F_GETFL, 0) | O_NONBLOCK);
+
+        // Link the connection before arming it, since a worker may pick it up right away
+        pthread_mutex_lock(&conns_mutex);
+        conn->prev = NULL;
+        conn->next = open_conns;
+        if (open_conns) open_conns->prev = conn;
+        open_conns = conn;
+        open_conn_count++;
+        accepted_count++;
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLET | EPOLLONESHOT, .data.ptr = conn };
+        int armed = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &ev);
+        pthread_mutex_unlock(&conns_mutex);
+        if (armed < 0) {
+            perror("epoll_ctl failed");
+            close_connection(conn);
         }
     }
-    return 0;
 }
 
 /**
- * @brief Thread function to handle an individual client connection.
+ * @brief Marks a connection idle after a command and re-arms it in epoll for the next one.
  * 
- *        This function is executed by a newly created thread for each client.
- *        It extracts the socket and thread number from the passed arguments,
- *        handles communication with the client, and then closes the connection.
+ *        Done under conns_mutex so the idle sweep never sees a connection that is idle but
+ *        not armed, or closes it while the worker still owns it.
  * 
- * @param arg Pointer to ThreadArgs struct containing client socket and thread number.
- * @return void* Always returns NULL.
+ * @param conn Connection whose command was completed.
  */
-void *client_thread(void *arg) {
-    ThreadArgs *args = (ThreadArgs *)arg;
-    int client_sock = args->client_sock;
-    int thread_num = args->thread_num;
-    free(arg);
-
-    printf("[Thread #%d] Connected to client\n", thread_num);
-    handle_client(client_sock);
-    close(client_sock);
-    printf("[Thread #%d] Connection closed\n", thread_num);
-    return NULL;
+void rearm_connection(Connection *conn) {
+    conn_reader_shrink(&conn->reader);
+    pthread_mutex_lock(&conns_mutex);
+    conn->busy = 0;
+    conn->last_active = time(NULL);
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET | EPOLLONESHOT, .data.ptr = conn };
+    int armed = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->client_sock, &ev);
+    pthread_mutex_unlock(&conns_mutex);
+    if (armed < 0) {
+        perror("epoll_ctl failed");
+        end_session(conn);
+    }
 }
 
 /**
- * @brief Handles a single client's command request.
- * 
- *        Reads a command line from the client socket, parses the command type,
- *        and dispatches to the appropriate handler function (WRITE, GET, or RM).
- *        Sends response messages back to the client based on the outcome.
+ * @brief Unlinks a connection from the open list, closes its socket and frees it.
+ *        Closing the socket also removes it from the epoll set.
  * 
- * @param client_sock Socket file descriptor for the connected client.
+ * @param conn Connection to close.
  */
-void handle_client(int client_sock) {
-    char command_buf[1024] = {0};
-    char ch;
-    int i = 0;
+void close_connection(Connection *conn) {
+    pthread_mutex_lock(&conns_mutex);
+    if (conn->prev) conn->prev->next = conn->next;
+    else open_conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    open_conn_count--;
+    pthread_mutex_unlock(&conns_mutex);
 
-    // Read commands (ends with newline)
-    while (recv(client_sock, &ch, 1, 0) > 0 && ch != '\n' && i < sizeof(command_buf) - 1) {
-        command_buf[i++] = ch;
-    }
-    command_buf[i] = '\0';
+    close(conn->client_sock);
+    free(conn->reader.buf);
+    pthread_mutex_destroy(&conn->send_mutex);
+    free(conn);
+}
 
-    // Extract command keyword
-    char command[16];
-    sscanf(command_buf, "%s", command);
+/**
+ * @brief Ends a session whose reader hit QUIT, EOF or an error. The connection is closed
+ *        right away, or by the last of its frames still running (see run_frame()).
+ * 
+ * @param conn Connection to close; busy stays set, so the idle sweep leaves it alone.
+ */
+void end_session(Connection *conn) {
+    pthread_mutex_lock(&conns_mutex);
+    conn->closing = 1;
+    int idle = conn->inflight == 0;
+    pthread_mutex_unlock(&conns_mutex);
+    if (idle) {
+        close_connection(conn);
+    }
+}
 
-    if (strcmp(command, "WRITE") == 0) {
-        char remote_path[1024];
-        int file_size;
-        if (sscanf(command_buf, "%*s %s %d", remote_path, &file_size) != 2) {
-            send(client_sock, "ERROR: Invalid WRITE format\n", 29, 0);
-            return;
-        }
-        printf("Received WRITE %s %d\n", remote_path, file_size);
-        receive_file(client_sock, remote_path, file_size);
-        send(client_sock, "OK\n", 3, 0);
-    } else if (strcmp(command, "GET") == 0) {
-        char remote_path[1024];
-        if (sscanf(command_buf, "%*s %s", remote_path) != 1) {
-            send(client_sock, "ERROR: Invalid GET format\n", 27, 0);
-            return;
-        }
-        printf("Received GET %s\n", remote_path);
-        send_file(client_sock, remote_path);
-    } else if (strcmp(command, "RM") == 0) {
-        char remote_path[1024];
-        if (sscanf(command_buf, "%*s %s", remote_path) != 1) {
-            send(client_sock, "ERROR: Invalid RM format\n", 25, 0);
-            return;
+/**
+ * @brief Closes every session that is not being served and has been idle for IDLE_TIMEOUT
+ *        seconds. Runs on the epoll thread between event batches.
+ */
+void close_idle_connections() {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&conns_mutex);
+    Connection *conn = open_conns;
+    while (conn) {
+        Connection *next = conn->next;
+        if (!conn->busy && conn->inflight == 0 && now - conn->last_active >= IDLE_TIMEOUT) {
+            if (conn->prev) conn->prev->next = conn->next;
+            else open_conns = conn->next;
+            if (conn->next) conn->next->prev = conn->prev;
+            printf("Connection #%d closed after idling\n", conn->conn_num);
+            close(conn->client_sock);
+            free(conn->reader.buf);
+            pthread_mutex_destroy(&conn->send_mutex);
+            free(conn);
         }
-        printf("Received RM %s\n", remote_path);
-        remove_file_or_dir(client_sock, remote_path);
-    } else {
-        send(client_sock, "ERROR: Unknown command\n", 25, 0);
+        conn = next;
     }
+    pthread_mutex_unlock(&conns_mutex);
 }
 
 /**
- * @brief Receives a file from the client and saves it to the server's file system.
- * 
- *        Acquires a file-specific mutex lock to ensure thread-safe writing.
- *        Automatically creates intermediate directories if they do not exist.
- *        Reads the incoming file data from the socket and writes it to disk.
+ * @brief Worker thread of the fixed pool. Takes tasks from the task queue: either a ready
+ *        connection, whose commands (or frames, or a primary's changes) it reads and serves, or
+ *        a single frame of a binary session to run. Commands the client pipelined are already in the connection's
+ *        buffer, where epoll cannot see them, so they are served before the session is
+ *        re-armed for its next command. The session is ended after QUIT, EOF or an error.
+ *        Each command, and each frame, gets a fresh wait budget of IO_GRACE seconds.
  * 
- * @param client_sock Socket file descriptor for the connected client.
- * @param remote_path Path (relative to ROOT_FOLDER) where the file should be saved.
- * @param file_size   Expected size of the incoming file in bytes.
+ * @param arg Worker number (cast to a pointer).
+ * @return void* Never returns.
  */
-void receive_file(int client_sock, char *remote_path, int file_size) {
-    char full_path[2048];
-    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
-
-    // Acquire file-specific lock
-    pthread_mutex_t *mutex = get_file_mutex(remote_path);
-    if (mutex) pthread_mutex_lock(mutex);
-
-    // Create intermediate directories if needed
-    for (char *p = full_path + strlen(ROOT_FOLDER) + 1; *p; p++) {
-        if (*p == '/') {
-            *p = '\0';
-            mkdir(full_path, 0777);
-            *p = '/';
+void *worker_thread(void *arg) {
+    int worker_num = (int)(long)arg;
+    while (1) {
+        Task task = task_queue_pop(&task_queue);
+        if (task.frame) {
+            netio_start_budget(IO_GRACE, MIN_TRANSFER_RATE, IO_TIMEOUT);
+            run_frame(task.frame);
+            continue;
+        }
+        Connection *conn = task.conn;
+        int result;
+        do {
+            netio_start_budget(IO_GRACE, MIN_TRANSFER_RATE, IO_TIMEOUT);
+            result = conn->binary        ? handle_frame(conn)
+                     : conn->replication ? handle_replication(conn)
+                                         : handle_client(conn);
+        } while (result == 0 && conn_buffered(&conn->reader) > 0);
+        if (result == 0) {
+            rearm_connection(conn);
+        } else {
+            printf("[Worker #%d] Connection #%d closed\n", worker_num, conn->conn_num);
+            end_session(conn);
         }
     }
+    return NULL;
+}
 
-    FILE *fp = fopen(full_path, "wb");
-    if (!fp) {
-        perror("File open failed");
-        return;
+/**
+ * @brief Appends a task to the task queue, waiting while the queue is full.
+ * 
+ * @param queue The task queue.
+ * @param task  Connection or frame to hand to a worker.
+ */
+void task_queue_push(TaskQueue *queue, Task task) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == TASK_QUEUE_SIZE) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
     }
+    queue->items[(queue->head + queue->count) % TASK_QUEUE_SIZE] = task;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
 
-    // Read file content from socket
-    int total_received = 0;
-    char buffer[BUFFER_SIZE];
-    while (total_received < file_size) {
-        int bytes = recv(client_sock, buffer, sizeof(buffer), 0);
-        if (bytes <= 0) break;
-        fwrite(buffer, 1, bytes, fp);
-        total_received += bytes;
+/**
+ * @brief Appends a task to the task queue unless it is full. Workers queue frames with it:
+ *        a worker waiting for room could wait on itself.
+ * 
+ * @param queue The task queue.
+ * @param task  Frame to hand to another worker.
+ * @return int 0 if the task was queued, -1 if the queue is full.
+ */
+int task_queue_try_push(TaskQueue *queue, Task task) {
+    pthread_mutex_lock(&queue->mutex);
+    int queued = queue->count < TASK_QUEUE_SIZE;
+    if (queued) {
+        queue->items[(queue->head + queue->count) % TASK_QUEUE_SIZE] = task;
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
     }
-    fclose(fp);
-    printf("File %s written (%d bytes)\n", remote_path, total_received);
+    pthread_mutex_unlock(&queue->mutex);
+    return queued ? 0 : -1;
+}
 
-    // Unlock file
-    if (mutex) pthread_mutex_unlock(mutex);
+/**
+ * @brief Removes the oldest task from the task queue, waiting while it is empty.
+ * 
+ * @param queue The task queue.
+ * @return Task The connection to serve or frame to run.
+ */
+Task task_queue_pop(TaskQueue *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    Task task = queue->items[queue->head];
+    queue->head = (queue->head + 1) % TASK_QUEUE_SIZE;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return task;
 }
 
 /**
- * @brief Sends a file from the server to the client.
+ * @brief Sends a complete response line to the client.
  * 
- *        Constructs the full file path, opens the file in binary read mode,
- *        and sends a header containing the file size. Then transmits the file
- *        contents in chunks over the socket. If the file does not exist, an
- *        error message is sent instead.
+ *        On a primary with a quorum (see replica.h), an OK for a request that changed files
+ *        waits until enough replicas applied the change, and becomes an error if they do not
+ *        in time.
  * 
  * @param client_sock Socket file descriptor for the connected client.
- * @param remote_path Path (relative to ROOT_FOLDER) of the file to send.
+ * @param response    NUL-terminated response, including its trailing newline.
  */
-void send_file(int client_sock, const char *remote_path) {
-    char full_path[2048];
-    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
-
-    FILE *fp = fopen(full_path, "rb");
-    if (!fp) {
-        send(client_sock, "ERROR: File not found\n", 23, 0);
-        return;
+void send_response(int client_sock, const char *response) {
+    if (replica_await(strncmp(response, "OK", 2) == 0) != 0) {
+        response = "ERROR: Replication quorum not reached\n";
     }
+    if (strncmp(response, "ERROR", 5) == 0) {
+        stats_count_error();
+    }
+    send_all(client_sock, response, strlen(response));
+}
 
-    // Acquire file-specific lock
-    pthread_mutex_t *mutex = get_file_mutex(remote_path);
-    if (mutex) pthread_mutex_lock(mutex);
-
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    int file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    // Send file size as header
-    char header[128];
-    snprintf(header, sizeof(header), "SIZE %d\n", file_size);
-    send(client_sock, header, strlen(header), 0);
+/**
+ * @brief Checks a WRITEPART token: letters, digits, '_' and '-' only, so it cannot lead the
+ *        temp file "<path>.part.<token>" out of the destination's directory.
+ */
+static int upload_token_ok(const char *token) {
+    static const char allowed[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_-";
+    return *token != '\0' && token[strspn(token, allowed)] == '\0';
+}
 
-    // Send file content
-    char buffer[BUFFER_SIZE];
-    int bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        send(client_sock, buffer, bytes, 0);
+/**
+ * @brief Tells the commands that change files, which a replica refuses.
+ */
+static int is_change_command(const char *command) {
+    static const char *changes[] = { "WRITE", "WRITEPART", "CHUNKS", "DELTA", "RM", "PUTDIR" };
+    for (size_t i = 0; i < sizeof(changes) / sizeof(changes[0]); i++) {
+        if (strcmp(command, changes[i]) == 0) return 1;
     }
+    return 0;
+}
 
-    fclose(fp);
-    printf("Sent file %s (%d bytes)\n", remote_path, file_size);
-
-    // Unlock file
-    if (mutex) pthread_mutex_unlock(mutex);
+/**
+ * @brief Consumes the body of a change a replica refuses, so the refusal reaches a client
+ *        that is still sending and the session stays usable: the bytes of a WRITE (raw or
+ *        compressed) or WRITEPART, the chunk list of CHUNKS, the ops of a DELTA up to END,
+ *        or the tree stream of PUTDIR. Nothing is checked beyond what skipping needs.
+ * 
+ * @param conn        The client's connection.
+ * @param command     Command keyword.
+ * @param command_buf Whole command line.
+ * @param compressed  Non-zero if a WRITE body is a compressed stream.
+ * @return int 0 if the body was consumed, -1 if the connection must be closed.
+ */
+static int discard_refused_body(Connection *conn, const char *command, const char *command_buf, int compressed) {
+    long long length;
+    if (strcmp(command, "RM") == 0) {
+        return 0;
+    }
+    if (strcmp(command, "WRITE") == 0) {
+        if (sscanf(command_buf, "%*s %*s %lld", &length) != 1 || length < 0) {
+            return -1;
+        }
+        return compressed ? recv_compressed_range(&conn->reader, -1, 0, length) : conn_discard(&conn->reader, length);
+    }
+    if (strcmp(command, "WRITEPART") == 0) {
+        if (sscanf(command_buf, "%*s %*s %*s %*s %lld", &length) != 1 || length < 0) {
+            return -1;
+        }
+        return conn_discard(&conn->reader, length);
+    }
+    if (strcmp(command, "CHUNKS") == 0) {
+        size_t count;
+        char line[256];
+        if (sscanf(command_buf, "%*s %*s %*s %zu", &count) != 1) {
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (conn_read_line(&conn->reader, line, sizeof(line)) < 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if (strcmp(command, "DELTA") == 0) {
+        char line[256];
+        size_t len;
+        while (conn_read_line(&conn->reader, line, sizeof(line)) >= 0) {
+            if (strncmp(line, "END ", 4) == 0) {
+                return 0;
+            }
+            if (sscanf(line, "L %zu", &len) == 1 && conn_discard(&conn->reader, len) != 0) {
+                return -1;
+            }
+        }
+        return -1;
+    }
+    if (strcmp(command, "PUTDIR") == 0) {
+        char line[2048], path[1024];
+        int is_dir, kind;
+        while (conn_read_line(&conn->reader, line, sizeof(line)) >= 0
+               && (kind = tree_parse_entry(line, &is_dir, &length, path, sizeof(path))) >= 0) {
+            if (kind == 1) {
+                return 0;
+            }
+            if (!is_dir && conn_discard(&conn->reader, length) != 0) {
+                return -1;
+            }
+        }
+    }
+    return -1;
 }
 
 /**
- * @brief Removes a file or directory from the server.
+ * @brief Handles one command of a client's session.
  * 
- *        Constructs the full path of the file or directory, checks if it exists,
- *        and then removes it. If the path refers to a directory, it is removed
- *        using `rmdir`, otherwise, a regular file is removed with `remove`. The
- *        client is notified of the operation result.
+ *        Reads a command line from the connection's buffer, parses the command type,
+ *        and dispatches to the appropriate handler function (WRITE, WRITEPART, CHUNKS, SIGS,
+ *        DELTA, GET, OFFSET, STAT, RM, PUTDIR, GETDIR, HELLO, STATS, REPLICATE, BINARY or QUIT).
+ *        After BINARY the session reads frames instead (see handle_frame()), after REPLICATE
+ *        changes (see handle_replication()). A replica refuses the commands that change files.
+ *        Sends response messages back to the client based on the outcome.
  * 
- * @param client_sock Socket file descriptor for the connected client.
- * @param remote_path Path (relative to ROOT_FOLDER) of the file or directory to remove.
+ * @param conn The client's connection.
+ * @return int 0 if the session can continue, -1 if the connection must be closed.
  */
-void remove_file_or_dir(int client_sock, const char *remote_path) {
-    char full_path[2048];
-    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+int handle_client(Connection *conn) {
+    int client_sock = conn->client_sock;
+    char command_buf[2048];
 
-    // Acquire file-specific lock
-    pthread_mutex_t *mutex = get_file_mutex(remote_path);
-    if (mutex) pthread_mutex_lock(mutex);
-
-    struct stat st;
-    if (stat(full_path, &st) != 0) {
-        send(client_sock, "ERROR: File not found\n", 23, 0);
-        return;
+    // Read commands (ends with newline)
+    if (conn_read_line(&conn->reader, command_buf, sizeof(command_buf)) < 0) {
+        return -1; // Client closed the session (or ran out of its wait budget)
     }
 
-    int result = -1;
-    if (S_ISDIR(st.st_mode)) {
-        result = rmdir(full_path);
-    } else {
-        result = remove(full_path);
+    // Extract command keyword, and the body encoding of a WRITE or GET
+    char command[16] = {0};
+    sscanf(command_buf, "%15s", command);
+    int level = strcmp(command, "WRITE") == 0 ? parse_encoding(command_buf, 3)   // WRITE <path> <size>
+                : strcmp(command, "GET") == 0 ? parse_encoding(command_buf, 2)     // GET <path>
+                                              : 0;
+    stats_count_request(command);
+
+    // A replica only changes through its primary's stream
+    if (replica_mode && is_change_command(command)) {
+        int result = discard_refused_body(conn, command, command_buf, level > 0);
+        send_response(client_sock, "ERROR: Read-only replica\n");
+        return result;
     }
 
-    if (result == 0) {
-        send(client_sock, "OK\n", 3, 0);
-        printf("Deleted: %s\n", full_path);
+    if (strcmp(command, "WRITE") == 0) {
+        char remote_path[1024];
+        long long file_size, offset = 0;
+        int fields = sscanf(command_buf, "%*s %1023s %lld %lld", remote_path, &file_size, &offset);
+        if (fields < 2 || file_size < 0 || offset < 0) {
+            send_response(client_sock, "ERROR: Invalid WRITE format\n");
+            return -1; // The body length is unknown, so the stream cannot be resynchronized
+        }
+        printf("Received WRITE %s %lld at %lld%s\n", remote_path, file_size, offset, level > 0 ? " (deflate)" : "");
+        int result = receive_file(conn, remote_path, file_size, offset, level > 0);
+        if (result == 0) {
+            send_response(client_sock, "OK\n");
+        } else if (result == 1) {
+            send_response(client_sock, "ERROR: Unable to write file\n");
+        } else if (result == 2) {
+            send_response(client_sock, "ERROR: Offset beyond committed length\n");
+        } else {
+            return -1; // Connection dropped mid-upload
+        }
+    } else if (strcmp(command, "WRITEPART") == 0) {
+        char remote_path[1024], token[32];
+        long long total, offset, length;
+        if (sscanf(command_buf, "%*s %1023s %lld %lld %lld %31s", remote_path, &total, &offset, &length, token) != 5
+            || length < 0) {
+            send_response(client_sock, "ERROR: Invalid WRITEPART format\n");
+            return -1; // The body length is unknown, so the stream cannot be resynchronized
+        }
+        if (!upload_token_ok(token)) {
+            if (conn_discard(&conn->reader, length) != 0) {
+                return -1;
+            }
+            send_response(client_sock, "ERROR: Invalid WRITEPART format\n");
+            return 0;
+        }
+        printf("Received WRITEPART %s %lld+%lld of %lld (%s)\n", remote_path, offset, length, total, token);
+        int result = receive_part(conn, remote_path, total, offset, length, token);
+        if (result == 0) {
+            send_response(client_sock, "OK\n");
+        } else if (result == 1) {
+            send_response(client_sock, "ERROR: Unable to write file\n");
+        } else if (result == 2) {
+            send_response(client_sock, "ERROR: Invalid part range\n");
+        } else {
+            return -1; // Connection dropped mid-upload
+        }
+    } else if (strcmp(command, "CHUNKS") == 0) {
+        char remote_path[1024];
+        long long total;
+        size_t count;
+        if (sscanf(command_buf, "%*s %1023s %lld %zu", remote_path, &total, &count) != 3 || total < 0
+            || count > (size_t)(total / CHUNK_MIN_SIZE) + 1) {
+            send_response(client_sock, "ERROR: Invalid CHUNKS format\n");
+            return -1; // The chunk list length is unknown, so the stream cannot be resynchronized
+        }
+        printf("Received CHUNKS %s %lld (%zu chunks)\n", remote_path, total, count);
+        return receive_chunks(conn, remote_path, total, count);
+    } else if (strcmp(command, "SIGS") == 0) {
+        char remote_path[1024];
+        if (sscanf(command_buf, "%*s %1023s", remote_path) != 1) {
+            send_response(client_sock, "ERROR: Invalid SIGS format\n");
+            return 0;
+        }
+        printf("Received SIGS %s\n", remote_path);
+        if (send_signatures(client_sock, remote_path) < 0) {
+            return -1; // Signature list cut short, the client cannot find the next response
+        }
+    } else if (strcmp(command, "DELTA") == 0) {
+        char remote_path[1024];
+        long long total, base_size;
+        uint32_t block_size;
+        if (sscanf(command_buf, "%*s %1023s %lld %lld %u", remote_path, &total, &base_size, &block_size) != 4
+            || total < 0 || base_size < 0 || block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK) {
+            send_response(client_sock, "ERROR: Invalid DELTA format\n");
+            return -1; // The op stream that follows cannot be skipped
+        }
+        printf("Received DELTA %s %lld against %lld\n", remote_path, total, base_size);
+        return receive_delta(conn, remote_path, total, base_size, block_size);
+    } else if (strcmp(command, "GET") == 0) {
+        char remote_path[1024];
+        long long offset = 0, length = -1; // Whole file unless a range is given
+        int fields = sscanf(command_buf, "%*s %1023s %lld %lld", remote_path, &offset, &length);
+        if (fields < 1 || offset < 0 || (fields == 3 && length < 0)) {
+            send_response(client_sock, "ERROR: Invalid GET format\n");
+            return 0;
+        }
+        printf("Received GET %s %lld %lld\n", remote_path, offset, length);
+        if (send_file(client_sock, remote_path, offset, length, level) < 0) {
+            return -1; // Body cut short, the client cannot find the next response
+        }
+    } else if (strcmp(command, "RM") == 0) {
+        char remote_path[1024], tree_path[1024];
+        int fields = sscanf(command_buf, "%*s %1023s %1023s", remote_path, tree_path);
+        if (fields == 2 && strcmp(remote_path, "-r") == 0) {
+            printf("Received RM -r %s\n", tree_path);
+            remove_tree(client_sock, tree_path);
+        } else if (fields == 1) {
+            printf("Received RM %s\n", remote_path);
+            remove_file_or_dir(client_sock, remote_path);
+        } else {
+            send_response(client_sock, "ERROR: Invalid RM format\n");
+        }
+    } else if (strcmp(command, "PUTDIR") == 0) {
+        char remote_dir[1024];
+        if (sscanf(command_buf, "%*s %1023s", remote_dir) != 1) {
+            send_response(client_sock, "ERROR: Invalid PUTDIR format\n");
+            return -1; // The tree stream that follows cannot be skipped
+        }
+        printf("Received PUTDIR %s\n", remote_dir);
+        return receive_tree(conn, remote_dir);
+    } else if (strcmp(command, "GETDIR") == 0) {
+        char remote_dir[1024];
+        if (sscanf(command_buf, "%*s %1023s", remote_dir) != 1) {
+            send_response(client_sock, "ERROR: Invalid GETDIR format\n");
+            return 0;
+        }
+        printf("Received GETDIR %s\n", remote_dir);
+        if (send_tree(client_sock, remote_dir) < 0) {
+            return -1; // Stream cut short, the client cannot find the next response
+        }
+    } else if (strcmp(command, "OFFSET") == 0) {
+        char remote_path[1024];
+        if (sscanf(command_buf, "%*s %1023s", remote_path) != 1) {
+            send_response(client_sock, "ERROR: Invalid OFFSET format\n");
+            return 0;
+        }
+        printf("Received OFFSET %s\n", remote_path);
+        send_committed_length(client_sock, remote_path);
+    } else if (strcmp(command, "STAT") == 0) {
+        char remote_path[1024];
+        if (sscanf(command_buf, "%*s %1023s", remote_path) != 1) {
+            send_response(client_sock, "ERROR: Invalid STAT format\n");
+            return 0;
+        }
+        printf("Received STAT %s\n", remote_path);
+        send_file_size(client_sock, remote_path);
+    } else if (strcmp(command, "HELLO") == 0) {
+        send_capabilities(client_sock, command_buf);
+    } else if (strcmp(command, "STATS") == 0) {
+        printf("Received STATS\n");
+        if (send_stats(client_sock) < 0) {
+            return -1;
+        }
+    } else if (strcmp(command, "REPLICATE") == 0) {
+        if (!replica_mode) {
+            send_response(client_sock, "ERROR: Not a replica\n");
+            return 0;
+        }
+        printf("Connection #%d streams changes from a primary\n", conn->conn_num);
+        char response[64];
+        snprintf(response, sizeof(response), "REPLICA %s\n", replica_instance);
+        send_response(client_sock, response);
+        conn->replication = 1;
+    } else if (strcmp(command, "BINARY") == 0) {
+        int version;
+        if (sscanf(command_buf, "%*s %d", &version) != 1 || version != FRAME_VERSION) {
+            send_response(client_sock, "ERROR: Unsupported protocol version\n");
+            return 0;
+        }
+        printf("Connection #%d switched to binary frames\n", conn->conn_num);
+        send_response(client_sock, "BINARY 1\n");
+        conn->binary = 1;
+    } else if (strcmp(command, "QUIT") == 0) {
+        send_response(client_sock, "OK\n");
+        return -1;
     } else {
-        perror("Remove failed");
-        send(client_sock, "ERROR: Unable to delete\n", 25, 0);
+        send_response(client_sock, "ERROR: Unknown command\n");
     }
+    return 0;
+}
 
-    // Unlock file
-    if (mutex) pthread_mutex_unlock(mutex);
+/**
+ * @brief Gathers the values only the server knows for a stats report.
+ * 
+ * @param gauges Receives the connection counts, queue depth, pool size, file cache counters
+ *               and replication state.
+ */
+void collect_gauges(ServerGauges *gauges) {
+    pthread_mutex_lock(&conns_mutex);
+    gauges->connections = open_conn_count;
+    gauges->connections_total = accepted_count;
+    pthread_mutex_unlock(&conns_mutex);
+    pthread_mutex_lock(&task_queue.mutex);
+    gauges->queued_tasks = task_queue.count;
+    pthread_mutex_unlock(&task_queue.mutex);
+    gauges->workers = worker_count;
+    file_cache_stats(&gauges->cache_hits, &gauges->cache_misses, &gauges->cache_bytes);
+    replica_status(&gauges->replicas_connected, &gauges->replication_lag);
 }
 
 /**
- * @brief Retrieves a mutex for a specific file path to ensure mutual exclusion
- *        when accessing the file. If no mutex exists for the path, a new one is created.
+ * @brief Answers STATS: "STATS <n>" and n lines "<name> <value>" with the server-wide
+ *        counters, merged from all threads (see stats.c).
  * 
- *        This function ensures that only one thread can access a particular file at a time
- *        by using a mutex. If the file already has an associated mutex, it is returned.
- *        If the mutex does not exist and space is available, a new mutex is initialized
- *        and added to the lock table.
+ * @param client_sock Socket file descriptor for the connected client.
+ * @return int 0 on success, -1 if the connection failed.
+ */
+int send_stats(int client_sock) {
+    ServerGauges gauges;
+    collect_gauges(&gauges);
+    size_t len, lines;
+    char *text = stats_format(&gauges, 0, &len, &lines);
+    if (!text) {
+        send_response(client_sock, "ERROR: Out of memory\n");
+        return 0;
+    }
+    char header[64];
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = snprintf(header, sizeof(header), "STATS %zu\n", lines) },
+        { .iov_base = text, .iov_len = len },
+    };
+    int result = send_iov(client_sock, iov, 2);
+    free(text);
+    return result;
+}
+
+/**
+ * @brief Starts the metrics endpoint: an HTTP listener on 127.0.0.1 served by a thread of
+ *        its own, so a scrape is answered even while every worker is busy.
  * 
- * @param path The file path for which to retrieve or create a mutex.
- * @return pthread_mutex_t* Pointer to the mutex associated with the given file path, or NULL
- *                          if no mutex could be created due to space constraints.
+ * @param port Port to listen on.
+ * @return int 0 on success, -1 if the port could not be opened.
  */
-pthread_mutex_t* get_file_mutex(const char *path) {
-    pthread_mutex_lock(&lock_table_mutex);
+int start_metrics_endpoint(int port) {
+    int metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_fd < 0) {
+        perror("Metrics socket failed");
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local scrapers only
+    if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(metrics_fd, 16) < 0) {
+        perror("Metrics bind failed");
+        close(metrics_fd);
+        return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, metrics_thread, (void *)(long)metrics_fd) != 0) {
+        perror("Failed to create metrics thread");
+        close(metrics_fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    printf("Metrics on http://127.0.0.1:%d/metrics\n", port);
+    return 0;
+}
 
-    // Check if mutex for path already exists
-    for (int i = 0; i < lock_count; i++) {
-        if (strcmp(file_locks[i].path, path) == 0) {
-            pthread_mutex_unlock(&lock_table_mutex);
-            return &file_locks[i].mutex;
+/**
+ * @brief Serves the metrics endpoint: every request on the listening socket gets the
+ *        counters in the Prometheus text format (GET /metrics), or 404 for other paths.
+ *        One request per connection; a client that sends nothing is dropped after a second.
+ * 
+ * @param arg The listening socket.
+ * @return void* Never returns.
+ */
+void *metrics_thread(void *arg) {
+    int metrics_fd = (int)(long)arg;
+    while (1) {
+        int sock = accept(metrics_fd, NULL, NULL);
+        if (sock < 0) {
+            continue;
         }
-    }
+        struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-    // If not found and space available, create new lock
-    if (lock_count < MAX_FILES) {
-        strcpy(file_locks[lock_count].path, path);
-        pthread_mutex_init(&file_locks[lock_count].mutex, NULL);
-        pthread_mutex_t *m = &file_locks[lock_count].mutex;
-        lock_count++;
-        pthread_mutex_unlock(&lock_table_mutex);
-        return m;
-    }
+        // The request line is all that matters; headers are not read
+        char request[1024];
+        ssize_t got = recv(sock, request, sizeof(request) - 1, 0);
+        request[got > 0 ? got : 0] = '\0';
+        char path[256] = "";
+        sscanf(request, "GET %255s", path);
 
-    pthread_mutex_unlock(&lock_table_mutex);
-    return NULL;  // No lock available
+        ServerGauges gauges;
+        collect_gauges(&gauges);
+        size_t len = 0, lines;
+        char *text = strcmp(path, "/metrics") == 0 || strcmp(path, "/") == 0
+                     ? stats_format(&gauges, 1, &len, &lines) : NULL;
+        char header[256];
+        struct iovec iov[2] = {
+            { .iov_base = header, .iov_len = 0 },
+            { .iov_base = text, .iov_len = len },
+        };
+        iov[0].iov_len = text ? snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                         "Content-Type: text/plain; version=0.0.4\r\n"
+                                         "Content-Length: %zu\r\nConnection: close\r\n\r\n", len)
+                              : snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\n"
+                                         "Content-Length: 0\r\nConnection: close\r\n\r\n");
+        send_iov(sock, iov, 2);
+        free(text);
+        close(sock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Takes the body encoding off the end of a WRITE or GET command line.
+ * 
+ *        The encoding is an optional last word "deflate" (WRITE: the body is compressed) or
+ *        "deflate:<level>" (GET: compress the reply at that level if it pays off). It is
+ *        removed from the line, so the positional fields parse as before. The last word is
+ *        only an encoding if the line has more words than the command requires, so a path
+ *        that happens to be named "deflate" stays a path.
+ * 
+ * @param command_buf The command line; the encoding word is cut off.
+ * @param required    Number of words the command needs, the command itself included.
+ * @return int The zlib level (a default one for a bare "deflate"), or 0 if there is none.
+ */
+int parse_encoding(char *command_buf, int required) {
+    int words = 0;
+    for (const char *p = command_buf; *p; p++) {
+        if (*p != ' ' && (p == command_buf || p[-1] == ' ')) words++;
+    }
+    char *word = strrchr(command_buf, ' ');
+    if (words <= required || !word || strncmp(word + 1, CODEC_NAME, strlen(CODEC_NAME)) != 0) {
+        return 0;
+    }
+    const char *arg = word + 1 + strlen(CODEC_NAME);
+    int level = 6;
+    if (*arg == ':') {
+        level = atoi(arg + 1);
+    } else if (*arg != '\0') {
+        return 0;
+    }
+    *word = '\0';
+    return level < 1 ? 1 : level > CODEC_MAX_LEVEL ? CODEC_MAX_LEVEL : level;
+}
+
+/**
+ * @brief Answers a HELLO: the reply repeats the capabilities of the request the server has.
+ * 
+ *        Clients ask before they use an optional protocol feature, so an old server (which
+ *        answers "ERROR: Unknown command") or a new one without the feature is never sent
+ *        something it cannot read. The only capability so far is CODEC_NAME.
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param command_buf The HELLO line.
+ */
+void send_capabilities(int client_sock, const char *command_buf) {
+    char response[256] = "HELLO";
+    char copy[2048];
+    snprintf(copy, sizeof(copy), "%s", command_buf);
+    char *save;
+    strtok_r(copy, " ", &save);
+    for (char *word = strtok_r(NULL, " ", &save); word; word = strtok_r(NULL, " ", &save)) {
+        if (strcmp(word, CODEC_NAME) == 0 && !strstr(response, CODEC_NAME)) {
+            strcat(response, " " CODEC_NAME);
+        }
+    }
+    strcat(response, "\n");
+    send_response(client_sock, response);
+}
+
+/**
+ * @brief Reads one request frame of a binary session and hands it to a worker.
+ * 
+ *        The payload is read here, on the session's reader, so the next frame can be read
+ *        right away; the request itself runs on another worker (see run_frame()). That is
+ *        what lets a slow request not hold up the ones pipelined behind it. Once the session
+ *        has FRAME_MAX_INFLIGHT frames running, or the task queue is full, frames run on the
+ *        reader itself, which stops a client from queueing unbounded work.
+ *        A payload above FRAME_MAX_PAYLOAD is skipped and answered with TOO_LARGE.
+ * 
+ * @param conn The client's connection.
+ * @return int 0 if the session can continue, -1 if the connection must be closed.
+ */
+int handle_frame(Connection *conn) {
+    FrameHeader header;
+    if (frame_read_header(&conn->reader, &header) < 0) {
+        return -1; // Client closed the session (or ran out of its wait budget)
+    }
+    if (header.length > FRAME_MAX_PAYLOAD) {
+        if (conn_discard(&conn->reader, header.length) != 0) {
+            return -1;
+        }
+        return send_frame(conn, &header, FRAME_STATUS_TOO_LARGE, NULL, 0);
+    }
+
+    FrameTask *frame = malloc(sizeof(FrameTask));
+    unsigned char *payload = malloc(header.length > 0 ? header.length : 1);
+    if (!frame || !payload || conn_read_full(&conn->reader, payload, header.length) < 0) {
+        free(frame);
+        free(payload);
+        return -1;
+    }
+    frame->conn = conn;
+    frame->header = header;
+    frame->payload = payload;
+
+    pthread_mutex_lock(&conns_mutex);
+    int dispatch = conn->inflight < FRAME_MAX_INFLIGHT;
+    conn->inflight++;
+    pthread_mutex_unlock(&conns_mutex);
+    if (!dispatch || task_queue_try_push(&task_queue, (Task){ .frame = frame }) != 0) {
+        run_frame(frame);
+    }
+    return 0;
+}
+
+/**
+ * @brief Copies the path of a frame payload into a C string.
+ * 
+ * @return int 0 on success, -1 if the path is empty, too long or contains a NUL byte.
+ */
+static int frame_path(const unsigned char *bytes, size_t len, char path[1024]) {
+    if (len == 0 || len > 1023 || memchr(bytes, '\0', len)) {
+        return -1;
+    }
+    memcpy(path, bytes, len);
+    path[len] = '\0';
+    return 0;
+}
+
+/**
+ * @brief Runs one request frame and sends its response frame (see frame.h).
+ * 
+ *        Frames of one session run concurrently, so responses go out in completion order,
+ *        each tagged with the request ID. The operations are those of the text commands:
+ *        GET (see send_frame_file()), WRITE (see store_file()), RM (see remove_path()) and
+ *        STAT (see lookup_file_size()). If a response is cut short the client can no longer
+ *        find the next frame, so the connection is shut down and its reader ends the session.
+ *        The last frame to finish after the session ended closes the connection.
+ * 
+ * @param frame The frame; freed here.
+ */
+void run_frame(FrameTask *frame) {
+    Connection *conn = frame->conn;
+    const FrameHeader *request = &frame->header;
+    const unsigned char *payload = frame->payload;
+    uint32_t length = request->length;
+    char remote_path[1024];
+    int result;
+
+    stats_count_request(request->opcode == FRAME_OP_GET     ? "GET"
+                        : request->opcode == FRAME_OP_WRITE ? "WRITE"
+                        : request->opcode == FRAME_OP_RM    ? "RM"
+                        : request->opcode == FRAME_OP_STAT  ? "STAT" : "OTHER");
+    if (request->version != FRAME_VERSION) {
+        result = send_frame(conn, request, FRAME_STATUS_UNSUPPORTED, NULL, 0);
+    } else if (replica_mode && (request->opcode == FRAME_OP_WRITE || request->opcode == FRAME_OP_RM)) {
+        result = send_frame(conn, request, FRAME_STATUS_READ_ONLY, NULL, 0);
+    } else if (request->opcode == FRAME_OP_GET) {
+        if (length < 16 || frame_path(payload + 16, length - 16, remote_path) != 0) {
+            result = send_frame(conn, request, FRAME_STATUS_INVALID, NULL, 0);
+        } else {
+            printf("Received frame GET %s (request %u)\n", remote_path, request->request_id);
+            result = send_frame_file(conn, request, remote_path, frame_get_u64(payload), frame_get_u64(payload + 8));
+        }
+    } else if (request->opcode == FRAME_OP_WRITE) {
+        size_t path_len = length >= 2 ? frame_get_u16(payload) : 0;
+        if (length < 2 || path_len > length - 2 || frame_path(payload + 2, path_len, remote_path) != 0) {
+            result = send_frame(conn, request, FRAME_STATUS_INVALID, NULL, 0);
+        } else {
+            printf("Received frame WRITE %s %zu (request %u)\n", remote_path, length - 2 - path_len,
+                   request->request_id);
+            int stored = store_file(remote_path, payload + 2 + path_len, length - 2 - path_len);
+            result = send_frame(conn, request, stored == 0 ? FRAME_STATUS_OK : FRAME_STATUS_IO_ERROR, NULL, 0);
+        }
+    } else if (request->opcode == FRAME_OP_RM) {
+        if (frame_path(payload, length, remote_path) != 0) {
+            result = send_frame(conn, request, FRAME_STATUS_INVALID, NULL, 0);
+        } else {
+            printf("Received frame RM %s (request %u)\n", remote_path, request->request_id);
+            int removed = remove_path(remote_path);
+            result = send_frame(conn, request, removed == 0 ? FRAME_STATUS_OK
+                                               : removed == 1 ? FRAME_STATUS_NOT_FOUND : FRAME_STATUS_IO_ERROR,
+                                NULL, 0);
+        }
+    } else if (request->opcode == FRAME_OP_STAT) {
+        long long size;
+        if (frame_path(payload, length, remote_path) != 0) {
+            result = send_frame(conn, request, FRAME_STATUS_INVALID, NULL, 0);
+        } else if (lookup_file_size(remote_path, &size) != 0) {
+            result = send_frame(conn, request, FRAME_STATUS_NOT_FOUND, NULL, 0);
+        } else {
+            unsigned char reply[8];
+            frame_put_u64(reply, (uint64_t)size);
+            result = send_frame(conn, request, FRAME_STATUS_OK, reply, sizeof(reply));
+        }
+    } else {
+        result = send_frame(conn, request, FRAME_STATUS_UNSUPPORTED, NULL, 0);
+    }
+    if (result != 0) {
+        shutdown(conn->client_sock, SHUT_RDWR);
+    }
+    free(frame->payload);
+    free(frame);
+
+    pthread_mutex_lock(&conns_mutex);
+    conn->inflight--;
+    conn->last_active = time(NULL);
+    int last = conn->closing && conn->inflight == 0;
+    pthread_mutex_unlock(&conns_mutex);
+    if (last) {
+        close_connection(conn);
+    }
+}
+
+/**
+ * @brief Sends a response frame. Frames of one session are answered by several workers,
+ *        so the send is serialized on the connection's send_mutex. Like send_response(), an
+ *        OK for a change waits for the replication quorum, or becomes NO_QUORUM.
+ * 
+ * @param conn    The client's connection.
+ * @param request Header of the request being answered (its opcode and ID are echoed).
+ * @param status  FRAME_STATUS_* code.
+ * @param payload Response payload (may be NULL if length is 0).
+ * @param length  Payload length.
+ * @return int 0 on success, -1 on a socket error.
+ */
+int send_frame(Connection *conn, const FrameHeader *request, uint16_t status, const void *payload, uint32_t length) {
+    if (replica_await(status == FRAME_STATUS_OK) != 0) {
+        status = FRAME_STATUS_NO_QUORUM;
+        length = 0;
+    }
+    FrameHeader header = {
+        .length = length, .version = FRAME_VERSION, .opcode = request->opcode,
+        .status = status, .request_id = request->request_id,
+    };
+    if (status != FRAME_STATUS_OK) {
+        stats_count_error();
+    }
+    pthread_mutex_lock(&conn->send_mutex);
+    int result = frame_send(conn->client_sock, &header, payload);
+    pthread_mutex_unlock(&conn->send_mutex);
+    return result;
+}
+
+/**
+ * @brief Answers a GET frame with a byte range of a file.
+ * 
+ *        The file is opened like for send_file(), from the file cache or from disk, or with
+ *        deduplication on from the chunk store. A cached range leaves with its header in
+ *        one gather send; otherwise the socket is corked and the range goes out zero-copy.
+ *        Ranges above FRAME_MAX_PAYLOAD are refused with TOO_LARGE; those files are fetched
+ *        with the text GET, which has no size limit.
+ * 
+ * @param conn        The client's connection.
+ * @param request     Header of the GET frame.
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file to send.
+ * @param offset      First byte of the range.
+ * @param length      Maximum number of bytes, or FRAME_LENGTH_ALL for the rest of the file.
+ * @return int 0 if the response was sent completely, -1 if it was cut short.
+ */
+int send_frame_file(Connection *conn, const FrameHeader *request, const char *remote_path, uint64_t offset,
+                    uint64_t length) {
+    struct stat st;
+    int fd;
+    CachedFile *cached;
+    ChunkRef *chunks = NULL;
+    size_t count = 0;
+    long long total;
+    if (open_for_read(remote_path, &st, &fd, &cached) == 0) {
+        total = st.st_size;
+    } else if (!dedup_enabled || dedup_load_manifest(remote_path, &chunks, &count, &total) != 0) {
+        return send_frame(conn, request, FRAME_STATUS_NOT_FOUND, NULL, 0);
+    }
+
+    uint16_t status = FRAME_STATUS_OK;
+    long long size = 0;
+    if (offset > (uint64_t)total) {
+        status = FRAME_STATUS_INVALID;
+    } else {
+        size = total - (long long)offset;
+        if (length < (uint64_t)size) size = (long long)length;
+        if (size > FRAME_MAX_PAYLOAD) status = FRAME_STATUS_TOO_LARGE;
+    }
+
+    int result;
+    if (status != FRAME_STATUS_OK) {
+        result = send_frame(conn, request, status, NULL, 0);
+    } else if (cached) {
+        result = send_frame(conn, request, FRAME_STATUS_OK, cached->data + offset, (uint32_t)size);
+    } else {
+        FrameHeader header = {
+            .length = (uint32_t)size, .version = FRAME_VERSION, .opcode = request->opcode,
+            .status = FRAME_STATUS_OK, .request_id = request->request_id,
+        };
+        unsigned char raw[FRAME_HEADER_SIZE];
+        frame_pack_header(&header, raw);
+
+        // Header held back until the first body segment fills it up, as in send_file()
+        pthread_mutex_lock(&conn->send_mutex);
+        set_cork(conn->client_sock, 1);
+        result = send_all(conn->client_sock, raw, sizeof(raw));
+        if (result == 0) {
+            result = fd >= 0 ? send_file_range(conn->client_sock, fd, offset, size)
+                             : dedup_send_range(conn->client_sock, chunks, count, offset, size);
+        }
+        set_cork(conn->client_sock, 0);
+        pthread_mutex_unlock(&conn->send_mutex);
+    }
+    if (status == FRAME_STATUS_OK) {
+        printf("Sent file %s (%lld bytes at %llu%s, request %u)\n", remote_path, size, (unsigned long long)offset,
+               cached ? ", cached" : "", request->request_id);
+    }
+    if (fd >= 0) close(fd);
+    file_cache_release(cached);
+    dedup_free_manifest(chunks);
+    return result;
+}
+
+/**
+ * @brief Stores a file sent in one piece, as the body of a WRITE frame.
+ * 
+ *        Like receive_file(): the bytes go to the temp file "<path>.partial", under the
+ *        temp file's lock, and are committed with commit_upload().
+ * 
+ * @param remote_path Path (relative to ROOT_FOLDER) where the file should be saved.
+ * @param data        File contents.
+ * @param len         Number of bytes.
+ * @return int 0 on success, -1 if the file could not be written.
+ */
+int store_file(const char *remote_path, const void *data, size_t len) {
+    char full_path[2048], partial_path[2100], partial_key[1100];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+    snprintf(partial_path, sizeof(partial_path), "%s%s", full_path, PARTIAL_SUFFIX);
+    snprintf(partial_key, sizeof(partial_key), "%s%s", remote_path, PARTIAL_SUFFIX);
+
+    FileLock *upload_lock = file_lock_acquire(partial_key, 1);
+    make_parent_dirs(full_path);
+    int fd = open(partial_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int result = fd < 0 ? -1 : 0;
+    const char *p = data;
+    while (result == 0 && len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+    if (result == 0) {
+        result = commit_upload(remote_path, fd, partial_path);
+    } else {
+        perror("File write failed");
+        if (fd >= 0) {
+            close(fd);
+            unlink(partial_path);
+        }
+    }
+    if (result == 0) printf("File %s written\n", remote_path);
+    file_lock_release(upload_lock);
+    return result;
+}
+
+/**
+ * @brief Receives a file from the client and saves it to the server's file system.
+ * 
+ *        Automatically creates intermediate directories if they do not exist.
+ *        The body is streamed into the temp file "<path>.partial" next to the destination and
+ *        renamed over it once complete (see commit_upload()), so readers see either the old
+ *        or the new file and never wait for the transfer. Only the rename takes the path's
+ *        lock; concurrent uploads of the same path are serialized on the lock of the temp file.
+ *        The blocks are preallocated from the declared size and the body is spliced from
+ *        the socket into the file (see recv_file_range()). If the file cannot be opened
+ *        or written, the body is still consumed, so the session stays in sync.
+ * 
+ *        If the connection drops, the temp file keeps the bytes received so far (the blocks
+ *        reserved beyond them are released). A WRITE with
+ *        a non-zero offset resumes it: the body is written from offset on, which must not lie
+ *        beyond the bytes already there (see send_committed_length()).
+ * 
+ *        A compressed body (see codec.h) is inflated block by block into the temp file.
+ * 
+ * @param conn        The client's connection; body bytes already buffered are used first.
+ * @param remote_path Path (relative to ROOT_FOLDER) where the file should be saved.
+ * @param file_size   Number of body bytes that follow (64-bit, files may exceed 2 GB).
+ * @param offset      Position in the file where the body starts.
+ * @param compressed  Non-zero if the body is a compressed stream of file_size raw bytes.
+ * @return int 0 on success, 1 if the file could not be written, 2 if offset lies beyond the
+ *         committed length, -1 if the connection dropped.
+ */
+int receive_file(Connection *conn, char *remote_path, long long file_size, long long offset, int compressed) {
+    char full_path[2048], partial_path[2100], partial_key[1100];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+    snprintf(partial_path, sizeof(partial_path), "%s%s", full_path, PARTIAL_SUFFIX);
+    snprintf(partial_key, sizeof(partial_key), "%s%s", remote_path, PARTIAL_SUFFIX);
+
+    // One upload of a path at a time; readers of the path itself are not held up
+    FileLock *upload_lock = file_lock_acquire(partial_key, 1);
+
+    // Create intermediate directories if needed
+    make_parent_dirs(full_path);
+
+    int fd = open(partial_path, offset > 0 ? O_WRONLY | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    struct stat st;
+    int result;
+    if (fd < 0) {
+        perror("File open failed");
+        result = (compressed ? recv_compressed_range(&conn->reader, -1, 0, file_size)
+                             : conn_discard(&conn->reader, file_size)) == 0 ? 1 : -1;
+    } else if (offset > 0 && (fstat(fd, &st) != 0 || st.st_size < offset)) {
+        // Resuming past the received bytes would leave a hole in the file
+        close(fd);
+        result = (compressed ? recv_compressed_range(&conn->reader, -1, 0, file_size)
+                             : conn_discard(&conn->reader, file_size)) == 0 ? 2 : -1;
+    } else {
+        // Reserve the blocks up front (size unchanged) so the file is laid out contiguously
+        preallocate_blocks(fd, FALLOC_FL_KEEP_SIZE, offset, file_size);
+        // Read file content from socket straight into the temp file (inflating a compressed body)
+        result = compressed ? recv_compressed_range(&conn->reader, fd, offset, file_size)
+                            : recv_file_range(&conn->reader, fd, offset, file_size);
+        if (result == 0 && offset > 0 && ftruncate(fd, offset + file_size) != 0) {
+            result = 1; // A longer, stale tail of an earlier upload would be left behind
+        }
+        if (result == 0) {
+            result = commit_upload(remote_path, fd, partial_path) == 0 ? 0 : 1;
+        } else {
+            // Keep the bytes only for a resumable, dropped upload, without the blocks reserved past them
+            if (result == -1 && fstat(fd, &st) == 0) ftruncate(fd, st.st_size);
+            close(fd);
+            if (result == 1) unlink(partial_path);
+        }
+        if (result == 0) printf("File %s written (%lld bytes at %lld)\n", remote_path, file_size, offset);
+    }
+
+    file_lock_release(upload_lock);
+    return result;
+}
+
+/**
+ * @brief Creates the missing directories on the way to a file below ROOT_FOLDER.
+ * 
+ * @param full_path Path of the file, starting with ROOT_FOLDER; restored before returning.
+ */
+void make_parent_dirs(char *full_path) {
+    for (char *p = full_path + strlen(ROOT_FOLDER) + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(full_path, 0777);
+            *p = '/';
+        }
+    }
+}
+
+/**
+ * @brief Reserves the blocks of an upload's body up front, so the file is laid out
+ *        contiguously and a full disk is noticed early. The size is declared by the client,
+ *        so nothing is reserved when it would leave less than PREALLOC_MARGIN of the disk
+ *        free; the body is then written without a reservation and fails with ENOSPC only
+ *        if it really does not fit. A no-op where fallocate() does not exist.
+ * 
+ * @param fd     Open upload file.
+ * @param mode   fallocate() mode (0, or FALLOC_FL_KEEP_SIZE to leave the file size unchanged).
+ * @param offset First byte to reserve.
+ * @param len    Number of bytes to reserve.
+ */
+void preallocate_blocks(int fd, int mode, long long offset, long long len) {
+#ifdef __linux__
+    struct statvfs vfs;
+    if (len <= 0 || fstatvfs(fd, &vfs) != 0) return;
+    long long available = (long long)vfs.f_bavail * (long long)vfs.f_frsize;
+    if (len > available - PREALLOC_MARGIN) return;
+    fallocate(fd, mode, offset, len);
+#else
+    (void)fd;
+    (void)mode;
+    (void)offset;
+    (void)len;
+#endif
+}
+
+/**
+ * @brief Makes a fully received temp file the new version of a path.
+ * 
+ *        The temp file is flushed as sync_mode asks, closed, and renamed over the
+ *        destination under the path's exclusive lock. The rename is atomic: a reader that
+ *        opened the old file keeps sending it, later readers get the new one. With SYNC_FULL
+ *        the directory is flushed too, so the new name is durable before the client hears OK.
+ *        The time this takes is counted as disk write latency (see stats.h). The committed
+ *        path is logged for the replicas (see replica.h).
+ * 
+ * @param remote_path Destination path (relative to ROOT_FOLDER).
+ * @param fd          Open descriptor of the temp file; always closed.
+ * @param temp_path   Temp file in the destination's directory.
+ * @return int 0 on success, -1 on failure (the temp file is then removed).
+ */
+int commit_upload(const char *remote_path, int fd, const char *temp_path) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+    long long start = stats_now_ns();
+
+    if (dedup_enabled) {
+        close(fd);
+        int result = commit_chunked(remote_path, temp_path);
+        stats_add_latency(STAT_DISK_WRITE, stats_now_ns() - start);
+        return result;
+    }
+
+    int result = 0;
+    if (sync_mode != SYNC_NONE && fdatasync(fd) != 0) {
+        result = -1;
+    }
+    if (close(fd) != 0) {
+        result = -1;
+    }
+
+    // Replace the file under an exclusive lock, so RM and other commits are ordered with it
+    FileLock *lock = file_lock_acquire(remote_path, 1);
+    if (result == 0 && rename(temp_path, full_path) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        file_cache_invalidate(remote_path);
+    }
+    file_lock_release(lock);
+
+    if (result != 0) {
+        perror("Commit failed");
+        unlink(temp_path);
+        stats_add_latency(STAT_DISK_WRITE, stats_now_ns() - start);
+        return -1;
+    }
+
+    if (sync_mode == SYNC_FULL) {
+        char dir_path[2048];
+        snprintf(dir_path, sizeof(dir_path), "%s", full_path);
+        *strrchr(dir_path, '/') = '\0';
+        int dir_fd = open(dir_path, O_RDONLY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+    stats_add_latency(STAT_DISK_WRITE, stats_now_ns() - start);
+    replica_log(remote_path);
+    return 0;
+}
+
+/**
+ * @brief Makes a fully received temp file the new version of a path in the chunk store.
+ * 
+ *        The temp file is split into content-defined chunks, the chunks not stored yet are
+ *        added to the store (see dedup.c) and the path's manifest is replaced. The temp file
+ *        is removed afterwards, whatever the outcome.
+ * 
+ * @param remote_path Destination path (relative to ROOT_FOLDER).
+ * @param temp_path   Fully written temp file.
+ * @return int 0 on success, -1 on failure.
+ */
+int commit_chunked(const char *remote_path, const char *temp_path) {
+    int fd = open(temp_path, O_RDONLY);
+    ChunkRef *chunks = NULL;
+    size_t count = 0;
+    dedup_pin(); // Chunks found present must not be collected before the manifest names them
+    int result = fd >= 0 && dedup_import_file(fd, &chunks, &count) == 0 ? 0 : -1;
+    if (fd >= 0) close(fd);
+    if (result == 0) {
+        result = publish_manifest(remote_path, chunks, count);
+    }
+    dedup_unpin();
+    if (result != 0) {
+        perror("Commit failed");
+    }
+    free(chunks);
+    unlink(temp_path);
+    return result;
+}
+
+/**
+ * @brief Makes a chunk list the new version of a path.
+ * 
+ *        The manifest is replaced and a plain file left at the path by an upload made
+ *        without deduplication is removed, both under the path's exclusive lock, so a reader
+ *        finds either the old version or the new manifest. The path is then logged for the
+ *        replicas.
+ * 
+ * @param remote_path Destination path (relative to ROOT_FOLDER).
+ * @param chunks      The file's chunks, all present in the store.
+ * @param count       Number of chunks.
+ * @return int 0 on success, -1 on failure.
+ */
+int publish_manifest(const char *remote_path, const ChunkRef *chunks, size_t count) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+
+    FileLock *lock = file_lock_acquire(remote_path, 1);
+    int result = dedup_save_manifest(remote_path, chunks, count);
+    if (result == 0) {
+        struct stat st;
+        if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            unlink(full_path);
+        }
+        file_cache_invalidate(remote_path);
+    }
+    file_lock_release(lock);
+    if (result == 0) {
+        replica_log(remote_path);
+    }
+    return result;
+}
+
+/**
+ * @brief Orders pointers to chunks by digest, so repeated chunks end up next to each other.
+ */
+static int compare_chunk_digests(const void *a, const void *b) {
+    return memcmp((*(ChunkRef *const *)a)->digest, (*(ChunkRef *const *)b)->digest, SHA256_DIGEST_SIZE);
+}
+
+/**
+ * @brief Orders chunk list indices.
+ */
+static int compare_chunk_indices(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Receives a file as a chunk list, taking only the chunks the server lacks.
+ * 
+ *        The command line is followed by count lines "<sha256> <length>", the client's
+ *        content-defined chunks of the file in order. The server replies "NEED <k>" and k
+ *        lines with the indices of the chunks it does not store (each distinct chunk once),
+ *        then reads exactly those chunks, in that order, checks each against its hash and
+ *        stores it. Finally the path's manifest is replaced and the result is sent.
+ * 
+ * @param conn        The client's connection.
+ * @param remote_path Path (relative to ROOT_FOLDER) where the file should be saved.
+ * @param total       File size, the sum of the chunk lengths.
+ * @param count       Number of chunk lines that follow.
+ * @return int 0 if the session can continue, -1 if the connection must be closed.
+ */
+int receive_chunks(Connection *conn, const char *remote_path, long long total, size_t count) {
+    int client_sock = conn->client_sock;
+    ChunkRef *chunks = malloc((count > 0 ? count : 1) * sizeof(ChunkRef));
+    ChunkRef **by_digest = malloc((count > 0 ? count : 1) * sizeof(ChunkRef *));
+    size_t *order = malloc((count > 0 ? count : 1) * sizeof(size_t));
+    char *buffer = malloc(CHUNK_MAX_SIZE);
+    if (!chunks || !by_digest || !order || !buffer) {
+        free(chunks);
+        free(by_digest);
+        free(order);
+        free(buffer);
+        return -1;
+    }
+
+    // Read the whole list first, so the session stays in sync whatever the answer
+    int valid = 1;
+    long long sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        char line[128], hex[CHUNK_HEX_SIZE + 1];
+        if (conn_read_line(&conn->reader, line, sizeof(line)) < 0) {
+            valid = -1;
+            break;
+        }
+        if (sscanf(line, "%65s %zu", hex, &chunks[i].length) != 2 || chunk_parse_hex(hex, chunks[i].digest) != 0
+            || chunks[i].length == 0 || chunks[i].length > CHUNK_MAX_SIZE) {
+            valid = 0;
+            continue;
+        }
+        chunks[i].offset = sum;
+        sum += chunks[i].length;
+    }
+    int result = valid < 0 ? -1 : 0;
+    if (valid == 0 || (valid > 0 && sum != total)) {
+        send_response(client_sock, "ERROR: Invalid chunk list\n");
+    } else if (valid > 0 && !dedup_enabled) {
+        send_response(client_sock, "ERROR: Deduplication disabled\n");
+    } else if (valid > 0) {
+        // Chunks the client is told the server has must stay until the manifest names them
+        dedup_pin();
+
+        // Ask for each missing chunk once, even if the file repeats it
+        for (size_t i = 0; i < count; i++) by_digest[i] = &chunks[i];
+        qsort(by_digest, count, sizeof(ChunkRef *), compare_chunk_digests);
+        size_t needed = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0 && memcmp(by_digest[i - 1]->digest, by_digest[i]->digest, SHA256_DIGEST_SIZE) == 0) {
+                continue;
+            }
+            if (!dedup_has_chunk(by_digest[i]->digest)) {
+                order[needed++] = (size_t)(by_digest[i] - chunks);
+            }
+        }
+        // Ask in file order, the client reads its file front to back
+        qsort(order, needed, sizeof(size_t), compare_chunk_indices);
+
+        char *reply = malloc(32 + needed * 24);
+        if (!reply) {
+            result = -1;
+        } else {
+            size_t len = sprintf(reply, "NEED %zu\n", needed);
+            for (size_t i = 0; i < needed; i++) {
+                len += sprintf(reply + len, "%zu\n", order[i]);
+            }
+            result = send_all(client_sock, reply, len);
+            free(reply);
+        }
+
+        // Receive the chunks; a bad one is still read, so the session stays in sync
+        int stored = 1, matched = 1;
+        for (size_t i = 0; i < needed && result == 0; i++) {
+            ChunkRef *chunk = &chunks[order[i]];
+            if (conn_read_full(&conn->reader, buffer, chunk->length) < 0) {
+                result = -1;
+                break;
+            }
+            unsigned char digest[SHA256_DIGEST_SIZE];
+            Sha256 sha;
+            sha256_init(&sha);
+            sha256_update(&sha, buffer, chunk->length);
+            sha256_final(&sha, digest);
+            if (memcmp(digest, chunk->digest, SHA256_DIGEST_SIZE) != 0) {
+                matched = 0;
+            } else if (dedup_put_chunk(digest, buffer, chunk->length) != 0) {
+                stored = 0;
+            }
+        }
+
+        if (result == 0) {
+            if (!matched) {
+                send_response(client_sock, "ERROR: Chunk hash mismatch\n");
+            } else if (!stored || publish_manifest(remote_path, chunks, count) != 0) {
+                send_response(client_sock, "ERROR: Unable to write file\n");
+            } else {
+                send_response(client_sock, "OK\n");
+                printf("File %s written (%lld bytes, %zu of %zu chunks received)\n", remote_path, total, needed,
+                       count);
+            }
+        }
+        dedup_unpin();
+    }
+    free(chunks);
+    free(by_digest);
+    free(order);
+    free(buffer);
+    return result;
+}
+
+/**
+ * @brief Sends the block signatures of a file, the base a client encodes a delta against.
+ * 
+ *        The reply is "SIGS <size> <block_size> <count>" and count lines "<rolling> <sha256>",
+ *        one per full block in file order (see delta.h). The file is read under the path's
+ *        shared lock, so the signatures describe one version of it. Files kept in the chunk
+ *        store are reported missing: uploads with deduplication on skip known chunks anyway.
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file.
+ * @return int 0 on success, -1 if the connection failed.
+ */
+int send_signatures(int client_sock, const char *remote_path) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+
+    FileLock *lock = file_lock_acquire(remote_path, 0);
+    int fd = open(full_path, O_RDONLY);
+    struct stat st;
+    BlockSignature *sigs = NULL;
+    size_t count = 0;
+    uint32_t block_size = 0;
+    int found = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (found) {
+        block_size = delta_block_size(st.st_size);
+        found = delta_signatures(fd, st.st_size, block_size, &sigs, &count) == 0;
+    }
+    if (fd >= 0) close(fd);
+    file_lock_release(lock);
+
+    if (!found) {
+        free(sigs);
+        send_response(client_sock, "ERROR: File not found\n");
+        return 0;
+    }
+
+    // Batch the lines into large sends; a signature line is 74 bytes
+    size_t capacity = 64 * 1024, len;
+    char *reply = malloc(capacity);
+    int result = reply ? 0 : -1;
+    if (result == 0) {
+        len = sprintf(reply, "SIGS %lld %u %zu\n", (long long)st.st_size, block_size, count);
+        for (size_t i = 0; i < count && result == 0; i++) {
+            char hex[CHUNK_HEX_SIZE];
+            chunk_digest_hex(sigs[i].digest, hex);
+            len += sprintf(reply + len, "%08x %s\n", sigs[i].rolling, hex);
+            if (len > capacity - 128) {
+                result = send_all(client_sock, reply, len);
+                len = 0;
+            }
+        }
+        if (result == 0 && len > 0) {
+            result = send_all(client_sock, reply, len);
+        }
+    }
+    free(reply);
+    free(sigs);
+    return result;
+}
+
+/**
+ * @brief Receives a file as a delta against the server's current version of it.
+ * 
+ *        The command line is followed by the ops of delta.h. The new file is rebuilt in the
+ *        temp file "<path>.partial": copied blocks are read from the base file, literal bytes
+ *        from the connection. It is committed (see commit_upload()) only if it has the
+ *        announced size and SHA-256. The base must still have the size the client's
+ *        signatures were taken at; if it was replaced since, the client is told so and may
+ *        send the whole file instead. The ops are always read to END, so the session
+ *        stays in sync.
+ * 
+ * @param conn        The client's connection.
+ * @param remote_path Path (relative to ROOT_FOLDER) where the file should be saved.
+ * @param total       Size of the new file.
+ * @param base_size   Size of the base file the delta was encoded against.
+ * @param block_size  Block size of the signatures the delta was encoded against.
+ * @return int 0 if the session can continue, -1 if the connection must be closed.
+ */
+int receive_delta(Connection *conn, const char *remote_path, long long total, long long base_size,
+                  uint32_t block_size) {
+    int client_sock = conn->client_sock;
+    char full_path[2048], partial_path[2100], partial_key[1100];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+    snprintf(partial_path, sizeof(partial_path), "%s%s", full_path, PARTIAL_SUFFIX);
+    snprintf(partial_key, sizeof(partial_key), "%s%s", remote_path, PARTIAL_SUFFIX);
+
+    // One upload of a path at a time; the base is read through its own descriptor, so a
+    // commit of the path meanwhile does not change the blocks being copied
+    FileLock *upload_lock = file_lock_acquire(partial_key, 1);
+    make_parent_dirs(full_path);
+
+    int base_fd = open(full_path, O_RDONLY);
+    struct stat st;
+    int stale = base_fd < 0 || fstat(base_fd, &st) != 0 || st.st_size != base_size
+                || block_size != delta_block_size(base_size);
+    int fd = open(partial_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    unsigned char *buffer = malloc(DELTA_LITERAL_MAX);
+    int write_failed = fd < 0, invalid = 0;
+    int result = buffer ? 0 : -1;
+    long long written = 0;
+    char hex[CHUNK_HEX_SIZE + 1] = {0};
+    Sha256 sha;
+    sha256_init(&sha);
+
+    while (result == 0) {
+        char line[256];
+        size_t first, count, len;
+        if (conn_read_line(&conn->reader, line, sizeof(line)) < 0) {
+            result = -1;
+        } else if (sscanf(line, "C %zu %zu", &first, &count) == 2) {
+            // Copy base blocks, one block at a time through the buffer
+            if (stale || invalid || write_failed) continue;
+            size_t blocks = (size_t)(base_size / block_size);
+            if (count == 0 || first > blocks || count > blocks - first
+                || (long long)count * block_size > total - written) {
+                invalid = 1;
+                continue;
+            }
+            for (size_t i = 0; i < count && !write_failed; i++) {
+                off_t from = (off_t)(first + i) * block_size;
+                if (pread(base_fd, buffer, block_size, from) != (ssize_t)block_size
+                    || pwrite(fd, buffer, block_size, written) != (ssize_t)block_size) {
+                    write_failed = 1;
+                    break;
+                }
+                sha256_update(&sha, buffer, block_size);
+                written += block_size;
+            }
+        } else if (sscanf(line, "L %zu", &len) == 1 && len > 0 && len <= DELTA_LITERAL_MAX) {
+            if (conn_read_full(&conn->reader, buffer, len) < 0) {
+                result = -1;
+            } else if (stale || invalid || write_failed) {
+                continue;
+            } else if ((long long)len > total - written) {
+                invalid = 1;
+            } else if (pwrite(fd, buffer, len, written) != (ssize_t)len) {
+                write_failed = 1;
+            } else {
+                sha256_update(&sha, buffer, len);
+                written += len;
+            }
+        } else if (sscanf(line, "END %65s", hex) == 1) {
+            break;
+        } else {
+            send_response(client_sock, "ERROR: Invalid delta\n");
+            result = -1; // The length of whatever follows is unknown
+        }
+    }
+
+    int committed = 0;
+    if (result == 0) {
+        unsigned char digest[SHA256_DIGEST_SIZE], expected[SHA256_DIGEST_SIZE];
+        sha256_final(&sha, digest);
+        if (stale) {
+            send_response(client_sock, "ERROR: Base file changed\n");
+        } else if (write_failed) {
+            perror("Delta write failed");
+            send_response(client_sock, "ERROR: Unable to write file\n");
+        } else if (invalid || written != total || chunk_parse_hex(hex, expected) != 0
+                   || memcmp(digest, expected, SHA256_DIGEST_SIZE) != 0) {
+            send_response(client_sock, "ERROR: Delta does not match\n");
+        } else {
+            committed = 1;
+            if (commit_upload(remote_path, fd, partial_path) == 0) {
+                send_response(client_sock, "OK\n");
+                printf("File %s written (%lld bytes from a delta)\n", remote_path, total);
+            } else {
+                send_response(client_sock, "ERROR: Unable to write file\n");
+            }
+        }
+    }
+    if (!committed && fd >= 0) {
+        close(fd);
+        unlink(partial_path);
+    }
+    if (base_fd >= 0) close(base_fd);
+    free(buffer);
+    file_lock_release(upload_lock);
+    return result;
+}
+
+/**
+ * @brief Receives one byte range of a file that the client uploads over several connections.
+ * 
+ *        All parts carrying the same token belong to one upload. The first part to arrive
+ *        creates a temp file of the total size (see join_upload()); each part
+ *        claims its range (see claim_part_range()) and writes it at its own offset with
+ *        pwrite/splice, so parts proceed in parallel without a lock. A part repeating a range
+ *        already written is answered OK without writing it again; one overlapping another
+ *        part otherwise is refused. Once every byte has landed the temp file is renamed over
+ *        remote_path, so readers see either the old file or the complete new one.
+ *        The body is always consumed, so the session stays in sync.
+ * 
+ * @param conn        The client's connection; body bytes already buffered are used first.
+ * @param remote_path Path (relative to ROOT_FOLDER) where the file should be saved.
+ * @param total       Size of the whole file.
+ * @param offset      Position of this part in the file.
+ * @param length      Number of body bytes that follow.
+ * @param token       ID shared by all parts of the upload.
+ * @return int 0 on success, 1 if the part could not be written, 2 if the range does not fit
+ *         the file or overlaps another part, -1 if the connection dropped.
+ */
+int receive_part(Connection *conn, const char *remote_path, long long total, long long offset, long long length,
+                 const char *token) {
+    if (total <= 0 || offset < 0 || length < 0 || offset > total - length) {
+        return conn_discard(&conn->reader, length) == 0 ? 2 : -1;
+    }
+
+    Upload *upload = join_upload(remote_path, total, token);
+    if (!upload) {
+        return conn_discard(&conn->reader, length) == 0 ? 1 : -1;
+    }
+
+    int claim = claim_part_range(upload, offset, length);
+    if (claim != 0) {
+        return conn_discard(&conn->reader, length) == 0 ? (claim > 0 ? 0 : 2) : -1;
+    }
+
+    // Claimed ranges never overlap, so parts write into the shared file without further locking
+    int result = recv_file_range(&conn->reader, upload->fd, offset, length);
+    if (finish_upload_part(upload, offset, length, result == 0) < 0 && result == 0) {
+        result = 1;
+    }
+    return result;
+}
+
+/**
+ * @brief Finds the upload a part belongs to, or starts it, and registers the part as active.
+ * 
+ *        A new upload gets the temp file "<path>.part.<token>" next to its destination, sized
+ *        to the total and preallocated as far as the disk allows (see preallocate_blocks()).
+ *        Its slot is reserved first and the file is created after uploads_mutex is released,
+ *        so slow file system calls never hold up the parts of other uploads; parts of the
+ *        same upload wait until the file exists. Uploads that have been abandoned for
+ *        UPLOAD_TIMEOUT are reclaimed (and their temp files removed) when a slot is needed.
+ * 
+ * @param remote_path Destination path (relative to ROOT_FOLDER).
+ * @param total       Size of the whole file; must match the upload's size.
+ * @param token       ID shared by all parts of the upload.
+ * @return Upload* The upload, or NULL if the table is full or the temp file cannot be created.
+ */
+Upload *join_upload(const char *remote_path, long long total, const char *token) {
+    time_t now = time(NULL);
+    Upload *free_slot = NULL;
+    int abandoned_fd = -1;
+    char abandoned_path[2100];
+
+    pthread_mutex_lock(&uploads_mutex);
+    for (int i = 0; i < MAX_UPLOADS; i++) {
+        Upload *upload = &uploads[i];
+        if (upload->in_use && strcmp(upload->token, token) == 0 && strcmp(upload->path, remote_path) == 0) {
+            if (upload->opening) {
+                // Another part is creating the temp file; look again once it is done
+                pthread_cond_wait(&upload_opened, &uploads_mutex);
+                free_slot = NULL;
+                i = -1;
+                continue;
+            }
+            if (upload->total != total) {
+                pthread_mutex_unlock(&uploads_mutex);
+                return NULL;
+            }
+            upload->active++;
+            upload->last_active = now;
+            pthread_mutex_unlock(&uploads_mutex);
+            return upload;
+        }
+        if (free_slot) continue;
+        if (!upload->in_use) {
+            free_slot = upload;
+        } else if (abandoned_fd < 0 && !upload->opening && upload->active == 0
+                   && now - upload->last_active >= UPLOAD_TIMEOUT) {
+            // Its temp file is closed and removed below, outside the lock
+            printf("Abandoned upload of %s reclaimed\n", upload->path);
+            abandoned_fd = upload->fd;
+            strcpy(abandoned_path, upload->temp_path);
+            free(upload->ranges);
+            upload->in_use = 0;
+            free_slot = upload;
+        }
+    }
+    if (!free_slot) {
+        pthread_mutex_unlock(&uploads_mutex);
+        return NULL;
+    }
+    strcpy(free_slot->path, remote_path);
+    strcpy(free_slot->token, token);
+    free_slot->fd = -1;
+    free_slot->opening = 1;
+    free_slot->total = total;
+    free_slot->received = 0;
+    free_slot->ranges = NULL;
+    free_slot->range_count = 0;
+    free_slot->range_capacity = 0;
+    free_slot->active = 1;
+    free_slot->last_active = now;
+    free_slot->in_use = 1;
+    pthread_mutex_unlock(&uploads_mutex);
+
+    if (abandoned_fd >= 0) {
+        close(abandoned_fd);
+        unlink(abandoned_path);
+    }
+
+    // Create intermediate directories if needed
+    char full_path[2048], temp_path[2100];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+    make_parent_dirs(full_path);
+
+    snprintf(temp_path, sizeof(temp_path), "%s.part.%s", full_path, token);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, total) != 0) {
+        perror("Temp file create failed");
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp_path);
+        }
+        fd = -1;
+    } else {
+        // Reserve the blocks up front so the parallel ranges are laid out contiguously
+        preallocate_blocks(fd, 0, 0, total);
+    }
+
+    pthread_mutex_lock(&uploads_mutex);
+    strcpy(free_slot->temp_path, temp_path);
+    free_slot->fd = fd;
+    free_slot->opening = 0;
+    if (fd < 0) free_slot->in_use = 0;
+    pthread_cond_broadcast(&upload_opened);
+    pthread_mutex_unlock(&uploads_mutex);
+    return fd >= 0 ? free_slot : NULL;
+}
+
+/**
+ * @brief Claims the byte range of a part, so no other part writes into it meanwhile.
+ * 
+ *        A range that was written already (a part sent again after its reply was lost)
+ *        needs nothing more. A range overlapping another part otherwise, running or written,
+ *        is refused: the upload could no longer tell when every byte has landed. A part
+ *        that claims nothing leaves the upload (see join_upload()).
+ * 
+ * @param upload The upload the part belongs to.
+ * @param offset Position of the part in the file.
+ * @param length Number of bytes in the part.
+ * @return int 0 if the range was claimed, 1 if it is empty or written already, -1 if it overlaps
+ *         another part or cannot be recorded.
+ */
+int claim_part_range(Upload *upload, long long offset, long long length) {
+    long long end = offset + length;
+    pthread_mutex_lock(&uploads_mutex);
+    int result = 0, i = 0;
+    while (i < upload->range_count && upload->ranges[i].end <= offset) {
+        i++;
+    }
+    if (length == 0) {
+        result = 1; // Nothing to write
+    } else if (i < upload->range_count && upload->ranges[i].offset < end) {
+        const PartRange *range = &upload->ranges[i];
+        result = range->done && range->offset <= offset && range->end >= end ? 1 : -1;
+    } else if (upload->range_count == upload->range_capacity) {
+        int capacity = upload->range_capacity ? upload->range_capacity * 2 : 16;
+        PartRange *grown = realloc(upload->ranges, capacity * sizeof(PartRange));
+        if (grown) {
+            upload->ranges = grown;
+            upload->range_capacity = capacity;
+        } else {
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        memmove(&upload->ranges[i + 1], &upload->ranges[i], (upload->range_count - i) * sizeof(PartRange));
+        upload->ranges[i] = (PartRange){ .offset = offset, .end = end, .done = 0 };
+        upload->range_count++;
+    } else {
+        upload->active--;
+        upload->last_active = time(NULL);
+    }
+    pthread_mutex_unlock(&uploads_mutex);
+    return result;
+}
+
+/**
+ * @brief Drops entry i of an upload's claimed ranges.
+ */
+static void remove_part_range(Upload *upload, int i) {
+    memmove(&upload->ranges[i], &upload->ranges[i + 1], (upload->range_count - i - 1) * sizeof(PartRange));
+    upload->range_count--;
+}
+
+/**
+ * @brief Marks a part of an upload as done and commits the file once all bytes have landed.
+ * 
+ *        The commit renames the temp file over the destination (see commit_upload()).
+ *        A failed part gives up its range and leaves the upload open, so the client may
+ *        send that range again.
+ * 
+ * @param upload  The upload the part belongs to.
+ * @param offset  Position of the part in the file, as claimed.
+ * @param length  Number of bytes in the part.
+ * @param written Non-zero if the part was received completely.
+ * @return int 0 if the part was recorded (and the file committed if it was the last one),
+ *         -1 if the commit failed.
+ */
+int finish_upload_part(Upload *upload, long long offset, long long length, int written) {
+    pthread_mutex_lock(&uploads_mutex);
+    upload->active--;
+    upload->last_active = time(NULL);
+    int i = 0;
+    while (i < upload->range_count && (upload->ranges[i].offset != offset || upload->ranges[i].done)) {
+        i++;
+    }
+    if (i < upload->range_count && !written) {
+        remove_part_range(upload, i);
+    } else if (i < upload->range_count) {
+        PartRange *ranges = upload->ranges;
+        upload->received += length;
+        ranges[i].done = 1;
+        // Merge with written neighbours, so a retry spanning several parts is recognized
+        if (i + 1 < upload->range_count && ranges[i + 1].done && ranges[i + 1].offset == ranges[i].end) {
+            ranges[i].end = ranges[i + 1].end;
+            remove_part_range(upload, i + 1);
+        }
+        if (i > 0 && ranges[i - 1].done && ranges[i - 1].end == ranges[i].offset) {
+            ranges[i - 1].end = ranges[i].end;
+            remove_part_range(upload, i);
+        }
+    }
+    if (upload->received < upload->total || upload->active > 0) {
+        pthread_mutex_unlock(&uploads_mutex);
+        return 0;
+    }
+
+    // Last part: take the upload out of the table, then commit it
+    char path[1024], temp_path[2100];
+    strcpy(path, upload->path);
+    strcpy(temp_path, upload->temp_path);
+    int fd = upload->fd;
+    free(upload->ranges);
+    upload->in_use = 0;
+    pthread_mutex_unlock(&uploads_mutex);
+
+    int result = commit_upload(path, fd, temp_path);
+    if (result == 0) {
+        printf("File %s committed from parts\n", path);
+    }
+    return result;
+}
+
+/**
+ * @brief Opens a plain file for sending, from the file cache when possible.
+ * 
+ *        Hot files are served from memory: one stat, no open or read. Otherwise the file is
+ *        opened and, if small enough and read before, loaded into the cache on the way (see
+ *        filecache.c); a first read is sent from the descriptor, zero-copy.
+ *        No lock is needed: uploads replace files by rename, so what is returned is always a
+ *        whole version of the file.
+ * 
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file.
+ * @param st          Receives the file's attributes.
+ * @param fd          Receives an open descriptor, or -1 when the file came from the cache.
+ * @param cached      Receives the cache entry (release with file_cache_release()), or NULL.
+ * @return int 0 if exactly one of *fd and *cached is set, -1 if there is no such plain file.
+ */
+int open_for_read(const char *remote_path, struct stat *st, int *fd, CachedFile **cached) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+
+    *fd = -1;
+    *cached = NULL;
+    if (stat(full_path, st) == 0 && S_ISREG(st->st_mode)) {
+        *cached = file_cache_lookup(remote_path, st);
+        if (*cached) {
+            return 0;
+        }
+    }
+    long long start = stats_now_ns();
+    *fd = open(full_path, O_RDONLY);
+    if (*fd < 0 || fstat(*fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+        return -1;
+    }
+    *cached = file_cache_load(remote_path, *fd, st);
+    if (*cached) {
+        close(*fd);
+        *fd = -1;
+    }
+    stats_add_latency(STAT_DISK_READ, stats_now_ns() - start);
+    return 0;
+}
+
+/**
+ * @brief Sends a file from the server to the client.
+ * 
+ *        Constructs the full file path, opens the file, and sends a header containing
+ *        the file size. Files up to FILE_CACHE_MAX_FILE are kept in the in-memory file cache
+ *        (see filecache.c) and sent from there, header and body in one gather send. Larger
+ *        files go from the page cache straight to the socket (see send_file_range()); the
+ *        socket is corked meanwhile, so the SIZE header leaves in the same segment as the
+ *        first bytes of the file. If the file does not exist, an error message is sent instead.
+ * 
+ *        Only the bytes from offset on are sent, at most length of them. The SIZE header
+ *        carries the length of that range, which is shorter than requested when the file
+ *        ends first. An offset beyond the end of the file is an error.
+ * 
+ *        With deduplication on, a path without a plain file is looked up in the chunk store
+ *        (see send_chunked_file()).
+ * 
+ *        If the client asked for compression and a sample of the range compresses well, the
+ *        header is "SIZE <size> deflate" and the body goes out as compressed blocks (see
+ *        codec.h); incompressible ranges keep the zero-copy path.
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file to send.
+ * @param offset      First byte of the range to send.
+ * @param length      Maximum number of bytes to send, or -1 for the rest of the file.
+ * @param level       zlib level the client asked for, or 0 to send the bytes raw.
+ * @return int 0 if the response was sent completely, -1 if the body was cut short.
+ */
+int send_file(int client_sock, const char *remote_path, long long offset, long long length, int level) {
+    struct stat st;
+    int fd;
+    CachedFile *cached;
+    if (open_for_read(remote_path, &st, &fd, &cached) != 0) {
+        if (dedup_enabled) {
+            return send_chunked_file(client_sock, remote_path, offset, length);
+        }
+        send_response(client_sock, "ERROR: File not found\n");
+        return 0;
+    }
+
+    // No lock needed: uploads replace the file by rename, so fd always refers to a whole version
+    if (offset > st.st_size) {
+        if (fd >= 0) close(fd);
+        file_cache_release(cached);
+        send_response(client_sock, "ERROR: Invalid range\n");
+        return 0;
+    }
+    long long file_size = st.st_size - offset;
+    if (length >= 0 && length < file_size) file_size = length;
+
+    // Compress only when a sample shows it pays off
+    int compress = level > 0 && (cached ? codec_worth_compressing(cached->data + offset, (size_t)file_size)
+                                        : codec_file_worth_compressing(fd, offset, file_size));
+
+    char header[128];
+    snprintf(header, sizeof(header), compress ? "SIZE %lld " CODEC_NAME "\n" : "SIZE %lld\n", file_size);
+    int result;
+    int from_cache = cached != NULL;
+    if (compress) {
+        set_cork(client_sock, 1);
+        result = send_all(client_sock, header, strlen(header));
+        if (result == 0) {
+            result = cached ? send_compressed_buffer(client_sock, cached->data + offset, (size_t)file_size, level)
+                            : send_compressed_range(client_sock, fd, offset, file_size, level);
+        }
+        set_cork(client_sock, 0);
+        if (cached) file_cache_release(cached);
+        if (fd >= 0) close(fd);
+    } else if (cached) {
+        // Header and body leave in one gather send
+        struct iovec iov[2] = {
+            { .iov_base = header, .iov_len = strlen(header) },
+            { .iov_base = cached->data + offset, .iov_len = (size_t)file_size },
+        };
+        result = send_iov(client_sock, iov, 2);
+        file_cache_release(cached);
+    } else {
+        // Send file size as header, held back until the first body segment fills it up
+        set_cork(client_sock, 1);
+        result = send_all(client_sock, header, strlen(header));
+
+        // Send file content without copying it through user space
+        if (result == 0) {
+            result = send_file_range(client_sock, fd, offset, file_size);
+        }
+        set_cork(client_sock, 0);
+        close(fd);
+    }
+    printf("Sent file %s (%lld bytes at %lld%s%s)\n", remote_path, file_size, offset,
+           from_cache ? ", cached" : "", compress ? ", deflate" : "");
+    return result;
+}
+
+/**
+ * @brief Sends a file, or a byte range of it, from the chunk store.
+ * 
+ *        Loads the path's manifest and answers like send_file(): a SIZE header with the
+ *        length of the range, then the bytes, each chunk straight from its chunk file (see
+ *        dedup_send_range()). No path lock is needed: a manifest is replaced by rename, and
+ *        the loaded manifest holds the store, so its chunks are not collected meanwhile.
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file to send.
+ * @param offset      First byte of the range to send.
+ * @param length      Maximum number of bytes to send, or -1 for the rest of the file.
+ * @return int 0 if the response was sent completely, -1 if the body was cut short.
+ */
+int send_chunked_file(int client_sock, const char *remote_path, long long offset, long long length) {
+    ChunkRef *chunks;
+    size_t count;
+    long long total;
+    if (dedup_load_manifest(remote_path, &chunks, &count, &total) != 0) {
+        send_response(client_sock, "ERROR: File not found\n");
+        return 0;
+    }
+    if (offset > total) {
+        dedup_free_manifest(chunks);
+        send_response(client_sock, "ERROR: Invalid range\n");
+        return 0;
+    }
+    long long file_size = total - offset;
+    if (length >= 0 && length < file_size) file_size = length;
+
+    char header[128];
+    snprintf(header, sizeof(header), "SIZE %lld\n", file_size);
+    set_cork(client_sock, 1);
+    int result = send_all(client_sock, header, strlen(header));
+    if (result == 0) {
+        result = dedup_send_range(client_sock, chunks, count, offset, file_size);
+    }
+    set_cork(client_sock, 0);
+    dedup_free_manifest(chunks);
+    printf("Sent file %s (%lld bytes at %lld, %zu chunks)\n", remote_path, file_size, offset, count);
+    return result;
+}
+
+/**
+ * @brief Reports how many bytes of an interrupted upload the server holds.
+ * 
+ *        A client resuming an interrupted WRITE asks for this length first and then sends
+ *        the rest of its file from there. It is the length of the path's temp file, or 0 if
+ *        no upload of the path was cut off. The reply is "OFFSET <length>".
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file.
+ */
+void send_committed_length(int client_sock, const char *remote_path) {
+    char partial_path[2100], partial_key[1100];
+    snprintf(partial_path, sizeof(partial_path), "%s/%s%s", ROOT_FOLDER, remote_path, PARTIAL_SUFFIX);
+    snprintf(partial_key, sizeof(partial_key), "%s%s", remote_path, PARTIAL_SUFFIX);
+
+    // Wait for a running upload of the path, so it is not measured halfway
+    FileLock *upload_lock = file_lock_acquire(partial_key, 0);
+    struct stat st;
+    long long length = stat(partial_path, &st) == 0 && S_ISREG(st.st_mode) ? (long long)st.st_size : 0;
+    file_lock_release(upload_lock);
+
+    char response[128];
+    snprintf(response, sizeof(response), "OFFSET %lld\n", length);
+    send_response(client_sock, response);
+}
+
+/**
+ * @brief Reports the size of a file, without sending it.
+ * 
+ *        The reply is "SIZE <size>", like the header of a GET, or an error if the path is
+ *        not a file. A multi-stream GET uses it to split the file into ranges.
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file.
+ */
+void send_file_size(int client_sock, const char *remote_path) {
+    long long size;
+    char response[128];
+    if (lookup_file_size(remote_path, &size) == 0) {
+        snprintf(response, sizeof(response), "SIZE %lld\n", size);
+    } else {
+        snprintf(response, sizeof(response), "ERROR: File not found\n");
+    }
+    send_response(client_sock, response);
+}
+
+/**
+ * @brief Looks up the size of a plain or (with deduplication on) chunked file.
+ * 
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file.
+ * @param size        Receives the size.
+ * @return int 0 on success, -1 if the path is not a file.
+ */
+int lookup_file_size(const char *remote_path, long long *size) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+
+    struct stat st;
+    ChunkRef *chunks = NULL;
+    size_t count;
+    int result = 0;
+    if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        *size = st.st_size;
+    } else if (!dedup_enabled || dedup_load_manifest(remote_path, &chunks, &count, size) != 0) {
+        result = -1;
+    }
+    dedup_free_manifest(chunks);
+    return result;
+}
+
+/**
+ * @brief Removes a file or directory from the server.
+ * 
+ *        Constructs the full path of the file or directory, checks if it exists,
+ *        and then removes it (see remove_path()). The client is notified of the
+ *        operation result.
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file or directory to remove.
+ */
+void remove_file_or_dir(int client_sock, const char *remote_path) {
+    int result = remove_path(remote_path);
+    if (result == 0) {
+        send_response(client_sock, "OK\n");
+    } else if (result == 1) {
+        send_response(client_sock, "ERROR: File not found\n");
+    } else {
+        send_response(client_sock, "ERROR: Unable to delete\n");
+    }
+}
+
+/**
+ * @brief Removes a file or an empty directory under the path's exclusive lock.
+ * 
+ *        A directory is removed with `rmdir`, anything else with `remove`. With
+ *        deduplication on, the path's manifest goes too. A removed path is logged for the
+ *        replicas.
+ * 
+ * @param remote_path Path (relative to ROOT_FOLDER) of the file or directory to remove.
+ * @return int 0 if it was removed, 1 if it does not exist, -1 if it could not be removed.
+ */
+int remove_path(const char *remote_path) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+
+    // Acquire an exclusive lock on the file
+    FileLock *lock = file_lock_acquire(remote_path, 1);
+
+    struct stat st;
+    int found = stat(full_path, &st) == 0;
+    int result = 0;
+    if (dedup_enabled) {
+        // A chunked file only has its manifest; a directory also has one in the manifest tree
+        if (dedup_remove_manifest(remote_path) == 0) {
+            found = 1;
+        } else if (errno != ENOENT) {
+            result = -1;
+        }
+    }
+    if (!found) {
+        file_lock_release(lock);
+        return 1;
+    }
+
+    if (result == 0 && stat(full_path, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            result = rmdir(full_path);
+        } else {
+            result = remove(full_path);
+        }
+    }
+
+    if (result == 0) {
+        file_cache_invalidate(remote_path);
+        printf("Deleted: %s\n", full_path);
+    } else {
+        perror("Remove failed");
+    }
+
+    // Unlock file
+    file_lock_release(lock);
+    if (result == 0) {
+        replica_log(remote_path);
+    }
+    return result;
+}
+
+/**
+ * @brief Leaves the server's own files out of tree listings: temp files of uploads in
+ *        progress and the chunk store.
+ */
+static int skip_internal(const char *name) {
+    size_t len = strlen(name);
+    return (len > strlen(PARTIAL_SUFFIX) && strcmp(name + len - strlen(PARTIAL_SUFFIX), PARTIAL_SUFFIX) == 0)
+           || strstr(name, ".part.") || strstr(name, ".tmp.")
+           || strcmp(name, DEDUP_CHUNK_DIR) == 0 || strcmp(name, DEDUP_MANIFEST_DIR) == 0;
+}
+
+/**
+ * @brief Lists a directory tree of the server: its plain files and, with deduplication on,
+ *        the chunked files of the manifest tree.
+ * 
+ * @param remote_dir Directory (relative to ROOT_FOLDER).
+ * @param entries    Receives the list (free with tree_free()).
+ * @param count      Receives the number of entries.
+ * @return int 0 on success, -1 if the directory does not exist.
+ */
+int list_tree(const char *remote_dir, TreeEntry **entries, size_t *count) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_dir);
+    int result = tree_list(full_path, skip_internal, entries, count);
+    if (dedup_enabled) {
+        TreeEntry *chunked;
+        size_t chunked_count;
+        snprintf(full_path, sizeof(full_path), "%s/%s/%s", ROOT_FOLDER, DEDUP_MANIFEST_DIR, remote_dir);
+        if (tree_list(full_path, skip_internal, &chunked, &chunked_count) == 0) {
+            result = tree_merge(entries, count, chunked, chunked_count);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Joins a directory and a path inside it ("" for ROOT_FOLDER itself).
+ * 
+ * @param remote_path Receives the path, relative to ROOT_FOLDER.
+ * @param remote_dir  Directory (relative to ROOT_FOLDER), or "".
+ * @param path        Path relative to remote_dir.
+ * @return int 0 on success, -1 if the result does not fit.
+ */
+static int join_remote_path(char remote_path[1024], const char *remote_dir, const char *path) {
+    int len = snprintf(remote_path, 1024, "%s%s%s", remote_dir, *remote_dir ? "/" : "", path);
+    return len < 1024 ? 0 : -1;
+}
+
+/**
+ * @brief Stores one entry of a tree stream below remote_dir: creates a directory, or
+ *        receives a file like a WRITE (see receive_file()), into a temp file renamed into
+ *        place once complete. Tree streams are not resumed, so the temp file of a file cut
+ *        off by a dropped connection is removed. An entry whose path is unsafe or too long
+ *        is skipped (the bytes of a file are drained).
+ * 
+ * @param conn       The client's connection.
+ * @param remote_dir Directory (relative to ROOT_FOLDER) to store the tree in, or "".
+ * @param path       Path of the entry in the tree.
+ * @param is_dir     Non-zero for a directory.
+ * @param size       Size of a file.
+ * @return int 0 if the entry was stored, 1 if it was skipped or could not be written,
+ *         -1 if the connection dropped.
+ */
+static int receive_tree_entry(Connection *conn, const char *remote_dir, const char *path, int is_dir,
+                              long long size) {
+    char remote_path[1024];
+    int valid = tree_path_ok(path) && join_remote_path(remote_path, remote_dir, path) == 0;
+    if (is_dir) {
+        if (!valid) return 1;
+        char full_path[2048];
+        snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+        tree_make_dirs(full_path);
+        replica_log(remote_path);
+        return 0;
+    }
+    if (!valid) {
+        return conn_discard(&conn->reader, size) == 0 ? 1 : -1;
+    }
+    int result = receive_file(conn, remote_path, size, 0, 0);
+    if (result < 0) {
+        char partial_path[2100], partial_key[1100];
+        snprintf(partial_path, sizeof(partial_path), "%s/%s%s", ROOT_FOLDER, remote_path, PARTIAL_SUFFIX);
+        snprintf(partial_key, sizeof(partial_key), "%s%s", remote_path, PARTIAL_SUFFIX);
+        FileLock *upload_lock = file_lock_acquire(partial_key, 1);
+        unlink(partial_path);
+        file_lock_release(upload_lock);
+    }
+    return result;
+}
+
+/**
+ * @brief Receives a directory tree streamed by PUTDIR (see tree.h) into remote_dir.
+ * 
+ *        Directories are created as they arrive, and every file is received like a WRITE
+ *        (see receive_tree_entry()). Nothing is answered per entry, so the whole tree costs
+ *        one round trip. Entries whose path is unsafe or too long, and files that cannot be
+ *        written, are skipped and counted. The reply after END is "OK <files> <bytes>", or an
+ *        error with the number of entries that failed.
+ * 
+ * @param conn       The client's connection.
+ * @param remote_dir Directory (relative to ROOT_FOLDER) to store the tree in.
+ * @return int 0 if the session can continue, -1 if the connection must be closed.
+ */
+int receive_tree(Connection *conn, const char *remote_dir) {
+    long long files = 0, bytes = 0;
+    int failed = 0;
+    char line[2048];
+    while (1) {
+        if (conn_read_line(&conn->reader, line, sizeof(line)) < 0) {
+            return -1;
+        }
+        int is_dir;
+        long long size;
+        char path[1024];
+        int kind = tree_parse_entry(line, &is_dir, &size, path, sizeof(path));
+        if (kind == 1) {
+            break;
+        }
+        if (kind < 0) {
+            send_response(conn->client_sock, "ERROR: Invalid tree entry\n");
+            return -1;
+        }
+
+        int result = receive_tree_entry(conn, remote_dir, path, is_dir, size);
+        if (result < 0) {
+            return -1;
+        }
+        if (result > 0) {
+            failed++;
+        } else if (!is_dir) {
+            files++;
+            bytes += size;
+        }
+    }
+
+    char response[128];
+    if (failed > 0) {
+        snprintf(response, sizeof(response), "ERROR: %d entries could not be written\n", failed);
+    } else {
+        snprintf(response, sizeof(response), "OK %lld %lld\n", files, bytes);
+    }
+    printf("Tree %s received (%lld files, %lld bytes, %d failed)\n", remote_dir, files, bytes, failed);
+    send_response(conn->client_sock, response);
+    return 0;
+}
+
+/**
+ * @brief Opens a file of a tree being sent by GETDIR or to a replica (see TreeSource).
+ *        A chunked file has no descriptor; send_tree_chunked() sends it.
+ */
+static int open_tree_file(void *ctx, const char *path, int *fd, long long *size) {
+    char remote_path[1024], full_path[2048];
+    if (join_remote_path(remote_path, (const char *)ctx, path) != 0) {
+        return -1;
+    }
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+    struct stat st;
+    *fd = open(full_path, O_RDONLY);
+    if (*fd >= 0 && fstat(*fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        *size = st.st_size;
+        return 0;
+    }
+    if (*fd >= 0) close(*fd);
+    *fd = -1;
+    return lookup_file_size(remote_path, size);
+}
+
+/**
+ * @brief Sends the body of a chunked file of a tree being sent by GETDIR or to a replica
+ *        (see TreeSource).
+ */
+static int send_tree_chunked(void *ctx, int sock, const char *path, long long size) {
+    char remote_path[1024];
+    ChunkRef *chunks = NULL;
+    size_t count;
+    long long total;
+    if (join_remote_path(remote_path, (const char *)ctx, path) != 0
+        || dedup_load_manifest(remote_path, &chunks, &count, &total) != 0 || total != size) {
+        dedup_free_manifest(chunks);
+        return -1; // Replaced since it was opened; the stream cannot carry the new size
+    }
+    int result = dedup_send_range(sock, chunks, count, 0, size);
+    dedup_free_manifest(chunks);
+    return result;
+}
+
+/**
+ * @brief Sends a directory tree for GETDIR: "TREE", then the entries (see tree.h) and END.
+ * 
+ *        The tree is listed first (see list_tree()), then streamed with tree_send(), whose
+ *        reader threads open and read files ahead of the socket. No lock is taken: uploads
+ *        replace files by rename, so every file goes out as one whole version.
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param remote_dir  Directory (relative to ROOT_FOLDER) to send.
+ * @return int 0 if the response was sent completely, -1 if it was cut short.
+ */
+int send_tree(int client_sock, const char *remote_dir) {
+    TreeEntry *entries;
+    size_t count;
+    if (list_tree(remote_dir, &entries, &count) != 0) {
+        send_response(client_sock, "ERROR: Directory not found\n");
+        return 0;
+    }
+    int result = send_all(client_sock, "TREE\n", 5);
+    long long files = 0, bytes = 0;
+    if (result == 0) {
+        TreeSource source = { .open = open_tree_file, .send_body = send_tree_chunked, .ctx = (void *)remote_dir };
+        result = tree_send(client_sock, entries, count, &source, &files, &bytes);
+    }
+    tree_free(entries, count);
+    printf("Sent tree %s (%lld files, %lld bytes)\n", remote_dir, files, bytes);
+    return result;
+}
+
+/**
+ * @brief Removes the listed entries of a directory, then the directory itself, each with
+ *        remove_path() under its own path lock.
+ * 
+ * @param remote_path Path (relative to ROOT_FOLDER) of the directory.
+ * @param entries     Its tree, as listed by list_tree().
+ * @param count       Number of entries.
+ * @return int Number of paths that could not be removed.
+ */
+static int remove_entries(const char *remote_path, const TreeEntry *entries, size_t count) {
+    // Sorted by path, so walking backwards removes contents before their directory
+    int failed = 0;
+    for (size_t i = count; i-- > 0;) {
+        char path[2100];
+        snprintf(path, sizeof(path), "%s/%s", remote_path, entries[i].path);
+        if (remove_path(path) < 0) {
+            failed++;
+        }
+    }
+    if (remove_path(remote_path) < 0) {
+        failed++;
+    }
+    return failed;
+}
+
+/**
+ * @brief Removes a directory and everything below it (RM -r).
+ * 
+ *        The tree is listed (see list_tree()), then every file and, deepest first, every
+ *        directory is removed (see remove_entries()). A path that is not a directory is
+ *        removed like a plain RM.
+ * 
+ * @param client_sock Socket file descriptor for the connected client.
+ * @param remote_path Path (relative to ROOT_FOLDER) of the tree to remove.
+ */
+void remove_tree(int client_sock, const char *remote_path) {
+    TreeEntry *entries;
+    size_t count;
+    if (list_tree(remote_path, &entries, &count) != 0) {
+        remove_file_or_dir(client_sock, remote_path);
+        return;
+    }
+    int failed = remove_entries(remote_path, entries, count);
+    tree_free(entries, count);
+
+    char response[128];
+    if (failed > 0) {
+        snprintf(response, sizeof(response), "ERROR: Unable to delete %d entries\n", failed);
+    } else {
+        snprintf(response, sizeof(response), "OK\n");
+    }
+    printf("Deleted tree %s (%zu entries, %d failed)\n", remote_path, count + 1, failed);
+    send_response(client_sock, response);
+}
+
+/**
+ * @brief Tells a directory by its path (see ReplicaSource).
+ */
+static int is_remote_dir(const char *remote_path) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, remote_path);
+    struct stat st;
+    return stat(full_path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief Removes a path with everything below it, on a replica.
+ * 
+ * @param remote_path Path (relative to ROOT_FOLDER) to remove.
+ * @return int Number of paths that could not be removed.
+ */
+static int remove_all(const char *remote_path) {
+    TreeEntry *entries;
+    size_t count;
+    if (list_tree(remote_path, &entries, &count) != 0) {
+        return remove_path(remote_path) < 0;
+    }
+    int failed = remove_entries(remote_path, entries, count);
+    tree_free(entries, count);
+    return failed;
+}
+
+/**
+ * @brief Applies a file or directory of the primary's stream, on a replica: a path of the
+ *        other kind is removed first (the primary replaced it), then the entry is stored
+ *        (see receive_tree_entry()).
+ * 
+ * @return int 0 if the entry was applied, 1 if it was not, -1 if the connection dropped.
+ */
+static int apply_entry(Connection *conn, const char *path, int is_dir, long long size) {
+    char full_path[2048];
+    snprintf(full_path, sizeof(full_path), "%s/%s", ROOT_FOLDER, path);
+    struct stat st;
+    if (tree_path_ok(path) && lstat(full_path, &st) == 0 && !S_ISDIR(st.st_mode) != !is_dir) {
+        remove_all(path);
+    }
+    return receive_tree_entry(conn, "", path, is_dir, size);
+}
+
+/**
+ * @brief Applies one line of a primary's stream of changes (see replica.h), on a replica.
+ * 
+ *        Files and directories are stored like the entries of a PUTDIR (see
+ *        receive_tree_entry()), and a removed path goes with everything below it. Changes
+ *        that cannot be applied are counted, and the SEQ that ends the batch is answered
+ *        with an error instead of being echoed, so the primary sends the batch again.
+ * 
+ * @param conn The primary's connection.
+ * @return int 0 if the stream can continue, -1 if the connection must be closed.
+ */
+int handle_replication(Connection *conn) {
+    char line[2048];
+    if (conn_read_line(&conn->reader, line, sizeof(line)) < 0) {
+        printf("Primary on connection #%d disconnected\n", conn->conn_num);
+        return -1;
+    }
+
+    long long seq;
+    if (sscanf(line, "SEQ %lld", &seq) == 1) {
+        char response[128];
+        if (conn->replication_failed > 0) {
+            snprintf(response, sizeof(response), "ERROR: %d changes could not be applied\n", conn->replication_failed);
+        } else {
+            snprintf(response, sizeof(response), "SEQ %lld\n", seq);
+        }
+        conn->replication_failed = 0;
+        send_response(conn->client_sock, response);
+        return 0;
+    }
+    if (strcmp(line, "SYNC") == 0) {
+        return receive_sync(conn);
+    }
+    if (strncmp(line, "R ", 2) == 0) {
+        const char *path = line + 2;
+        if (!tree_path_ok(path) || strlen(path) >= 1024) {
+            conn->replication_failed++;
+            return 0;
+        }
+        conn->replication_failed += remove_all(path);
+        return 0;
+    }
+
+    int is_dir;
+    long long size;
+    char path[1024];
+    if (tree_parse_entry(line, &is_dir, &size, path, sizeof(path)) != 0) {
+        send_response(conn->client_sock, "ERROR: Invalid replication stream\n");
+        return -1;
+    }
+    int result = apply_entry(conn, path, is_dir, size);
+    if (result > 0) {
+        conn->replication_failed++;
+    }
+    return result < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Orders pointers to paths, as tree streams are sorted.
+ */
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Receives the whole tree of the primary after SYNC, on a replica.
+ * 
+ *        Every entry is stored like a change (see receive_tree_entry()). After END, every
+ *        local path the tree lacks is removed, so the replica ends up with exactly the
+ *        primary's tree. The SEQ that follows answers for the whole tree.
+ * 
+ * @param conn The primary's connection.
+ * @return int 0 if the stream can continue, -1 if the connection must be closed.
+ */
+int receive_sync(Connection *conn) {
+    char **kept = NULL;
+    size_t kept_count = 0, kept_capacity = 0;
+    long long files = 0, bytes = 0;
+    int result = 0;
+    char line[2048];
+    while (1) {
+        if (conn_read_line(&conn->reader, line, sizeof(line)) < 0) {
+            result = -1;
+            break;
+        }
+        int is_dir;
+        long long size;
+        char path[1024];
+        int kind = tree_parse_entry(line, &is_dir, &size, path, sizeof(path));
+        if (kind == 1) {
+            break;
+        }
+        if (kind < 0) {
+            send_response(conn->client_sock, "ERROR: Invalid tree entry\n");
+            result = -1;
+            break;
+        }
+
+        int stored = apply_entry(conn, path, is_dir, size);
+        if (stored < 0) {
+            result = -1;
+            break;
+        }
+        if (stored > 0) {
+            conn->replication_failed++;
+            continue;
+        }
+        if (!is_dir) {
+            files++;
+            bytes += size;
+        }
+        if (kept_count == kept_capacity) {
+            kept_capacity = kept_capacity ? kept_capacity * 2 : 256;
+            char **grown = realloc(kept, kept_capacity * sizeof(char *));
+            if (!grown) {
+                result = -1;
+                break;
+            }
+            kept = grown;
+        }
+        if (!(kept[kept_count] = strdup(path))) {
+            result = -1;
+            break;
+        }
+        kept_count++;
+    }
+
+    // Remove what the primary no longer has, contents before their directory
+    TreeEntry *entries;
+    size_t count;
+    int removed = 0;
+    if (result == 0 && list_tree("", &entries, &count) == 0) {
+        qsort(kept, kept_count, sizeof(char *), compare_paths);
+        for (size_t i = count; i-- > 0;) {
+            const char *path = entries[i].path;
+            if (bsearch(&path, kept, kept_count, sizeof(char *), compare_paths)) {
+                continue;
+            }
+            if (remove_path(path) < 0) {
+                conn->replication_failed++;
+            } else {
+                removed++;
+            }
+        }
+        tree_free(entries, count);
+    }
+    for (size_t i = 0; i < kept_count; i++) {
+        free(kept[i]);
+    }
+    free(kept);
+    if (result == 0) {
+        printf("Tree synced from the primary (%lld files, %lld bytes, %d removed)\n", files, bytes, removed);
+    }
+    return result;
+}
+
+/**
+ * @brief Lists the whole tree under ROOT_FOLDER (see ReplicaSource).
+ */
+static int list_root(TreeEntry **entries, size_t *count) {
+    return list_tree("", entries, count);
+}
+
+/**
+ * @brief Starts streaming changes to the replicas given with --replicate-to, if any
+ *        (see replica.h).
+ * 
+ * @param quorum Replicas a change must reach before it is answered OK (0: none).
+ * @return int 0 on success, -1 if the replication threads could not be started.
+ */
+int start_replication(int quorum) {
+    if (replica_count() == 0) {
+        return 0;
+    }
+    static const ReplicaSource source = {
+        .files = { .open = open_tree_file, .send_body = send_tree_chunked, .ctx = (void *)"" },
+        .is_dir = is_remote_dir,
+        .list = list_root,
+    };
+    return replica_start(&source, quorum);
 }
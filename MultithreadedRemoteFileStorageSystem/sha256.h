@@ -0,0 +1,30 @@
+/*
+ * sha256.h -- SHA-256 (FIPS 180-4), used to name deduplicated chunks
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+
+// Running state of one hash computation
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;            // Bytes hashed so far
+    unsigned char block[64];    // Partial input block
+    size_t block_len;
+} Sha256;
+
+// Function to start a hash computation
+void sha256_init(Sha256 *ctx);
+
+// Function to hash more input
+void sha256_update(Sha256 *ctx, const void *data, size_t len);
+
+// Function to finish the computation and write the 32-byte digest
+void sha256_final(Sha256 *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+#endif // SHA256_H
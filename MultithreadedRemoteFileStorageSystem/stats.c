@@ -0,0 +1,327 @@
+/*
+ * stats.c -- Server-wide counters of the RFS server
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+// Adds to a counter of the calling thread's block. Only that thread writes the counter, so a
+// plain load and store suffice; the store is atomic so a reader never sees a torn value.
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Command words counted apart; anything else counts as the last one
+static const char *command_names[] = {
+    "WRITE", "WRITEPART", "CHUNKS", "SIGS", "DELTA", "GET", "RM", "PUTDIR", "GETDIR",
+    "OFFSET", "STAT", "HELLO", "BINARY", "STATS", "REPLICATE", "QUIT", "OTHER",
+};
+#define STAT_COMMANDS (int)(sizeof(command_names) / sizeof(command_names[0]))
+
+// Upper bounds of the finite histogram buckets, in nanoseconds
+static const long long latency_bounds[STATS_LATENCY_BUCKETS] = {
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000, 100000000, 1000000000,
+};
+static const char *latency_names[STAT_LATENCIES] = { "rfs_disk_read_seconds", "rfs_disk_write_seconds" };
+static const char *latency_help[STAT_LATENCIES] = {
+    "Time to open a file for GET on a cache miss, including loading it into the cache",
+    "Time to commit an upload: flush, close and rename into place",
+};
+
+// Counters of one thread
+typedef struct ThreadStats {
+    unsigned long long requests[STAT_COMMANDS];
+    unsigned long long bytes_received;
+    unsigned long long bytes_sent;
+    unsigned long long errors;
+    unsigned long long lock_waits;
+    unsigned long long lock_wait_ns;
+    unsigned long long latency[STAT_LATENCIES][STATS_LATENCY_BUCKETS + 1];  // Per bucket, last is +Inf
+    unsigned long long latency_ns[STAT_LATENCIES];
+    struct ThreadStats *prev;   // Neighbours in the list of live threads
+    struct ThreadStats *next;
+} ThreadStats;
+
+static __thread ThreadStats *local_stats = NULL;    // Block of the calling thread
+static ThreadStats *live_stats = NULL;              // Blocks of all live threads
+static ThreadStats retired_stats;                   // Sums of the threads that have exited
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;  // Guards live_stats and retired_stats
+static pthread_key_t stats_key;                     // Retires a block when its thread exits
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+// Text being built by stats_format()
+typedef struct {
+    char *text;
+    size_t len;
+    size_t capacity;
+    size_t lines;
+    int failed;
+} StatsText;
+
+static void retire_thread(void *arg);
+
+/**
+ * @brief Creates the key whose destructor retires a thread's block (run once).
+ */
+static void init_stats_key(void) {
+    pthread_key_create(&stats_key, retire_thread);
+}
+
+/**
+ * @brief Returns the calling thread's block, registering it on first use.
+ *
+ * @return ThreadStats* The block, or NULL if out of memory (the count is then dropped).
+ */
+static ThreadStats *thread_stats(void) {
+    if (local_stats) {
+        return local_stats;
+    }
+    pthread_once(&stats_once, init_stats_key);
+    ThreadStats *stats = calloc(1, sizeof(ThreadStats));
+    if (!stats) {
+        return NULL;
+    }
+    pthread_mutex_lock(&stats_mutex);
+    stats->next = live_stats;
+    if (live_stats) live_stats->prev = stats;
+    live_stats = stats;
+    pthread_mutex_unlock(&stats_mutex);
+    pthread_setspecific(stats_key, stats);
+    local_stats = stats;
+    return stats;
+}
+
+/**
+ * @brief Adds the counters of one block to another.
+ */
+static void add_stats(ThreadStats *sum, ThreadStats *stats) {
+    for (int i = 0; i < STAT_COMMANDS; i++) {
+        sum->requests[i] += STAT_LOAD(stats->requests[i]);
+    }
+    sum->bytes_received += STAT_LOAD(stats->bytes_received);
+    sum->bytes_sent += STAT_LOAD(stats->bytes_sent);
+    sum->errors += STAT_LOAD(stats->errors);
+    sum->lock_waits += STAT_LOAD(stats->lock_waits);
+    sum->lock_wait_ns += STAT_LOAD(stats->lock_wait_ns);
+    for (int i = 0; i < STAT_LATENCIES; i++) {
+        for (int j = 0; j <= STATS_LATENCY_BUCKETS; j++) {
+            sum->latency[i][j] += STAT_LOAD(stats->latency[i][j]);
+        }
+        sum->latency_ns[i] += STAT_LOAD(stats->latency_ns[i]);
+    }
+}
+
+/**
+ * @brief Folds the block of an exiting thread into the retired totals and frees it, so
+ *        short-lived threads (such as the readers of a GETDIR) leave nothing behind.
+ *
+ * @param arg The thread's block.
+ */
+static void retire_thread(void *arg) {
+    ThreadStats *stats = arg;
+    pthread_mutex_lock(&stats_mutex);
+    add_stats(&retired_stats, stats);
+    if (stats->prev) stats->prev->next = stats->next;
+    else live_stats = stats->next;
+    if (stats->next) stats->next->prev = stats->prev;
+    pthread_mutex_unlock(&stats_mutex);
+    free(stats);
+}
+
+/**
+ * @brief Counts a request by its command word.
+ *
+ * @param command Command word, e.g. "GET" (frames count under their text command).
+ */
+void stats_count_request(const char *command) {
+    ThreadStats *stats = thread_stats();
+    if (!stats) return;
+    int i = 0;
+    while (i < STAT_COMMANDS - 1 && strcmp(command_names[i], command) != 0) {
+        i++;
+    }
+    STAT_ADD(stats->requests[i], 1);
+}
+
+/**
+ * @brief Counts bytes received from and sent to clients (called by netio.c).
+ */
+void stats_count_bytes(size_t received, size_t sent) {
+    ThreadStats *stats = thread_stats();
+    if (!stats) return;
+    if (received) STAT_ADD(stats->bytes_received, received);
+    if (sent) STAT_ADD(stats->bytes_sent, sent);
+}
+
+/**
+ * @brief Counts an error response.
+ */
+void stats_count_error(void) {
+    ThreadStats *stats = thread_stats();
+    if (stats) STAT_ADD(stats->errors, 1);
+}
+
+/**
+ * @brief Counts a wait for a file lock that another thread held.
+ *
+ * @param ns How long the wait took.
+ */
+void stats_add_lock_wait(long long ns) {
+    ThreadStats *stats = thread_stats();
+    if (!stats) return;
+    STAT_ADD(stats->lock_waits, 1);
+    STAT_ADD(stats->lock_wait_ns, ns);
+}
+
+/**
+ * @brief Adds a latency to one of the histograms.
+ *
+ * @param which The histogram.
+ * @param ns    The latency.
+ */
+void stats_add_latency(StatLatency which, long long ns) {
+    ThreadStats *stats = thread_stats();
+    if (!stats) return;
+    int bucket = 0;
+    while (bucket < STATS_LATENCY_BUCKETS && ns > latency_bounds[bucket]) {
+        bucket++;
+    }
+    STAT_ADD(stats->latency[which][bucket], 1);
+    STAT_ADD(stats->latency_ns[which], ns);
+}
+
+/**
+ * @brief Reads the monotonic clock.
+ *
+ * @return long long Nanoseconds since an arbitrary point.
+ */
+long long stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Appends a formatted line to the text, growing it as needed.
+ */
+static void append_line(StatsText *out, const char *format, ...) {
+    while (!out->failed) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(out->text + out->len, out->capacity - out->len, format, args);
+        va_end(args);
+        if (n >= 0 && (size_t)n < out->capacity - out->len) {
+            out->len += n;
+            out->lines++;
+            return;
+        }
+        char *grown = realloc(out->text, out->capacity * 2);
+        if (!grown) {
+            out->failed = 1;
+            return;
+        }
+        out->text = grown;
+        out->capacity *= 2;
+    }
+}
+
+/**
+ * @brief Appends the HELP and TYPE comments of a metric (Prometheus only).
+ */
+static void append_header(StatsText *out, int prometheus, const char *name, const char *type, const char *help) {
+    if (prometheus) {
+        append_line(out, "# HELP %s %s\n", name, help);
+        append_line(out, "# TYPE %s %s\n", name, type);
+    }
+}
+
+/**
+ * @brief Formats all counters, the per-thread blocks merged, as one "name value" line each.
+ *
+ *        Names and labels follow the Prometheus text format, so the same lines serve the
+ *        STATS reply and (with HELP and TYPE comments added) the metrics endpoint. Histograms
+ *        have cumulative buckets with an "le" label, a sum in seconds and a count.
+ *
+ * @param gauges     Values only the server knows.
+ * @param prometheus Non-zero to add the HELP and TYPE comments.
+ * @param len        Receives the length of the text.
+ * @param lines      Receives the number of lines.
+ * @return char* The text (free it), or NULL if out of memory.
+ */
+char *stats_format(const ServerGauges *gauges, int prometheus, size_t *len, size_t *lines) {
+    ThreadStats sum;
+    memset(&sum, 0, sizeof(sum));
+    pthread_mutex_lock(&stats_mutex);
+    add_stats(&sum, &retired_stats);
+    for (ThreadStats *stats = live_stats; stats; stats = stats->next) {
+        add_stats(&sum, stats);
+    }
+    pthread_mutex_unlock(&stats_mutex);
+
+    StatsText out = { .text = malloc(4096), .capacity = 4096 };
+    if (!out.text) {
+        return NULL;
+    }
+    append_header(&out, prometheus, "rfs_connections_active", "gauge", "Open client connections");
+    append_line(&out, "rfs_connections_active %lld\n", gauges->connections);
+    append_header(&out, prometheus, "rfs_connections_accepted_total", "counter", "Client connections accepted");
+    append_line(&out, "rfs_connections_accepted_total %lld\n", gauges->connections_total);
+    append_header(&out, prometheus, "rfs_tasks_queued", "gauge", "Connections and frames waiting for a worker");
+    append_line(&out, "rfs_tasks_queued %d\n", gauges->queued_tasks);
+    append_header(&out, prometheus, "rfs_workers", "gauge", "Threads of the worker pool");
+    append_line(&out, "rfs_workers %d\n", gauges->workers);
+
+    append_header(&out, prometheus, "rfs_requests_total", "counter", "Requests by command");
+    for (int i = 0; i < STAT_COMMANDS; i++) {
+        append_line(&out, "rfs_requests_total{command=\"%s\"} %llu\n", command_names[i], sum.requests[i]);
+    }
+    append_header(&out, prometheus, "rfs_errors_total", "counter", "Error responses");
+    append_line(&out, "rfs_errors_total %llu\n", sum.errors);
+    append_header(&out, prometheus, "rfs_received_bytes_total", "counter", "Bytes received from clients");
+    append_line(&out, "rfs_received_bytes_total %llu\n", sum.bytes_received);
+    append_header(&out, prometheus, "rfs_sent_bytes_total", "counter", "Bytes sent to clients");
+    append_line(&out, "rfs_sent_bytes_total %llu\n", sum.bytes_sent);
+
+    append_header(&out, prometheus, "rfs_lock_waits_total", "counter", "File lock acquisitions that had to wait");
+    append_line(&out, "rfs_lock_waits_total %llu\n", sum.lock_waits);
+    append_header(&out, prometheus, "rfs_lock_wait_seconds_total", "counter", "Time spent waiting for file locks");
+    append_line(&out, "rfs_lock_wait_seconds_total %.6f\n", sum.lock_wait_ns / 1e9);
+
+    for (int i = 0; i < STAT_LATENCIES; i++) {
+        const char *name = latency_names[i];
+        append_header(&out, prometheus, name, "histogram", latency_help[i]);
+        unsigned long long count = 0;
+        for (int j = 0; j < STATS_LATENCY_BUCKETS; j++) {
+            count += sum.latency[i][j];
+            append_line(&out, "%s_bucket{le=\"%g\"} %llu\n", name, latency_bounds[j] / 1e9, count);
+        }
+        count += sum.latency[i][STATS_LATENCY_BUCKETS];
+        append_line(&out, "%s_bucket{le=\"+Inf\"} %llu\n", name, count);
+        append_line(&out, "%s_sum %.6f\n", name, sum.latency_ns[i] / 1e9);
+        append_line(&out, "%s_count %llu\n", name, count);
+    }
+
+    append_header(&out, prometheus, "rfs_file_cache_hits_total", "counter", "File cache lookups served from memory");
+    append_line(&out, "rfs_file_cache_hits_total %lu\n", gauges->cache_hits);
+    append_header(&out, prometheus, "rfs_file_cache_misses_total", "counter", "File cache lookups that went to disk");
+    append_line(&out, "rfs_file_cache_misses_total %lu\n", gauges->cache_misses);
+    append_header(&out, prometheus, "rfs_file_cache_bytes", "gauge", "Bytes held by the file cache");
+    append_line(&out, "rfs_file_cache_bytes %zu\n", gauges->cache_bytes);
+
+    append_header(&out, prometheus, "rfs_replicas_connected", "gauge", "Replicas being streamed to");
+    append_line(&out, "rfs_replicas_connected %d\n", gauges->replicas_connected);
+    append_header(&out, prometheus, "rfs_replication_lag", "gauge", "Changes the slowest replica has not applied");
+    append_line(&out, "rfs_replication_lag %lld\n", gauges->replication_lag);
+
+    if (out.failed) {
+        free(out.text);
+        return NULL;
+    }
+    *len = out.len;
+    *lines = out.lines;
+    return out.text;
+}
@@ -0,0 +1,59 @@
+/*
+ * stats.h -- Server-wide counters of the RFS server
+ *
+ * Every thread counts into a block of its own, with plain stores and no
+ * lock, so counting costs the request path next to nothing. A reader adds
+ * up the blocks of all threads (and the totals of threads that have exited)
+ * when the counters are asked for, with STATS or on the metrics endpoint.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+#define STATS_LATENCY_BUCKETS 10    // Finite histogram buckets (see stats.c), plus one for +Inf
+
+// Latencies kept as histograms
+typedef enum {
+    STAT_DISK_READ,     // Opening a file for GET on a cache miss, with loading it into the cache
+    STAT_DISK_WRITE,    // Committing an upload: flush (see --sync), close and rename
+    STAT_LATENCIES,
+} StatLatency;
+
+// Values only the server knows, reported along with the counters
+typedef struct {
+    long long connections;          // Open connections
+    long long connections_total;    // Connections accepted since the start
+    int queued_tasks;               // Tasks waiting for a worker
+    int workers;                    // Threads of the worker pool
+    unsigned long cache_hits;       // File cache lookups served from memory
+    unsigned long cache_misses;     // File cache lookups that went to disk
+    size_t cache_bytes;             // Bytes held by the file cache
+    int replicas_connected;         // Replicas streamed to and up to date (primary only)
+    long long replication_lag;      // Logged changes the slowest replica has not applied
+} ServerGauges;
+
+// Function to count a request by its command word (unknown words count as OTHER)
+void stats_count_request(const char *command);
+
+// Function to count bytes received from and sent to clients
+void stats_count_bytes(size_t received, size_t sent);
+
+// Function to count an error response
+void stats_count_error(void);
+
+// Function to count a wait for a contended file lock
+void stats_add_lock_wait(long long ns);
+
+// Function to add a latency to a histogram
+void stats_add_latency(StatLatency which, long long ns);
+
+// Function to read a monotonic clock in nanoseconds
+long long stats_now_ns(void);
+
+// Function to format all counters as "name value" lines (with HELP and TYPE comments for
+// Prometheus); returns a malloc'ed text and its length and line count, or NULL
+char *stats_format(const ServerGauges *gauges, int prometheus, size_t *len, size_t *lines);
+
+#endif // STATS_H
@@ -0,0 +1,439 @@
+/*
+ * tree.c -- Directory tree streams shared by the RFS server and client
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "netio.h"
+#include "tree.h"
+
+// A file of the tree as read ahead by a reader thread
+typedef struct {
+    int ready;              // Set once a reader is done with the entry
+    int failed;             // The file could not be opened or read
+    int fd;                 // Open file to send from, or -1
+    unsigned char *data;    // Whole contents of a small file, or NULL
+    long long size;
+} TreeSlot;
+
+// State shared by the sender of a tree and its reader threads
+typedef struct {
+    const TreeEntry *entries;
+    size_t count;
+    const TreeSource *source;
+    TreeSlot *slots;        // One per entry
+    size_t next;            // Next entry a reader takes
+    size_t sent;            // Entries the sender is done with
+    int stop;               // The sender gave up; readers exit
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;   // Signalled when a slot becomes ready
+    pthread_cond_t room;    // Signalled when the sender moves on
+} TreeSender;
+
+/**
+ * @brief Orders entries by path, which puts every directory before its contents.
+ */
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const TreeEntry *)a)->path, ((const TreeEntry *)b)->path);
+}
+
+/**
+ * @brief Appends an entry to a growing list.
+ *
+ * @return int 0 on success, -1 if out of memory.
+ */
+static int add_entry(TreeEntry **entries, size_t *count, size_t *capacity, const char *path, int is_dir) {
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 64;
+        TreeEntry *bigger = realloc(*entries, grown * sizeof(TreeEntry));
+        if (!bigger) {
+            return -1;
+        }
+        *entries = bigger;
+        *capacity = grown;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        return -1;
+    }
+    (*entries)[*count].path = copy;
+    (*entries)[*count].is_dir = is_dir;
+    (*count)++;
+    return 0;
+}
+
+/**
+ * @brief Adds the contents of one directory of the tree, and recursively of its subdirectories.
+ *
+ * @param root     Root of the tree.
+ * @param relative Directory relative to root ("" for root itself).
+ * @return int 0 on success, -1 if out of memory.
+ */
+static int list_dir(const char *root, const char *relative, int (*skip)(const char *name), TreeEntry **entries,
+                    size_t *count, size_t *capacity) {
+    char dir_path[2048];
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", root, relative);
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        return 0; // Removed meanwhile, or unreadable: nothing to add
+    }
+    int result = 0;
+    struct dirent *item;
+    while (result == 0 && (item = readdir(dir))) {
+        const char *name = item->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strchr(name, '\n') || (skip && skip(name))) {
+            continue;
+        }
+        char path[1024], full_path[3100];
+        if (snprintf(path, sizeof(path), "%s%s%s", relative, *relative ? "/" : "", name) >= (int)sizeof(path)) {
+            continue; // Too long for the protocol
+        }
+        snprintf(full_path, sizeof(full_path), "%s/%s", root, path);
+
+        // Symbolic links and special files are left out, so a link cannot loop the walk
+        struct stat st;
+        if (lstat(full_path, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
+            continue;
+        }
+        result = add_entry(entries, count, capacity, path, S_ISDIR(st.st_mode));
+        if (result == 0 && S_ISDIR(st.st_mode)) {
+            result = list_dir(root, path, skip, entries, count, capacity);
+        }
+    }
+    closedir(dir);
+    return result;
+}
+
+/**
+ * @brief Lists every directory and regular file below a root, sorted by path.
+ *
+ * @param root    Directory to list.
+ * @param skip    Called with each name; entries it returns non-zero for are left out (may be NULL).
+ * @param entries Receives the list (free with tree_free()).
+ * @param count   Receives the number of entries.
+ * @return int 0 on success, -1 if root is not a directory or memory ran out.
+ */
+int tree_list(const char *root, int (*skip)(const char *name), TreeEntry **entries, size_t *count) {
+    struct stat st;
+    *entries = NULL;
+    *count = 0;
+    if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    size_t capacity = 0;
+    if (list_dir(root, "", skip, entries, count, &capacity) != 0) {
+        tree_free(*entries, *count);
+        *entries = NULL;
+        *count = 0;
+        return -1;
+    }
+    if (*count > 0) {
+        qsort(*entries, *count, sizeof(TreeEntry), compare_entries);
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees a list built by tree_list().
+ */
+void tree_free(TreeEntry *entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+/**
+ * @brief Adds the entries of a second list whose paths the first one lacks, keeping the
+ *        result sorted. The second list is consumed.
+ *
+ * @param entries    First list; grown in place.
+ * @param count      Its number of entries; updated.
+ * @param more       Second list (freed here).
+ * @param more_count Its number of entries.
+ * @return int 0 on success, -1 if out of memory (the first list is unchanged).
+ */
+int tree_merge(TreeEntry **entries, size_t *count, TreeEntry *more, size_t more_count) {
+    TreeEntry *merged = malloc((*count + more_count + 1) * sizeof(TreeEntry));
+    if (!merged) {
+        tree_free(more, more_count);
+        return -1;
+    }
+    size_t n = 0, i = 0, j = 0;
+    while (i < *count || j < more_count) {
+        int order = i == *count ? 1 : j == more_count ? -1 : strcmp((*entries)[i].path, more[j].path);
+        if (order <= 0) {
+            merged[n++] = (*entries)[i++];
+            if (order == 0) free(more[j++].path);
+        } else {
+            merged[n++] = more[j++];
+        }
+    }
+    free(*entries);
+    free(more);
+    *entries = merged;
+    *count = n;
+    return 0;
+}
+
+/**
+ * @brief Checks a path received in a tree stream: not empty, not absolute, no empty,
+ *        "." or ".." components, so it cannot point outside the tree it is stored in.
+ *
+ * @param path Relative path.
+ * @return int 1 if the path is safe, 0 otherwise.
+ */
+int tree_path_ok(const char *path) {
+    if (*path == '\0' || *path == '/') {
+        return 0;
+    }
+    for (const char *part = path; part; ) {
+        const char *end = strchr(part, '/');
+        size_t len = end ? (size_t)(end - part) : strlen(part);
+        if (len == 0 || (len == 1 && part[0] == '.') || (len == 2 && part[0] == '.' && part[1] == '.')) {
+            return 0;
+        }
+        part = end ? end + 1 : NULL;
+    }
+    return 1;
+}
+
+/**
+ * @brief Parses the header line of a tree entry (see tree.h).
+ *
+ * @param line      The line, without its newline.
+ * @param is_dir    Receives 1 for a directory, 0 for a file.
+ * @param size      Receives the size of a file (0 for a directory).
+ * @param path      Receives the entry's path.
+ * @param path_size Size of the path buffer.
+ * @return int 0 for an entry, 1 for END, -1 if the line is malformed.
+ */
+int tree_parse_entry(const char *line, int *is_dir, long long *size, char *path, size_t path_size) {
+    const char *rest;
+    if (strcmp(line, "END") == 0) {
+        return 1;
+    }
+    if (strncmp(line, "D ", 2) == 0) {
+        *is_dir = 1;
+        *size = 0;
+        rest = line + 2;
+    } else if (strncmp(line, "F ", 2) == 0) {
+        char *end;
+        *is_dir = 0;
+        *size = strtoll(line + 2, &end, 10);
+        if (end == line + 2 || *end != ' ' || *size < 0) {
+            return -1;
+        }
+        rest = end + 1;
+    } else {
+        return -1;
+    }
+    if (strlen(rest) >= path_size) {
+        return -1;
+    }
+    strcpy(path, rest);
+    return 0;
+}
+
+/**
+ * @brief Creates a directory and every missing directory above it (like "mkdir -p").
+ *
+ * @param path Directory to create.
+ */
+void tree_make_dirs(const char *path) {
+    char copy[2200];
+    snprintf(copy, sizeof(copy), "%s", path);
+    for (char *p = copy + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(copy, 0777);
+            *p = '/';
+        }
+    }
+    mkdir(copy, 0777);
+}
+
+/**
+ * @brief Reader thread of tree_send(). Takes the next entry within TREE_WINDOW of the one
+ *        being sent, opens it and reads a small file into memory, so the opens and reads of
+ *        many small files overlap with each other and with the sending.
+ *
+ * @param arg The TreeSender.
+ * @return void* Always NULL.
+ */
+static void *tree_reader(void *arg) {
+    TreeSender *sender = arg;
+    while (1) {
+        pthread_mutex_lock(&sender->mutex);
+        while (!sender->stop && sender->next < sender->count && sender->next >= sender->sent + TREE_WINDOW) {
+            pthread_cond_wait(&sender->room, &sender->mutex);
+        }
+        if (sender->stop || sender->next >= sender->count) {
+            pthread_mutex_unlock(&sender->mutex);
+            return NULL;
+        }
+        size_t i = sender->next++;
+        pthread_mutex_unlock(&sender->mutex);
+
+        TreeSlot *slot = &sender->slots[i];
+        slot->fd = -1;
+        if (!sender->entries[i].is_dir) {
+            const TreeSource *source = sender->source;
+            if (source->open(source->ctx, sender->entries[i].path, &slot->fd, &slot->size) != 0) {
+                slot->fd = -1;
+                slot->failed = 1;
+            } else if (slot->fd >= 0 && slot->size <= TREE_PREFETCH_MAX) {
+                slot->data = malloc(slot->size > 0 ? slot->size : 1);
+                long long done = 0;
+                while (slot->data && done < slot->size) {
+                    ssize_t got = pread(slot->fd, slot->data + done, slot->size - done, done);
+                    if (got < 0 && errno == EINTR) continue;
+                    if (got <= 0) break;
+                    done += got;
+                }
+                if (!slot->data || done < slot->size) {
+                    free(slot->data);
+                    slot->data = NULL;
+                    slot->failed = 1;
+                }
+                close(slot->fd);
+                slot->fd = -1;
+            } else if (slot->fd >= 0) {
+#ifdef __linux__
+                // Too big to hold in memory: start reading it into the page cache instead
+                posix_fadvise(slot->fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+            }
+        }
+
+        pthread_mutex_lock(&sender->mutex);
+        slot->ready = 1;
+        pthread_cond_broadcast(&sender->ready);
+        pthread_mutex_unlock(&sender->mutex);
+    }
+}
+
+/**
+ * @brief Sends one entry of a tree.
+ *
+ * @return int 0 on success, -1 if the connection failed.
+ */
+static int send_entry(int sock, const TreeEntry *entry, TreeSlot *slot, const TreeSource *source) {
+    char header[1100];
+    if (entry->is_dir) {
+        snprintf(header, sizeof(header), "D %s\n", entry->path);
+        return send_all(sock, header, strlen(header));
+    }
+    snprintf(header, sizeof(header), "F %lld %s\n", slot->size, entry->path);
+    if (slot->data) {
+        // Header and contents leave in one gather send
+        struct iovec iov[2] = {
+            { .iov_base = header, .iov_len = strlen(header) },
+            { .iov_base = slot->data, .iov_len = (size_t)slot->size },
+        };
+        return send_iov(sock, iov, 2);
+    }
+    set_cork(sock, 1);
+    int result = send_all(sock, header, strlen(header));
+    if (result == 0) {
+        result = slot->fd >= 0 ? send_file_range(sock, slot->fd, 0, slot->size)
+                               : source->send_body(source->ctx, sock, entry->path, slot->size);
+    }
+    set_cork(sock, 0);
+    return result;
+}
+
+/**
+ * @brief Sends the entries of a tree, followed by END.
+ *
+ *        TREE_READERS threads open the files ahead of the sender, up to TREE_WINDOW entries,
+ *        and read those up to TREE_PREFETCH_MAX into memory; larger files are sent straight
+ *        from the page cache (see send_file_range()). Files that cannot be opened are left
+ *        out of the stream with a message. The stream is cut off (and -1 returned) only if
+ *        the connection fails, or a file shrinks while it is being sent.
+ *
+ * @param sock    Socket to send on.
+ * @param entries The tree, as listed by tree_list().
+ * @param count   Number of entries.
+ * @param source  How to open the files.
+ * @param files   Receives the number of files sent (may be NULL).
+ * @param bytes   Receives the number of file bytes sent (may be NULL).
+ * @return int 0 on success, -1 if the connection failed.
+ */
+int tree_send(int sock, const TreeEntry *entries, size_t count, const TreeSource *source, long long *files,
+              long long *bytes) {
+    TreeSender sender = { .entries = entries, .count = count, .source = source };
+    sender.slots = calloc(count > 0 ? count : 1, sizeof(TreeSlot));
+    if (!sender.slots) {
+        return -1;
+    }
+    pthread_mutex_init(&sender.mutex, NULL);
+    pthread_cond_init(&sender.ready, NULL);
+    pthread_cond_init(&sender.room, NULL);
+
+    pthread_t readers[TREE_READERS];
+    int started = 0;
+    while (started < TREE_READERS && pthread_create(&readers[started], NULL, tree_reader, &sender) == 0) {
+        started++;
+    }
+
+    long long sent_files = 0, sent_bytes = 0;
+    int result = started > 0 ? 0 : -1;
+    for (size_t i = 0; i < count && result == 0; i++) {
+        TreeSlot *slot = &sender.slots[i];
+        pthread_mutex_lock(&sender.mutex);
+        while (!slot->ready) {
+            pthread_cond_wait(&sender.ready, &sender.mutex);
+        }
+        pthread_mutex_unlock(&sender.mutex);
+
+        if (slot->failed) {
+            printf("Skipped %s: unable to read file\n", entries[i].path);
+        } else {
+            result = send_entry(sock, &entries[i], slot, source);
+            if (result == 0 && !entries[i].is_dir) {
+                sent_files++;
+                sent_bytes += slot->size;
+            }
+        }
+        if (slot->fd >= 0) close(slot->fd);
+        free(slot->data);
+        slot->fd = -1;
+        slot->data = NULL;
+
+        pthread_mutex_lock(&sender.mutex);
+        sender.sent = i + 1;
+        pthread_cond_broadcast(&sender.room);
+        pthread_mutex_unlock(&sender.mutex);
+    }
+
+    pthread_mutex_lock(&sender.mutex);
+    sender.stop = 1;
+    pthread_cond_broadcast(&sender.room);
+    pthread_mutex_unlock(&sender.mutex);
+    for (int i = 0; i < started; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    for (size_t i = sender.sent; i < count; i++) {
+        if (sender.slots[i].ready && sender.slots[i].fd >= 0) close(sender.slots[i].fd);
+        free(sender.slots[i].data);
+    }
+    free(sender.slots);
+    pthread_mutex_destroy(&sender.mutex);
+    pthread_cond_destroy(&sender.ready);
+    pthread_cond_destroy(&sender.room);
+
+    if (result == 0) {
+        result = send_all(sock, "END\n", 4);
+    }
+    if (files) *files = sent_files;
+    if (bytes) *bytes = sent_bytes;
+    return result;
+}
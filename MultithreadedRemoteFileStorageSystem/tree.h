@@ -0,0 +1,64 @@
+/*
+ * tree.h -- Directory tree streams shared by the RFS server and client
+ *
+ * PUTDIR and GETDIR move a whole tree as one sequence of entries over one
+ * connection, with no reply per file:
+ *
+ *   D <path>\n                    a directory
+ *   F <size> <path>\n<bytes>      a file and its contents
+ *   END\n                         the end of the tree
+ *
+ * Paths are relative to the tree's root and come last on the line, so they
+ * may contain spaces (but no newline, "." or ".." components). A directory
+ * is always sent before anything inside it.
+ */
+
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+
+#define TREE_READERS 4                  // Threads reading files ahead of the sender
+#define TREE_WINDOW 32                  // Most files read ahead of the one being sent
+#define TREE_PREFETCH_MAX (256 * 1024)  // Files up to this size are read into memory ahead of time
+
+// One entry of a tree
+typedef struct {
+    char *path;     // Relative to the tree's root
+    int is_dir;
+} TreeEntry;
+
+// Where the sender of a tree gets its files from
+typedef struct {
+    // Function to open a file of the tree; sets *fd (or -1 if send_body sends it) and *size; 0 on success
+    int (*open)(void *ctx, const char *path, int *fd, long long *size);
+    // Function to send the body of a file opened without a descriptor (may be NULL); 0 on success
+    int (*send_body)(void *ctx, int sock, const char *path, long long size);
+    void *ctx;
+} TreeSource;
+
+// Function to list a tree (without its root), directories before their contents; 0 on success,
+// -1 if root is not a directory. skip (may be NULL) drops an entry and everything below it.
+int tree_list(const char *root, int (*skip)(const char *name), TreeEntry **entries, size_t *count);
+
+// Function to free a list built by tree_list()
+void tree_free(TreeEntry *entries, size_t count);
+
+// Function to add the entries of another list that are not in the first one (both sorted)
+int tree_merge(TreeEntry **entries, size_t *count, TreeEntry *more, size_t more_count);
+
+// Function to check that a received entry path is relative and stays inside the tree
+int tree_path_ok(const char *path);
+
+// Function to parse an entry line; 0 for an entry, 1 for END, -1 if malformed
+int tree_parse_entry(const char *line, int *is_dir, long long *size, char *path, size_t path_size);
+
+// Function to create a directory and all missing directories above it
+void tree_make_dirs(const char *path);
+
+// Function to send the entries of a tree and END, reading files ahead in parallel;
+// 0 on success, -1 if the connection failed
+int tree_send(int sock, const TreeEntry *entries, size_t count, const TreeSource *source, long long *files,
+              long long *bytes);
+
+#endif // TREE_H